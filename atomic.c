@@ -28,22 +28,22 @@
 
 void atomic_init(struct atomic_t *atomic) {
 	memset(atomic, 0, sizeof(*atomic));
-	pthread_mutex_init(&atomic->mutex, NULL);
+	lockstat_mutex_init(&atomic->mutex, "atomic");
 	pthread_cond_init(&atomic->cond, NULL);
 }
 
 void atomic_add(struct atomic_t *atomic, int value) {
-	pthread_mutex_lock(&atomic->mutex);
+	lockstat_lock(&atomic->mutex);
 	atomic->value += value;
 	pthread_cond_broadcast(&atomic->cond);
-	pthread_mutex_unlock(&atomic->mutex);
+	lockstat_unlock(&atomic->mutex);
 }
 
 void atomic_set(struct atomic_t *atomic, int value) {
-	pthread_mutex_lock(&atomic->mutex);
+	lockstat_lock(&atomic->mutex);
 	atomic->value = value;
 	pthread_cond_broadcast(&atomic->cond);
-	pthread_mutex_unlock(&atomic->mutex);
+	lockstat_unlock(&atomic->mutex);
 }
 
 void atomic_inc(struct atomic_t *atomic) {
@@ -55,11 +55,11 @@ void atomic_dec(struct atomic_t *atomic) {
 }
 
 void atomic_wait_until_value(struct atomic_t *atomic, int value) {
-	pthread_mutex_lock(&atomic->mutex);
+	lockstat_lock(&atomic->mutex);
 	while (atomic->value != value) {
-		pthread_cond_wait(&atomic->cond, &atomic->mutex);
+		lockstat_cond_wait(&atomic->cond, &atomic->mutex);
 	}
-	pthread_mutex_unlock(&atomic->mutex);
+	lockstat_unlock(&atomic->mutex);
 }
 
 static void errstack_atomic_dec(struct errstack_element_t *element) {
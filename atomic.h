@@ -25,10 +25,11 @@
 #define __ATOMIC_H__
 
 #include <pthread.h>
+#include "lockstat.h"
 #include "errstack.h"
 
 struct atomic_t {
-	pthread_mutex_t mutex;
+	struct lockstat_mutex_t mutex;
 	pthread_cond_t cond;
 	int value;
 };
@@ -0,0 +1,231 @@
+#!/usr/bin/python3
+#	ratched - TLS connection router that performs a man-in-the-middle attack
+#	Copyright (C) 2017-2017 Johannes Bauer
+#
+#	This file is part of ratched.
+#
+#	ratched is free software; you can redistribute it and/or modify
+#	it under the terms of the GNU General Public License as published by
+#	the Free Software Foundation; this program is ONLY licensed under
+#	version 3 of the License, later versions are explicitly excluded.
+#
+#	ratched is distributed in the hope that it will be useful,
+#	but WITHOUT ANY WARRANTY; without even the implied warranty of
+#	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#	GNU General Public License for more details.
+#
+#	You should have received a copy of the GNU General Public License
+#	along with ratched; if not, write to the Free Software
+#	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+#
+#	Johannes Bauer <JohannesBauer@gmx.de>
+
+
+# Measures how much latency ratched adds per connection stage: runs the same
+# workload once directly against an upstream (usually upstream_sim.py) and
+# once through ratched and reports both distributions and their difference.
+
+import os
+import sys
+import ssl
+import time
+import json
+import socket
+import tempfile
+import argparse
+import subprocess
+import statistics
+import concurrent.futures
+
+STAGES = {
+	"https":	[ "connect", "handshake", "ttfb", "transfer", "total" ],
+	"banner":	[ "connect", "banner", "echo", "total" ],
+}
+
+class BenchmarkException(Exception):
+	pass
+
+def parse_address(address):
+	(host, port) = address.rsplit(":", 1)
+	return (host, int(port))
+
+class Workload(object):
+	def __init__(self, args):
+		self._args = args
+		self._context = ssl.SSLContext(ssl.PROTOCOL_TLS_CLIENT)
+		self._context.check_hostname = False
+		self._context.verify_mode = ssl.CERT_NONE
+
+	def server_name(self, index):
+		if self._args.distinct_snis > 0:
+			return "%s%d.bench" % (self._args.sni, index % self._args.distinct_snis)
+		return self._args.sni
+
+	def _connect(self, address):
+		t0 = time.perf_counter()
+		sock = socket.create_connection(address, timeout = self._args.timeout)
+		sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+		return (sock, time.perf_counter() - t0)
+
+	def _run_https(self, address, index):
+		times = { }
+		(sock, times["connect"]) = self._connect(address)
+		t0 = time.perf_counter()
+		with self._context.wrap_socket(sock, server_hostname = self.server_name(index)) as tls:
+			times["handshake"] = time.perf_counter() - t0
+			for request in range(self._args.requests):
+				t0 = time.perf_counter()
+				tls.sendall(b"GET /%d HTTP/1.1\r\nHost: %s\r\n\r\n" % (self._args.response_size, self.server_name(index).encode()))
+				response = tls.recv(65536)
+				if len(response) == 0:
+					raise BenchmarkException("Connection closed before response.")
+				t1 = time.perf_counter()
+				(header, body) = response.split(b"\r\n\r\n", 1) if (b"\r\n\r\n" in response) else (response, b"")
+				received = len(body)
+				while received < self._args.response_size:
+					data = tls.recv(65536)
+					if len(data) == 0:
+						raise BenchmarkException("Connection closed after %d of %d response bytes." % (received, self._args.response_size))
+					received += len(data)
+				t2 = time.perf_counter()
+				times["ttfb"] = times.get("ttfb", 0) + (t1 - t0)
+				times["transfer"] = times.get("transfer", 0) + (t2 - t1)
+		return times
+
+	def _run_banner(self, address, index):
+		times = { }
+		(sock, times["connect"]) = self._connect(address)
+		with sock:
+			t0 = time.perf_counter()
+			f = sock.makefile("rb")
+			if not f.readline().startswith(b"220 "):
+				raise BenchmarkException("Did not receive greeting.")
+			times["banner"] = time.perf_counter() - t0
+			t0 = time.perf_counter()
+			sock.sendall(b"ping %d\r\n" % (index))
+			if not f.readline().startswith(b"ping "):
+				raise BenchmarkException("Did not receive echo.")
+			times["echo"] = time.perf_counter() - t0
+		return times
+
+	def run_one(self, address, index):
+		try:
+			if self._args.protocol == "https":
+				times = self._run_https(address, index)
+			else:
+				times = self._run_banner(address, index)
+		except (OSError, BenchmarkException) as e:
+			return str(e)
+		times["total"] = sum(times.values())
+		return times
+
+	def run(self, address):
+		for index in range(self._args.warmup):
+			self.run_one(address, index)
+		results = [ ]
+		failures = 0
+		first_failure = None
+		with concurrent.futures.ThreadPoolExecutor(max_workers = self._args.concurrency) as executor:
+			futures = [ executor.submit(self.run_one, address, index) for index in range(self._args.connections) ]
+			for future in futures:
+				times = future.result()
+				if isinstance(times, str):
+					failures += 1
+					first_failure = first_failure or times
+				else:
+					results.append(times)
+		if first_failure is not None:
+			print("%d of %d connections to %s:%d failed, first error: %s" % (failures, self._args.connections, address[0], address[1], first_failure), file = sys.stderr)
+		return (results, failures)
+
+def quantile(values, q):
+	if len(values) == 0:
+		return float("nan")
+	values = sorted(values)
+	return values[min(len(values) - 1, int(q * len(values)))]
+
+def summarize(results, stages):
+	summary = { }
+	for stage in stages:
+		values = [ result[stage] for result in results if stage in result ]
+		summary[stage] = { "p50": quantile(values, 0.5), "p90": quantile(values, 0.9), "p99": quantile(values, 0.99), "mean": statistics.mean(values) if values else float("nan") }
+	return summary
+
+class RatchedProcess(object):
+	def __init__(self, args):
+		self._args = args
+		self._tempdir = tempfile.TemporaryDirectory(prefix = "ratched_bench_")
+		cmd = [ args.ratched ]
+		cmd += [ "-l", args.proxy ]
+		cmd += [ "-f", args.direct ]
+		cmd += [ "--config-dir", args.config_dir ]
+		cmd += [ "-o", os.path.join(self._tempdir.name, "bench.pcapng") ]
+		cmd += args.ratched_args
+		self._proc = subprocess.Popen(cmd, stdout = subprocess.DEVNULL, stderr = subprocess.DEVNULL)
+		self._wait_listening()
+
+	def _wait_listening(self):
+		end = time.time() + 10
+		while time.time() < end:
+			if self._proc.poll() is not None:
+				raise BenchmarkException("ratched exited with status %d during startup." % (self._proc.returncode))
+			try:
+				socket.create_connection(parse_address(self._args.proxy), timeout = 1).close()
+				return
+			except OSError:
+				time.sleep(0.1)
+		raise BenchmarkException("ratched did not start listening on %s." % (self._args.proxy))
+
+	def stop(self):
+		self._proc.terminate()
+		self._proc.wait()
+
+def print_report(args, stages, direct, proxied):
+	print("%d connections, concurrency %d, protocol %s%s" % (args.connections, args.concurrency, args.protocol, (", %d requests of %d bytes each" % (args.requests, args.response_size)) if (args.protocol == "https") else ""))
+	print("%-10s  %-26s  %-26s  %-26s" % ("stage [ms]", "direct p50/p90/p99", "ratched p50/p90/p99", "added p50/p90/p99"))
+	for stage in stages:
+		row = [ "%-10s" % (stage) ]
+		for summary in [ direct[0], proxied[0] ]:
+			row.append("%8.2f %8.2f %8.2f" % tuple(summary[stage][q] * 1000 for q in [ "p50", "p90", "p99" ]))
+		row.append("%+8.2f %+8.2f %+8.2f" % tuple((proxied[0][stage][q] - direct[0][stage][q]) * 1000 for q in [ "p50", "p90", "p99" ]))
+		print("  ".join(row))
+	print("failed connections: %d direct, %d through ratched" % (direct[1], proxied[1]))
+
+parser = argparse.ArgumentParser(description = "Measure the latency ratched adds to each connection stage by running the same workload directly against an upstream and through ratched.")
+parser.add_argument("-d", "--direct", metavar = "host:port", default = "127.0.0.1:9443", help = "Upstream to connect to directly, e.g. upstream_sim.py. Defaults to %(default)s.")
+parser.add_argument("-p", "--proxy", metavar = "host:port", default = "127.0.0.1:9444", help = "Address ratched listens on, forwarding to the upstream. Defaults to %(default)s.")
+parser.add_argument("--ratched", metavar = "binary", help = "Start this ratched binary on the proxy address with -f pointing to the upstream, instead of using an already running instance.")
+parser.add_argument("--config-dir", metavar = "path", default = os.path.join(os.path.dirname(os.path.abspath(__file__)), "..", "itests", "ratched_ca"), help = "Configuration directory for a ratched started with --ratched. Defaults to itests/ratched_ca.")
+parser.add_argument("--ratched-args", metavar = "args", type = str.split, default = [ ], help = "Additional command line arguments for a ratched started with --ratched, as one string.")
+parser.add_argument("--protocol", choices = [ "https", "banner" ], default = "https", help = "Protocol spoken by the upstream, must match upstream_sim.py. Defaults to %(default)s.")
+parser.add_argument("-n", "--connections", metavar = "count", type = int, default = 100, help = "Number of measured connections per run. Defaults to %(default)d.")
+parser.add_argument("-c", "--concurrency", metavar = "count", type = int, default = 1, help = "Number of connections in flight at once. Defaults to %(default)d.")
+parser.add_argument("-w", "--warmup", metavar = "count", type = int, default = 5, help = "Unmeasured connections before each run, e.g. to have certificates forged already. Defaults to %(default)d.")
+parser.add_argument("-r", "--requests", metavar = "count", type = int, default = 1, help = "HTTP requests per connection. Defaults to %(default)d.")
+parser.add_argument("-s", "--response-size", metavar = "bytes", type = int, default = 16384, help = "Response body size to request. Defaults to %(default)d.")
+parser.add_argument("--sni", metavar = "name", default = "foo", help = "Server name indication to send. Defaults to %(default)s.")
+parser.add_argument("--distinct-snis", metavar = "count", type = int, default = 0, help = "Cycle through this many different server names (<sni><n>.bench) so that ratched has to forge certificates for many hosts.")
+parser.add_argument("--timeout", metavar = "secs", type = float, default = 30, help = "Socket timeout. Defaults to %(default).0f secs.")
+parser.add_argument("--json", metavar = "filename", help = "Also write the summaries as JSON to this file.")
+args = parser.parse_args(sys.argv[1:])
+
+stages = STAGES[args.protocol]
+workload = Workload(args)
+try:
+	direct = workload.run(parse_address(args.direct))
+	ratched = RatchedProcess(args) if args.ratched else None
+	try:
+		proxied = workload.run(parse_address(args.proxy))
+	finally:
+		if ratched is not None:
+			ratched.stop()
+except BenchmarkException as e:
+	print("Error: %s" % (str(e)), file = sys.stderr)
+	sys.exit(1)
+
+direct = (summarize(direct[0], stages), direct[1])
+proxied = (summarize(proxied[0], stages), proxied[1])
+print_report(args, stages, direct, proxied)
+if args.json is not None:
+	with open(args.json, "w") as f:
+		json.dump({ "direct": direct[0], "ratched": proxied[0], "failures": { "direct": direct[1], "ratched": proxied[1] } }, f, indent = 4)
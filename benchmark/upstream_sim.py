@@ -0,0 +1,323 @@
+#!/usr/bin/python3
+#	ratched - TLS connection router that performs a man-in-the-middle attack
+#	Copyright (C) 2017-2017 Johannes Bauer
+#
+#	This file is part of ratched.
+#
+#	ratched is free software; you can redistribute it and/or modify
+#	it under the terms of the GNU General Public License as published by
+#	the Free Software Foundation; this program is ONLY licensed under
+#	version 3 of the License, later versions are explicitly excluded.
+#
+#	ratched is distributed in the hope that it will be useful,
+#	but WITHOUT ANY WARRANTY; without even the implied warranty of
+#	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#	GNU General Public License for more details.
+#
+#	You should have received a copy of the GNU General Public License
+#	along with ratched; if not, write to the Free Software
+#	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+#
+#	Johannes Bauer <JohannesBauer@gmx.de>
+
+
+# Stand-in for upstream servers on the internet. Serves TLS for many SNIs with
+# the certificates from itests/demo_ca (or a plaintext server-first protocol)
+# behind a shaping layer that adds round trip time, jitter, a bandwidth cap,
+# TCP slow start, occasional stalls and connection resets to the raw byte
+# stream in both directions, including the TLS handshake.
+
+import os
+import sys
+import ssl
+import glob
+import random
+import socket
+import struct
+import asyncio
+import argparse
+import tempfile
+
+MSS = 1460
+
+class LinkProfile(object):
+	def __init__(self, rtt = 0, jitter = 0, bandwidth = 0, initial_cwnd = 10, slow_start = True, idle_restart = 1.0):
+		self.rtt = rtt
+		self.jitter = jitter
+		self.bandwidth = bandwidth
+		self.initial_cwnd = initial_cwnd * MSS
+		self.slow_start = slow_start and (rtt > 0)
+		self.idle_restart = idle_restart
+
+	@classmethod
+	def from_args(cls, args):
+		return cls(rtt = args.rtt / 1000, jitter = args.jitter / 1000, bandwidth = args.bandwidth * 1000 * 1000 / 8, initial_cwnd = args.initial_cwnd, slow_start = not args.no_slow_start)
+
+class ShapedDirection(object):
+	"""Computes when each segment sent into one direction of a connection
+	arrives at the other end. Segments leave no earlier than the bandwidth cap
+	and the congestion window allow and arrive one way delay (plus jitter)
+	later, never overtaking each other."""
+	def __init__(self, profile):
+		self._profile = profile
+		self._link_free_at = 0
+		self._last_arrival = 0
+		self._last_departure = None
+		self._round_start = None
+		self._round_bytes = 0
+		self._cwnd = profile.initial_cwnd
+
+	def _congestion_window(self, departure, length):
+		if (self._last_departure is None) or (departure - self._last_departure > self._profile.idle_restart):
+			# Slow start after idle (RFC 2861)
+			self._cwnd = self._profile.initial_cwnd
+			self._round_start = departure
+			self._round_bytes = 0
+		elif departure >= self._round_start + self._profile.rtt:
+			self._round_start = departure
+			self._round_bytes = 0
+		while (self._round_bytes > 0) and (self._round_bytes + length > self._cwnd):
+			# Window exhausted, wait for the ACKs of this round
+			self._round_start += self._profile.rtt
+			self._round_bytes = 0
+			self._cwnd *= 2
+			departure = max(departure, self._round_start)
+		self._round_bytes += length
+		return departure
+
+	def schedule(self, now, length):
+		departure = max(now, self._link_free_at)
+		if self._profile.slow_start:
+			departure = self._congestion_window(departure, length)
+		self._last_departure = departure
+		if self._profile.bandwidth > 0:
+			self._link_free_at = departure + length / self._profile.bandwidth
+		else:
+			self._link_free_at = departure
+		delay = self._profile.rtt / 2
+		if self._profile.jitter > 0:
+			delay = max(0, delay + random.uniform(-self._profile.jitter / 2, self._profile.jitter / 2))
+		arrival = max(self._last_arrival, self._link_free_at + delay)
+		self._last_arrival = arrival
+		return arrival
+
+class ShapedConnection(object):
+	def __init__(self, simulator, client_reader, client_writer):
+		self._sim = simulator
+		self._client_reader = client_reader
+		self._client_writer = client_writer
+		args = simulator.args
+		self._stall_at = random.randint(0, args.impairment_window) if (random.random() < args.stall_probability) else None
+		self._reset_at = random.randint(0, args.impairment_window) if (random.random() < args.reset_probability) else None
+		self._downstream_bytes = 0
+		self._reset = False
+
+	def _abort(self):
+		"""Closes the client connection with a RST instead of a FIN."""
+		self._reset = True
+		sock = self._client_writer.get_extra_info("socket")
+		if sock is not None:
+			sock.setsockopt(socket.SOL_SOCKET, socket.SO_LINGER, struct.pack("ii", 1, 0))
+		self._client_writer.transport.abort()
+
+	async def _pump(self, reader, writer, direction, downstream):
+		loop = asyncio.get_running_loop()
+		queue = asyncio.Queue()
+
+		async def deliver():
+			while True:
+				(arrival, data) = await queue.get()
+				if data is None:
+					break
+				delay = arrival - loop.time()
+				if delay > 0:
+					await asyncio.sleep(delay)
+				if self._reset:
+					break
+				writer.write(data)
+				await writer.drain()
+			if not self._reset and writer.can_write_eof():
+				writer.write_eof()
+
+		delivery = asyncio.ensure_future(deliver())
+		try:
+			while not self._reset:
+				data = await reader.read(65536)
+				if len(data) == 0:
+					break
+				for offset in range(0, len(data), MSS):
+					segment = data[offset : offset + MSS]
+					if downstream:
+						if (self._stall_at is not None) and (self._downstream_bytes + len(segment) > self._stall_at):
+							self._stall_at = None
+							self._sim.statistics["stalls"] += 1
+							await asyncio.sleep(self._sim.args.stall_duration / 1000)
+						if (self._reset_at is not None) and (self._downstream_bytes + len(segment) > self._reset_at):
+							self._sim.statistics["resets"] += 1
+							self._abort()
+							break
+						self._downstream_bytes += len(segment)
+					queue.put_nowait((direction.schedule(loop.time(), len(segment)), segment))
+		except ConnectionError:
+			pass
+		queue.put_nowait((0, None))
+		try:
+			await delivery
+		except ConnectionError:
+			pass
+
+	async def run(self):
+		try:
+			(backend_reader, backend_writer) = await asyncio.open_connection(*self._sim.backend_address)
+		except OSError:
+			self._client_writer.close()
+			return
+		profile = self._sim.profile
+		await asyncio.gather(
+			self._pump(self._client_reader, backend_writer, ShapedDirection(profile), downstream = False),
+			self._pump(backend_reader, self._client_writer, ShapedDirection(profile), downstream = True),
+		)
+		backend_writer.close()
+		if not self._reset:
+			self._client_writer.close()
+
+class UpstreamSimulator(object):
+	def __init__(self, args):
+		self._args = args
+		self._profile = LinkProfile.from_args(args)
+		self._tempdir = tempfile.TemporaryDirectory(prefix = "upstream_sim_")
+		self._contexts = { }
+		self._default_context = None
+		self._backend_address = None
+		self._statistics = { "connections": 0, "stalls": 0, "resets": 0 }
+		if args.protocol == "https":
+			self._load_certificates()
+
+	@property
+	def args(self):
+		return self._args
+
+	@property
+	def profile(self):
+		return self._profile
+
+	@property
+	def backend_address(self):
+		return self._backend_address
+
+	@property
+	def statistics(self):
+		return self._statistics
+
+	def _load_certificates(self):
+		ca_dir = self._args.ca_dir
+		intermediate = open(os.path.join(ca_dir, "intermediate.crt")).read()
+		for certfile in sorted(glob.glob(os.path.join(ca_dir, "server_*.crt"))):
+			name = os.path.basename(certfile)[len("server_") : -len(".crt")]
+			chainfile = os.path.join(self._tempdir.name, name + ".pem")
+			with open(chainfile, "w") as f:
+				f.write(open(certfile).read())
+				f.write(intermediate)
+			context = ssl.SSLContext(ssl.PROTOCOL_TLS_SERVER)
+			context.load_cert_chain(chainfile, certfile[:-len(".crt")] + ".key")
+			self._contexts[name] = context
+		if len(self._contexts) == 0:
+			raise Exception("No server_*.crt certificates found in %s." % (ca_dir))
+		self._default_context = self._contexts.get(self._args.default_sni, next(iter(self._contexts.values())))
+		self._default_context.sni_callback = self._select_certificate
+
+	def _select_certificate(self, sslobj, server_name, context):
+		"""Exact matches first, otherwise the first label decides, so that e.g.
+		"foo17.bench" and "foo.example.com" are served with the "foo"
+		certificate. Everything else gets the default certificate."""
+		if server_name is None:
+			return
+		if server_name in self._contexts:
+			sslobj.context = self._contexts[server_name]
+			return
+		label = server_name.split(".")[0].rstrip("0123456789")
+		if label in self._contexts:
+			sslobj.context = self._contexts[label]
+
+	async def _serve_http(self, reader, writer):
+		"""HTTP/1.1 with keep-alive; GET /<n> responds with n bytes of body,
+		everything else with the default response size."""
+		while True:
+			request = await reader.readuntil(b"\r\n\r\n")
+			request_line = request.split(b"\r\n")[0].split()
+			length = self._args.response_size
+			if (len(request_line) >= 2) and request_line[1][1:].isdigit():
+				length = int(request_line[1][1:])
+			writer.write(b"HTTP/1.1 200 OK\r\nContent-Type: application/octet-stream\r\nContent-Length: %d\r\n\r\n" % (length))
+			remaining = length
+			while remaining > 0:
+				chunk = min(remaining, 65536)
+				writer.write(bytes(chunk))
+				remaining -= chunk
+				await writer.drain()
+			await writer.drain()
+
+	async def _serve_banner(self, reader, writer):
+		"""Server-first plaintext protocol in the style of SMTP: greets the
+		client right away, then echoes every line."""
+		writer.write(b"220 upstream-sim ready\r\n")
+		await writer.drain()
+		while True:
+			line = await reader.readline()
+			if len(line) == 0:
+				break
+			writer.write(line)
+			await writer.drain()
+
+	async def _handle_backend(self, reader, writer):
+		try:
+			if self._args.protocol == "https":
+				await self._serve_http(reader, writer)
+			else:
+				await self._serve_banner(reader, writer)
+		except (asyncio.IncompleteReadError, ConnectionError, ssl.SSLError):
+			pass
+		finally:
+			writer.close()
+
+	async def _handle_client(self, reader, writer):
+		self._statistics["connections"] += 1
+		await ShapedConnection(self, reader, writer).run()
+
+	async def run(self):
+		backend = await asyncio.start_server(self._handle_backend, "127.0.0.1", 0, ssl = self._default_context)
+		self._backend_address = backend.sockets[0].getsockname()[:2]
+		(host, port) = self._args.listen.rsplit(":", 1)
+		frontend = await asyncio.start_server(self._handle_client, host, int(port))
+		if self._args.verbose:
+			print("Simulating %s upstream on %s: RTT %.0f ms, jitter %.0f ms, bandwidth %s, slow start %s, stall probability %.2f, reset probability %.2f" % (self._args.protocol, self._args.listen, self._args.rtt, self._args.jitter, ("%.1f MBit/s" % (self._args.bandwidth)) if (self._args.bandwidth > 0) else "unlimited", "on" if self._profile.slow_start else "off", self._args.stall_probability, self._args.reset_probability), file = sys.stderr)
+		async with backend, frontend:
+			await frontend.serve_forever()
+
+parser = argparse.ArgumentParser(description = "Simulate upstream servers with internet-like latency, bandwidth and impairments for benchmarking ratched.")
+parser.add_argument("-l", "--listen", metavar = "host:port", default = "127.0.0.1:9443", help = "Address to accept connections on. Defaults to %(default)s.")
+parser.add_argument("-p", "--protocol", choices = [ "https", "banner" ], default = "https", help = "Protocol to serve. \"https\" is HTTP/1.1 over TLS, \"banner\" a plaintext server-first protocol that sends a greeting before the client says anything. Defaults to %(default)s.")
+parser.add_argument("--ca-dir", metavar = "path", default = os.path.join(os.path.dirname(os.path.abspath(__file__)), "..", "itests", "demo_ca"), help = "Directory with server_<name>.crt/.key certificates and intermediate.crt. Defaults to itests/demo_ca.")
+parser.add_argument("--default-sni", metavar = "name", default = "bar", help = "Certificate to serve when the SNI does not match any. Defaults to %(default)s.")
+parser.add_argument("--response-size", metavar = "bytes", type = int, default = 16384, help = "Size of HTTP response bodies unless the request asks for /<n>. Defaults to %(default)d.")
+parser.add_argument("--rtt", metavar = "ms", type = float, default = 50, help = "Round trip time to simulate. Defaults to %(default).0f ms.")
+parser.add_argument("--jitter", metavar = "ms", type = float, default = 5, help = "Spread of the one way delay (uniformly distributed). Defaults to %(default).0f ms.")
+parser.add_argument("--bandwidth", metavar = "MBit/s", type = float, default = 0, help = "Bandwidth cap per direction and connection; 0 means unlimited. Defaults to %(default).0f.")
+parser.add_argument("--initial-cwnd", metavar = "segments", type = int, default = 10, help = "Initial congestion window for slow start. Defaults to %(default)d.")
+parser.add_argument("--no-slow-start", action = "store_true", help = "Do not limit senders by a congestion window.")
+parser.add_argument("--stall-probability", metavar = "p", type = float, default = 0, help = "Probability that a connection stalls once while sending the response. Defaults to %(default).2f.")
+parser.add_argument("--stall-duration", metavar = "ms", type = float, default = 1000, help = "Duration of a stall. Defaults to %(default).0f ms.")
+parser.add_argument("--reset-probability", metavar = "p", type = float, default = 0, help = "Probability that the upstream resets a connection while sending the response. Defaults to %(default).2f.")
+parser.add_argument("--impairment-window", metavar = "bytes", type = int, default = 65536, help = "Stalls and resets happen at a random offset within the first this many bytes sent by the server. Defaults to %(default)d.")
+parser.add_argument("--seed", metavar = "seed", type = int, help = "Seed the random number generator for reproducible runs.")
+parser.add_argument("-v", "--verbose", action = "store_true", help = "Print the simulated link parameters and connection statistics.")
+args = parser.parse_args(sys.argv[1:])
+
+if args.seed is not None:
+	random.seed(args.seed)
+simulator = UpstreamSimulator(args)
+try:
+	asyncio.run(simulator.run())
+except KeyboardInterrupt:
+	if args.verbose:
+		print("%d connections, %d stalled, %d reset." % (simulator.statistics["connections"], simulator.statistics["stalls"], simulator.statistics["resets"]), file = sys.stderr)
@@ -0,0 +1,82 @@
+/**
+ *	ratched - TLS connection router that performs a man-in-the-middle attack
+ *	Copyright (C) 2017-2017 Johannes Bauer
+ *
+ *	This file is part of ratched.
+ *
+ *	ratched is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; this program is ONLY licensed under
+ *	version 3 of the License, later versions are explicitly excluded.
+ *
+ *	ratched is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with ratched; if not, write to the Free Software
+ *	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *	Johannes Bauer <JohannesBauer@gmx.de>
+**/
+
+
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include "cdc.h"
+
+/* Gear hash based content-defined chunking: every byte shifts the rolling
+ * hash by one bit and adds a per-byte-value constant, so the top bits of the
+ * hash depend on the last 64 bytes of input only. A chunk ends wherever the
+ * top CDC_AVERAGE_CHUNK_BITS bits are all zero. Because boundaries depend on
+ * content only, the same data produces the same chunks no matter how it was
+ * split into reads or at which offset of a stream it appears. The gear table
+ * is derived from a fixed seed so that boundaries stay stable across runs,
+ * which is what makes chunks from earlier captures reusable. */
+#define CDC_BOUNDARY_SHIFT			(64 - CDC_AVERAGE_CHUNK_BITS)
+#define CDC_GEAR_SEED				0x72617463686564ULL
+
+static pthread_once_t gear_table_once = PTHREAD_ONCE_INIT;
+static uint64_t gear_table[256];
+
+static void init_gear_table(void) {
+	/* splitmix64 */
+	uint64_t state = CDC_GEAR_SEED;
+	for (int i = 0; i < 256; i++) {
+		state += 0x9e3779b97f4a7c15ULL;
+		uint64_t z = state;
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+		gear_table[i] = z ^ (z >> 31);
+	}
+}
+
+void cdc_init(struct cdc_chunker_t *chunker) {
+	pthread_once(&gear_table_once, init_gear_table);
+	chunker->hash = 0;
+	chunker->length = 0;
+}
+
+void cdc_feed(struct cdc_chunker_t *chunker, const uint8_t *data, unsigned int length, cdc_chunk_callback_t callback, void *argument) {
+	uint64_t hash = chunker->hash;
+	for (unsigned int i = 0; i < length; i++) {
+		hash = (hash << 1) + gear_table[data[i]];
+		chunker->data[chunker->length++] = data[i];
+		if (((chunker->length >= CDC_MIN_CHUNK_SIZE) && ((hash >> CDC_BOUNDARY_SHIFT) == 0)) || (chunker->length == CDC_MAX_CHUNK_SIZE)) {
+			callback(chunker->data, chunker->length, argument);
+			chunker->length = 0;
+			hash = 0;
+		}
+	}
+	chunker->hash = hash;
+}
+
+void cdc_flush(struct cdc_chunker_t *chunker, cdc_chunk_callback_t callback, void *argument) {
+	if (chunker->length) {
+		callback(chunker->data, chunker->length, argument);
+	}
+	chunker->length = 0;
+	chunker->hash = 0;
+}
@@ -0,0 +1,50 @@
+/**
+ *	ratched - TLS connection router that performs a man-in-the-middle attack
+ *	Copyright (C) 2017-2017 Johannes Bauer
+ *
+ *	This file is part of ratched.
+ *
+ *	ratched is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; this program is ONLY licensed under
+ *	version 3 of the License, later versions are explicitly excluded.
+ *
+ *	ratched is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with ratched; if not, write to the Free Software
+ *	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *	Johannes Bauer <JohannesBauer@gmx.de>
+**/
+
+
+#ifndef __CDC_H__
+#define __CDC_H__
+
+#include <stdint.h>
+
+/* Chunk sizes of the content-defined chunker. The maximum needs to fit into
+ * the payload of a single emulated IPv4/TCP packet. */
+#define CDC_MIN_CHUNK_SIZE			(2 * 1024)
+#define CDC_AVERAGE_CHUNK_BITS		13
+#define CDC_MAX_CHUNK_SIZE			(32 * 1024)
+
+typedef void (*cdc_chunk_callback_t)(const uint8_t *data, unsigned int length, void *argument);
+
+struct cdc_chunker_t {
+	uint64_t hash;
+	unsigned int length;
+	uint8_t data[CDC_MAX_CHUNK_SIZE];
+};
+
+/*************** AUTO GENERATED SECTION FOLLOWS ***************/
+void cdc_init(struct cdc_chunker_t *chunker);
+void cdc_feed(struct cdc_chunker_t *chunker, const uint8_t *data, unsigned int length, cdc_chunk_callback_t callback, void *argument);
+void cdc_flush(struct cdc_chunker_t *chunker, cdc_chunk_callback_t callback, void *argument);
+/***************  AUTO GENERATED SECTION ENDS   ***************/
+
+#endif
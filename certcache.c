@@ -0,0 +1,408 @@
+/**
+ *	ratched - TLS connection router that performs a man-in-the-middle attack
+ *	Copyright (C) 2017-2017 Johannes Bauer
+ *
+ *	This file is part of ratched.
+ *
+ *	ratched is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; this program is ONLY licensed under
+ *	version 3 of the License, later versions are explicitly excluded.
+ *
+ *	ratched is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with ratched; if not, write to the Free Software
+ *	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *	Johannes Bauer <JohannesBauer@gmx.de>
+**/
+
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <openssl/x509.h>
+#include "logging.h"
+#include "certcache.h"
+#include "openssl_certs.h"
+#include "lockstat.h"
+
+/* Cache of certificates that holds each entry as its DER encoding inside a
+ * single allocation (entry metadata and DER blob are contiguous). A forged ECC
+ * certificate thereby takes well under 1 kB instead of the several kB that
+ * the parsed X509 structure with its many small allocations needs. Entries
+ * are evicted in LRU order once the configured byte budget is exceeded. A
+ * small, direct-mapped "hot" tier keeps parsed X509 objects of recently used
+ * entries around so that popular hosts do not need to be decoded on every
+ * connection. */
+#define CERTCACHE_INITIAL_BUCKET_COUNT		1024
+#define CERTCACHE_SCAN_BUCKETS_PER_LOCK		1024
+
+struct certcache_entry_t {
+	struct certcache_entry_t *hash_next;
+	struct certcache_entry_t *lru_prev;
+	struct certcache_entry_t *lru_next;
+	uint32_t hash;
+	uint8_t key_length;
+	uint8_t key[CERTCACHE_MAX_KEY_LENGTH];
+	uint64_t generation;
+	time_t created;
+	time_t not_after;
+	unsigned int der_length;
+	uint8_t der[];
+};
+
+struct certcache_hot_entry_t {
+	uint8_t key_length;
+	uint8_t key[CERTCACHE_MAX_KEY_LENGTH];
+	X509 *certificate;
+};
+
+struct certcache_t {
+	struct lockstat_mutex_t lock;
+	size_t byte_budget;
+	unsigned int bucket_count;
+	struct certcache_entry_t **buckets;
+	struct certcache_entry_t *lru_head;
+	struct certcache_entry_t *lru_tail;
+	uint64_t next_generation;
+	unsigned int hot_entry_count;
+	struct certcache_hot_entry_t *hot_entries;
+	struct certcache_stats_t stats;
+};
+
+static uint32_t hash_key(const uint8_t *key, unsigned int key_length) {
+	/* FNV-1a */
+	uint32_t hash = 0x811c9dc5;
+	for (unsigned int i = 0; i < key_length; i++) {
+		hash ^= key[i];
+		hash *= 0x01000193;
+	}
+	return hash;
+}
+
+static size_t entry_size(const struct certcache_entry_t *entry) {
+	return sizeof(struct certcache_entry_t) + entry->der_length;
+}
+
+static bool key_matches(const uint8_t *key1, unsigned int key1_length, const uint8_t *key2, unsigned int key2_length) {
+	return (key1_length == key2_length) && !memcmp(key1, key2, key1_length);
+}
+
+static struct certcache_hot_entry_t *hot_slot(struct certcache_t *cache, uint32_t hash) {
+	return cache->hot_entry_count ? &cache->hot_entries[hash % cache->hot_entry_count] : NULL;
+}
+
+static void hot_slot_clear(struct certcache_hot_entry_t *slot) {
+	X509_free(slot->certificate);
+	slot->certificate = NULL;
+	slot->key_length = 0;
+}
+
+static void hot_slot_set(struct certcache_hot_entry_t *slot, const uint8_t *key, unsigned int key_length, X509 *certificate) {
+	hot_slot_clear(slot);
+	X509_up_ref(certificate);
+	slot->certificate = certificate;
+	slot->key_length = key_length;
+	memcpy(slot->key, key, key_length);
+}
+
+static void lru_unlink(struct certcache_t *cache, struct certcache_entry_t *entry) {
+	if (entry->lru_prev) {
+		entry->lru_prev->lru_next = entry->lru_next;
+	} else {
+		cache->lru_head = entry->lru_next;
+	}
+	if (entry->lru_next) {
+		entry->lru_next->lru_prev = entry->lru_prev;
+	} else {
+		cache->lru_tail = entry->lru_prev;
+	}
+	entry->lru_prev = NULL;
+	entry->lru_next = NULL;
+}
+
+static void lru_push_front(struct certcache_t *cache, struct certcache_entry_t *entry) {
+	entry->lru_prev = NULL;
+	entry->lru_next = cache->lru_head;
+	if (cache->lru_head) {
+		cache->lru_head->lru_prev = entry;
+	} else {
+		cache->lru_tail = entry;
+	}
+	cache->lru_head = entry;
+}
+
+static struct certcache_entry_t **find_entry_ref(struct certcache_t *cache, const uint8_t *key, unsigned int key_length, uint32_t hash) {
+	struct certcache_entry_t **ref = &cache->buckets[hash % cache->bucket_count];
+	while (*ref) {
+		if (((*ref)->hash == hash) && key_matches((*ref)->key, (*ref)->key_length, key, key_length)) {
+			break;
+		}
+		ref = &(*ref)->hash_next;
+	}
+	return ref;
+}
+
+static void remove_entry(struct certcache_t *cache, struct certcache_entry_t **ref) {
+	struct certcache_entry_t *entry = *ref;
+	*ref = entry->hash_next;
+	lru_unlink(cache, entry);
+
+	struct certcache_hot_entry_t *slot = hot_slot(cache, entry->hash);
+	if (slot && key_matches(slot->key, slot->key_length, entry->key, entry->key_length)) {
+		hot_slot_clear(slot);
+	}
+
+	cache->stats.entry_count--;
+	cache->stats.bytes_used -= entry_size(entry);
+	free(entry);
+}
+
+static void grow_buckets(struct certcache_t *cache) {
+	unsigned int new_bucket_count = cache->bucket_count * 2;
+	struct certcache_entry_t **new_buckets = calloc(new_bucket_count, sizeof(struct certcache_entry_t*));
+	if (!new_buckets) {
+		return;
+	}
+	for (unsigned int i = 0; i < cache->bucket_count; i++) {
+		struct certcache_entry_t *entry = cache->buckets[i];
+		while (entry) {
+			struct certcache_entry_t *next = entry->hash_next;
+			unsigned int index = entry->hash % new_bucket_count;
+			entry->hash_next = new_buckets[index];
+			new_buckets[index] = entry;
+			entry = next;
+		}
+	}
+	free(cache->buckets);
+	cache->buckets = new_buckets;
+	cache->bucket_count = new_bucket_count;
+}
+
+static void evict_to_budget(struct certcache_t *cache) {
+	while ((cache->stats.bytes_used > cache->byte_budget) && cache->lru_tail) {
+		struct certcache_entry_t *victim = cache->lru_tail;
+		remove_entry(cache, find_entry_ref(cache, victim->key, victim->key_length, victim->hash));
+		cache->stats.evictions++;
+	}
+}
+
+struct certcache_t *certcache_new(size_t byte_budget, unsigned int hot_entry_count) {
+	struct certcache_t *cache = calloc(1, sizeof(struct certcache_t));
+	if (!cache) {
+		logmsg(LLVL_FATAL, "Unable to allocate certificate cache: %s", strerror(errno));
+		return NULL;
+	}
+	lockstat_mutex_init(&cache->lock, "certcache");
+	cache->byte_budget = byte_budget;
+	cache->bucket_count = CERTCACHE_INITIAL_BUCKET_COUNT;
+	cache->buckets = calloc(cache->bucket_count, sizeof(struct certcache_entry_t*));
+	cache->hot_entry_count = hot_entry_count;
+	cache->hot_entries = hot_entry_count ? calloc(hot_entry_count, sizeof(struct certcache_hot_entry_t)) : NULL;
+	if (!cache->buckets || (hot_entry_count && !cache->hot_entries)) {
+		logmsg(LLVL_FATAL, "Unable to allocate certificate cache tables: %s", strerror(errno));
+		certcache_free(cache);
+		return NULL;
+	}
+	return cache;
+}
+
+X509 *certcache_get(struct certcache_t *cache, const void *vkey, unsigned int key_length) {
+	const uint8_t *key = (const uint8_t*)vkey;
+	if (key_length > CERTCACHE_MAX_KEY_LENGTH) {
+		return NULL;
+	}
+	uint32_t hash = hash_key(key, key_length);
+
+	lockstat_lock(&cache->lock);
+	struct certcache_hot_entry_t *slot = hot_slot(cache, hash);
+	if (slot && slot->certificate && key_matches(slot->key, slot->key_length, key, key_length)) {
+		X509 *certificate = slot->certificate;
+		X509_up_ref(certificate);
+		struct certcache_entry_t *entry = *find_entry_ref(cache, key, key_length, hash);
+		if (entry) {
+			lru_unlink(cache, entry);
+			lru_push_front(cache, entry);
+		}
+		cache->stats.hot_hits++;
+		lockstat_unlock(&cache->lock);
+		return certificate;
+	}
+
+	struct certcache_entry_t *entry = *find_entry_ref(cache, key, key_length, hash);
+	if (!entry) {
+		cache->stats.misses++;
+		lockstat_unlock(&cache->lock);
+		return NULL;
+	}
+	lru_unlink(cache, entry);
+	lru_push_front(cache, entry);
+	cache->stats.der_hits++;
+
+	/* Decode outside of the lock; the entry might be evicted or replaced
+	 * meanwhile, so work on a copy of the DER data. */
+	const uint64_t generation = entry->generation;
+	const unsigned int der_length = entry->der_length;
+	uint8_t *der = malloc(der_length);
+	if (!der) {
+		lockstat_unlock(&cache->lock);
+		logmsg(LLVL_ERROR, "Unable to allocate %u bytes to decode cached certificate: %s", der_length, strerror(errno));
+		return NULL;
+	}
+	memcpy(der, entry->der, der_length);
+	lockstat_unlock(&cache->lock);
+
+	const unsigned char *der_ptr = der;
+	X509 *certificate = d2i_X509(NULL, &der_ptr, der_length);
+	free(der);
+	if (!certificate) {
+		logmsgext(LLVL_ERROR, FLAG_OPENSSL_ERROR, "Unable to decode cached DER certificate of %u bytes.", der_length);
+		return NULL;
+	}
+
+	if (slot) {
+		/* Only promote the certificate if the entry it was decoded from is
+		 * still current; a concurrent replacement (e.g., a renewal) has
+		 * already put its own certificate into the hot slot. */
+		lockstat_lock(&cache->lock);
+		entry = *find_entry_ref(cache, key, key_length, hash);
+		if (entry && (entry->generation == generation)) {
+			hot_slot_set(slot, key, key_length, certificate);
+		}
+		lockstat_unlock(&cache->lock);
+	}
+	return certificate;
+}
+
+/* Returns true if the certificate was inserted. If an entry with the same key
+ * already exists, it is only replaced if replace_existing is set. */
+bool certcache_put(struct certcache_t *cache, const void *vkey, unsigned int key_length, X509 *certificate, bool replace_existing) {
+	const uint8_t *key = (const uint8_t*)vkey;
+	if (key_length > CERTCACHE_MAX_KEY_LENGTH) {
+		logmsg(LLVL_FATAL, "Programming error: certificate cache key of %u bytes exceeds maximum of %d bytes.", key_length, CERTCACHE_MAX_KEY_LENGTH);
+		return false;
+	}
+
+	int der_length = i2d_X509(certificate, NULL);
+	if (der_length <= 0) {
+		logmsgext(LLVL_ERROR, FLAG_OPENSSL_ERROR, "Unable to determine DER length of certificate to cache.");
+		return false;
+	}
+	struct certcache_entry_t *new_entry = malloc(sizeof(struct certcache_entry_t) + der_length);
+	if (!new_entry) {
+		logmsg(LLVL_ERROR, "Unable to allocate %d bytes for certificate cache entry: %s", der_length, strerror(errno));
+		return false;
+	}
+	memset(new_entry, 0, sizeof(struct certcache_entry_t));
+	new_entry->created = time(NULL);
+	if (!get_certificate_expiry(certificate, &new_entry->not_after)) {
+		free(new_entry);
+		return false;
+	}
+	unsigned char *der_ptr = new_entry->der;
+	i2d_X509(certificate, &der_ptr);
+	new_entry->der_length = der_length;
+	new_entry->hash = hash_key(key, key_length);
+	new_entry->key_length = key_length;
+	memcpy(new_entry->key, key, key_length);
+
+	lockstat_lock(&cache->lock);
+	struct certcache_entry_t **ref = find_entry_ref(cache, key, key_length, new_entry->hash);
+	if (*ref) {
+		if (!replace_existing) {
+			lockstat_unlock(&cache->lock);
+			free(new_entry);
+			return false;
+		}
+		remove_entry(cache, ref);
+		ref = find_entry_ref(cache, key, key_length, new_entry->hash);
+	}
+	new_entry->generation = ++cache->next_generation;
+	new_entry->hash_next = *ref;
+	*ref = new_entry;
+	lru_push_front(cache, new_entry);
+	cache->stats.entry_count++;
+	cache->stats.bytes_used += entry_size(new_entry);
+	cache->stats.insertions++;
+
+	struct certcache_hot_entry_t *slot = hot_slot(cache, new_entry->hash);
+	if (slot) {
+		hot_slot_set(slot, key, key_length, certificate);
+	}
+	evict_to_budget(cache);
+	if (cache->stats.entry_count > cache->bucket_count) {
+		grow_buckets(cache);
+	}
+	lockstat_unlock(&cache->lock);
+	return true;
+}
+
+/* Calls the callback for every cached entry. The cache lock is only held for a
+ * limited number of hash buckets at a time so that connection handling is not
+ * stalled by a scan of a large cache; entries that are inserted or moved
+ * during the scan may therefore be missed or reported twice. The callback
+ * must not call back into the cache. */
+void certcache_scan(struct certcache_t *cache, void (*callback)(const struct certcache_entry_info_t *info, void *argument), void *argument) {
+	unsigned int bucket_index = 0;
+	while (true) {
+		lockstat_lock(&cache->lock);
+		if (bucket_index >= cache->bucket_count) {
+			lockstat_unlock(&cache->lock);
+			break;
+		}
+		unsigned int end_index = bucket_index + CERTCACHE_SCAN_BUCKETS_PER_LOCK;
+		if (end_index > cache->bucket_count) {
+			end_index = cache->bucket_count;
+		}
+		for (; bucket_index < end_index; bucket_index++) {
+			for (const struct certcache_entry_t *entry = cache->buckets[bucket_index]; entry; entry = entry->hash_next) {
+				struct certcache_entry_info_t info = {
+					.key = entry->key,
+					.key_length = entry->key_length,
+					.created = entry->created,
+					.not_after = entry->not_after,
+				};
+				callback(&info, argument);
+			}
+		}
+		lockstat_unlock(&cache->lock);
+	}
+}
+
+void certcache_get_stats(struct certcache_t *cache, struct certcache_stats_t *stats) {
+	lockstat_lock(&cache->lock);
+	*stats = cache->stats;
+	lockstat_unlock(&cache->lock);
+}
+
+void certcache_free(struct certcache_t *cache) {
+	if (!cache) {
+		return;
+	}
+	if (cache->buckets) {
+		for (unsigned int i = 0; i < cache->bucket_count; i++) {
+			struct certcache_entry_t *entry = cache->buckets[i];
+			while (entry) {
+				struct certcache_entry_t *next = entry->hash_next;
+				free(entry);
+				entry = next;
+			}
+		}
+	}
+	if (cache->hot_entries) {
+		for (unsigned int i = 0; i < cache->hot_entry_count; i++) {
+			hot_slot_clear(&cache->hot_entries[i]);
+		}
+	}
+	free(cache->hot_entries);
+	free(cache->buckets);
+	lockstat_mutex_destroy(&cache->lock);
+	free(cache);
+}
@@ -0,0 +1,62 @@
+/**
+ *	ratched - TLS connection router that performs a man-in-the-middle attack
+ *	Copyright (C) 2017-2017 Johannes Bauer
+ *
+ *	This file is part of ratched.
+ *
+ *	ratched is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; this program is ONLY licensed under
+ *	version 3 of the License, later versions are explicitly excluded.
+ *
+ *	ratched is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with ratched; if not, write to the Free Software
+ *	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *	Johannes Bauer <JohannesBauer@gmx.de>
+**/
+
+
+#ifndef __CERTCACHE_H__
+#define __CERTCACHE_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+#include <openssl/x509.h>
+
+#define CERTCACHE_MAX_KEY_LENGTH		32
+
+struct certcache_stats_t {
+	unsigned int entry_count;
+	size_t bytes_used;
+	uint64_t hot_hits;
+	uint64_t der_hits;
+	uint64_t misses;
+	uint64_t insertions;
+	uint64_t evictions;
+};
+
+struct certcache_entry_info_t {
+	const void *key;
+	unsigned int key_length;
+	time_t created;
+	time_t not_after;
+};
+
+/*************** AUTO GENERATED SECTION FOLLOWS ***************/
+struct certcache_t *certcache_new(size_t byte_budget, unsigned int hot_entry_count);
+X509 *certcache_get(struct certcache_t *cache, const void *vkey, unsigned int key_length);
+bool certcache_put(struct certcache_t *cache, const void *vkey, unsigned int key_length, X509 *certificate, bool replace_existing);
+void certcache_scan(struct certcache_t *cache, void (*callback)(const struct certcache_entry_info_t *info, void *argument), void *argument);
+void certcache_get_stats(struct certcache_t *cache, struct certcache_stats_t *stats);
+void certcache_free(struct certcache_t *cache);
+/***************  AUTO GENERATED SECTION ENDS   ***************/
+
+#endif
@@ -22,10 +22,13 @@
 **/
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <errno.h>
+#include <time.h>
+#include <pthread.h>
 #include <openssl/evp.h>
 #include <openssl/x509.h>
 #include <openssl/pem.h>
@@ -35,21 +38,67 @@
 #include "openssl_certs.h"
 #include "ipfwd.h"
 #include "tools.h"
-#include "map.h"
+#include "certcache.h"
+#include "thread.h"
+#include "stats.h"
+#include "cryptomem.h"
+#include "lockstat.h"
 
 #define MAX_PATH_LEN		1024
-
-struct server_certificate_t {
-	const char *hostname;
-	uint32_t ipv4_nbo;
-	X509 *certificate;
-};
+#define SERVER_CERTIFICATE_HOT_ENTRIES		256
+#define ROOT_CERTIFICATE_VALIDITY_SECS		(86400 * 365 * 5)
+#define SERVER_CERTIFICATE_VALIDITY_SECS	(86400 * 365 * 1)
+#define SERVER_CERTIFICATE_RENEWAL_MARGIN_SECS	(86400 * 30)
+#define MAX_RENEWALS_PER_MAINTENANCE_RUN	4096
+#define DETERMINISTIC_VALIDITY_EPOCH_SECS	(86400 * 7)
 
 static X509 *root_ca;
+static struct lockstat_mutex_t root_ca_lock = LOCKSTAT_MUTEX_INITIALIZER("root_ca");
 static EVP_PKEY *root_ca_key;
 static EVP_PKEY *server_key;
 static EVP_PKEY *client_key;
-static struct map_t *server_certificates;
+static struct certcache_t *server_certificates;
+static struct periodic_thread_t maintenance_thread;
+
+static struct {
+	struct stats_counter_t *forged;
+	struct stats_counter_t *renewed;
+	struct stats_counter_t *renewal_failed;
+	struct stats_counter_t *expired_on_use;
+	struct stats_counter_t *cached;
+	struct stats_counter_t *cache_bytes;
+	struct stats_counter_t *expiring;
+	struct stats_counter_t *age_mean_secs;
+	struct stats_counter_t *age_max_secs;
+	struct stats_counter_t *root_remaining_secs;
+	struct stats_counter_t *root_rollovers;
+	struct stats_counter_t *mirrored;
+	struct stats_counter_t *mirror_hits;
+	struct stats_counter_t *mirror_warm;
+	struct stats_counter_t *mirror_cold;
+	struct stats_counter_t *mirror_expiring;
+} counters;
+
+struct server_certificate_key_t {
+	uint32_t ipv4_nbo;
+	uint32_t hostname_id;
+};
+
+/* Mirrored certificates live in the same cache as regular forgeries, but
+ * under keys of different lengths so that they never collide with them (and
+ * are not renewed by the maintenance task; their validity is that of the
+ * upstream certificate). They are cached by the fingerprint of the upstream
+ * certificate and, additionally, the most recent one per host so that later
+ * connections to that host do not need to wait for the upstream handshake. */
+struct mirrored_certificate_key_t {
+	uint8_t upstream_fingerprint[32];
+};
+
+struct mirrored_host_key_t {
+	uint32_t ipv4_nbo;
+	uint32_t hostname_id;
+	uint32_t mirrored;
+};
 
 static bool get_config_filename(char filename[static MAX_PATH_LEN], const char *suffix) {
 	return strxcat(filename, MAX_PATH_LEN, pgm_options->config_dir, "/", suffix, NULL);
@@ -59,6 +108,10 @@ static bool get_root_ca_filename(char filename[static MAX_PATH_LEN]) {
 	return get_config_filename(filename, "root.crt");
 }
 
+static bool get_previous_root_ca_filename(char filename[static MAX_PATH_LEN]) {
+	return get_config_filename(filename, "root-previous.crt");
+}
+
 static bool get_root_key_filename(char filename[static MAX_PATH_LEN]) {
 	return get_config_filename(filename, "root.key");
 }
@@ -83,70 +136,273 @@ static void fill_pgmopts_keyspec(struct keyspec_t *keyspec) {
 	}
 }
 
-bool certforgery_init(void) {
-	makedirs(pgm_options->config_dir);
-	{
-		struct keyspec_t keyspec = {
-			.description = "root",
-		};
-		fill_pgmopts_keyspec(&keyspec);
-		char filename[MAX_PATH_LEN];
-		if (get_root_key_filename(filename)) {
-			root_ca_key = openssl_load_stored_key(&keyspec, filename);
-			if (!root_ca_key) {
-				logmsg(LLVL_FATAL, "Unable to load or create root CA private keypair.");
-				return false;
-			}
-		} else {
-			logmsg(LLVL_FATAL, "Could not get root CA private key filename.");
-			return false;
+struct stored_key_job_t {
+	const char *description;
+	bool (*get_filename)(char filename[static MAX_PATH_LEN]);
+	EVP_PKEY **key;
+	bool success;
+};
+
+static void load_stored_key_job(unsigned int index, void *vjobs) {
+	struct stored_key_job_t *job = ((struct stored_key_job_t*)vjobs) + index;
+	struct keyspec_t keyspec = {
+		.description = job->description,
+	};
+	fill_pgmopts_keyspec(&keyspec);
+	char filename[MAX_PATH_LEN];
+	if (!job->get_filename(filename)) {
+		logmsg(LLVL_FATAL, "Could not get %s private key filename.", job->description);
+		return;
+	}
+	*job->key = openssl_load_stored_key(&keyspec, filename);
+	if (!*job->key) {
+		logmsg(LLVL_FATAL, "Unable to load or create %s private keypair.", job->description);
+		return;
+	}
+	job->success = true;
+}
+
+static void fill_root_certspec(struct certificatespec_t *certspec) {
+	*certspec = (struct certificatespec_t) {
+		.description = "root",
+		.subject_pubkey = root_ca_key,
+		.issuer_privkey = root_ca_key,
+		.common_name = "Evil root certificate",
+		.mark_certificate = pgm_options->forged_certs.mark_forged_certificates,
+		.is_ca_certificate = true,
+		.validity_predate_seconds = 86400,
+		.validity_seconds = ROOT_CERTIFICATE_VALIDITY_SECS,
+	};
+}
+
+static X509 *get_root_certificate(void) {
+	lockstat_lock(&root_ca_lock);
+	X509 *certificate = root_ca;
+	X509_up_ref(certificate);
+	lockstat_unlock(&root_ca_lock);
+	return certificate;
+}
+
+/* When the root certificate approaches its expiry, a successor is issued with
+ * the same key and subject. Forged certificates are therefore signed by a key
+ * that both the old and the new root certify: clients that still only trust
+ * the old root keep working until it expires (the transition window) while
+ * the new root.crt is distributed. The old root is kept as root-previous.crt. */
+static void check_root_rollover(void) {
+	X509 *current_root = get_root_certificate();
+	time_t not_after;
+	if (!get_certificate_expiry(current_root, &not_after)) {
+		X509_free(current_root);
+		return;
+	}
+	time_t remaining = not_after - time(NULL);
+	stats_set(counters.root_remaining_secs, remaining);
+
+	const time_t transition_window = (time_t)pgm_options->forged_certs.root_transition_days * 86400;
+	if (remaining > transition_window) {
+		X509_free(current_root);
+		return;
+	}
+
+	logmsg(LLVL_WARN, "Root certificate expires in %ld days, issuing successor with identical key and subject.", (long)(remaining / 86400));
+	struct certificatespec_t certspec;
+	fill_root_certspec(&certspec);
+	X509 *new_root = openssl_create_certificate(&certspec);
+	if (!new_root) {
+		logmsg(LLVL_ERROR, "Root certificate rollover failed, will retry during next maintenance run.");
+		X509_free(current_root);
+		return;
+	}
+
+	char filename[MAX_PATH_LEN];
+	if (get_previous_root_ca_filename(filename)) {
+		openssl_store_cert(filename, "previous root", false, current_root);
+	}
+	if (get_root_ca_filename(filename)) {
+		openssl_store_cert(filename, "root", false, new_root);
+	}
+
+	lockstat_lock(&root_ca_lock);
+	X509 *old_root = root_ca;
+	root_ca = new_root;
+	lockstat_unlock(&root_ca_lock);
+	X509_free(old_root);
+
+	stats_inc(counters.root_rollovers);
+	if (get_certificate_expiry(new_root, &not_after)) {
+		stats_set(counters.root_remaining_secs, not_after - time(NULL));
+	}
+	if (remaining > 0) {
+		logmsg(LLVL_WARN, "Root certificate rolled over; the previous root stays valid for %ld more days. Clients should import the new %s/root.crt before then.", (long)(remaining / 86400), pgm_options->config_dir);
+	} else {
+		logmsg(LLVL_WARN, "Expired root certificate replaced; clients need to import the new %s/root.crt.", pgm_options->config_dir);
+	}
+	log_cert(LLVL_DEBUG, new_root, "New root certificate");
+	X509_free(current_root);
+}
+
+static X509 *forge_server_certificate(const struct hostname_t *hostname, uint32_t ipv4_nbo) {
+	if (hostname) {
+		logmsg(LLVL_DEBUG, "Forging certificate for %s (" PRI_IPv4 ")", hostname->name, FMT_IPv4(ipv4_nbo));
+	} else {
+		logmsg(LLVL_DEBUG, "Forging certificate for " PRI_IPv4, FMT_IPv4(ipv4_nbo));
+	}
+	X509 *issuer = get_root_certificate();
+	char ipv4[16];
+	struct certificatespec_t certspec = {
+		.description = "TLS server",
+		.subject_pubkey = server_key,
+		.issuer_privkey = root_ca_key,
+		.issuer_certificate = issuer,
+		.mark_certificate = pgm_options->forged_certs.mark_forged_certificates,
+		.subject_alternative_ipv4_address = ipv4_nbo,
+		.is_ca_certificate = false,
+		.validity_predate_seconds = 86400,
+		.validity_seconds = SERVER_CERTIFICATE_VALIDITY_SECS,
+		.validity_epoch_seconds = pgm_options->forged_certs.deterministic ? DETERMINISTIC_VALIDITY_EPOCH_SECS : 0,
+		.crl_uri = pgm_options->forged_certs.crl_uri,
+		.ocsp_responder_uri = pgm_options->forged_certs.ocsp_responder_uri,
+	};
+	if (hostname) {
+		certspec.subject_alternative_dns_hostname = hostname->name;
+		certspec.common_name = hostname->name;
+	} else {
+		snprintf(ipv4, sizeof(ipv4), PRI_IPv4, FMT_IPv4(ipv4_nbo));
+		certspec.common_name = ipv4;
+	}
+	enum cryptomem_subsystem_t previous_subsystem = cryptomem_enter(CRYPTOMEM_FORGING);
+	X509 *certificate = openssl_create_certificate(&certspec);
+	X509_free(issuer);
+	cryptomem_leave(previous_subsystem);
+	if (!certificate) {
+		logmsg(LLVL_ERROR, "Forging server certificate failed.");
+		return NULL;
+	}
+	stats_inc(counters.forged);
+	if (pgm_options->log.dump_certificates) {
+		log_cert(LLVL_DEBUG, certificate, "Created forged server certificate");
+	}
+	return certificate;
+}
+
+struct maintenance_scan_t {
+	time_t now;
+	unsigned int entry_count;
+	unsigned int expiring_count;
+	unsigned int mirror_expiring_count;
+	double age_sum;
+	time_t max_age;
+	unsigned int renewal_count;
+	struct server_certificate_key_t renewals[MAX_RENEWALS_PER_MAINTENANCE_RUN];
+};
+
+static void maintenance_scan_entry(const struct certcache_entry_info_t *info, void *vscan) {
+	struct maintenance_scan_t *scan = (struct maintenance_scan_t*)vscan;
+	time_t age = scan->now - info->created;
+	scan->entry_count++;
+	scan->age_sum += age;
+	if (age > scan->max_age) {
+		scan->max_age = age;
+	}
+	if (info->not_after - scan->now < SERVER_CERTIFICATE_RENEWAL_MARGIN_SECS) {
+		if (info->key_length != sizeof(struct server_certificate_key_t)) {
+			/* Mirrored certificate, only replaced when the upstream
+			 * certificate changes */
+			scan->mirror_expiring_count++;
+			return;
+		}
+		scan->expiring_count++;
+		if (scan->renewal_count < MAX_RENEWALS_PER_MAINTENANCE_RUN) {
+			memcpy(&scan->renewals[scan->renewal_count++], info->key, sizeof(struct server_certificate_key_t));
 		}
 	}
-	{
-		struct keyspec_t keyspec = {
-			.description = "TLS server",
-		};
-		fill_pgmopts_keyspec(&keyspec);
-		char filename[MAX_PATH_LEN];
-		if (get_server_key_filename(filename)) {
-			server_key = openssl_load_stored_key(&keyspec, filename);
-			if (!server_key) {
-				logmsg(LLVL_FATAL, "Unable to load or create server private keypair.");
-				return false;
-			}
+}
+
+/* Periodically run off the connection handling path: renews forged
+ * certificates that are about to expire (so that clients never get to see an
+ * expired one and connections do not have to wait for inline forging), rolls
+ * over the root certificate when necessary and updates the age metrics. */
+static void certificate_maintenance(void *argument) {
+	enum cryptomem_subsystem_t previous_subsystem = cryptomem_enter(CRYPTOMEM_FORGING);
+	check_root_rollover();
+
+	struct maintenance_scan_t *scan = calloc(1, sizeof(struct maintenance_scan_t));
+	if (!scan) {
+		logmsg(LLVL_ERROR, "Unable to allocate certificate maintenance scan state: %s", strerror(errno));
+		cryptomem_leave(previous_subsystem);
+		return;
+	}
+	scan->now = time(NULL);
+	certcache_scan(server_certificates, maintenance_scan_entry, scan);
+
+	unsigned int renewed = 0;
+	for (unsigned int i = 0; i < scan->renewal_count; i++) {
+		const struct server_certificate_key_t *key = &scan->renewals[i];
+		const struct hostname_t *hostname = get_interned_hostname(key->hostname_id);
+		X509 *certificate = forge_server_certificate(hostname, key->ipv4_nbo);
+		if (certificate && certcache_put(server_certificates, key, sizeof(*key), certificate, true)) {
+			renewed++;
 		} else {
-			logmsg(LLVL_FATAL, "Could not get server private key filename.");
-			return false;
+			stats_inc(counters.renewal_failed);
 		}
+		X509_free(certificate);
 	}
-	{
-		struct keyspec_t keyspec = {
-			.description = "TLS client",
-		};
-		fill_pgmopts_keyspec(&keyspec);
-		char filename[MAX_PATH_LEN];
-		if (get_client_key_filename(filename)) {
-			client_key = openssl_load_stored_key(&keyspec, filename);
-			if (!client_key) {
-				logmsg(LLVL_FATAL, "Unable to load or create client private keypair.");
-				return false;
-			}
-		} else {
-			logmsg(LLVL_FATAL, "Could not get client private key filename.");
+	stats_add(counters.renewed, renewed);
+
+	struct certcache_stats_t cache_stats;
+	certcache_get_stats(server_certificates, &cache_stats);
+	stats_set(counters.cached, cache_stats.entry_count);
+	stats_set(counters.cache_bytes, cache_stats.bytes_used);
+	stats_set(counters.expiring, scan->expiring_count - renewed);
+	stats_set(counters.mirror_expiring, scan->mirror_expiring_count);
+	stats_set(counters.age_mean_secs, scan->entry_count ? (int64_t)(scan->age_sum / scan->entry_count) : 0);
+	stats_set(counters.age_max_secs, scan->max_age);
+	logmsg(renewed ? LLVL_INFO : LLVL_DEBUG, "Certificate maintenance: %u cached server certificates, mean age %.1f days, max age %.1f days, %u expiring, %u renewed, %u mirrored expiring.", scan->entry_count, scan->entry_count ? (scan->age_sum / scan->entry_count / 86400) : 0, scan->max_age / 86400., scan->expiring_count, renewed, scan->mirror_expiring_count);
+	free(scan);
+	cryptomem_leave(previous_subsystem);
+}
+
+static void init_counters(void) {
+	counters.forged = stats_counter("certs.forged");
+	counters.renewed = stats_counter("certs.renewed");
+	counters.renewal_failed = stats_counter("certs.renewal_failed");
+	counters.expired_on_use = stats_counter("certs.expired_on_use");
+	counters.cached = stats_counter("certs.cached");
+	counters.cache_bytes = stats_counter("certs.cache_bytes");
+	counters.expiring = stats_counter("certs.expiring");
+	counters.age_mean_secs = stats_counter("certs.age_mean_secs");
+	counters.age_max_secs = stats_counter("certs.age_max_secs");
+	counters.root_remaining_secs = stats_counter("root.remaining_secs");
+	counters.root_rollovers = stats_counter("root.rollovers");
+	counters.mirrored = stats_counter("certs.mirrored");
+	counters.mirror_hits = stats_counter("certs.mirror_hits");
+	counters.mirror_warm = stats_counter("certs.mirror_warm");
+	counters.mirror_cold = stats_counter("certs.mirror_cold");
+	counters.mirror_expiring = stats_counter("certs.mirror_expiring");
+}
+
+bool certforgery_init(void) {
+	init_counters();
+	makedirs(pgm_options->config_dir);
+
+	/* Loading the keys is independent of each other, but generating them
+	 * (especially RSA) is expensive on first start; do it in parallel. */
+	struct stored_key_job_t key_jobs[] = {
+		{ .description = "root", .get_filename = get_root_key_filename, .key = &root_ca_key },
+		{ .description = "TLS server", .get_filename = get_server_key_filename, .key = &server_key },
+		{ .description = "TLS client", .get_filename = get_client_key_filename, .key = &client_key },
+	};
+	const unsigned int key_job_count = sizeof(key_jobs) / sizeof(key_jobs[0]);
+	run_parallel_jobs(key_job_count, load_stored_key_job, key_jobs);
+	for (unsigned int i = 0; i < key_job_count; i++) {
+		if (!key_jobs[i].success) {
 			return false;
 		}
 	}
+
 	{
-		struct certificatespec_t certspec = {
-			.description = "root",
-			.subject_pubkey = root_ca_key,
-			.issuer_privkey = root_ca_key,
-			.common_name = "Evil root certificate",
-			.mark_certificate = pgm_options->forged_certs.mark_forged_certificates,
-			.is_ca_certificate = true,
-			.validity_predate_seconds = 86400,
-			.validity_seconds = 86400 * 365 * 5,
-		};
+		struct certificatespec_t certspec;
+		fill_root_certspec(&certspec);
 		char filename[MAX_PATH_LEN];
 		if (get_root_ca_filename(filename)) {
 			root_ca = openssl_load_stored_certificate(&certspec, filename, true, true);
@@ -154,19 +410,31 @@ bool certforgery_init(void) {
 			logmsg(LLVL_FATAL, "Could not get root CA filename.");
 			return false;
 		}
+		if (!root_ca) {
+			logmsg(LLVL_FATAL, "Unable to load or create root certificate.");
+			return false;
+		}
 		log_cert(LLVL_DEBUG, root_ca, "Used root certificate");
 	}
-	server_certificates = map_new();
+	check_root_rollover();
+	server_certificates = certcache_new((size_t)pgm_options->forged_certs.cache_size_mib * 1024 * 1024, SERVER_CERTIFICATE_HOT_ENTRIES);
 	if (!server_certificates) {
-		logmsg(LLVL_FATAL, "Failed to create server_certificates map.");
+		logmsg(LLVL_FATAL, "Failed to create server certificate cache.");
 		return false;
 	}
+	if (pgm_options->forged_certs.deterministic && (EVP_PKEY_id(root_ca_key) == EVP_PKEY_EC)) {
+		logmsg(LLVL_WARN, "Deterministic certificates requested, but the root key uses ECDSA which signs with a random nonce. Forged certificates will only be identical apart from their signatures.");
+	}
+	if (pgm_options->forged_certs.maintenance_interval > 0) {
+		if (!start_periodic_thread(&maintenance_thread, "certmaint", pgm_options->forged_certs.maintenance_interval, certificate_maintenance, NULL)) {
+			logmsg(LLVL_WARN, "Certificate maintenance thread could not be started, forged certificates will only be renewed on expiry.");
+		}
+	}
 	return true;
 }
 
 X509 *get_forged_root_certificate(void) {
-	X509_up_ref(root_ca);
-	return root_ca;
+	return get_root_certificate();
 }
 
 EVP_PKEY *get_forged_root_key(void) {
@@ -184,68 +452,152 @@ EVP_PKEY *get_tls_client_key(void) {
 	return client_key;
 }
 
-X509 *forge_certificate_for_server(const char *hostname, uint32_t ipv4_nbo) {
-	int hlen = hostname ? strlen(hostname) : 0;
-	int keylen = sizeof(uint32_t) + hlen;
-	uint8_t key[keylen];
-	memcpy(key + 0, &ipv4_nbo, sizeof(uint32_t));
-	if (hostname) {
-		memcpy(key + sizeof(uint32_t), hostname, hlen);
+static X509 *server_certificate_cache_put(const struct server_certificate_key_t *key, X509 *certificate) {
+	if (!certcache_put(server_certificates, key, sizeof(*key), certificate, false)) {
+		/* Another thread was faster forging the same certificate. Use theirs
+		 * so that all connections see the same certificate. */
+		X509 *existing = certcache_get(server_certificates, key, sizeof(*key));
+		if (existing) {
+			X509_free(certificate);
+			certificate = existing;
+		}
 	}
+	return certificate;
+}
 
-	X509 *certificate = map_get(server_certificates, key, keylen);
-	if (!certificate) {
-		if (hostname) {
-			logmsg(LLVL_DEBUG, "Forging certificate for %s (" PRI_IPv4 ")", hostname, FMT_IPv4(ipv4_nbo));
-		} else {
-			logmsg(LLVL_DEBUG, "Forging certificate for " PRI_IPv4, FMT_IPv4(ipv4_nbo));
-		}
-		char ipv4[16];
-		struct certificatespec_t certspec = {
-			.description = "TLS server",
-			.subject_pubkey = server_key,
-			.issuer_privkey = root_ca_key,
-			.issuer_certificate = root_ca,
-			.mark_certificate = pgm_options->forged_certs.mark_forged_certificates,
-			.subject_alternative_ipv4_address = ipv4_nbo,
-			.is_ca_certificate = false,
-			.validity_predate_seconds = 86400,
-			.validity_seconds = 86400 * 365 * 1,
-			.crl_uri = pgm_options->forged_certs.crl_uri,
-			.ocsp_responder_uri = pgm_options->forged_certs.ocsp_responder_uri,
-		};
-		if (hostname) {
-			certspec.subject_alternative_dns_hostname = hostname;
-			certspec.common_name = hostname;
-		} else {
-			snprintf(ipv4, sizeof(ipv4), PRI_IPv4, FMT_IPv4(ipv4_nbo));
-			certspec.common_name = ipv4;
+X509 *forge_certificate_for_server(const struct hostname_t *hostname, uint32_t ipv4_nbo) {
+	struct server_certificate_key_t key = {
+		.ipv4_nbo = ipv4_nbo,
+		.hostname_id = hostname ? hostname->id : 0,
+	};
+	if (hostname && !hostname->id) {
+		/* Host name could not be interned and therefore cannot be part of a
+		 * cache key */
+		return forge_server_certificate(hostname, ipv4_nbo);
+	}
+
+	X509 *certificate = certcache_get(server_certificates, &key, sizeof(key));
+	if (certificate) {
+		if (X509_cmp_current_time(X509_get0_notAfter(certificate)) > 0) {
+			return certificate;
 		}
-		certificate = openssl_create_certificate(&certspec);
+		/* Should usually have been renewed by the maintenance thread */
+		X509_free(certificate);
+		stats_inc(counters.expired_on_use);
+		certificate = forge_server_certificate(hostname, ipv4_nbo);
 		if (certificate) {
-			map_set_ptr(server_certificates, key, keylen, certificate);
-			if (pgm_options->log.dump_certificates) {
-				log_cert(LLVL_DEBUG, certificate, "Created forged server certificate");
-			}
-		} else {
-			logmsg(LLVL_ERROR, "Forging server certificate failed.");
+			certcache_put(server_certificates, &key, sizeof(key), certificate, true);
 		}
+		return certificate;
 	}
-	if (certificate) {
-		X509_up_ref(certificate);
+
+	certificate = forge_server_certificate(hostname, ipv4_nbo);
+	if (!certificate) {
+		return NULL;
+	}
+	return server_certificate_cache_put(&key, certificate);
+}
+
+static X509 *forge_mirrored_certificate(X509 *upstream_certificate) {
+	if (loglevel_at_least(LLVL_DEBUG)) {
+		char subject[256];
+		X509_NAME_oneline(X509_get_subject_name(upstream_certificate), subject, sizeof(subject));
+		logmsg(LLVL_DEBUG, "Forging mirror of upstream certificate %s", subject);
+	}
+	X509 *issuer = get_root_certificate();
+	struct certificatespec_t certspec = {
+		.description = "mirrored TLS server",
+		.subject_pubkey = server_key,
+		.issuer_privkey = root_ca_key,
+		.issuer_certificate = issuer,
+		.mark_certificate = pgm_options->forged_certs.mark_forged_certificates,
+		.is_ca_certificate = false,
+		.crl_uri = pgm_options->forged_certs.crl_uri,
+		.ocsp_responder_uri = pgm_options->forged_certs.ocsp_responder_uri,
+		.mirror_certificate = upstream_certificate,
+	};
+	enum cryptomem_subsystem_t previous_subsystem = cryptomem_enter(CRYPTOMEM_FORGING);
+	X509 *certificate = openssl_create_certificate(&certspec);
+	X509_free(issuer);
+	cryptomem_leave(previous_subsystem);
+	if (!certificate) {
+		logmsg(LLVL_ERROR, "Forging mirrored server certificate failed.");
+		return NULL;
+	}
+	stats_inc(counters.mirrored);
+	if (pgm_options->log.dump_certificates) {
+		log_cert(LLVL_DEBUG, certificate, "Created mirrored server certificate");
 	}
 	return certificate;
 }
 
-static void free_certificate(void *server_cert) {
-	X509_free((X509*)server_cert);
+/* Returns the certificate that was last mirrored for the given host, if any.
+ * It can be presented to the client before the upstream connection has been
+ * established. */
+X509 *get_mirrored_certificate_for_server(const struct hostname_t *hostname, uint32_t ipv4_nbo) {
+	struct mirrored_host_key_t host_key = {
+		.ipv4_nbo = ipv4_nbo,
+		.hostname_id = hostname ? hostname->id : 0,
+		.mirrored = 1,
+	};
+	X509 *certificate = (hostname && !hostname->id) ? NULL : certcache_get(server_certificates, &host_key, sizeof(host_key));
+	stats_inc(certificate ? counters.mirror_warm : counters.mirror_cold);
+	return certificate;
+}
+
+/* Returns the forged mirror image of the certificate that the upstream
+ * server presented, which is only created if that certificate has not been
+ * seen before. Also remembers it as the host's current mirror when it differs
+ * from the one that was used for this connection. */
+X509 *mirror_certificate_for_server(const struct hostname_t *hostname, uint32_t ipv4_nbo, X509 *upstream_certificate, X509 *presented_certificate) {
+	struct mirrored_certificate_key_t key;
+	if (!upstream_certificate) {
+		logmsg(LLVL_ERROR, "Upstream server did not present a certificate that could be mirrored.");
+		return NULL;
+	}
+	if (!get_certificate_hash(key.upstream_fingerprint, upstream_certificate)) {
+		logmsg(LLVL_ERROR, "Cannot determine fingerprint of upstream certificate to mirror.");
+		return NULL;
+	}
+
+	X509 *certificate = certcache_get(server_certificates, &key, sizeof(key));
+	if (certificate) {
+		stats_inc(counters.mirror_hits);
+	} else {
+		certificate = forge_mirrored_certificate(upstream_certificate);
+		if (!certificate) {
+			return NULL;
+		}
+		if (!certcache_put(server_certificates, &key, sizeof(key), certificate, false)) {
+			X509 *existing = certcache_get(server_certificates, &key, sizeof(key));
+			if (existing) {
+				X509_free(certificate);
+				certificate = existing;
+			}
+		}
+	}
+
+	if ((!hostname || hostname->id) && (!presented_certificate || X509_cmp(presented_certificate, certificate))) {
+		struct mirrored_host_key_t host_key = {
+			.ipv4_nbo = ipv4_nbo,
+			.hostname_id = hostname ? hostname->id : 0,
+			.mirrored = 1,
+		};
+		certcache_put(server_certificates, &host_key, sizeof(host_key), certificate, true);
+	}
+	return certificate;
 }
 
 void certforgery_deinit(void) {
+	stop_periodic_thread(&maintenance_thread);
 	X509_free(root_ca);
 	EVP_PKEY_free(root_ca_key);
 	EVP_PKEY_free(server_key);
 	EVP_PKEY_free(client_key);
-	map_foreach_ptrvalue(server_certificates, free_certificate);
-	map_free(server_certificates);
+	if (server_certificates) {
+		struct certcache_stats_t stats;
+		certcache_get_stats(server_certificates, &stats);
+		logmsg(LLVL_DEBUG, "Server certificate cache: %u entries in %zu bytes, %" PRIu64 " hot hits, %" PRIu64 " DER hits, %" PRIu64 " misses, %" PRIu64 " evictions", stats.entry_count, stats.bytes_used, stats.hot_hits, stats.der_hits, stats.misses, stats.evictions);
+	}
+	certcache_free(server_certificates);
 }
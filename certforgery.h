@@ -28,15 +28,17 @@
 #include <stdbool.h>
 #include <openssl/x509.h>
 #include <openssl/evp.h>
+#include "hostname_ids.h"
 
 /*************** AUTO GENERATED SECTION FOLLOWS ***************/
-struct server_certificate_t;
 bool certforgery_init(void);
 X509 *get_forged_root_certificate(void);
 EVP_PKEY *get_forged_root_key(void);
 EVP_PKEY *get_tls_server_key(void);
 EVP_PKEY *get_tls_client_key(void);
-X509 *forge_certificate_for_server(const char *hostname, uint32_t ipv4_nbo);
+X509 *forge_certificate_for_server(const struct hostname_t *hostname, uint32_t ipv4_nbo);
+X509 *get_mirrored_certificate_for_server(const struct hostname_t *hostname, uint32_t ipv4_nbo);
+X509 *mirror_certificate_for_server(const struct hostname_t *hostname, uint32_t ipv4_nbo, X509 *upstream_certificate, X509 *presented_certificate);
 void certforgery_deinit(void);
 /***************  AUTO GENERATED SECTION ENDS   ***************/
 
@@ -0,0 +1,264 @@
+/**
+ *	ratched - TLS connection router that performs a man-in-the-middle attack
+ *	Copyright (C) 2017-2017 Johannes Bauer
+ *
+ *	This file is part of ratched.
+ *
+ *	ratched is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; this program is ONLY licensed under
+ *	version 3 of the License, later versions are explicitly excluded.
+ *
+ *	ratched is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with ratched; if not, write to the Free Software
+ *	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *	Johannes Bauer <JohannesBauer@gmx.de>
+**/
+
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+#include <openssl/evp.h>
+#include <openssl/sha.h>
+#include "chainverify.h"
+#include "cryptopool.h"
+#include "cryptomem.h"
+#include "logging.h"
+#include "lockstat.h"
+#include "stats.h"
+#include "tools.h"
+
+/* Upstream certificate chains are verified once and the outcome cached under
+ * a digest over all certificates the server sent plus the name they were
+ * checked against, so that the chain building and signature checks are not
+ * repeated on every handshake with the same server. Entries expire after the
+ * TTL, and positive results no later than the first certificate of the chain
+ * does. The cache is direct-mapped; a colliding insertion replaces the
+ * previous occupant. */
+#define CHAINVERIFY_CACHE_SLOTS		4096
+
+struct chainverify_cache_slot_t {
+	bool used;
+	uint8_t digest[SHA256_DIGEST_LENGTH];
+	double expires;
+	bool verified;
+	int error;
+	int error_depth;
+};
+
+static struct {
+	X509_STORE *store;
+	double ttl;
+	struct lockstat_mutex_t lock;
+	struct chainverify_cache_slot_t *slots;
+	struct stats_counter_t *cache_hits;
+	struct stats_counter_t *verified;
+	struct stats_counter_t *failed;
+} chainverify = {
+	.lock = LOCKSTAT_MUTEX_INITIALIZER("chainverify"),
+};
+
+struct chainverify_job_t {
+	STACK_OF(X509) *chain;
+	const char *server_name;
+	uint32_t ipv4_nbo;
+	struct chainverify_result_t *result;
+	double lifetime;
+};
+
+bool chainverify_init(const char *trust_store, unsigned int ttl_secs) {
+	chainverify.store = X509_STORE_new();
+	chainverify.slots = calloc(CHAINVERIFY_CACHE_SLOTS, sizeof(struct chainverify_cache_slot_t));
+	if (!chainverify.store || !chainverify.slots) {
+		logmsg(LLVL_FATAL, "Failed to allocate upstream certificate verification state.");
+		chainverify_deinit();
+		return false;
+	}
+
+	bool loaded;
+	struct stat statbuf;
+	if (!trust_store) {
+		loaded = X509_STORE_set_default_paths(chainverify.store) == 1;
+	} else if (stat(trust_store, &statbuf)) {
+		logmsg(LLVL_ERROR, "Cannot access upstream trust store %s: %s", trust_store, strerror(errno));
+		loaded = false;
+	} else if (S_ISDIR(statbuf.st_mode)) {
+		loaded = X509_STORE_load_locations(chainverify.store, NULL, trust_store) == 1;
+	} else {
+		loaded = X509_STORE_load_locations(chainverify.store, trust_store, NULL) == 1;
+	}
+	if (!loaded) {
+		logmsgext(LLVL_ERROR, FLAG_OPENSSL_ERROR, "Failed to load upstream trust store %s.", trust_store ? trust_store : "from the default locations");
+		chainverify_deinit();
+		return false;
+	}
+
+	chainverify.ttl = ttl_secs;
+	chainverify.cache_hits = stats_counter("chainverify.cache_hits");
+	chainverify.verified = stats_counter("chainverify.verified");
+	chainverify.failed = stats_counter("chainverify.failed");
+	logmsg(LLVL_DEBUG, "Verifying upstream certificates against %s, caching results for %u secs.", trust_store ? trust_store : "the default trust store", ttl_secs);
+	return true;
+}
+
+bool chainverify_active(void) {
+	return chainverify.store != NULL;
+}
+
+static bool chain_digest(STACK_OF(X509) *chain, const char *server_name, uint32_t ipv4_nbo, uint8_t digest[static SHA256_DIGEST_LENGTH]) {
+	EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+	bool success = ctx && (EVP_DigestInit_ex(ctx, EVP_sha256(), NULL) == 1);
+	for (int i = 0; success && (i < sk_X509_num(chain)); i++) {
+		uint8_t fingerprint[EVP_MAX_MD_SIZE];
+		unsigned int fingerprint_length;
+		success = (X509_digest(sk_X509_value(chain, i), EVP_sha256(), fingerprint, &fingerprint_length) == 1) && (EVP_DigestUpdate(ctx, fingerprint, fingerprint_length) == 1);
+	}
+	if (success) {
+		/* What the chain was checked against is part of the key as well */
+		if (server_name) {
+			success = EVP_DigestUpdate(ctx, server_name, strlen(server_name) + 1) == 1;
+		} else {
+			success = EVP_DigestUpdate(ctx, &ipv4_nbo, sizeof(ipv4_nbo)) == 1;
+		}
+	}
+	success = success && (EVP_DigestFinal_ex(ctx, digest, NULL) == 1);
+	EVP_MD_CTX_free(ctx);
+	return success;
+}
+
+/* Seconds until the first certificate of the chain expires */
+static double chain_remaining_validity(STACK_OF(X509) *chain) {
+	double remaining = -1;
+	for (int i = 0; i < sk_X509_num(chain); i++) {
+		int days, secs;
+		if (ASN1_TIME_diff(&days, &secs, NULL, X509_get0_notAfter(sk_X509_value(chain, i))) == 1) {
+			double cert_remaining = (days * 86400.0) + secs;
+			if ((remaining < 0) || (cert_remaining < remaining)) {
+				remaining = cert_remaining;
+			}
+		}
+	}
+	return remaining;
+}
+
+static void chainverify_job_fnc(void *argument) {
+	struct chainverify_job_t *job = (struct chainverify_job_t*)argument;
+	enum cryptomem_subsystem_t previous_subsystem = cryptomem_enter(CRYPTOMEM_HANDSHAKE);
+	X509_STORE_CTX *ctx = X509_STORE_CTX_new();
+	if (ctx && (X509_STORE_CTX_init(ctx, chainverify.store, sk_X509_value(job->chain, 0), job->chain) == 1)) {
+		X509_STORE_CTX_set_default(ctx, "ssl_server");
+		X509_VERIFY_PARAM *param = X509_STORE_CTX_get0_param(ctx);
+		if (job->server_name) {
+			X509_VERIFY_PARAM_set1_host(param, job->server_name, 0);
+		} else {
+			X509_VERIFY_PARAM_set1_ip(param, (const unsigned char*)&job->ipv4_nbo, sizeof(job->ipv4_nbo));
+		}
+		job->result->verified = (X509_verify_cert(ctx) == 1);
+		job->result->error = X509_STORE_CTX_get_error(ctx);
+		job->result->error_depth = X509_STORE_CTX_get_error_depth(ctx);
+	} else {
+		logmsgext(LLVL_ERROR, FLAG_OPENSSL_ERROR, "Cannot initialize upstream certificate verification context.");
+		job->result->verified = false;
+		job->result->error = X509_V_ERR_UNSPECIFIED;
+	}
+	X509_STORE_CTX_free(ctx);
+
+	job->lifetime = chainverify.ttl;
+	if (job->result->verified) {
+		double remaining = chain_remaining_validity(job->chain);
+		if (remaining < job->lifetime) {
+			job->lifetime = remaining;
+		}
+	}
+	cryptomem_leave(previous_subsystem);
+}
+
+/* Verifies a chain as sent by a server, leaf first, either against the
+ * given server name or, if there is none, the address that was connected
+ * to */
+void chainverify_chain(STACK_OF(X509) *chain, const char *server_name, uint32_t ipv4_nbo, struct chainverify_result_t *result) {
+	memset(result, 0, sizeof(*result));
+	if (!chain || !sk_X509_num(chain)) {
+		result->error = X509_V_ERR_UNSPECIFIED;
+		stats_inc(chainverify.failed);
+		return;
+	}
+
+	uint8_t digest[SHA256_DIGEST_LENGTH];
+	bool cacheable = chain_digest(chain, server_name, ipv4_nbo, digest);
+	struct chainverify_cache_slot_t *slot = NULL;
+	if (cacheable) {
+		uint32_t index;
+		memcpy(&index, digest, sizeof(index));
+		slot = &chainverify.slots[index % CHAINVERIFY_CACHE_SLOTS];
+
+		lockstat_lock(&chainverify.lock);
+		if (slot->used && !memcmp(slot->digest, digest, sizeof(digest)) && (monotonic_time() < slot->expires)) {
+			result->verified = slot->verified;
+			result->error = slot->error;
+			result->error_depth = slot->error_depth;
+			result->cached = true;
+		}
+		lockstat_unlock(&chainverify.lock);
+	}
+
+	if (result->cached) {
+		stats_inc(chainverify.cache_hits);
+	} else {
+		struct chainverify_job_t job = {
+			.chain = chain,
+			.server_name = server_name,
+			.ipv4_nbo = ipv4_nbo,
+			.result = result,
+		};
+		cryptopool_run(chainverify_job_fnc, &job);
+		if (slot && (job.lifetime > 0)) {
+			lockstat_lock(&chainverify.lock);
+			*slot = (struct chainverify_cache_slot_t) {
+				.used = true,
+				.expires = monotonic_time() + job.lifetime,
+				.verified = result->verified,
+				.error = result->error,
+				.error_depth = result->error_depth,
+			};
+			memcpy(slot->digest, digest, sizeof(digest));
+			lockstat_unlock(&chainverify.lock);
+		}
+	}
+	stats_inc(result->verified ? chainverify.verified : chainverify.failed);
+}
+
+/* Verifies the certificate chain that the peer of an established client
+ * connection presented. Returns false if verification is not enabled. */
+bool chainverify_peer(SSL *ssl, const char *server_name, uint32_t ipv4_nbo, struct chainverify_result_t *result) {
+	if (!chainverify_active()) {
+		return false;
+	}
+	/* On the client side, the chain includes the peer's certificate */
+	chainverify_chain(SSL_get_peer_cert_chain(ssl), server_name, ipv4_nbo, result);
+	return true;
+}
+
+void chainverify_describe(const struct chainverify_result_t *result, char *text, size_t length) {
+	if (result->verified) {
+		snprintf(text, length, "verified%s", result->cached ? " (cached)" : "");
+	} else {
+		snprintf(text, length, "verification failed at depth %d: %s%s", result->error_depth, X509_verify_cert_error_string(result->error), result->cached ? " (cached)" : "");
+	}
+}
+
+void chainverify_deinit(void) {
+	X509_STORE_free(chainverify.store);
+	chainverify.store = NULL;
+	free(chainverify.slots);
+	chainverify.slots = NULL;
+}
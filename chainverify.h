@@ -0,0 +1,56 @@
+/**
+ *	ratched - TLS connection router that performs a man-in-the-middle attack
+ *	Copyright (C) 2017-2017 Johannes Bauer
+ *
+ *	This file is part of ratched.
+ *
+ *	ratched is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; this program is ONLY licensed under
+ *	version 3 of the License, later versions are explicitly excluded.
+ *
+ *	ratched is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with ratched; if not, write to the Free Software
+ *	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *	Johannes Bauer <JohannesBauer@gmx.de>
+**/
+
+
+#ifndef __CHAINVERIFY_H__
+#define __CHAINVERIFY_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+
+enum chainverify_mode_t {
+	CHAINVERIFY_OFF = 0,
+	CHAINVERIFY_REPORT,
+	CHAINVERIFY_ENFORCE,
+};
+
+struct chainverify_result_t {
+	bool verified;
+	bool cached;
+	int error;
+	int error_depth;
+};
+
+/*************** AUTO GENERATED SECTION FOLLOWS ***************/
+bool chainverify_init(const char *trust_store, unsigned int ttl_secs);
+bool chainverify_active(void);
+void chainverify_chain(STACK_OF(X509) *chain, const char *server_name, uint32_t ipv4_nbo, struct chainverify_result_t *result);
+bool chainverify_peer(SSL *ssl, const char *server_name, uint32_t ipv4_nbo, struct chainverify_result_t *result);
+void chainverify_describe(const struct chainverify_result_t *result, char *text, size_t length);
+void chainverify_deinit(void);
+/***************  AUTO GENERATED SECTION ENDS   ***************/
+
+#endif
@@ -0,0 +1,326 @@
+/**
+ *	ratched - TLS connection router that performs a man-in-the-middle attack
+ *	Copyright (C) 2017-2017 Johannes Bauer
+ *
+ *	This file is part of ratched.
+ *
+ *	ratched is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; this program is ONLY licensed under
+ *	version 3 of the License, later versions are explicitly excluded.
+ *
+ *	ratched is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with ratched; if not, write to the Free Software
+ *	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *	Johannes Bauer <JohannesBauer@gmx.de>
+**/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <pthread.h>
+#include <openssl/sha.h>
+#include "chunkstore.h"
+#include "logging.h"
+#include "stats.h"
+#include "tools.h"
+#include "thread.h"
+#include "lockstat.h"
+
+/* Content-addressed store of payload chunks. A chunk with SHA-256 digest
+ * "abcd..." lives in <directory>/ab/abcd...; new chunks are written to a
+ * temporary file first and renamed into place, so a chunk that exists in the
+ * store is always complete, also for concurrent writers of the same chunk
+ * and across restarts.
+ *
+ * The capture path never touches the file system: it only consults an
+ * in-memory, direct-mapped index of digests that are known to be on disk and
+ * otherwise submits the chunk to a writer thread through a bounded queue.
+ * A digest enters the index only after its file has been renamed into
+ * place, so a chunk is referenced in a capture only once it is complete.
+ * Collisions in the index merely cost deduplication, never correctness. */
+#define CHUNKSTORE_INDEX_SLOTS			65536
+#define CHUNKSTORE_MAX_QUEUED_BYTES		(16 * 1024 * 1024)
+
+struct chunkstore_job_t {
+	struct chunkstore_job_t *next;
+	uint8_t digest[CHUNKSTORE_DIGEST_LENGTH];
+	unsigned int length;
+	uint8_t data[];
+};
+
+struct chunkstore_t {
+	char *directory;
+	struct lockstat_mutex_t index_lock;
+	uint8_t (*index)[CHUNKSTORE_DIGEST_LENGTH];
+
+	pthread_t writer;
+	bool writer_running;
+	struct lockstat_mutex_t queue_lock;
+	pthread_cond_t queue_cond;
+	struct chunkstore_job_t *head, *tail;
+	size_t queued_bytes;
+	bool quit;
+
+	struct {
+		struct stats_counter_t *stored;
+		struct stats_counter_t *stored_bytes;
+		struct stats_counter_t *present;
+		struct stats_counter_t *deduplicated_bytes;
+		struct stats_counter_t *failed;
+		struct stats_counter_t *dropped;
+	} counters;
+};
+
+static void format_hex(const uint8_t digest[static CHUNKSTORE_DIGEST_LENGTH], char hex[static 2 * CHUNKSTORE_DIGEST_LENGTH + 1]) {
+	for (int i = 0; i < CHUNKSTORE_DIGEST_LENGTH; i++) {
+		sprintf(hex + (2 * i), "%02x", digest[i]);
+	}
+}
+
+static unsigned int index_slot(const uint8_t digest[static CHUNKSTORE_DIGEST_LENGTH]) {
+	return ((digest[0] << 8) | digest[1]) % CHUNKSTORE_INDEX_SLOTS;
+}
+
+static void index_insert(struct chunkstore_t *store, const uint8_t digest[static CHUNKSTORE_DIGEST_LENGTH]) {
+	lockstat_lock(&store->index_lock);
+	memcpy(store->index[index_slot(digest)], digest, CHUNKSTORE_DIGEST_LENGTH);
+	lockstat_unlock(&store->index_lock);
+}
+
+static bool index_contains(struct chunkstore_t *store, const uint8_t digest[static CHUNKSTORE_DIGEST_LENGTH]) {
+	lockstat_lock(&store->index_lock);
+	bool contained = !memcmp(store->index[index_slot(digest)], digest, CHUNKSTORE_DIGEST_LENGTH);
+	lockstat_unlock(&store->index_lock);
+	return contained;
+}
+
+static void* chunkstore_writer_thread_fnc(void *argument) {
+	struct chunkstore_t *store = (struct chunkstore_t*)argument;
+	set_thread_name("chunkstore");
+	lockstat_lock(&store->queue_lock);
+	while (true) {
+		while (!store->head && !store->quit) {
+			lockstat_cond_wait(&store->queue_cond, &store->queue_lock);
+		}
+		struct chunkstore_job_t *jobs = store->head;
+		store->head = NULL;
+		store->tail = NULL;
+		store->queued_bytes = 0;
+		if (!jobs && store->quit) {
+			break;
+		}
+
+		lockstat_unlock(&store->queue_lock);
+		while (jobs) {
+			struct chunkstore_job_t *next = jobs->next;
+			chunkstore_put(store, jobs->digest, jobs->data, jobs->length);
+			free(jobs);
+			jobs = next;
+		}
+		lockstat_lock(&store->queue_lock);
+	}
+	lockstat_unlock(&store->queue_lock);
+	return NULL;
+}
+
+struct chunkstore_t *chunkstore_open(const char *directory) {
+	if (!makedirs(directory)) {
+		logmsg(LLVL_ERROR, "Could not create chunk store directory %s.", directory);
+		return NULL;
+	}
+
+	struct chunkstore_t *store = calloc(1, sizeof(struct chunkstore_t));
+	if (!store) {
+		logmsg(LLVL_ERROR, "Failed to allocate chunk store: %s", strerror(errno));
+		return NULL;
+	}
+	store->directory = strdup(directory);
+	if (!store->directory) {
+		logmsg(LLVL_ERROR, "Failed to strdup(3) chunk store directory: %s", strerror(errno));
+		free(store);
+		return NULL;
+	}
+	lockstat_mutex_init(&store->index_lock, "chunkstore.index");
+	lockstat_mutex_init(&store->queue_lock, "chunkstore.queue");
+	pthread_cond_init(&store->queue_cond, NULL);
+
+	/* Create all fan-out directories upfront so that storing a chunk never
+	 * needs to */
+	for (int i = 0; i < 256; i++) {
+		char path[strlen(store->directory) + 8];
+		snprintf(path, sizeof(path), "%s/%02x", store->directory, i);
+		if ((mkdir(path, 0700) == -1) && (errno != EEXIST)) {
+			logmsg(LLVL_ERROR, "mkdir(2) of %s failed: %s", path, strerror(errno));
+			chunkstore_close(store);
+			return NULL;
+		}
+	}
+
+	store->counters.stored = stats_counter("chunks.stored");
+	store->counters.stored_bytes = stats_counter("chunks.stored_bytes");
+	store->counters.present = stats_counter("chunks.referenced");
+	store->counters.deduplicated_bytes = stats_counter("chunks.deduplicated_bytes");
+	store->counters.failed = stats_counter("chunks.store_failed");
+	store->counters.dropped = stats_counter("chunks.store_dropped");
+
+	store->index = calloc(CHUNKSTORE_INDEX_SLOTS, CHUNKSTORE_DIGEST_LENGTH);
+	if (!store->index) {
+		logmsg(LLVL_ERROR, "Failed to allocate chunk store index: %s", strerror(errno));
+		chunkstore_close(store);
+		return NULL;
+	}
+
+	int result = pthread_create(&store->writer, NULL, chunkstore_writer_thread_fnc, store);
+	if (result) {
+		logmsg(LLVL_ERROR, "Could not start chunk store writer thread: %s", strerror(result));
+		chunkstore_close(store);
+		return NULL;
+	}
+	store->writer_running = true;
+	return store;
+}
+
+void chunkstore_digest(const uint8_t *data, unsigned int length, uint8_t digest[static CHUNKSTORE_DIGEST_LENGTH]) {
+	SHA256(data, length, digest);
+}
+
+void chunkstore_format_reference(const uint8_t digest[static CHUNKSTORE_DIGEST_LENGTH], char *reference, unsigned int reference_size) {
+	char hex[2 * CHUNKSTORE_DIGEST_LENGTH + 1];
+	format_hex(digest, hex);
+	snprintf(reference, reference_size, CHUNKSTORE_REFERENCE_PREFIX "%s", hex);
+}
+
+static bool write_fully(int fd, const uint8_t *data, unsigned int length) {
+	while (length > 0) {
+		ssize_t written = write(fd, data, length);
+		if (written == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return false;
+		}
+		data += written;
+		length -= written;
+	}
+	return true;
+}
+
+enum chunkstore_result_t chunkstore_put(struct chunkstore_t *store, const uint8_t digest[static CHUNKSTORE_DIGEST_LENGTH], const uint8_t *data, unsigned int length) {
+	char hex[2 * CHUNKSTORE_DIGEST_LENGTH + 1];
+	format_hex(digest, hex);
+
+	char path[strlen(store->directory) + 4 + sizeof(hex)];
+	snprintf(path, sizeof(path), "%s/%.2s/%s", store->directory, hex, hex);
+
+	struct stat statbuf;
+	if ((stat(path, &statbuf) == 0) && (statbuf.st_size == length)) {
+		index_insert(store, digest);
+		return CHUNK_PRESENT;
+	}
+
+	char tmppath[sizeof(path) + 8];
+	snprintf(tmppath, sizeof(tmppath), "%s.XXXXXX", path);
+	int fd = mkstemp(tmppath);
+	if (fd == -1) {
+		logmsg(LLVL_ERROR, "Could not create temporary chunk file %s: %s", tmppath, strerror(errno));
+		stats_inc(store->counters.failed);
+		return CHUNK_FAILED;
+	}
+	bool success = write_fully(fd, data, length);
+	if (!success) {
+		logmsg(LLVL_ERROR, "Could not write chunk file %s: %s", tmppath, strerror(errno));
+	}
+	if (close(fd) == -1) {
+		success = false;
+	}
+	if (success && (rename(tmppath, path) == -1)) {
+		logmsg(LLVL_ERROR, "Could not rename chunk file %s: %s", tmppath, strerror(errno));
+		success = false;
+	}
+	if (!success) {
+		unlink(tmppath);
+		stats_inc(store->counters.failed);
+		return CHUNK_FAILED;
+	}
+	index_insert(store, digest);
+	stats_inc(store->counters.stored);
+	stats_add(store->counters.stored_bytes, length);
+	return CHUNK_STORED;
+}
+
+/* Called from the capture path, never blocks on I/O. Returns true if the
+ * chunk is known to be in the store, in which case the capture may reference
+ * it instead of including its payload. Otherwise, the chunk is queued for
+ * the writer thread (or dropped if the writer has fallen behind) and must be
+ * captured in full. */
+bool chunkstore_reference(struct chunkstore_t *store, const uint8_t digest[static CHUNKSTORE_DIGEST_LENGTH], const uint8_t *data, unsigned int length) {
+	if (index_contains(store, digest)) {
+		stats_inc(store->counters.present);
+		stats_add(store->counters.deduplicated_bytes, length);
+		return true;
+	}
+
+	struct chunkstore_job_t *job = malloc(sizeof(struct chunkstore_job_t) + length);
+	if (!job) {
+		stats_inc(store->counters.dropped);
+		return false;
+	}
+	job->next = NULL;
+	memcpy(job->digest, digest, CHUNKSTORE_DIGEST_LENGTH);
+	job->length = length;
+	memcpy(job->data, data, length);
+
+	lockstat_lock(&store->queue_lock);
+	const bool accept = (store->queued_bytes + length <= CHUNKSTORE_MAX_QUEUED_BYTES);
+	if (accept) {
+		if (store->tail) {
+			store->tail->next = job;
+		} else {
+			store->head = job;
+		}
+		store->tail = job;
+		store->queued_bytes += length;
+		pthread_cond_signal(&store->queue_cond);
+	}
+	lockstat_unlock(&store->queue_lock);
+
+	if (!accept) {
+		stats_inc(store->counters.dropped);
+		free(job);
+	}
+	return false;
+}
+
+void chunkstore_close(struct chunkstore_t *store) {
+	if (!store) {
+		return;
+	}
+	if (store->writer_running) {
+		/* The writer drains everything that is still queued before it
+		 * terminates. */
+		lockstat_lock(&store->queue_lock);
+		store->quit = true;
+		pthread_cond_signal(&store->queue_cond);
+		lockstat_unlock(&store->queue_lock);
+		pthread_join(store->writer, NULL);
+	}
+	lockstat_mutex_destroy(&store->index_lock);
+	lockstat_mutex_destroy(&store->queue_lock);
+	pthread_cond_destroy(&store->queue_cond);
+	free(store->index);
+	free(store->directory);
+	free(store);
+}
@@ -0,0 +1,51 @@
+/**
+ *	ratched - TLS connection router that performs a man-in-the-middle attack
+ *	Copyright (C) 2017-2017 Johannes Bauer
+ *
+ *	This file is part of ratched.
+ *
+ *	ratched is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; this program is ONLY licensed under
+ *	version 3 of the License, later versions are explicitly excluded.
+ *
+ *	ratched is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with ratched; if not, write to the Free Software
+ *	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *	Johannes Bauer <JohannesBauer@gmx.de>
+**/
+
+
+#ifndef __CHUNKSTORE_H__
+#define __CHUNKSTORE_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define CHUNKSTORE_DIGEST_LENGTH		32
+#define CHUNKSTORE_REFERENCE_PREFIX		"ratched-chunk sha256="
+
+enum chunkstore_result_t {
+	CHUNK_STORED,
+	CHUNK_PRESENT,
+	CHUNK_FAILED,
+};
+
+struct chunkstore_t;
+
+/*************** AUTO GENERATED SECTION FOLLOWS ***************/
+struct chunkstore_t *chunkstore_open(const char *directory);
+void chunkstore_digest(const uint8_t *data, unsigned int length, uint8_t digest[static CHUNKSTORE_DIGEST_LENGTH]);
+void chunkstore_format_reference(const uint8_t digest[static CHUNKSTORE_DIGEST_LENGTH], char *reference, unsigned int reference_size);
+enum chunkstore_result_t chunkstore_put(struct chunkstore_t *store, const uint8_t digest[static CHUNKSTORE_DIGEST_LENGTH], const uint8_t *data, unsigned int length);
+bool chunkstore_reference(struct chunkstore_t *store, const uint8_t digest[static CHUNKSTORE_DIGEST_LENGTH], const uint8_t *data, unsigned int length);
+void chunkstore_close(struct chunkstore_t *store);
+/***************  AUTO GENERATED SECTION ENDS   ***************/
+
+#endif
@@ -0,0 +1,139 @@
+#!/usr/bin/python3
+#	ratched - TLS connection router that performs a man-in-the-middle attack
+#	Copyright (C) 2017-2017 Johannes Bauer
+#
+#	This file is part of ratched.
+#
+#	ratched is free software; you can redistribute it and/or modify
+#	it under the terms of the GNU General Public License as published by
+#	the Free Software Foundation; this program is ONLY licensed under
+#	version 3 of the License, later versions are explicitly excluded.
+#
+#	ratched is distributed in the hope that it will be useful,
+#	but WITHOUT ANY WARRANTY; without even the implied warranty of
+#	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#	GNU General Public License for more details.
+#
+#	You should have received a copy of the GNU General Public License
+#	along with ratched; if not, write to the Free Software
+#	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+#
+#	Johannes Bauer <JohannesBauer@gmx.de>
+
+# Turns a PCAPNG file written with --chunk-store back into a regular PCAPNG
+# file by replacing every packet that only references a stored chunk with the
+# full packet.
+
+import os
+import sys
+import struct
+import hashlib
+import argparse
+
+BLOCKTYPE_SHB = 0x0a0d0d0a
+BLOCKTYPE_EPB = 6
+OPTIONCODE_ENDOFOPT = 0
+OPTIONCODE_COMMENT = 1
+REFERENCE_PREFIX = b"ratched-chunk sha256="
+
+class RehydrationException(Exception):
+	pass
+
+def pad4(data):
+	return data + bytes(-len(data) % 4)
+
+def parse_options(data, endian):
+	options = [ ]
+	offset = 0
+	while offset + 4 <= len(data):
+		(code, length) = struct.unpack(endian + "HH", data[offset : offset + 4])
+		if code == OPTIONCODE_ENDOFOPT:
+			break
+		options.append((code, data[offset + 4 : offset + 4 + length]))
+		offset += 4 + length + (-length % 4)
+	return options
+
+def serialize_options(options, endian):
+	if len(options) == 0:
+		return b""
+	data = b""
+	for (code, value) in options:
+		data += struct.pack(endian + "HH", code, len(value)) + pad4(value)
+	return data + struct.pack(endian + "HH", OPTIONCODE_ENDOFOPT, 0)
+
+def load_chunk(args, digest_hex):
+	filename = os.path.join(args.chunk_store, digest_hex[:2], digest_hex)
+	try:
+		with open(filename, "rb") as f:
+			chunk = f.read()
+	except FileNotFoundError:
+		raise RehydrationException("Chunk %s is missing from store %s." % (digest_hex, args.chunk_store))
+	if hashlib.sha256(chunk).hexdigest() != digest_hex:
+		raise RehydrationException("Chunk %s in store %s is corrupt." % (digest_hex, args.chunk_store))
+	return chunk
+
+def rehydrate_epb(args, body, endian, statistics):
+	(iface_id, ts_high, ts_low, cap_length, orig_length) = struct.unpack(endian + "LLLLL", body[:20])
+	packet = body[20 : 20 + cap_length]
+	options = parse_options(body[20 + cap_length + (-cap_length % 4):], endian)
+
+	references = [ value for (code, value) in options if (code == OPTIONCODE_COMMENT) and value.startswith(REFERENCE_PREFIX) ]
+	if len(references) == 0:
+		return None
+
+	digest_hex = references[0][len(REFERENCE_PREFIX):].decode("ascii")
+	chunk = load_chunk(args, digest_hex)
+	if cap_length + len(chunk) != orig_length:
+		raise RehydrationException("Chunk %s has %d bytes, but packet is missing %d bytes." % (digest_hex, len(chunk), orig_length - cap_length))
+	packet += chunk
+	options = [ (code, value) for (code, value) in options if not ((code == OPTIONCODE_COMMENT) and value.startswith(REFERENCE_PREFIX)) ]
+	statistics["packets"] += 1
+	statistics["bytes"] += len(chunk)
+	return struct.pack(endian + "LLLLL", iface_id, ts_high, ts_low, len(packet), orig_length) + pad4(packet) + serialize_options(options, endian)
+
+def rehydrate(args):
+	statistics = { "packets": 0, "bytes": 0 }
+	endian = "<"
+	with open(args.infile, "rb") as infile, open(args.outfile, "wb") as outfile:
+		while True:
+			header = infile.read(8)
+			if len(header) == 0:
+				break
+			if len(header) != 8:
+				raise RehydrationException("Truncated block header in %s." % (args.infile))
+			(blocktype, ) = struct.unpack("<L", header[:4])
+			if blocktype == BLOCKTYPE_SHB:
+				magic = infile.read(4)
+				endian = "<" if (magic == b"\x4d\x3c\x2b\x1a") else ">"
+				(blocklength, ) = struct.unpack(endian + "L", header[4:])
+				body = magic + infile.read(blocklength - 12 - 4)
+			else:
+				(blocktype, blocklength) = struct.unpack(endian + "LL", header)
+				body = infile.read(blocklength - 12)
+			trailer = infile.read(4)
+			if (len(trailer) != 4) or (len(body) != blocklength - 12):
+				raise RehydrationException("Truncated block in %s." % (args.infile))
+
+			if blocktype == BLOCKTYPE_EPB:
+				new_body = rehydrate_epb(args, body, endian, statistics)
+				if new_body is not None:
+					blocklength = 12 + len(new_body)
+					header = struct.pack(endian + "LL", blocktype, blocklength)
+					trailer = struct.pack(endian + "L", blocklength)
+					body = new_body
+			outfile.write(header + body + trailer)
+	if args.verbose:
+		print("Rehydrated %d packets with %d bytes of payload." % (statistics["packets"], statistics["bytes"]), file = sys.stderr)
+
+parser = argparse.ArgumentParser(description = "Restore a PCAPNG file that ratched wrote with --chunk-store into a regular PCAPNG file.")
+parser.add_argument("-c", "--chunk-store", metavar = "directory", required = True, help = "Chunk store directory that was given to ratched via --chunk-store.")
+parser.add_argument("-v", "--verbose", action = "store_true", help = "Print how much data was restored.")
+parser.add_argument("infile", metavar = "infile", help = "Deduplicated PCAPNG file written by ratched.")
+parser.add_argument("outfile", metavar = "outfile", help = "Regular PCAPNG file to write.")
+args = parser.parse_args(sys.argv[1:])
+
+try:
+	rehydrate(args)
+except RehydrationException as e:
+	print("Error: %s" % (str(e)), file = sys.stderr)
+	sys.exit(1)
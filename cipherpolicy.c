@@ -0,0 +1,300 @@
+/**
+ *	ratched - TLS connection router that performs a man-in-the-middle attack
+ *	Copyright (C) 2017-2017 Johannes Bauer
+ *
+ *	This file is part of ratched.
+ *
+ *	ratched is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; this program is ONLY licensed under
+ *	version 3 of the License, later versions are explicitly excluded.
+ *
+ *	ratched is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with ratched; if not, write to the Free Software
+ *	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *	Johannes Bauer <JohannesBauer@gmx.de>
+**/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <pthread.h>
+#include <openssl/evp.h>
+#include <openssl/ec.h>
+#include <openssl/hmac.h>
+#include <openssl/objects.h>
+#include "cipherpolicy.h"
+#include "logging.h"
+#include "tools.h"
+#include "lockstat.h"
+
+/* The "cheapest" cipher policy orders the proxy's own preferences by how
+ * expensive each algorithm is on this machine. The costs are measured once,
+ * the first time the policy is used: bulk ciphers as CPU seconds per GB of
+ * records, key exchange groups and signatures as CPU time per operation.
+ * Only AEAD ciphers are ranked; CBC+HMAC suites stay available as a fallback
+ * behind them, and their cost is measured only for the log. */
+#define BENCHMARK_RECORD_SIZE		(16 * 1024)
+#define BENCHMARK_MIN_CPU_SECS		0.02
+#define BENCHMARK_MIN_ITERATIONS	8
+
+struct aead_candidate_t {
+	const char *name;
+	const EVP_CIPHER *(*cipher)(void);
+	const char *tls13_ciphersuite;
+	const char *tls12_ciphers;
+	double secs_per_gb;
+};
+
+struct group_candidate_t {
+	const char *name;
+	int pkey_type;
+	int curve_nid;
+	double usecs_per_handshake;
+};
+
+static struct lockstat_mutex_t policy_lock = LOCKSTAT_MUTEX_INITIALIZER("cipherpolicy");
+static bool policy_initialized;
+static struct cipher_preferences_t cheapest_preferences;
+
+static double benchmark_aead(const EVP_CIPHER *cipher) {
+	EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+	if (!ctx) {
+		return -1;
+	}
+	static uint8_t plaintext[BENCHMARK_RECORD_SIZE];
+	static uint8_t ciphertext[BENCHMARK_RECORD_SIZE + 64];
+	uint8_t key[32] = { 0 };
+	uint8_t iv[12] = { 0 };
+	uint8_t tag[16];
+
+	bool success = true;
+	uint64_t bytes = 0;
+	unsigned int iterations = 0;
+	const double start = thread_cpu_time();
+	double elapsed = 0;
+	while (success && ((elapsed < BENCHMARK_MIN_CPU_SECS) || (iterations < BENCHMARK_MIN_ITERATIONS))) {
+		int length = 0, final_length = 0;
+		iv[0] = iterations;
+		success = EVP_EncryptInit_ex(ctx, cipher, NULL, key, iv)
+			&& EVP_EncryptUpdate(ctx, ciphertext, &length, plaintext, sizeof(plaintext))
+			&& EVP_EncryptFinal_ex(ctx, ciphertext + length, &final_length)
+			&& EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_GET_TAG, sizeof(tag), tag);
+		bytes += sizeof(plaintext);
+		iterations++;
+		elapsed = thread_cpu_time() - start;
+	}
+	EVP_CIPHER_CTX_free(ctx);
+	return success ? (elapsed / bytes * 1e9) : -1;
+}
+
+static double benchmark_cbc_hmac(void) {
+	EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+	if (!ctx) {
+		return -1;
+	}
+	static uint8_t plaintext[BENCHMARK_RECORD_SIZE];
+	static uint8_t ciphertext[BENCHMARK_RECORD_SIZE + 64];
+	uint8_t key[32] = { 0 };
+	uint8_t iv[16] = { 0 };
+	uint8_t mac[EVP_MAX_MD_SIZE];
+
+	bool success = true;
+	uint64_t bytes = 0;
+	unsigned int iterations = 0;
+	const double start = thread_cpu_time();
+	double elapsed = 0;
+	while (success && ((elapsed < BENCHMARK_MIN_CPU_SECS) || (iterations < BENCHMARK_MIN_ITERATIONS))) {
+		int length = 0, final_length = 0;
+		unsigned int mac_length = 0;
+		success = (HMAC(EVP_sha256(), key, sizeof(key), plaintext, sizeof(plaintext), mac, &mac_length) != NULL)
+			&& EVP_EncryptInit_ex(ctx, EVP_aes_128_cbc(), NULL, key, iv)
+			&& EVP_EncryptUpdate(ctx, ciphertext, &length, plaintext, sizeof(plaintext))
+			&& EVP_EncryptFinal_ex(ctx, ciphertext + length, &final_length);
+		bytes += sizeof(plaintext);
+		iterations++;
+		elapsed = thread_cpu_time() - start;
+	}
+	EVP_CIPHER_CTX_free(ctx);
+	return success ? (elapsed / bytes * 1e9) : -1;
+}
+
+static EVP_PKEY *generate_key(int pkey_type, int curve_nid) {
+	EVP_PKEY_CTX *ctx = EVP_PKEY_CTX_new_id(pkey_type, NULL);
+	if (!ctx) {
+		return NULL;
+	}
+	EVP_PKEY *key = NULL;
+	if ((EVP_PKEY_keygen_init(ctx) <= 0) || (curve_nid && (EVP_PKEY_CTX_set_ec_paramgen_curve_nid(ctx, curve_nid) <= 0)) || (EVP_PKEY_keygen(ctx, &key) <= 0)) {
+		key = NULL;
+	}
+	EVP_PKEY_CTX_free(ctx);
+	return key;
+}
+
+static bool derive_secret(EVP_PKEY *key, EVP_PKEY *peer) {
+	EVP_PKEY_CTX *ctx = EVP_PKEY_CTX_new(key, NULL);
+	if (!ctx) {
+		return false;
+	}
+	uint8_t secret[128];
+	size_t secret_length = sizeof(secret);
+	bool success = (EVP_PKEY_derive_init(ctx) > 0) && (EVP_PKEY_derive_set_peer(ctx, peer) > 0) && (EVP_PKEY_derive(ctx, secret, &secret_length) > 0);
+	EVP_PKEY_CTX_free(ctx);
+	return success;
+}
+
+/* One ephemeral key generation plus one shared secret derivation, which is
+ * what each side pays per handshake */
+static double benchmark_group(const struct group_candidate_t *group) {
+	EVP_PKEY *peer = generate_key(group->pkey_type, group->curve_nid);
+	if (!peer) {
+		return -1;
+	}
+	bool success = true;
+	unsigned int iterations = 0;
+	const double start = thread_cpu_time();
+	double elapsed = 0;
+	while (success && ((elapsed < BENCHMARK_MIN_CPU_SECS) || (iterations < BENCHMARK_MIN_ITERATIONS))) {
+		EVP_PKEY *key = generate_key(group->pkey_type, group->curve_nid);
+		success = key && derive_secret(key, peer);
+		EVP_PKEY_free(key);
+		iterations++;
+		elapsed = thread_cpu_time() - start;
+	}
+	EVP_PKEY_free(peer);
+	return success ? (elapsed / iterations * 1e6) : -1;
+}
+
+static double benchmark_signature(EVP_PKEY *key) {
+	const EVP_MD *md = ((EVP_PKEY_id(key) == EVP_PKEY_ED25519) || (EVP_PKEY_id(key) == EVP_PKEY_ED448)) ? NULL : EVP_sha256();
+	const uint8_t message[64] = { 0 };
+	uint8_t signature[1024];
+
+	bool success = true;
+	unsigned int iterations = 0;
+	const double start = thread_cpu_time();
+	double elapsed = 0;
+	while (success && ((elapsed < BENCHMARK_MIN_CPU_SECS) || (iterations < BENCHMARK_MIN_ITERATIONS))) {
+		EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+		size_t signature_length = sizeof(signature);
+		success = ctx && (EVP_DigestSignInit(ctx, NULL, md, NULL, key) == 1) && (EVP_DigestSign(ctx, signature, &signature_length, message, sizeof(message)) == 1);
+		EVP_MD_CTX_free(ctx);
+		iterations++;
+		elapsed = thread_cpu_time() - start;
+	}
+	return success ? (elapsed / iterations * 1e6) : -1;
+}
+
+static int compare_aead(const void *va, const void *vb) {
+	const struct aead_candidate_t *a = (const struct aead_candidate_t*)va;
+	const struct aead_candidate_t *b = (const struct aead_candidate_t*)vb;
+	return (a->secs_per_gb > b->secs_per_gb) - (a->secs_per_gb < b->secs_per_gb);
+}
+
+static int compare_group(const void *va, const void *vb) {
+	const struct group_candidate_t *a = (const struct group_candidate_t*)va;
+	const struct group_candidate_t *b = (const struct group_candidate_t*)vb;
+	return (a->usecs_per_handshake > b->usecs_per_handshake) - (a->usecs_per_handshake < b->usecs_per_handshake);
+}
+
+static void append_text(char *text, unsigned int text_size, const char *separator, const char *element) {
+	unsigned int length = strlen(text);
+	strxcat(text + length, text_size - length, length ? separator : "", element, NULL);
+}
+
+static void rank_ciphers(struct cipher_preferences_t *preferences) {
+	struct aead_candidate_t candidates[] = {
+		{ .name = "AES-128-GCM", .cipher = EVP_aes_128_gcm, .tls13_ciphersuite = "TLS_AES_128_GCM_SHA256", .tls12_ciphers = "ECDHE-ECDSA-AES128-GCM-SHA256:ECDHE-RSA-AES128-GCM-SHA256" },
+		{ .name = "AES-256-GCM", .cipher = EVP_aes_256_gcm, .tls13_ciphersuite = "TLS_AES_256_GCM_SHA384", .tls12_ciphers = "ECDHE-ECDSA-AES256-GCM-SHA384:ECDHE-RSA-AES256-GCM-SHA384" },
+		{ .name = "ChaCha20-Poly1305", .cipher = EVP_chacha20_poly1305, .tls13_ciphersuite = "TLS_CHACHA20_POLY1305_SHA256", .tls12_ciphers = "ECDHE-ECDSA-CHACHA20-POLY1305:ECDHE-RSA-CHACHA20-POLY1305" },
+	};
+	const unsigned int candidate_count = sizeof(candidates) / sizeof(candidates[0]);
+	for (unsigned int i = 0; i < candidate_count; i++) {
+		candidates[i].secs_per_gb = benchmark_aead(candidates[i].cipher());
+		if (candidates[i].secs_per_gb < 0) {
+			/* Not available, rank last */
+			candidates[i].secs_per_gb = 1e9;
+		}
+	}
+	qsort(candidates, candidate_count, sizeof(candidates[0]), compare_aead);
+
+	char text[256] = { 0 };
+	for (unsigned int i = 0; i < candidate_count; i++) {
+		append_text(preferences->tls13_ciphersuites, sizeof(preferences->tls13_ciphersuites), ":", candidates[i].tls13_ciphersuite);
+		append_text(preferences->tls12_ciphers, sizeof(preferences->tls12_ciphers), ":", candidates[i].tls12_ciphers);
+		char entry[64];
+		snprintf(entry, sizeof(entry), "%s %.2f", candidates[i].name, candidates[i].secs_per_gb);
+		append_text(text, sizeof(text), ", ", entry);
+	}
+	append_text(preferences->tls12_ciphers, sizeof(preferences->tls12_ciphers), ":", "HIGH:!aNULL:!eNULL:!3DES");
+	logmsg(LLVL_INFO, "Cipher cost in CPU secs/GB: %s; AES-128-CBC-HMAC-SHA256 %.2f", text, benchmark_cbc_hmac());
+}
+
+static void rank_groups(struct cipher_preferences_t *preferences) {
+	struct group_candidate_t candidates[] = {
+		{ .name = "X25519", .pkey_type = EVP_PKEY_X25519 },
+		{ .name = "P-256", .pkey_type = EVP_PKEY_EC, .curve_nid = NID_X9_62_prime256v1 },
+		{ .name = "P-384", .pkey_type = EVP_PKEY_EC, .curve_nid = NID_secp384r1 },
+	};
+	const unsigned int candidate_count = sizeof(candidates) / sizeof(candidates[0]);
+	for (unsigned int i = 0; i < candidate_count; i++) {
+		candidates[i].usecs_per_handshake = benchmark_group(&candidates[i]);
+		if (candidates[i].usecs_per_handshake < 0) {
+			candidates[i].usecs_per_handshake = 1e9;
+		}
+	}
+	qsort(candidates, candidate_count, sizeof(candidates[0]), compare_group);
+
+	char text[256] = { 0 };
+	for (unsigned int i = 0; i < candidate_count; i++) {
+		append_text(preferences->groups, sizeof(preferences->groups), ":", candidates[i].name);
+		char entry[64];
+		snprintf(entry, sizeof(entry), "%s %.0f", candidates[i].name, candidates[i].usecs_per_handshake);
+		append_text(text, sizeof(text), ", ", entry);
+	}
+	logmsg(LLVL_INFO, "Key exchange cost in CPU usecs/handshake: %s", text);
+}
+
+static void rank_signatures(struct cipher_preferences_t *preferences, EVP_PKEY *signing_key) {
+	/* The proxy can only sign with the key type of its forged certificates, so
+	 * the order only matters towards servers that have several certificates.
+	 * What is measured is whether the forged key is a costly choice. */
+	append_text(preferences->sigalgs, sizeof(preferences->sigalgs), ":", "ECDSA+SHA256:ed25519:ECDSA+SHA384:RSA-PSS+SHA256:rsa_pss_pss_sha256:RSA+SHA256:RSA-PSS+SHA384:RSA+SHA384:RSA-PSS+SHA512:RSA+SHA512:ECDSA+SHA512");
+	if (!signing_key || (EVP_PKEY_id(signing_key) != EVP_PKEY_RSA)) {
+		return;
+	}
+	EVP_PKEY *ecdsa_key = generate_key(EVP_PKEY_EC, NID_X9_62_prime256v1);
+	if (!ecdsa_key) {
+		return;
+	}
+	double rsa_cost = benchmark_signature(signing_key);
+	double ecdsa_cost = benchmark_signature(ecdsa_key);
+	EVP_PKEY_free(ecdsa_key);
+	if ((rsa_cost > 0) && (ecdsa_cost > 0)) {
+		logmsg(LLVL_INFO, "Forged certificates use RSA-%d keys, signing costs %.0f CPU usecs per handshake; with --keyspec ecc:secp256r1 it would be %.0f usecs.", EVP_PKEY_bits(signing_key), rsa_cost, ecdsa_cost);
+	}
+}
+
+const struct cipher_preferences_t *cipherpolicy_cheapest(EVP_PKEY *signing_key) {
+	lockstat_lock(&policy_lock);
+	if (!policy_initialized) {
+		memset(&cheapest_preferences, 0, sizeof(cheapest_preferences));
+		rank_ciphers(&cheapest_preferences);
+		rank_groups(&cheapest_preferences);
+		rank_signatures(&cheapest_preferences, signing_key);
+		logmsg(LLVL_DEBUG, "Cheapest cipher policy: TLS 1.3 \"%s\", TLS 1.2 \"%s\", groups \"%s\".", cheapest_preferences.tls13_ciphersuites, cheapest_preferences.tls12_ciphers, cheapest_preferences.groups);
+		policy_initialized = true;
+	}
+	lockstat_unlock(&policy_lock);
+	return &cheapest_preferences;
+}
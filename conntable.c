@@ -0,0 +1,364 @@
+/**
+ *	ratched - TLS connection router that performs a man-in-the-middle attack
+ *	Copyright (C) 2017-2017 Johannes Bauer
+ *
+ *	This file is part of ratched.
+ *
+ *	ratched is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; this program is ONLY licensed under
+ *	version 3 of the License, later versions are explicitly excluded.
+ *
+ *	ratched is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with ratched; if not, write to the Free Software
+ *	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *	Johannes Bauer <JohannesBauer@gmx.de>
+**/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <string.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+#include "conntable.h"
+#include "tools.h"
+#include "stats.h"
+
+#define CACHELINE_SIZE			64
+#define CONNTABLE_MAX_CAPACITY	(1 << 20)
+
+/* Hot part of a slot, exactly one cache line. Only the owning connection
+ * thread writes to it (plus the byte counters from its relay threads), while
+ * the sweeper and introspection read it without any lock. The connection ID
+ * doubles as a sequence number: readers that observe a different ID after
+ * reading the other fields know that the slot has been recycled meanwhile
+ * and discard what they have read. */
+struct conn_slot_t {
+	atomic_uint connection_id;
+	atomic_uint state;
+	atomic_int interception_mode;
+	atomic_int fd[2];
+	atomic_uint sweeping;
+	atomic_uint_fast64_t accepted_at_msecs;
+	atomic_uint_fast64_t deadline_msecs;
+	atomic_uint_fast64_t bytes[2];
+} __attribute__ ((aligned (CACHELINE_SIZE)));
+
+static struct {
+	struct conn_slot_t *slots;
+	uint8_t *cold;
+	size_t cold_size;
+	unsigned int capacity;
+	unsigned int index_bits;
+	unsigned int next_index;
+	struct stats_counter_t *full;
+	struct stats_counter_t *expired;
+	struct stats_counter_t *in_use;
+} table;
+
+static const char *state_names[CONN_STATE_COUNT] = {
+	[CONN_FREE] = "free",
+	[CONN_ACCEPTED] = "accepted",
+	[CONN_HANDSHAKE] = "handshake",
+	[CONN_FORWARDING] = "forwarding",
+	[CONN_CLOSING] = "closing",
+};
+
+const char *conn_state_to_str(enum conn_state_t state) {
+	return (state < CONN_STATE_COUNT) ? state_names[state] : "?";
+}
+
+static uint64_t now_msecs(void) {
+	return monotonic_time() * 1000;
+}
+
+static uint64_t deadline_from_timeout(double timeout) {
+	return (timeout > 0) ? now_msecs() + (uint64_t)(timeout * 1000) : 0;
+}
+
+bool conntable_init(unsigned int capacity, size_t cold_size) {
+	if ((capacity == 0) || (capacity > CONNTABLE_MAX_CAPACITY)) {
+		logmsg(LLVL_ERROR, "Connection table capacity must be between 1 and %u, but %u was requested.", CONNTABLE_MAX_CAPACITY, capacity);
+		return false;
+	}
+	memset(&table, 0, sizeof(table));
+	table.capacity = capacity;
+	while ((1U << table.index_bits) < capacity) {
+		table.index_bits++;
+	}
+
+	/* The cold part is never touched for most of its size (the pages behind
+	 * unused slots and unused buffer space are not even faulted in), so a
+	 * generous capacity costs address space rather than memory. */
+	table.cold_size = (cold_size + CACHELINE_SIZE - 1) / CACHELINE_SIZE * CACHELINE_SIZE;
+	if (posix_memalign((void**)&table.slots, CACHELINE_SIZE, sizeof(struct conn_slot_t) * capacity)) {
+		logmsg(LLVL_ERROR, "Could not allocate connection table with %u slots.", capacity);
+		return false;
+	}
+	table.cold = calloc(capacity, table.cold_size);
+	if (!table.cold) {
+		logmsg(LLVL_ERROR, "Could not allocate %zu bytes of per-connection data for %u slots.", table.cold_size, capacity);
+		free(table.slots);
+		table.slots = NULL;
+		return false;
+	}
+	/* Generations start out at their maximum, so that the first connection
+	 * of every slot has generation zero and the ID equals the slot index */
+	for (unsigned int i = 0; i < capacity; i++) {
+		struct conn_slot_t *slot = &table.slots[i];
+		atomic_init(&slot->connection_id, (~0U << table.index_bits) | i);
+		atomic_init(&slot->state, CONN_FREE);
+		atomic_init(&slot->interception_mode, -1);
+		atomic_init(&slot->fd[CONN_FD_ACCEPTED], -1);
+		atomic_init(&slot->fd[CONN_FD_CONNECTED], -1);
+		atomic_init(&slot->sweeping, 0);
+		atomic_init(&slot->accepted_at_msecs, 0);
+		atomic_init(&slot->deadline_msecs, 0);
+		atomic_init(&slot->bytes[0], 0);
+		atomic_init(&slot->bytes[1], 0);
+	}
+	table.full = stats_counter("conntable.full");
+	table.expired = stats_counter("conntable.expired");
+	table.in_use = stats_counter("conntable.in_use");
+	logmsg(LLVL_DEBUG, "Connection table initialized with %u slots, %zu bytes hot and %zu bytes cold data per slot.", capacity, sizeof(struct conn_slot_t), table.cold_size);
+	return true;
+}
+
+void conntable_deinit(void) {
+	free(table.slots);
+	free(table.cold);
+	table.slots = NULL;
+	table.cold = NULL;
+}
+
+static struct conn_slot_t *lookup_slot(unsigned int connection_id) {
+	if (!table.slots) {
+		return NULL;
+	}
+	unsigned int index = connection_id & ((1U << table.index_bits) - 1);
+	if (index >= table.capacity) {
+		return NULL;
+	}
+	return &table.slots[index];
+}
+
+/* Slots are only ever allocated by the accepting thread, so searching for a
+ * free slot and claiming it does not need to be atomic; releasing a slot
+ * from any connection thread is a single store. The search starts after the
+ * most recently allocated slot, which spreads reuse over the table and
+ * makes it unlikely that a slot is recycled while a reader still inspects
+ * its previous connection. */
+struct conn_slot_t *conntable_alloc(int accepted_fd, double timeout) {
+	for (unsigned int i = 0; i < table.capacity; i++) {
+		unsigned int index = table.next_index;
+		table.next_index = (table.next_index + 1) % table.capacity;
+
+		struct conn_slot_t *slot = &table.slots[index];
+		if (atomic_load_explicit(&slot->state, memory_order_acquire) != CONN_FREE) {
+			continue;
+		}
+
+		unsigned int generation = (atomic_load_explicit(&slot->connection_id, memory_order_relaxed) >> table.index_bits) + 1;
+		atomic_store(&slot->connection_id, (generation << table.index_bits) | index);
+		/* A sweeper that has not seen the new connection ID yet may still be
+		 * working on the previous connection of this slot; it must not get
+		 * hold of the new descriptor. */
+		while (atomic_load(&slot->sweeping)) {
+			sched_yield();
+		}
+		atomic_store_explicit(&slot->interception_mode, -1, memory_order_relaxed);
+		atomic_store_explicit(&slot->fd[CONN_FD_ACCEPTED], accepted_fd, memory_order_relaxed);
+		atomic_store_explicit(&slot->fd[CONN_FD_CONNECTED], -1, memory_order_relaxed);
+		atomic_store_explicit(&slot->accepted_at_msecs, now_msecs(), memory_order_relaxed);
+		atomic_store_explicit(&slot->deadline_msecs, deadline_from_timeout(timeout), memory_order_relaxed);
+		atomic_store_explicit(&slot->bytes[0], 0, memory_order_relaxed);
+		atomic_store_explicit(&slot->bytes[1], 0, memory_order_relaxed);
+		memset(conntable_cold(slot), 0, table.cold_size);
+		atomic_store_explicit(&slot->state, CONN_ACCEPTED, memory_order_release);
+		stats_inc(table.in_use);
+		return slot;
+	}
+	stats_inc(table.full);
+	return NULL;
+}
+
+void conntable_free(struct conn_slot_t *slot) {
+	conntable_set_fd(slot, CONN_FD_ACCEPTED, -1);
+	conntable_set_fd(slot, CONN_FD_CONNECTED, -1);
+	atomic_store_explicit(&slot->state, CONN_FREE, memory_order_release);
+	stats_add(table.in_use, -1);
+}
+
+unsigned int conntable_id(const struct conn_slot_t *slot) {
+	return atomic_load_explicit(&slot->connection_id, memory_order_relaxed);
+}
+
+void *conntable_cold(const struct conn_slot_t *slot) {
+	return table.cold + (table.cold_size * (slot - table.slots));
+}
+
+void conntable_set_state(struct conn_slot_t *slot, enum conn_state_t state) {
+	atomic_store_explicit(&slot->state, state, memory_order_release);
+}
+
+void conntable_set_mode(struct conn_slot_t *slot, int interception_mode) {
+	atomic_store_explicit(&slot->interception_mode, interception_mode, memory_order_relaxed);
+}
+
+void conntable_set_deadline(struct conn_slot_t *slot, double timeout) {
+	atomic_store_explicit(&slot->deadline_msecs, deadline_from_timeout(timeout), memory_order_relaxed);
+}
+
+/* Publishes a file descriptor of the connection so that the sweeper may
+ * shut it down once the connection's deadline has passed, or retracts it
+ * (fd -1) before the owner closes it. Retracting is a store followed by a
+ * check whether the sweeper is currently working on the slot; the sweeper
+ * announces itself before it loads the descriptor. With sequentially
+ * consistent ordering of both pairs, either the sweeper sees the retracted
+ * descriptor or the owner waits until the sweeper is done, so a descriptor
+ * is never shut down after it has been closed (and possibly reused). */
+void conntable_set_fd(struct conn_slot_t *slot, enum conn_fd_t which, int fd) {
+	atomic_store(&slot->fd[which], fd);
+	if (fd == -1) {
+		while (atomic_load(&slot->sweeping)) {
+			sched_yield();
+		}
+	}
+}
+
+void conntable_account(unsigned int connection_id, bool direction, unsigned int length) {
+	struct conn_slot_t *slot = lookup_slot(connection_id);
+	if (slot && (atomic_load_explicit(&slot->connection_id, memory_order_relaxed) == connection_id)) {
+		atomic_fetch_add_explicit(&slot->bytes[direction ? 0 : 1], length, memory_order_relaxed);
+	}
+}
+
+static bool read_slot(struct conn_slot_t *slot, struct conn_info_t *info, uint64_t now) {
+	enum conn_state_t state = atomic_load_explicit(&slot->state, memory_order_acquire);
+	if (state == CONN_FREE) {
+		return false;
+	}
+	unsigned int connection_id = atomic_load_explicit(&slot->connection_id, memory_order_acquire);
+	*info = (struct conn_info_t) {
+		.connection_id = connection_id,
+		.state = state,
+		.interception_mode = atomic_load_explicit(&slot->interception_mode, memory_order_relaxed),
+		.age = (now - atomic_load_explicit(&slot->accepted_at_msecs, memory_order_relaxed)) / 1000.,
+		.bytes_up = atomic_load_explicit(&slot->bytes[0], memory_order_relaxed),
+		.bytes_down = atomic_load_explicit(&slot->bytes[1], memory_order_relaxed),
+	};
+	atomic_thread_fence(memory_order_acquire);
+	return atomic_load_explicit(&slot->connection_id, memory_order_relaxed) == connection_id;
+}
+
+bool conntable_get(unsigned int connection_id, struct conn_info_t *info) {
+	struct conn_slot_t *slot = lookup_slot(connection_id);
+	return slot && read_slot(slot, info, now_msecs()) && (info->connection_id == connection_id);
+}
+
+/* Calls the callback for every connection in the table until it returns
+ * false. Does not block connections in any way; connections that are opened
+ * or closed during the iteration may or may not be seen. */
+unsigned int conntable_foreach(bool (*callback)(const struct conn_info_t *info, void *argument), void *argument) {
+	const uint64_t now = now_msecs();
+	unsigned int count = 0;
+	for (unsigned int i = 0; i < table.capacity; i++) {
+		struct conn_info_t info;
+		if (read_slot(&table.slots[i], &info, now)) {
+			count++;
+			if (!callback(&info, argument)) {
+				break;
+			}
+		}
+	}
+	return count;
+}
+
+static bool slot_expired(struct conn_slot_t *slot, uint64_t now) {
+	const uint64_t deadline = atomic_load_explicit(&slot->deadline_msecs, memory_order_relaxed);
+	if ((deadline == 0) || (deadline > now)) {
+		return false;
+	}
+	enum conn_state_t state = atomic_load_explicit(&slot->state, memory_order_acquire);
+	return (state == CONN_ACCEPTED) || (state == CONN_HANDSHAKE);
+}
+
+/* Shuts down the sockets of all connections whose deadline has passed. The
+ * threads that are blocked on them (e.g., in a TLS handshake) then fail and
+ * tear down the connection themselves. Returns the number of connections
+ * that were expired. */
+unsigned int conntable_expire(void) {
+	const uint64_t now = now_msecs();
+	unsigned int expired = 0;
+	for (unsigned int i = 0; i < table.capacity; i++) {
+		struct conn_slot_t *slot = &table.slots[i];
+		const unsigned int connection_id = atomic_load(&slot->connection_id);
+		if (!slot_expired(slot, now)) {
+			continue;
+		}
+
+		/* The owner may have freed the slot and the accepting thread may have
+		 * reused it since the check above. Once the sweeper has announced
+		 * itself, the slot can no longer change hands unnoticed: either the
+		 * new connection ID is visible here or conntable_alloc() waits for
+		 * the sweeper before it publishes the new descriptors. */
+		atomic_store(&slot->sweeping, 1);
+		const enum conn_state_t state = atomic_load_explicit(&slot->state, memory_order_acquire);
+		if ((atomic_load(&slot->connection_id) != connection_id) || !slot_expired(slot, now)) {
+			atomic_store(&slot->sweeping, 0);
+			continue;
+		}
+		for (int which = CONN_FD_ACCEPTED; which <= CONN_FD_CONNECTED; which++) {
+			int fd = atomic_load(&slot->fd[which]);
+			if (fd != -1) {
+				shutdown(fd, SHUT_RDWR);
+			}
+		}
+		atomic_store_explicit(&slot->deadline_msecs, 0, memory_order_relaxed);
+		atomic_store(&slot->sweeping, 0);
+
+		logmsg(LLVL_WARN, "Connection %u expired after %.1f secs in state %s.", connection_id, (now - atomic_load_explicit(&slot->accepted_at_msecs, memory_order_relaxed)) / 1000., conn_state_to_str(state));
+		expired++;
+	}
+	stats_add(table.expired, expired);
+	return expired;
+}
+
+struct conntable_summary_t {
+	unsigned int count[CONN_STATE_COUNT];
+	double oldest[CONN_STATE_COUNT];
+	uint64_t bytes_up, bytes_down;
+};
+
+static bool summarize_connection(const struct conn_info_t *info, void *argument) {
+	struct conntable_summary_t *summary = (struct conntable_summary_t*)argument;
+	summary->count[info->state]++;
+	if (info->age > summary->oldest[info->state]) {
+		summary->oldest[info->state] = info->age;
+	}
+	summary->bytes_up += info->bytes_up;
+	summary->bytes_down += info->bytes_down;
+	return true;
+}
+
+void conntable_log(enum loglvl_t loglvl) {
+	if (!table.slots || !loglevel_at_least(loglvl)) {
+		return;
+	}
+	struct conntable_summary_t summary = { 0 };
+	unsigned int total = conntable_foreach(summarize_connection, &summary);
+	logmsg(loglvl, "Connection table: %u of %u slots in use; %u accepted (oldest %.1f secs), %u in handshake (oldest %.1f secs), %u forwarding (oldest %.1f secs), %u closing; %" PRIu64 " bytes up and %" PRIu64 " bytes down on open connections.", total, table.capacity,
+		summary.count[CONN_ACCEPTED], summary.oldest[CONN_ACCEPTED],
+		summary.count[CONN_HANDSHAKE], summary.oldest[CONN_HANDSHAKE],
+		summary.count[CONN_FORWARDING], summary.oldest[CONN_FORWARDING],
+		summary.count[CONN_CLOSING], summary.bytes_up, summary.bytes_down);
+}
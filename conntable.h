@@ -0,0 +1,83 @@
+/**
+ *	ratched - TLS connection router that performs a man-in-the-middle attack
+ *	Copyright (C) 2017-2017 Johannes Bauer
+ *
+ *	This file is part of ratched.
+ *
+ *	ratched is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; this program is ONLY licensed under
+ *	version 3 of the License, later versions are explicitly excluded.
+ *
+ *	ratched is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with ratched; if not, write to the Free Software
+ *	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *	Johannes Bauer <JohannesBauer@gmx.de>
+**/
+
+
+#ifndef __CONNTABLE_H__
+#define __CONNTABLE_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "logging.h"
+
+/* Fixed-capacity table of all connections. Every connection occupies one
+ * slot, and its connection ID is the slot index combined with a generation
+ * counter that is incremented every time the slot is reused, so stale IDs
+ * never resolve to a newer connection. The frequently scanned state of all
+ * slots (state, file descriptors, deadline, byte counters) lives in one
+ * dense array of cache lines; the bulky per-connection data of the owning
+ * thread is kept in a separate array. */
+enum conn_state_t {
+	CONN_FREE = 0,
+	CONN_ACCEPTED,
+	CONN_HANDSHAKE,
+	CONN_FORWARDING,
+	CONN_CLOSING,
+};
+#define CONN_STATE_COUNT		(CONN_CLOSING + 1)
+
+enum conn_fd_t {
+	CONN_FD_ACCEPTED = 0,
+	CONN_FD_CONNECTED = 1,
+};
+
+struct conn_slot_t;
+
+struct conn_info_t {
+	unsigned int connection_id;
+	enum conn_state_t state;
+	int interception_mode;
+	double age;
+	uint64_t bytes_up, bytes_down;
+};
+
+/*************** AUTO GENERATED SECTION FOLLOWS ***************/
+const char *conn_state_to_str(enum conn_state_t state);
+bool conntable_init(unsigned int capacity, size_t cold_size);
+void conntable_deinit(void);
+struct conn_slot_t *conntable_alloc(int accepted_fd, double timeout);
+void conntable_free(struct conn_slot_t *slot);
+unsigned int conntable_id(const struct conn_slot_t *slot);
+void *conntable_cold(const struct conn_slot_t *slot);
+void conntable_set_state(struct conn_slot_t *slot, enum conn_state_t state);
+void conntable_set_mode(struct conn_slot_t *slot, int interception_mode);
+void conntable_set_deadline(struct conn_slot_t *slot, double timeout);
+void conntable_set_fd(struct conn_slot_t *slot, enum conn_fd_t which, int fd);
+void conntable_account(unsigned int connection_id, bool direction, unsigned int length);
+bool conntable_get(unsigned int connection_id, struct conn_info_t *info);
+unsigned int conntable_foreach(bool (*callback)(const struct conn_info_t *info, void *argument), void *argument);
+unsigned int conntable_expire(void);
+void conntable_log(enum loglvl_t loglvl);
+/***************  AUTO GENERATED SECTION ENDS   ***************/
+
+#endif
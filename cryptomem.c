@@ -0,0 +1,282 @@
+/**
+ *	ratched - TLS connection router that performs a man-in-the-middle attack
+ *	Copyright (C) 2017-2017 Johannes Bauer
+ *
+ *	This file is part of ratched.
+ *
+ *	ratched is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; this program is ONLY licensed under
+ *	version 3 of the License, later versions are explicitly excluded.
+ *
+ *	ratched is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with ratched; if not, write to the Free Software
+ *	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *	Johannes Bauer <JohannesBauer@gmx.de>
+**/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <pthread.h>
+#include <openssl/crypto.h>
+#include "cryptomem.h"
+#include "stats.h"
+#include "logging.h"
+
+/* Allocator for OpenSSL that keeps small blocks in per-thread free lists, so
+ * that the many short-lived objects created for every connection (forged
+ * certificates, OCSP responses, SSL objects and BIOs) do not contend for the
+ * shared malloc arenas. Every block carries a header that records its size
+ * class and the subsystem it was allocated for, which is what the accounting
+ * is based on. Blocks may be freed by any thread; they then end up in that
+ * thread's cache. */
+#define SIZE_CLASS_COUNT				9
+#define SMALLEST_SIZE_CLASS_SHIFT		5
+#define LARGE_SIZE_CLASS				SIZE_CLASS_COUNT
+#define MAX_CACHED_BYTES_PER_CLASS		(16 * 1024)
+#define MIN_CACHED_BLOCKS_PER_CLASS		4
+#define STATISTICS_FLUSH_INTERVAL		64
+
+union block_header_t {
+	struct {
+		uint32_t size_class;
+		uint32_t subsystem;
+		size_t requested_size;
+	};
+	max_align_t alignment;
+};
+
+struct free_block_t {
+	struct free_block_t *next;
+};
+
+struct size_class_cache_t {
+	struct free_block_t *head;
+	unsigned int count;
+};
+
+struct subsystem_delta_t {
+	int64_t live_bytes;
+	int64_t allocations;
+};
+
+struct thread_cache_t {
+	struct size_class_cache_t classes[SIZE_CLASS_COUNT];
+	struct subsystem_delta_t deltas[CRYPTOMEM_SUBSYSTEM_COUNT];
+	unsigned int operations_since_flush;
+};
+
+static const char *subsystem_names[CRYPTOMEM_SUBSYSTEM_COUNT] = {
+	[CRYPTOMEM_OTHER] = "other",
+	[CRYPTOMEM_FORGING] = "forging",
+	[CRYPTOMEM_OCSP] = "ocsp",
+	[CRYPTOMEM_HANDSHAKE] = "handshake",
+	[CRYPTOMEM_RELAY] = "relay",
+};
+
+static struct {
+	struct stats_counter_t *live_bytes;
+	struct stats_counter_t *allocations;
+} counters[CRYPTOMEM_SUBSYSTEM_COUNT];
+static struct stats_counter_t *cache_hits;
+
+static pthread_key_t thread_cache_key;
+static _Thread_local struct thread_cache_t *thread_cache;
+static _Thread_local bool thread_cache_destroyed;
+static _Thread_local enum cryptomem_subsystem_t current_subsystem;
+
+static size_t size_class_bytes(unsigned int size_class) {
+	return (size_t)1 << (size_class + SMALLEST_SIZE_CLASS_SHIFT);
+}
+
+static unsigned int size_class_capacity(unsigned int size_class) {
+	unsigned int capacity = MAX_CACHED_BYTES_PER_CLASS / size_class_bytes(size_class);
+	return (capacity < MIN_CACHED_BLOCKS_PER_CLASS) ? MIN_CACHED_BLOCKS_PER_CLASS : capacity;
+}
+
+static unsigned int get_size_class(size_t block_size) {
+	for (unsigned int size_class = 0; size_class < SIZE_CLASS_COUNT; size_class++) {
+		if (block_size <= size_class_bytes(size_class)) {
+			return size_class;
+		}
+	}
+	return LARGE_SIZE_CLASS;
+}
+
+static void flush_deltas(struct subsystem_delta_t *deltas) {
+	for (unsigned int i = 0; i < CRYPTOMEM_SUBSYSTEM_COUNT; i++) {
+		if (deltas[i].live_bytes) {
+			stats_add(counters[i].live_bytes, deltas[i].live_bytes);
+			deltas[i].live_bytes = 0;
+		}
+		if (deltas[i].allocations) {
+			stats_add(counters[i].allocations, deltas[i].allocations);
+			deltas[i].allocations = 0;
+		}
+	}
+}
+
+static void destroy_thread_cache(void *vcache) {
+	struct thread_cache_t *cache = (struct thread_cache_t*)vcache;
+	for (unsigned int i = 0; i < SIZE_CLASS_COUNT; i++) {
+		struct free_block_t *block = cache->classes[i].head;
+		while (block) {
+			struct free_block_t *next = block->next;
+			free(block);
+			block = next;
+		}
+	}
+	flush_deltas(cache->deltas);
+	free(cache);
+
+	/* OpenSSL's own thread cleanup may still release memory after this;
+	 * those blocks go straight back to malloc. */
+	thread_cache = NULL;
+	thread_cache_destroyed = true;
+}
+
+static struct thread_cache_t *get_thread_cache(void) {
+	if (!thread_cache && !thread_cache_destroyed) {
+		thread_cache = calloc(1, sizeof(struct thread_cache_t));
+		if (thread_cache) {
+			pthread_setspecific(thread_cache_key, thread_cache);
+		}
+	}
+	return thread_cache;
+}
+
+static void account(struct thread_cache_t *cache, enum cryptomem_subsystem_t subsystem, int64_t bytes, int64_t allocations) {
+	if (!cache) {
+		stats_add(counters[subsystem].live_bytes, bytes);
+		stats_add(counters[subsystem].allocations, allocations);
+		return;
+	}
+	cache->deltas[subsystem].live_bytes += bytes;
+	cache->deltas[subsystem].allocations += allocations;
+	if (++cache->operations_since_flush >= STATISTICS_FLUSH_INTERVAL) {
+		cache->operations_since_flush = 0;
+		flush_deltas(cache->deltas);
+	}
+}
+
+static void *cryptomem_malloc(size_t size, const char *file, int line) {
+	struct thread_cache_t *cache = get_thread_cache();
+	unsigned int size_class = get_size_class(sizeof(union block_header_t) + size);
+	union block_header_t *header = NULL;
+	if ((size_class != LARGE_SIZE_CLASS) && cache && cache->classes[size_class].head) {
+		struct size_class_cache_t *class_cache = &cache->classes[size_class];
+		header = (union block_header_t*)class_cache->head;
+		class_cache->head = class_cache->head->next;
+		class_cache->count--;
+		stats_inc(cache_hits);
+	} else {
+		size_t block_size = (size_class != LARGE_SIZE_CLASS) ? size_class_bytes(size_class) : (sizeof(union block_header_t) + size);
+		header = malloc(block_size);
+		if (!header) {
+			return NULL;
+		}
+	}
+	header->size_class = size_class;
+	header->subsystem = current_subsystem;
+	header->requested_size = size;
+	account(cache, current_subsystem, size, 1);
+	return header + 1;
+}
+
+static void cryptomem_free(void *ptr, const char *file, int line) {
+	if (!ptr) {
+		return;
+	}
+	union block_header_t *header = ((union block_header_t*)ptr) - 1;
+	struct thread_cache_t *cache = get_thread_cache();
+	account(cache, header->subsystem, -(int64_t)header->requested_size, 0);
+
+	unsigned int size_class = header->size_class;
+	if ((size_class != LARGE_SIZE_CLASS) && cache && (cache->classes[size_class].count < size_class_capacity(size_class))) {
+		struct size_class_cache_t *class_cache = &cache->classes[size_class];
+		struct free_block_t *block = (struct free_block_t*)header;
+		block->next = class_cache->head;
+		class_cache->head = block;
+		class_cache->count++;
+	} else {
+		free(header);
+	}
+}
+
+static void *cryptomem_realloc(void *ptr, size_t size, const char *file, int line) {
+	if (!ptr) {
+		return cryptomem_malloc(size, file, line);
+	}
+	if (!size) {
+		cryptomem_free(ptr, file, line);
+		return NULL;
+	}
+
+	union block_header_t *header = ((union block_header_t*)ptr) - 1;
+	if ((header->size_class != LARGE_SIZE_CLASS) && (sizeof(union block_header_t) + size <= size_class_bytes(header->size_class))) {
+		/* Still fits into the block we have */
+		account(get_thread_cache(), header->subsystem, (int64_t)size - (int64_t)header->requested_size, 0);
+		header->requested_size = size;
+		return ptr;
+	}
+
+	void *new_ptr = cryptomem_malloc(size, file, line);
+	if (!new_ptr) {
+		return NULL;
+	}
+	memcpy(new_ptr, ptr, (header->requested_size < size) ? header->requested_size : size);
+	cryptomem_free(ptr, file, line);
+	return new_ptr;
+}
+
+/* Needs to be called before OpenSSL performs its first allocation, i.e.,
+ * before it is initialized. */
+bool cryptomem_init(void) {
+	for (unsigned int i = 0; i < CRYPTOMEM_SUBSYSTEM_COUNT; i++) {
+		char name[64];
+		snprintf(name, sizeof(name), "mem.%s.live_bytes", subsystem_names[i]);
+		counters[i].live_bytes = stats_counter(name);
+		snprintf(name, sizeof(name), "mem.%s.allocations", subsystem_names[i]);
+		counters[i].allocations = stats_counter(name);
+	}
+	cache_hits = stats_counter("mem.cache_hits");
+
+	if (pthread_key_create(&thread_cache_key, destroy_thread_cache)) {
+		logmsg(LLVL_ERROR, "Unable to create thread cache key for OpenSSL allocator.");
+		return false;
+	}
+	if (!CRYPTO_set_mem_functions(cryptomem_malloc, cryptomem_realloc, cryptomem_free)) {
+		logmsg(LLVL_WARN, "Unable to install OpenSSL allocator, OpenSSL has already allocated memory.");
+		return false;
+	}
+	return true;
+}
+
+/* Returns the previously active subsystem, which must be passed to
+ * cryptomem_leave() afterwards. */
+enum cryptomem_subsystem_t cryptomem_enter(enum cryptomem_subsystem_t subsystem) {
+	enum cryptomem_subsystem_t previous = current_subsystem;
+	current_subsystem = subsystem;
+	return previous;
+}
+
+void cryptomem_leave(enum cryptomem_subsystem_t previous) {
+	current_subsystem = previous;
+}
+
+void cryptomem_flush_thread_statistics(void) {
+	if (thread_cache) {
+		thread_cache->operations_since_flush = 0;
+		flush_deltas(thread_cache->deltas);
+	}
+}
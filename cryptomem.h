@@ -0,0 +1,48 @@
+/**
+ *	ratched - TLS connection router that performs a man-in-the-middle attack
+ *	Copyright (C) 2017-2017 Johannes Bauer
+ *
+ *	This file is part of ratched.
+ *
+ *	ratched is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; this program is ONLY licensed under
+ *	version 3 of the License, later versions are explicitly excluded.
+ *
+ *	ratched is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with ratched; if not, write to the Free Software
+ *	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *	Johannes Bauer <JohannesBauer@gmx.de>
+**/
+
+
+#ifndef __CRYPTOMEM_H__
+#define __CRYPTOMEM_H__
+
+#include <stdbool.h>
+
+/* Subsystems that OpenSSL allocations are accounted to. The subsystem is a
+ * property of the calling thread and set by cryptomem_enter(). */
+enum cryptomem_subsystem_t {
+	CRYPTOMEM_OTHER = 0,
+	CRYPTOMEM_FORGING,
+	CRYPTOMEM_OCSP,
+	CRYPTOMEM_HANDSHAKE,
+	CRYPTOMEM_RELAY,
+	CRYPTOMEM_SUBSYSTEM_COUNT
+};
+
+/*************** AUTO GENERATED SECTION FOLLOWS ***************/
+bool cryptomem_init(void);
+enum cryptomem_subsystem_t cryptomem_enter(enum cryptomem_subsystem_t subsystem);
+void cryptomem_leave(enum cryptomem_subsystem_t previous);
+void cryptomem_flush_thread_statistics(void);
+/***************  AUTO GENERATED SECTION ENDS   ***************/
+
+#endif
@@ -0,0 +1,158 @@
+/**
+ *	ratched - TLS connection router that performs a man-in-the-middle attack
+ *	Copyright (C) 2017-2017 Johannes Bauer
+ *
+ *	This file is part of ratched.
+ *
+ *	ratched is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; this program is ONLY licensed under
+ *	version 3 of the License, later versions are explicitly excluded.
+ *
+ *	ratched is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with ratched; if not, write to the Free Software
+ *	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *	Johannes Bauer <JohannesBauer@gmx.de>
+**/
+
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include "cryptopool.h"
+#include "logging.h"
+#include "thread.h"
+#include "lockstat.h"
+#include "stats.h"
+#include "tools.h"
+
+#define MAX_CRYPTO_WORKERS		64
+
+/* A fixed set of worker threads for CPU-bound public key operations. Every
+ * connection has its own thread, so running such operations there directly
+ * would let the number of concurrent signature checks grow with the number
+ * of connections instead of the number of cores. Callers hand in a job and
+ * sleep until a worker has run it. */
+struct cryptopool_job_t {
+	void (*job_fnc)(void *argument);
+	void *argument;
+	double enqueued;
+	sem_t done;
+	struct cryptopool_job_t *next;
+};
+
+static struct {
+	struct lockstat_mutex_t lock;
+	pthread_cond_t cond;
+	struct cryptopool_job_t *head, *tail;
+	bool quit;
+	unsigned int worker_count;
+	pthread_t workers[MAX_CRYPTO_WORKERS];
+	struct stats_counter_t *jobs;
+	struct stats_counter_t *queue_wait_usecs;
+} pool = {
+	.lock = LOCKSTAT_MUTEX_INITIALIZER("cryptopool"),
+	.cond = PTHREAD_COND_INITIALIZER,
+};
+static pthread_once_t counters_once = PTHREAD_ONCE_INIT;
+
+static void init_counters(void) {
+	pool.jobs = stats_counter("cryptopool.jobs");
+	pool.queue_wait_usecs = stats_counter("cryptopool.queue_wait_usecs");
+}
+
+static void *cryptopool_worker_fnc(void *argument) {
+	set_thread_name("crypto-%u", (unsigned int)(uintptr_t)argument);
+	lockstat_lock(&pool.lock);
+	while (true) {
+		while (!pool.head && !pool.quit) {
+			lockstat_cond_wait(&pool.cond, &pool.lock);
+		}
+		if (!pool.head) {
+			break;
+		}
+		struct cryptopool_job_t *job = pool.head;
+		pool.head = job->next;
+		if (!pool.head) {
+			pool.tail = NULL;
+		}
+		lockstat_unlock(&pool.lock);
+
+		stats_add(pool.queue_wait_usecs, (monotonic_time() - job->enqueued) * 1e6);
+		job->job_fnc(job->argument);
+		sem_post(&job->done);
+
+		lockstat_lock(&pool.lock);
+	}
+	lockstat_unlock(&pool.lock);
+	return NULL;
+}
+
+bool cryptopool_init(unsigned int worker_count) {
+	if (worker_count > MAX_CRYPTO_WORKERS) {
+		worker_count = MAX_CRYPTO_WORKERS;
+	}
+	pthread_once(&counters_once, init_counters);
+	pool.quit = false;
+	for (unsigned int i = 0; i < worker_count; i++) {
+		int result = pthread_create(&pool.workers[i], NULL, cryptopool_worker_fnc, (void*)(uintptr_t)i);
+		if (result) {
+			logmsg(LLVL_ERROR, "Could not start crypto worker %u of %u: %s", i + 1, worker_count, strerror(result));
+			break;
+		}
+		pool.worker_count++;
+	}
+	logmsg(LLVL_DEBUG, "Started %u crypto workers.", pool.worker_count);
+	return pool.worker_count > 0;
+}
+
+/* Runs job_fnc(argument) on a crypto worker and returns once it has
+ * finished. Without a running pool (e.g., in tests), the job runs on the
+ * calling thread. */
+void cryptopool_run(void (*job_fnc)(void *argument), void *argument) {
+	pthread_once(&counters_once, init_counters);
+	stats_inc(pool.jobs);
+	if (!pool.worker_count) {
+		job_fnc(argument);
+		return;
+	}
+
+	struct cryptopool_job_t job = {
+		.job_fnc = job_fnc,
+		.argument = argument,
+		.enqueued = monotonic_time(),
+	};
+	sem_init(&job.done, 0, 0);
+	lockstat_lock(&pool.lock);
+	if (pool.tail) {
+		pool.tail->next = &job;
+	} else {
+		pool.head = &job;
+	}
+	pool.tail = &job;
+	pthread_cond_signal(&pool.cond);
+	lockstat_unlock(&pool.lock);
+
+	while (sem_wait(&job.done) && (errno == EINTR));
+	sem_destroy(&job.done);
+}
+
+void cryptopool_deinit(void) {
+	lockstat_lock(&pool.lock);
+	pool.quit = true;
+	pthread_cond_broadcast(&pool.cond);
+	lockstat_unlock(&pool.lock);
+	for (unsigned int i = 0; i < pool.worker_count; i++) {
+		pthread_join(pool.workers[i], NULL);
+	}
+	pool.worker_count = 0;
+}
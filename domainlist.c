@@ -0,0 +1,587 @@
+/**
+ *	ratched - TLS connection router that performs a man-in-the-middle attack
+ *	Copyright (C) 2017-2017 Johannes Bauer
+ *
+ *	This file is part of ratched.
+ *
+ *	ratched is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; this program is ONLY licensed under
+ *	version 3 of the License, later versions are explicitly excluded.
+ *
+ *	ratched is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with ratched; if not, write to the Free Software
+ *	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *	Johannes Bauer <JohannesBauer@gmx.de>
+**/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "domainlist.h"
+#include "logging.h"
+
+/* Average number of entries per hash bucket; larger buckets mean a smaller
+ * displacement table, but a longer search when building */
+#define ENTRIES_PER_BUCKET			4
+#define MAX_BUCKET_SIZE				64
+#define MAX_DISPLACEMENT_TRIALS		(1 << 20)
+#define MAX_SEED_ATTEMPTS			16
+#define MAX_REPORTED_INVALID_LINES	10
+
+/* A compiled list is only ever read by the ratched binary that matches the
+ * tool which wrote it, so the hash does not need to be portable beyond that.
+ * It does need to be stable across releases, however: FNV-1a over the
+ * normalized name, finished with the SplitMix64 mixer. */
+static uint64_t mix64(uint64_t x) {
+	x ^= x >> 30;
+	x *= 0xbf58476d1ce4e5b9ULL;
+	x ^= x >> 27;
+	x *= 0x94d049bb133111ebULL;
+	x ^= x >> 31;
+	return x;
+}
+
+static uint64_t name_hash(uint64_t seed, const char *name, unsigned int length) {
+	uint64_t hash = 0xcbf29ce484222325ULL ^ seed;
+	for (unsigned int i = 0; i < length; i++) {
+		hash ^= (uint8_t)name[i];
+		hash *= 0x100000001b3ULL;
+	}
+	return mix64(hash);
+}
+
+struct slot_hash_t {
+	uint32_t bucket;
+	uint32_t f1;
+	uint32_t f2;
+};
+
+static struct slot_hash_t split_hash(uint64_t hash, uint32_t entry_count, uint32_t bucket_count) {
+	return (struct slot_hash_t) {
+		.bucket = (hash >> 32) % bucket_count,
+		.f1 = (hash & 0xffffffff) % entry_count,
+		.f2 = mix64(hash) % entry_count,
+	};
+}
+
+/* Compress, hash and displace: the displacement index of a bucket encodes
+ * the pair (d0, d1) that places all of its keys at (f1 + d0 * f2 + d1) mod n */
+static uint32_t slot_position(const struct slot_hash_t *slot_hash, uint32_t displacement, uint32_t entry_count) {
+	const uint64_t d0 = displacement / entry_count;
+	const uint64_t d1 = displacement % entry_count;
+	return (slot_hash->f1 + (d0 * slot_hash->f2) + d1) % entry_count;
+}
+
+/* Lowercases and validates a host name and removes a trailing dot. Returns
+ * the normalized length or -1 if it is not a valid host name. */
+static int normalize_name(const char *name, unsigned int length, char *normalized) {
+	if (length && (name[length - 1] == '.')) {
+		length--;
+	}
+	if ((length == 0) || (length > DOMAINLIST_MAX_NAME_LENGTH)) {
+		return -1;
+	}
+	for (unsigned int i = 0; i < length; i++) {
+		char c = name[i];
+		if ((c >= 'A') && (c <= 'Z')) {
+			c += 'a' - 'A';
+		} else if (!(((c >= 'a') && (c <= 'z')) || ((c >= '0') && (c <= '9')) || (c == '-') || (c == '_') || (c == '.'))) {
+			return -1;
+		}
+		if ((c == '.') && ((i == 0) || (normalized[i - 1] == '.'))) {
+			/* Empty label */
+			return -1;
+		}
+		normalized[i] = c;
+	}
+	return length;
+}
+
+struct domainlist_builder_t *domainlist_builder_new(void) {
+	struct domainlist_builder_t *builder = calloc(1, sizeof(struct domainlist_builder_t));
+	if (!builder) {
+		logmsg(LLVL_FATAL, "Failed to allocate domain list builder: %s", strerror(errno));
+	}
+	return builder;
+}
+
+/* Adds a host name; with a leading "." or "*.", the entry also matches all
+ * subdomains of the name. Returns false for invalid names. */
+bool domainlist_builder_add(struct domainlist_builder_t *builder, const char *pattern, uint8_t value) {
+	uint8_t flags = 0;
+	if (!strncmp(pattern, "*.", 2)) {
+		pattern += 2;
+		flags |= DOMAINLIST_SUBDOMAINS;
+	} else if (pattern[0] == '.') {
+		pattern += 1;
+		flags |= DOMAINLIST_SUBDOMAINS;
+	}
+
+	char normalized[DOMAINLIST_MAX_NAME_LENGTH];
+	int length = normalize_name(pattern, strlen(pattern), normalized);
+	if (length == -1) {
+		return false;
+	}
+
+	if (builder->count == builder->alloced) {
+		unsigned int new_alloced = builder->alloced ? (2 * builder->alloced) : 1024;
+		struct domainlist_builder_entry_t *new_entries = realloc(builder->entries, sizeof(struct domainlist_builder_entry_t) * new_alloced);
+		if (!new_entries) {
+			logmsg(LLVL_FATAL, "Failed to grow domain list to %u entries: %s", new_alloced, strerror(errno));
+			return false;
+		}
+		builder->entries = new_entries;
+		builder->alloced = new_alloced;
+	}
+	char *name = malloc(length);
+	if (!name) {
+		logmsg(LLVL_FATAL, "Failed to allocate domain list entry: %s", strerror(errno));
+		return false;
+	}
+	memcpy(name, normalized, length);
+	builder->entries[builder->count] = (struct domainlist_builder_entry_t) {
+		.name = name,
+		.length = length,
+		.value = value,
+		.flags = flags,
+		.index = builder->count,
+	};
+	builder->count++;
+	return true;
+}
+
+/* Reads one host name per line. Everything after a '#' is a comment. Lines
+ * in hosts file format ("0.0.0.0 name [name ...]") contribute all names
+ * after the address, so that common blocklists can be used as they are. */
+bool domainlist_builder_add_file(struct domainlist_builder_t *builder, const char *filename, uint8_t value) {
+	FILE *f = fopen(filename, "r");
+	if (!f) {
+		logmsg(LLVL_ERROR, "Cannot open domain list source %s: %s", filename, strerror(errno));
+		return false;
+	}
+	char *line = NULL;
+	size_t line_alloced = 0;
+	unsigned int line_no = 0;
+	unsigned int invalid_count = 0;
+	const unsigned int count_before = builder->count;
+	while (getline(&line, &line_alloced, f) != -1) {
+		line_no++;
+		line[strcspn(line, "#\r\n")] = 0;
+
+		char *tokens[64];
+		unsigned int token_count = 0;
+		char *saveptr = NULL;
+		for (char *token = strtok_r(line, " \t", &saveptr); token && (token_count < 64); token = strtok_r(NULL, " \t", &saveptr)) {
+			tokens[token_count++] = token;
+		}
+		for (unsigned int i = (token_count > 1) ? 1 : 0; i < token_count; i++) {
+			if (!domainlist_builder_add(builder, tokens[i], value)) {
+				if (invalid_count < MAX_REPORTED_INVALID_LINES) {
+					logmsg(LLVL_WARN, "%s line %u: ignoring invalid host name \"%s\".", filename, line_no, tokens[i]);
+				}
+				invalid_count++;
+			}
+		}
+	}
+	free(line);
+	fclose(f);
+	logmsg(LLVL_DEBUG, "Read %u host names from %s, ignored %u invalid ones.", builder->count - count_before, filename, invalid_count);
+	return true;
+}
+
+static int compare_entries(const void *va, const void *vb) {
+	const struct domainlist_builder_entry_t *a = (const struct domainlist_builder_entry_t*)va;
+	const struct domainlist_builder_entry_t *b = (const struct domainlist_builder_entry_t*)vb;
+	const unsigned int common_length = (a->length < b->length) ? a->length : b->length;
+	int result = memcmp(a->name, b->name, common_length);
+	if (result) {
+		return result;
+	} else if (a->length != b->length) {
+		return (a->length < b->length) ? -1 : 1;
+	}
+	return (a->index < b->index) ? -1 : 1;
+}
+
+/* Keeps only the first occurrence of every name */
+static void remove_duplicates(struct domainlist_builder_t *builder) {
+	if (builder->count == 0) {
+		return;
+	}
+	qsort(builder->entries, builder->count, sizeof(struct domainlist_builder_entry_t), compare_entries);
+	unsigned int kept = 1;
+	for (unsigned int i = 1; i < builder->count; i++) {
+		const struct domainlist_builder_entry_t *previous = &builder->entries[kept - 1];
+		struct domainlist_builder_entry_t *entry = &builder->entries[i];
+		if ((entry->length == previous->length) && !memcmp(entry->name, previous->name, entry->length)) {
+			free(entry->name);
+		} else {
+			builder->entries[kept++] = *entry;
+		}
+	}
+	if (kept != builder->count) {
+		logmsg(LLVL_DEBUG, "Removed %u duplicate host names from domain list.", builder->count - kept);
+	}
+	builder->count = kept;
+}
+
+/* Tries to find a displacement for every bucket so that all entries end up
+ * in distinct slots. Buckets are placed largest first while the table is
+ * still empty; single-entry buckets come last and are put directly into the
+ * remaining free slots. */
+static bool build_perfect_hash(const struct domainlist_builder_t *builder, uint64_t seed, uint32_t bucket_count, uint32_t *displacements, uint32_t *positions) {
+	const uint32_t n = builder->count;
+	bool success = false;
+	uint32_t *bucket_start = calloc(bucket_count + 1, sizeof(uint32_t));
+	uint32_t *bucket_members = malloc(n * sizeof(uint32_t));
+	uint32_t *bucket_order = malloc(bucket_count * sizeof(uint32_t));
+	uint8_t *taken = calloc(n, 1);
+	struct slot_hash_t *hashes = malloc(n * sizeof(struct slot_hash_t));
+	if (!bucket_start || !bucket_members || !bucket_order || !taken || !hashes) {
+		logmsg(LLVL_FATAL, "Failed to allocate perfect hash construction state for %u entries: %s", n, strerror(errno));
+		goto out;
+	}
+
+	/* Group entries by bucket */
+	for (uint32_t i = 0; i < n; i++) {
+		const struct domainlist_builder_entry_t *entry = &builder->entries[i];
+		hashes[i] = split_hash(name_hash(seed, entry->name, entry->length), n, bucket_count);
+		bucket_start[hashes[i].bucket + 1]++;
+	}
+	unsigned int size_count[MAX_BUCKET_SIZE + 1] = { 0 };
+	for (uint32_t b = 0; b < bucket_count; b++) {
+		const uint32_t size = bucket_start[b + 1];
+		if (size > MAX_BUCKET_SIZE) {
+			goto out;
+		}
+		size_count[size]++;
+		bucket_start[b + 1] += bucket_start[b];
+	}
+	{
+		uint32_t *fill = calloc(bucket_count, sizeof(uint32_t));
+		if (!fill) {
+			goto out;
+		}
+		for (uint32_t i = 0; i < n; i++) {
+			const uint32_t b = hashes[i].bucket;
+			bucket_members[bucket_start[b] + fill[b]++] = i;
+		}
+		free(fill);
+	}
+
+	/* Order buckets by descending size */
+	unsigned int size_start[MAX_BUCKET_SIZE + 1];
+	size_start[MAX_BUCKET_SIZE] = 0;
+	for (int size = MAX_BUCKET_SIZE - 1; size >= 0; size--) {
+		size_start[size] = size_start[size + 1] + size_count[size + 1];
+	}
+	for (uint32_t b = 0; b < bucket_count; b++) {
+		const uint32_t size = bucket_start[b + 1] - bucket_start[b];
+		bucket_order[size_start[size]++] = b;
+	}
+
+	uint32_t free_cursor = 0;
+	for (uint32_t k = 0; k < bucket_count; k++) {
+		const uint32_t b = bucket_order[k];
+		const uint32_t *members = bucket_members + bucket_start[b];
+		const uint32_t size = bucket_start[b + 1] - bucket_start[b];
+		displacements[b] = 0;
+		if (size == 0) {
+			continue;
+		} else if (size == 1) {
+			while (taken[free_cursor]) {
+				free_cursor++;
+			}
+			displacements[b] = (free_cursor + n - hashes[members[0]].f1) % n;
+			positions[members[0]] = free_cursor;
+			taken[free_cursor] = 1;
+			continue;
+		}
+
+		bool placed = false;
+		for (uint32_t displacement = 0; (displacement < MAX_DISPLACEMENT_TRIALS) && !placed; displacement++) {
+			uint32_t candidate[MAX_BUCKET_SIZE];
+			placed = true;
+			for (uint32_t j = 0; (j < size) && placed; j++) {
+				candidate[j] = slot_position(&hashes[members[j]], displacement, n);
+				if (taken[candidate[j]]) {
+					placed = false;
+				}
+				for (uint32_t l = 0; (l < j) && placed; l++) {
+					if (candidate[l] == candidate[j]) {
+						placed = false;
+					}
+				}
+			}
+			if (placed) {
+				displacements[b] = displacement;
+				for (uint32_t j = 0; j < size; j++) {
+					positions[members[j]] = candidate[j];
+					taken[candidate[j]] = 1;
+				}
+			}
+		}
+		if (!placed) {
+			goto out;
+		}
+	}
+	success = true;
+
+out:
+	free(bucket_start);
+	free(bucket_members);
+	free(bucket_order);
+	free(taken);
+	free(hashes);
+	return success;
+}
+
+static uint64_t align8(uint64_t value) {
+	return (value + 7) & ~7ULL;
+}
+
+/* Writes the compiled list to a temporary file first and renames it into
+ * place, so that a running ratched that reloads the list never sees a
+ * partially written file */
+bool domainlist_builder_write(struct domainlist_builder_t *builder, const char *filename) {
+	remove_duplicates(builder);
+	const uint32_t n = builder->count;
+	const uint32_t bucket_count = (n + ENTRIES_PER_BUCKET - 1) / ENTRIES_PER_BUCKET + 1;
+	uint32_t *displacements = calloc(bucket_count, sizeof(uint32_t));
+	uint32_t *positions = calloc(n ? n : 1, sizeof(uint32_t));
+	struct domainlist_slot_t *slots = calloc(n ? n : 1, sizeof(struct domainlist_slot_t));
+	if (!displacements || !positions || !slots) {
+		logmsg(LLVL_FATAL, "Failed to allocate compiled domain list for %u entries: %s", n, strerror(errno));
+		free(displacements);
+		free(positions);
+		free(slots);
+		return false;
+	}
+
+	uint64_t seed = 0;
+	bool success = (n == 0);
+	for (unsigned int attempt = 0; !success && (attempt < MAX_SEED_ATTEMPTS); attempt++) {
+		seed = mix64(0x5eed + attempt);
+		success = build_perfect_hash(builder, seed, bucket_count, displacements, positions);
+	}
+	if (!success) {
+		logmsg(LLVL_ERROR, "Could not construct a perfect hash function for %u domain list entries.", n);
+	}
+
+	/* Names are stored in slot order so that lookups touch few pages */
+	uint32_t *entry_at_slot = malloc((n ? n : 1) * sizeof(uint32_t));
+	uint64_t string_size = 0;
+	if (success && entry_at_slot) {
+		for (uint32_t i = 0; i < n; i++) {
+			entry_at_slot[positions[i]] = i;
+		}
+		for (uint32_t p = 0; p < n; p++) {
+			const struct domainlist_builder_entry_t *entry = &builder->entries[entry_at_slot[p]];
+			slots[p] = (struct domainlist_slot_t) {
+				.name_offset = string_size,
+				.name_length = entry->length,
+				.value = entry->value,
+				.flags = entry->flags,
+			};
+			string_size += entry->length;
+		}
+		if (string_size > UINT32_MAX) {
+			logmsg(LLVL_ERROR, "Domain list names take %lu bytes, more than the compiled format supports.", (unsigned long)string_size);
+			success = false;
+		}
+	} else if (success) {
+		logmsg(LLVL_FATAL, "Failed to allocate slot map: %s", strerror(errno));
+		success = false;
+	}
+
+	struct domainlist_header_t header = {
+		.magic = DOMAINLIST_MAGIC,
+		.header_size = sizeof(struct domainlist_header_t),
+		.entry_count = n,
+		.bucket_count = bucket_count,
+		.seed = seed,
+		.displacement_offset = sizeof(struct domainlist_header_t),
+	};
+	header.slot_offset = align8(header.displacement_offset + (uint64_t)bucket_count * sizeof(uint32_t));
+	header.string_offset = header.slot_offset + (uint64_t)n * sizeof(struct domainlist_slot_t);
+	header.string_size = string_size;
+	header.file_size = header.string_offset + string_size;
+
+	char tmp_filename[strlen(filename) + 8];
+	snprintf(tmp_filename, sizeof(tmp_filename), "%s.tmp", filename);
+	FILE *f = success ? fopen(tmp_filename, "w") : NULL;
+	if (success && !f) {
+		logmsg(LLVL_ERROR, "Cannot open %s for writing: %s", tmp_filename, strerror(errno));
+		success = false;
+	}
+	if (f) {
+		const uint8_t padding[8] = { 0 };
+		bool written = (fwrite(&header, sizeof(header), 1, f) == 1);
+		written = written && (fwrite(displacements, sizeof(uint32_t), bucket_count, f) == bucket_count);
+		const size_t padding_length = header.slot_offset - header.displacement_offset - (uint64_t)bucket_count * sizeof(uint32_t);
+		written = written && (fwrite(padding, 1, padding_length, f) == padding_length);
+		written = written && (fwrite(slots, sizeof(struct domainlist_slot_t), n, f) == n);
+		for (uint32_t p = 0; written && (p < n); p++) {
+			const struct domainlist_builder_entry_t *entry = &builder->entries[entry_at_slot[p]];
+			written = (fwrite(entry->name, 1, entry->length, f) == entry->length);
+		}
+		if (fclose(f) || !written) {
+			logmsg(LLVL_ERROR, "Failed to write compiled domain list %s: %s", tmp_filename, strerror(errno));
+			success = false;
+		} else if (rename(tmp_filename, filename)) {
+			logmsg(LLVL_ERROR, "Failed to rename %s to %s: %s", tmp_filename, filename, strerror(errno));
+			success = false;
+		}
+		if (!success) {
+			unlink(tmp_filename);
+		}
+	}
+
+	free(entry_at_slot);
+	free(displacements);
+	free(positions);
+	free(slots);
+	return success;
+}
+
+void domainlist_builder_free(struct domainlist_builder_t *builder) {
+	if (!builder) {
+		return;
+	}
+	for (unsigned int i = 0; i < builder->count; i++) {
+		free(builder->entries[i].name);
+	}
+	free(builder->entries);
+	free(builder);
+}
+
+static bool validate_header(const struct domainlist_header_t *header, size_t size) {
+	if (header->magic != DOMAINLIST_MAGIC) {
+		return false;
+	}
+	if ((header->header_size != sizeof(struct domainlist_header_t)) || (header->file_size != size) || (header->bucket_count == 0)) {
+		return false;
+	}
+	if ((header->displacement_offset < header->header_size) || (header->displacement_offset % sizeof(uint32_t)) || (header->slot_offset % sizeof(uint32_t))) {
+		return false;
+	}
+	if (header->displacement_offset + (uint64_t)header->bucket_count * sizeof(uint32_t) > header->slot_offset) {
+		return false;
+	}
+	if (header->slot_offset + (uint64_t)header->entry_count * sizeof(struct domainlist_slot_t) > header->string_offset) {
+		return false;
+	}
+	return header->string_offset + header->string_size == header->file_size;
+}
+
+/* Maps a compiled domain list read-only. The pages are shared with every
+ * other process that maps the same file and only those that lookups touch
+ * are ever read, so opening even huge lists is instant. */
+struct domainlist_t *domainlist_open(const char *filename) {
+	int fd = open(filename, O_RDONLY);
+	if (fd == -1) {
+		logmsg(LLVL_ERROR, "Cannot open domain list %s: %s", filename, strerror(errno));
+		return NULL;
+	}
+	struct stat statbuf;
+	if (fstat(fd, &statbuf)) {
+		logmsg(LLVL_ERROR, "Cannot stat domain list %s: %s", filename, strerror(errno));
+		close(fd);
+		return NULL;
+	}
+	if (statbuf.st_size < sizeof(struct domainlist_header_t)) {
+		logmsg(LLVL_ERROR, "Domain list %s is truncated.", filename);
+		close(fd);
+		return NULL;
+	}
+
+	void *mapping = mmap(NULL, statbuf.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (mapping == MAP_FAILED) {
+		logmsg(LLVL_ERROR, "Cannot map domain list %s: %s", filename, strerror(errno));
+		return NULL;
+	}
+	if (!validate_header((const struct domainlist_header_t*)mapping, statbuf.st_size)) {
+		logmsg(LLVL_ERROR, "%s is not a valid compiled domain list.", filename);
+		munmap(mapping, statbuf.st_size);
+		return NULL;
+	}
+	/* Lookups are random accesses, read-ahead would only waste page cache */
+	madvise(mapping, statbuf.st_size, MADV_RANDOM);
+
+	struct domainlist_t *list = calloc(1, sizeof(struct domainlist_t));
+	if (!list) {
+		logmsg(LLVL_FATAL, "Failed to allocate domain list: %s", strerror(errno));
+		munmap(mapping, statbuf.st_size);
+		return NULL;
+	}
+	list->mapping = mapping;
+	list->size = statbuf.st_size;
+	list->header = (const struct domainlist_header_t*)mapping;
+	list->displacements = (const uint32_t*)((const uint8_t*)mapping + list->header->displacement_offset);
+	list->slots = (const struct domainlist_slot_t*)((const uint8_t*)mapping + list->header->slot_offset);
+	list->strings = (const char*)mapping + list->header->string_offset;
+	return list;
+}
+
+unsigned int domainlist_entry_count(const struct domainlist_t *list) {
+	return list->header->entry_count;
+}
+
+static const struct domainlist_slot_t *find_slot(const struct domainlist_t *list, const char *name, unsigned int length) {
+	const struct domainlist_header_t *header = list->header;
+	const struct slot_hash_t slot_hash = split_hash(name_hash(header->seed, name, length), header->entry_count, header->bucket_count);
+	const struct domainlist_slot_t *slot = &list->slots[slot_position(&slot_hash, list->displacements[slot_hash.bucket], header->entry_count)];
+	if ((slot->name_length != length) || ((uint64_t)slot->name_offset + length > header->string_size)) {
+		return NULL;
+	}
+	return memcmp(list->strings + slot->name_offset, name, length) ? NULL : slot;
+}
+
+/* Looks up the host name itself and then every parent domain, of which only
+ * entries that include their subdomains match. That is at most one hash
+ * probe per label. */
+bool domainlist_lookup(const struct domainlist_t *list, const char *hostname, uint8_t *value) {
+	if (!list || (list->header->entry_count == 0)) {
+		return false;
+	}
+	char normalized[DOMAINLIST_MAX_NAME_LENGTH];
+	int length = normalize_name(hostname, strlen(hostname), normalized);
+	if (length == -1) {
+		return false;
+	}
+
+	const struct domainlist_slot_t *slot = find_slot(list, normalized, length);
+	for (int i = 0; !slot && (i < length); i++) {
+		if (normalized[i] == '.') {
+			slot = find_slot(list, normalized + i + 1, length - i - 1);
+			if (slot && !(slot->flags & DOMAINLIST_SUBDOMAINS)) {
+				slot = NULL;
+			}
+		}
+	}
+	if (slot) {
+		*value = slot->value;
+	}
+	return slot != NULL;
+}
+
+void domainlist_close(struct domainlist_t *list) {
+	if (!list) {
+		return;
+	}
+	munmap(list->mapping, list->size);
+	free(list);
+}
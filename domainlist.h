@@ -0,0 +1,102 @@
+/**
+ *	ratched - TLS connection router that performs a man-in-the-middle attack
+ *	Copyright (C) 2017-2017 Johannes Bauer
+ *
+ *	This file is part of ratched.
+ *
+ *	ratched is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; this program is ONLY licensed under
+ *	version 3 of the License, later versions are explicitly excluded.
+ *
+ *	ratched is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with ratched; if not, write to the Free Software
+ *	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *	Johannes Bauer <JohannesBauer@gmx.de>
+**/
+
+
+#ifndef __DOMAINLIST_H__
+#define __DOMAINLIST_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define DOMAINLIST_MAGIC				0x314c4452		/* "RDL1" */
+#define DOMAINLIST_MAX_NAME_LENGTH		253
+
+enum domainlist_flag_t {
+	/* Entry also matches all subdomains of its name */
+	DOMAINLIST_SUBDOMAINS = (1 << 0),
+};
+
+/* On-disk layout of a compiled domain list, in host byte order. The file is
+ * mapped read-only and used in place: a header, one 32-bit displacement per
+ * hash bucket, one slot per entry (the minimal perfect hash maps every
+ * listed name to exactly one slot) and the names the slots refer to, which
+ * are compared on lookup since unlisted names map to arbitrary slots. */
+struct domainlist_header_t {
+	uint32_t magic;
+	uint32_t header_size;
+	uint32_t entry_count;
+	uint32_t bucket_count;
+	uint64_t seed;
+	uint64_t displacement_offset;
+	uint64_t slot_offset;
+	uint64_t string_offset;
+	uint64_t string_size;
+	uint64_t file_size;
+};
+
+struct domainlist_slot_t {
+	uint32_t name_offset;
+	uint8_t name_length;
+	uint8_t value;
+	uint8_t flags;
+	uint8_t reserved;
+};
+
+struct domainlist_t {
+	void *mapping;
+	size_t size;
+	const struct domainlist_header_t *header;
+	const uint32_t *displacements;
+	const struct domainlist_slot_t *slots;
+	const char *strings;
+};
+
+struct domainlist_builder_entry_t {
+	char *name;
+	uint8_t length;
+	uint8_t value;
+	uint8_t flags;
+	unsigned int index;
+	uint64_t hash;
+};
+
+struct domainlist_builder_t {
+	unsigned int count;
+	unsigned int alloced;
+	struct domainlist_builder_entry_t *entries;
+};
+
+/*************** AUTO GENERATED SECTION FOLLOWS ***************/
+struct domainlist_builder_t *domainlist_builder_new(void);
+bool domainlist_builder_add(struct domainlist_builder_t *builder, const char *pattern, uint8_t value);
+bool domainlist_builder_add_file(struct domainlist_builder_t *builder, const char *filename, uint8_t value);
+bool domainlist_builder_write(struct domainlist_builder_t *builder, const char *filename);
+void domainlist_builder_free(struct domainlist_builder_t *builder);
+struct domainlist_t *domainlist_open(const char *filename);
+unsigned int domainlist_entry_count(const struct domainlist_t *list);
+bool domainlist_lookup(const struct domainlist_t *list, const char *hostname, uint8_t *value);
+void domainlist_close(struct domainlist_t *list);
+/***************  AUTO GENERATED SECTION ENDS   ***************/
+
+#endif
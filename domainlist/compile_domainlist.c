@@ -0,0 +1,135 @@
+/**
+ *	ratched - TLS connection router that performs a man-in-the-middle attack
+ *	Copyright (C) 2017-2017 Johannes Bauer
+ *
+ *	This file is part of ratched.
+ *
+ *	ratched is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; this program is ONLY licensed under
+ *	version 3 of the License, later versions are explicitly excluded.
+ *
+ *	ratched is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with ratched; if not, write to the Free Software
+ *	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *	Johannes Bauer <JohannesBauer@gmx.de>
+**/
+
+
+/* Offline compiler for domain lists that ratched maps via --domain-list:
+ *
+ *   compile_domainlist -o lists.rdl -m reject ads.txt trackers.txt -m forward banks.txt
+ *
+ * Every source file is read with the interception mode given by the last -m
+ * before it (reject by default). Names prefixed with "." or "*." also match
+ * all of their subdomains; hosts file lines ("0.0.0.0 name") are understood.
+ * If a name is listed more than once, its first occurrence wins. The output
+ * is replaced atomically, so a running ratched picks it up on its next
+ * reload check. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <domainlist.h>
+#include <intercept_config.h>
+#include <keyvaluelist.h>
+#include <logging.h>
+
+static bool verbose;
+
+bool loglevel_at_least(enum loglvl_t lvl) {
+	return verbose || (lvl <= LLVL_WARN);
+}
+
+void logmsg_src(enum loglvl_t lvl, const char *src_file, unsigned int src_lineno, const char *msg, ...) {
+	if (!loglevel_at_least(lvl)) {
+		return;
+	}
+	va_list ap;
+	va_start(ap, msg);
+	vfprintf(stderr, msg, ap);
+	va_end(ap);
+	fprintf(stderr, "\n");
+}
+
+static const struct lookup_entry_t mode_names[] = {
+	{ "opportunistic",	OPPORTUNISTIC_TLS_INTERCEPTION },
+	{ "mandatory",		MANDATORY_TLS_INTERCEPTION },
+	{ "forward",		TRAFFIC_FORWARDING },
+	{ "reject",			REJECT_CONNECTION },
+	{ 0 }
+};
+
+static int parse_mode(const char *name) {
+	for (const struct lookup_entry_t *entry = mode_names; entry->key; entry++) {
+		if (!strcmp(entry->key, name)) {
+			return entry->value;
+		}
+	}
+	return -1;
+}
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + (ts.tv_nsec * 1e-9);
+}
+
+static void usage(const char *pgmname) {
+	fprintf(stderr, "%s [-v] -o output [-m mode] source [source ...] [-m mode source ...]\n", pgmname);
+	fprintf(stderr, "Compiles host name lists into a domain list for ratched's --domain-list option.\n");
+	fprintf(stderr, "Valid modes: opportunistic, mandatory, forward, reject (default).\n");
+}
+
+int main(int argc, char **argv) {
+	const char *output = NULL;
+	int mode = REJECT_CONNECTION;
+	unsigned int source_count = 0;
+	const double t0 = now();
+
+	struct domainlist_builder_t *builder = domainlist_builder_new();
+	if (!builder) {
+		return EXIT_FAILURE;
+	}
+	bool success = true;
+	for (int i = 1; success && (i < argc); i++) {
+		if (!strcmp(argv[i], "-v")) {
+			verbose = true;
+		} else if (!strcmp(argv[i], "-o") && (i + 1 < argc)) {
+			output = argv[++i];
+		} else if (!strcmp(argv[i], "-m") && (i + 1 < argc)) {
+			mode = parse_mode(argv[++i]);
+			if (mode == -1) {
+				fprintf(stderr, "Invalid mode: %s\n", argv[i]);
+				success = false;
+			}
+		} else if (argv[i][0] == '-') {
+			usage(argv[0]);
+			success = false;
+		} else {
+			success = domainlist_builder_add_file(builder, argv[i], mode);
+			source_count++;
+		}
+	}
+	if (success && (!output || !source_count)) {
+		usage(argv[0]);
+		success = false;
+	}
+	if (success) {
+		const double t1 = now();
+		success = domainlist_builder_write(builder, output);
+		if (success) {
+			fprintf(stderr, "%s: %u host names, read in %.2f secs, compiled in %.2f secs.\n", output, builder->count, t1 - t0, now() - t1);
+		}
+	}
+	domainlist_builder_free(builder);
+	return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -39,12 +39,32 @@ parser.add_argument("--logfile", metavar = "file", help = "Instead of logging to
 parser.add_argument("--flush-logs", action = "store_true", help = "Flush logfile after each call to logmsg(). Decreases performance, but gives line-buffered logs.")
 parser.add_argument("--crl-uri", metavar = "uri", help = "Encode the given URI into the CRL Distribution Point X.509 extension of server certificates.")
 parser.add_argument("--ocsp-uri", metavar = "uri", help = "Encode the given URI into the Authority Info Access X.509 extension of server certificates as the OCSP responder URI.")
+parser.add_argument("--tcp-defer-accept", metavar = "secs", type = int, default = 0, help = "Set TCP_DEFER_ACCEPT on the listening socket so that connections are only handed to ratched once the client has sent data (usually the ClientHello), waiting for at most the given number of seconds. This saves a wakeup per connection, but delays protocols in which the server speaks first. Disabled by default.")
+parser.add_argument("--max-connections", metavar = "count", type = int, default = 4096, help = "Maximum number of connections that are handled at the same time. State for all of them is preallocated in a connection table at startup; connections that are accepted while the table is full are closed immediately. Defaults to %(default)d.")
+parser.add_argument("--handshake-timeout", metavar = "secs", type = float, default = 30.0, help = "Time in seconds (as a floating point number) after which a connection that has not started forwarding data yet, i.e., that is still waiting for the ClientHello, for the outgoing connection or in one of the TLS handshakes, is forcibly closed. Zero disables the timeout. Defaults to %(default).0f secs.")
+parser.add_argument("--max-hostnames", metavar = "count", type = int, default = 65536, help = "Maximum number of distinct host names (as requested by clients through the Server Name Indication) that are remembered for the lifetime of the process. Per-host caches, such as the one for forged certificates, are keyed off these; once the limit is reached, connections to further host names are still handled, but their certificates are forged anew for every connection. Defaults to %(default)d.")
+parser.add_argument("--cert-cache-size", metavar = "MiB", type = int, default = 64, help = "Amount of memory in MiB that the cache of forged server certificates may use. Certificates are held in their compact DER encoding and the least recently used ones are evicted once this budget is exceeded. Defaults to %(default)d MiB.")
+parser.add_argument("--cert-maintenance-interval", metavar = "secs", type = int, default = 600, help = "Interval in seconds in which a background task renews cached forged certificates that are about to expire, checks whether the root certificate needs to be rolled over and updates certificate age statistics. Zero disables the background task. Defaults to %(default)d secs.")
+parser.add_argument("--root-transition-days", metavar = "days", type = int, default = 90, help = "When the root certificate has less than this many days of validity left, a successor with identical key and subject is issued and stored as root.crt (the old one is kept as root-previous.crt). Both are valid during the transition window, so clients can be migrated to the new root before the old one expires. Defaults to %(default)d days.")
+parser.add_argument("--deterministic-certs", action = "store_true", help = "Forge server certificates deterministically: their validity starts at the beginning of the current week and their serial number is derived from a hash keyed with the CA key over host name, address and validity. Multiple ratched instances that share their configuration directory (i.e., the same CA and server keys) thus create identical certificates for identical hosts without coordination, as long as the CA signs deterministically (RSA or EdDSA keys, but not ECDSA).")
+parser.add_argument("--stats-interval", metavar = "secs", type = int, default = 0, help = "Periodically log all internal statistics counters at the given interval in seconds. By default, statistics are only logged at shutdown.")
 parser.add_argument("--write-memdumps-into-files", action = "store_true", help = "When dumping a piece of memory in the log, also output its binary equivalent into a file called hexdump_####.bin, where #### is an ascending number. Useful for debugging of internal data structures.")
 parser.add_argument("--use-ipv6-encapsulation", action = "store_true", help = "For writing the PCAPNG file format, usually IPv4 is emulated. This has the drawback that when one IPv4 endpoint serves multiple servers via the TLS Server Name Indication extension, they cannot be differentiated by their hostname. With this parameter, ratched wraps the packets in IPv4-in-IPv6 emulation and assigns different IPv6 addresses for different server names, thus enabling accurate name resolution.")
 parser.add_argument("-l", "--listen", metavar = "hostname:port", default = "127.0.0.1:9999", help = "Specify the address and port that ratched is listening on. Defaults to %(default)s.")
 parser.add_argument("-d", "--defaults", metavar = "key=value[,key=value,...]", type = str, help = "Specify the server and client connection parameters for all hosts that are not explicitly listed via a --intercept option. Arguments are given in a key=value fashion; valid arguments are shown below.")
 parser.add_argument("-i", "--intercept", metavar = "hostname[,key=value,...]", help = "Intercept only a specific host name, as indicated by the Server Name Indication inside the ClientHello. Can be specified multiple times to include interception or more than one host. Additional arguments can be specified in a key=value fashion to further define interception parameters for that particular host.")
+parser.add_argument("--intercept-file", metavar = "filename", help = "Read additional interception rules from the given file. Each non-empty line that does not start with '#' is treated exactly like the argument of an --intercept option, i.e., it contains a hostname followed by optional key=value arguments, separated by commas. Can be specified multiple times.")
+parser.add_argument("--domain-list", metavar = "filename", help = "Decide the interception mode of host names that are not explicitly configured via --intercept by looking them up in the given compiled domain list. Such lists may contain millions of names (e.g., blocklists whose hosts are rejected or allowlists whose hosts are only forwarded) and are created offline by domainlist/compile_domainlist. The file is mapped into memory instead of being loaded, so that startup is instant, its pages are shared by all processes that use it and every lookup is a constant number of hash probes per label of the host name.")
+parser.add_argument("--domain-list-reload", metavar = "secs", type = int, default = 10, help = "Interval in seconds in which the domain list file is checked for having been replaced. A replaced list is mapped and swapped in while connections continue to be served; decisions made with the previous list are discarded. Zero disables the check. Defaults to %(default)d secs.")
+parser.add_argument("--upstream-verify", metavar = "mode", choices = [ "report", "enforce" ], help = "Verify the certificate chain that each upstream server presents against a trust store and the host name the client requested (or, if the client sent no Server Name Indication, the address that was connected to). In 'report' mode, the outcome is logged and annotated in the PCAPNG file; in 'enforce' mode, connections to servers that fail verification are additionally closed before any data is forwarded. The outcome is cached per chain and name, see --upstream-verify-ttl. Verification is disabled by default.")
+parser.add_argument("--upstream-ca", metavar = "path", help = "File or directory (in OpenSSL hashed format) with the trusted root certificates that upstream chains are verified against. Defaults to the trust store that OpenSSL was configured with.")
+parser.add_argument("--upstream-verify-ttl", metavar = "secs", type = int, default = 300, help = "Time in seconds for which the outcome of verifying a particular upstream certificate chain is reused for later connections. Successful verifications are never cached beyond the point at which the first certificate of the chain expires. Defaults to %(default)d secs.")
+parser.add_argument("--overload-control", metavar = "key=value[,key=value,...]", help = "Shed load in stages when ratched cannot keep up instead of letting handshake latency grow until all clients time out. Targets are given as accept=count (connections waiting in the listen queue), cryptowait=msecs (mean time that verification jobs wait for a crypto worker) and handshake=msecs (99th percentile of the time from accepting a connection until data is forwarded); targets that are not given are not considered. Every interval=msecs (default 1000), the worst ratio of measured value to target is determined. Whenever it exceeds 1, the next stage is engaged: first, hosts in opportunistic mode are forwarded without interception; then, connections to hosts that are not explicitly configured via --intercept, --intercept-file or --domain-list are rejected; finally, all new connections are closed right after being accepted. A stage is only left again once the ratio stayed below 0.75 for recover=count consecutive intervals (default 5).")
 parser.add_argument("--pcap-comment", metavar = "comment", help = "Store a particular piece of information inside the PCAPNG header as a comment.")
+parser.add_argument("--http-sidecar", metavar = "filename", help = "Frame HTTP/1.x requests and responses found inside intercepted TLS connections and write one JSON record per message into the given file. Records contain the request or response line, headers and the stream offsets of header and body, which refer back into the synthetic TCP stream of the PCAPNG file. Records are dropped rather than ever delaying forwarded traffic.")
+parser.add_argument("--chunk-store", metavar = "directory", help = "Deduplicate captured payload. Data of each connection is split into content-defined chunks which are stored once, addressed by their SHA-256 hash, inside the given directory. Chunks that are already present in the store are written to the PCAPNG file as truncated packets which only carry a reference to the chunk. Use chunkstore/rehydrate.py together with the same directory to turn such a capture back into a regular PCAPNG file.")
+parser.add_argument("--plugin", metavar = "filename[,argument]", help = "Load a plugin from the given shared object. Plugins are called when an intercepted TLS connection starts and ends and for every chunk of plaintext relayed in either direction, which they may inspect, modify in place, hold back, replace or answer themselves by injecting data; see ratched_plugin.h for the interface. Everything following the first comma is passed to the plugin's initialization function. Can be specified multiple times, in which case chunks pass through the plugins in the given order.")
+parser.add_argument("--scan-patterns", metavar = "filename", help = "Scan all relayed data, i.e., plaintext of intercepted TLS connections after plugins processed it as well as plainly forwarded connections, for the literal byte patterns listed in the given file. Each non-empty line that does not start with '#' contains a pattern name, colon-separated flags and the pattern itself (the rest of the line, in which a backslash followed by s, t, r, n, another backslash or xNN with two hex digits denotes a space, tab, carriage return, line feed, backslash or arbitrary byte), separated by whitespace. With the 'report' flag, a match is logged and annotated as a packet comment in the PCAPNG file; with 'terminate', the chunk that completes the match is not forwarded and the connection is closed. All patterns are matched in a single pass, so the cost per byte does not grow with their number.")
 parser.add_argument("-o", "--outfile", metavar = "filename", type = str, help = "Specifies the PCAPNG file that the intercepted traffic is written to. Mandatory argument.")
 parser.add_argument("-v", "--verbose", action = "store_true", help = "Increase logging verbosity.")
 
@@ -84,8 +104,12 @@ help_page += """
 The arguments which are valid for the --intercept argument are as follows:
 """
 help_page += format_arg_option("intercept=[opportunistic|mandatory|forward|reject]", "Specifies the mode that ratched should act in for this particular connection. Opportunistic TLS interception is the default; it means that TLS interception is tried first. Should it fail, however (because someone tries to send non-TLS traffic), it falls back to 'forward' mode (i.e., forwarding all data unmodified). Mandatory TLS interception means that if no TLS interception is possible, the connection is terminated. 'forward', as explained, simply forwards everything unmodified. 'reject' closes the connection altogether, regardless of the type of seen traffic.")
+help_page += format_arg_option("tcpfastopen=bool", "When forwarding traffic unmodified, send the data that the client initially sent to the server together with the connection request using TCP Fast Open. Saves one round trip when the kernel holds a Fast Open cookie for the server (requires bit 1 of the net.ipv4.tcp_fastopen sysctl) and silently falls back to a regular connection otherwise. Defaults to off.")
+help_page += format_arg_option("capture=[intercepted|all|none]", "Specifies which connections are written to the PCAPNG file. By default, only TLS-intercepted connections are captured. 'all' additionally captures connections that are forwarded unmodified (non-TLS traffic or hosts that are not intercepted), so that the capture shows everything that went through ratched. 'none' does not capture the connection at all.")
+help_page += format_arg_option("cipherpolicy=[static|cheapest]", "Specifies how the cipher suites, key agreement groups and signature algorithms of both TLS connections are chosen. 'static' (the default) uses the library defaults or whatever is given via the s_/c_ ciphers, groups and sigalgs options. 'cheapest' measures once at startup how much CPU time the available AEAD ciphers and key agreement groups cost on this machine and prefers the cheapest ones on both legs; the ratched server side enforces its own order, but still picks ChaCha20-Poly1305 for clients that prefer it (typically those without AES hardware support). Explicitly given cipher, group or sigalg strings take precedence.")
 help_page += format_arg_option("s_tlsversions=versions", "Colon-separated string that specifies the acceptable TLS version for the ratched server component. Valid elements are ssl2, ssl3, tls10, tls11, tls12, tls13. Defaults to tls10:tls11:tls12.")
 help_page += format_arg_option("s_reqclientcert=bool", "Ask all connecting clients to the server side of the TLS proxy for a client certificate. If not replacement certificate (at least certfile and keyfile) is given, forge all metadata of the incoming certificate. If a certfile/keyfile is given, this option is implied.")
+help_page += format_arg_option("s_mirrorcert=bool", "Instead of forging a minimal server certificate that only contains the host name, mirror the certificate of the actual server: subject, subject alternative names, key usage, extended key usage, validity and policy extensions are copied from it, while key, issuer and serial number are ratched's. Since the upstream certificate needs to be known for this, the connection to the server is made before the client handshake the first time a host is seen. Mirrored certificates are cached by the fingerprint of the upstream certificate and the most recent one is presented right away on later connections to the same host, which are then handled in the usual order; if the server's certificate changed meanwhile, the next connection sees the updated mirror. Not combinable with forged client certificates on the first connection to a host. Defaults to off.")
 help_page += format_arg_option("s_certfile=filename", "Specifies an X.509 certificate in PEM format that should be used by ratched as the server certificate. By default, this certificate is automatically generated. Must be used in conjunction with s_keyfile.")
 help_page += format_arg_option("s_keyfile=filename", "Specifies the private key for the given server certificate, in PEM format.")
 help_page += format_arg_option("s_chainfile=filename", "Specifies the X.509 certificate chain that is to be sent to the client, in PEM format.")
@@ -94,6 +118,13 @@ help_page += format_arg_option("s_cakey=filename", "The X.509 CA certificate key
 help_page += format_arg_option("s_ciphers=ciphers", "The cipher suite string that the ratched TLS server uses.")
 help_page += format_arg_option("s_groups=groups", "The key agreement 'supported groups' string (formerly known as 'elliptic curves') that the ratched TLS server uses.")
 help_page += format_arg_option("s_sigalgs=algs", "The key agreement 'signature algorithms' string which the ratched TLS server uses.")
+help_page += format_arg_option("s_congestion=algorithm", "TCP congestion control algorithm (e.g., cubic or bbr) of the connection that the client made to ratched. The algorithm needs to be available in the kernel. Defaults to the system default.")
+help_page += format_arg_option("s_rcvbuf=bytes", "Receive buffer size (SO_RCVBUF) of the connection that the client made to ratched. Defaults to kernel auto-tuning.")
+help_page += format_arg_option("s_sndbuf=bytes", "Send buffer size (SO_SNDBUF) of the connection that the client made to ratched. Defaults to kernel auto-tuning.")
+help_page += format_arg_option("s_notsentlowat=bytes", "Limit for unsent data queued in the kernel (TCP_NOTSENT_LOWAT) on the connection that the client made to ratched. Defaults to the system default.")
+help_page += format_arg_option("s_usertimeout=msecs", "Time that transmitted data may remain unacknowledged before the connection that the client made to ratched is closed (TCP_USER_TIMEOUT). Defaults to the system default.")
+help_page += format_arg_option("s_keepalive=secs", "Enable TCP keepalive on the connection that the client made to ratched, with the first probe after the given idle time. Disabled by default.")
+help_page += format_arg_option("s_keepintvl=secs", "Interval between TCP keepalive probes on the connection that the client made to ratched once it has been idle for the keepalive time. Defaults to 10 seconds or the keepalive idle time, whichever is shorter.")
 help_page += format_arg_option("c_tlsversions=versions", "Colon-separated string that specifies the acceptable TLS version for the ratched client component. Valid elements are ssl2, ssl3, tls10, tls11, tls12, tls13. Defaults to tls10:tls11:tls12.")
 help_page += format_arg_option("c_certfile=filename", "Specifies an X.509 certificate in PEM format that should be used by ratched as a client certificate. It will only be used when the connecting client also provided a client certificate. Must be used in conjunction with c_keyfile.")
 help_page += format_arg_option("c_keyfile=filename", "The private key for the given client certificate, in PEM format.")
@@ -102,6 +133,14 @@ help_page += format_arg_option("c_ciphers=ciphers", "The cipher suite string tha
 help_page += format_arg_option("c_groups=groups", "The key agreement 'supported groups' string (formerly known as 'elliptic curves') that the ratched TLS client uses.")
 help_page += format_arg_option("c_sigalgs=algs", "The key agreement 'signature algorithms' string which the ratched TLS client uses.")
 
+help_page += format_arg_option("c_congestion=algorithm", "TCP congestion control algorithm of the connection that ratched makes to the server. Set before connecting.")
+help_page += format_arg_option("c_rcvbuf=bytes", "Receive buffer size of the connection that ratched makes to the server. Set before connecting so that the window scale fits the buffer.")
+help_page += format_arg_option("c_sndbuf=bytes", "Send buffer size of the connection that ratched makes to the server.")
+help_page += format_arg_option("c_notsentlowat=bytes", "Limit for unsent data queued in the kernel on the connection that ratched makes to the server.")
+help_page += format_arg_option("c_usertimeout=msecs", "TCP user timeout of the connection that ratched makes to the server.")
+help_page += format_arg_option("c_keepalive=secs", "Enable TCP keepalive on the connection that ratched makes to the server.")
+help_page += format_arg_option("c_keepintvl=secs", "Interval between TCP keepalive probes on the connection that ratched makes to the server.")
+
 help_page += """
 examples:
 """
@@ -21,65 +21,246 @@
  *	Johannes Bauer <JohannesBauer@gmx.de>
 **/
 
+
+#include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
 #include <errno.h>
+#include <pthread.h>
 #include "logging.h"
 #include "hostname_ids.h"
-#include "map.h"
-
-static struct map_t *ip_to_hostnames;
-/* ip_to_hostnames = {
- * 		0x11223344: {
- * 			"foobar":	1,
- * 			"barfoo":	2,
- * 			"mookoo":	3,
- * 		},
- * 		0x22334455: {
- * 			"moo.com":	1,
- * 			"bar.de":	2,
- * 		},
- * }
- */
-
-unsigned int resolve_hostname_id(uint32_t ipv4_nbo, const char *hostname) {
-	if (!hostname) {
-		return 0;
+#include "lockstat.h"
+#include "stats.h"
+
+/* Interning table for host names. Every distinct host name is stored exactly
+ * once, receives a stable, dense ID (starting at 1) and is never modified or
+ * freed until deinit_hostname_ids() is called. This means that pointers to
+ * interned host names may be shared freely between threads and that all
+ * per-host caches can be keyed off the integer ID. The table is split into
+ * shards, each of which is protected by its own lock.
+ *
+ * Since host names come straight from client hellos, the number of interned
+ * names is capped. Beyond that, intern_hostname() hands out private copies
+ * with ID 0 that are not cached anywhere and that the caller has to give back
+ * through release_hostname(). */
+#define HOSTNAME_SHARD_COUNT			64
+#define HOSTNAME_INITIAL_BUCKET_COUNT	64
+
+struct hostname_shard_t {
+	struct lockstat_mutex_t lock;
+	unsigned int bucket_count;
+	unsigned int element_count;
+	struct hostname_t **buckets;
+};
+
+static struct hostname_shard_t shards[HOSTNAME_SHARD_COUNT];
+static struct {
+	struct lockstat_mutex_t lock;
+	unsigned int count;
+	unsigned int alloced;
+	unsigned int max_count;
+	bool full_reported;
+	const struct hostname_t **hostnames;
+	struct stats_counter_t *uninterned;
+} hostnames_by_id = {
+	.lock = LOCKSTAT_MUTEX_INITIALIZER("hostname_ids"),
+};
+
+static uint32_t hash_hostname(const char *hostname, unsigned int length) {
+	/* FNV-1a */
+	uint32_t hash = 0x811c9dc5;
+	for (unsigned int i = 0; i < length; i++) {
+		hash ^= (uint8_t)hostname[i];
+		hash *= 0x01000193;
 	}
+	return hash;
+}
 
-	struct map_t *map = map_get(ip_to_hostnames, &ipv4_nbo, sizeof(uint32_t));
-	if (!map) {
-		/* No entry for that IP address so far */
-		map = map_new();
-		if (!map) {
-			logmsg(LLVL_FATAL, "Unable to create inner map for hostname entry for \"%s\", returning 0.", hostname);
-			return 0;
+static struct hostname_t *shard_lookup(const struct hostname_shard_t *shard, const char *hostname, unsigned int length, uint32_t hash) {
+	struct hostname_t *entry = shard->buckets[hash % shard->bucket_count];
+	while (entry) {
+		if ((entry->hash == hash) && (entry->length == length) && !memcmp(entry->name, hostname, length)) {
+			return entry;
 		}
-		if (!map_set_ptr(ip_to_hostnames, &ipv4_nbo, sizeof(uint32_t), map)) {
-			logmsg(LLVL_FATAL, "Unable to register inner map for hostname entry for \"%s\", returning 0.", hostname);
-			map_free(map);
-			return 0;
+		entry = entry->next;
+	}
+	return NULL;
+}
+
+static void shard_grow(struct hostname_shard_t *shard) {
+	unsigned int new_bucket_count = shard->bucket_count * 2;
+	struct hostname_t **new_buckets = calloc(new_bucket_count, sizeof(struct hostname_t*));
+	if (!new_buckets) {
+		/* Not fatal, the chains just get longer. */
+		logmsg(LLVL_WARN, "Unable to grow hostname shard to %u buckets: %s", new_bucket_count, strerror(errno));
+		return;
+	}
+	for (unsigned int i = 0; i < shard->bucket_count; i++) {
+		struct hostname_t *entry = shard->buckets[i];
+		while (entry) {
+			struct hostname_t *next = entry->next;
+			unsigned int new_index = entry->hash % new_bucket_count;
+			entry->next = new_buckets[new_index];
+			new_buckets[new_index] = entry;
+			entry = next;
 		}
 	}
+	free(shard->buckets);
+	shard->buckets = new_buckets;
+	shard->bucket_count = new_bucket_count;
+}
 
-	int hostname_id = strmap_get_int(map, hostname);
-	if (hostname_id == -1) {
-		hostname_id = map->element_count + 1;
-		strmap_set_int(map, hostname, hostname_id);
+static struct hostname_t *new_hostname(const char *hostname, unsigned int length, uint32_t hash) {
+	struct hostname_t *entry = malloc(sizeof(struct hostname_t) + length + 1);
+	if (!entry) {
+		logmsg(LLVL_FATAL, "Unable to allocate %u bytes for hostname: %s", length + 1, strerror(errno));
+		return NULL;
 	}
+	entry->id = 0;
+	entry->hash = hash;
+	entry->length = length;
+	entry->next = NULL;
+	memcpy(entry->name, hostname, length);
+	entry->name[length] = 0;
+	return entry;
+}
+
+enum register_result_t {
+	REGISTERED,
+	TABLE_FULL,
+	REGISTER_FAILED,
+};
 
-	return hostname_id;
+static enum register_result_t register_hostname_id(struct hostname_t *entry) {
+	enum register_result_t result = REGISTERED;
+	lockstat_lock(&hostnames_by_id.lock);
+	if (hostnames_by_id.count >= hostnames_by_id.max_count) {
+		if (!hostnames_by_id.full_reported) {
+			logmsg(LLVL_WARN, "Hostname table is full (%u entries), further host names are not interned.", hostnames_by_id.max_count);
+			hostnames_by_id.full_reported = true;
+		}
+		result = TABLE_FULL;
+	} else if (hostnames_by_id.count + 1 >= hostnames_by_id.alloced) {
+		unsigned int new_alloced = hostnames_by_id.alloced ? (hostnames_by_id.alloced * 2) : 1024;
+		const struct hostname_t **new_hostnames = realloc(hostnames_by_id.hostnames, new_alloced * sizeof(struct hostname_t*));
+		if (new_hostnames) {
+			hostnames_by_id.hostnames = new_hostnames;
+			hostnames_by_id.alloced = new_alloced;
+		} else {
+			logmsg(LLVL_FATAL, "Unable to grow hostname ID table to %u entries: %s", new_alloced, strerror(errno));
+			result = REGISTER_FAILED;
+		}
+	}
+	if (result == REGISTERED) {
+		hostnames_by_id.count++;
+		entry->id = hostnames_by_id.count;
+		hostnames_by_id.hostnames[entry->id] = entry;
+	}
+	lockstat_unlock(&hostnames_by_id.lock);
+	return result;
 }
 
-void init_hostname_ids(void) {
-	ip_to_hostnames = map_new();
+/* Returns the interned host name or, if the table is full, a private copy
+ * with ID 0. Either way, the result has to be passed to release_hostname()
+ * once it is no longer needed. */
+const struct hostname_t *intern_hostname(const char *hostname, unsigned int length) {
+	if (!hostname) {
+		return NULL;
+	}
+
+	uint32_t hash = hash_hostname(hostname, length);
+	struct hostname_shard_t *shard = &shards[hash % HOSTNAME_SHARD_COUNT];
+
+	lockstat_lock(&shard->lock);
+	struct hostname_t *entry = shard_lookup(shard, hostname, length, hash);
+	if (!entry) {
+		entry = new_hostname(hostname, length, hash);
+		if (entry) {
+			enum register_result_t result = register_hostname_id(entry);
+			if (result == REGISTERED) {
+				unsigned int index = hash % shard->bucket_count;
+				entry->next = shard->buckets[index];
+				shard->buckets[index] = entry;
+				shard->element_count++;
+				if (shard->element_count > shard->bucket_count) {
+					shard_grow(shard);
+				}
+			} else if (result == TABLE_FULL) {
+				stats_inc(hostnames_by_id.uninterned);
+			} else {
+				free(entry);
+				entry = NULL;
+			}
+		}
+	}
+	lockstat_unlock(&shard->lock);
+	return entry;
 }
 
-static void free_inner_map(void *inner_map) {
-	map_free((struct map_t*)inner_map);
+void release_hostname(const struct hostname_t *hostname) {
+	if (hostname && !hostname->id) {
+		free((struct hostname_t*)hostname);
+	}
+}
+
+const struct hostname_t *intern_hostname_str(const char *hostname) {
+	return hostname ? intern_hostname(hostname, strlen(hostname)) : NULL;
+}
+
+const struct hostname_t *get_interned_hostname(unsigned int hostname_id) {
+	const struct hostname_t *result = NULL;
+	lockstat_lock(&hostnames_by_id.lock);
+	if ((hostname_id > 0) && (hostname_id <= hostnames_by_id.count)) {
+		result = hostnames_by_id.hostnames[hostname_id];
+	}
+	lockstat_unlock(&hostnames_by_id.lock);
+	return result;
+}
+
+unsigned int get_interned_hostname_count(void) {
+	lockstat_lock(&hostnames_by_id.lock);
+	unsigned int count = hostnames_by_id.count;
+	lockstat_unlock(&hostnames_by_id.lock);
+	return count;
+}
+
+bool init_hostname_ids(unsigned int max_hostnames) {
+	hostnames_by_id.max_count = max_hostnames;
+	hostnames_by_id.full_reported = false;
+	hostnames_by_id.uninterned = stats_counter("hostnames.uninterned");
+	for (unsigned int i = 0; i < HOSTNAME_SHARD_COUNT; i++) {
+		struct hostname_shard_t *shard = &shards[i];
+		lockstat_mutex_init(&shard->lock, "hostname_ids.shard");
+		shard->bucket_count = HOSTNAME_INITIAL_BUCKET_COUNT;
+		shard->element_count = 0;
+		shard->buckets = calloc(shard->bucket_count, sizeof(struct hostname_t*));
+		if (!shard->buckets) {
+			logmsg(LLVL_FATAL, "Unable to allocate hostname shard: %s", strerror(errno));
+			return false;
+		}
+	}
+	return true;
 }
 
 void deinit_hostname_ids(void) {
-	map_foreach_ptrvalue(ip_to_hostnames, free_inner_map);
-	map_free(ip_to_hostnames);
+	for (unsigned int i = 0; i < HOSTNAME_SHARD_COUNT; i++) {
+		struct hostname_shard_t *shard = &shards[i];
+		for (unsigned int j = 0; j < shard->bucket_count; j++) {
+			struct hostname_t *entry = shard->buckets[j];
+			while (entry) {
+				struct hostname_t *next = entry->next;
+				free(entry);
+				entry = next;
+			}
+		}
+		free(shard->buckets);
+		shard->buckets = NULL;
+		lockstat_mutex_destroy(&shard->lock);
+	}
+	lockstat_lock(&hostnames_by_id.lock);
+	free(hostnames_by_id.hostnames);
+	hostnames_by_id.hostnames = NULL;
+	hostnames_by_id.count = 0;
+	hostnames_by_id.alloced = 0;
+	lockstat_unlock(&hostnames_by_id.lock);
 }
@@ -21,14 +21,28 @@
  *	Johannes Bauer <JohannesBauer@gmx.de>
 **/
 
+
 #ifndef __HOSTNAME_IDS_H__
 #define __HOSTNAME_IDS_H__
 
 #include <stdint.h>
+#include <stdbool.h>
+
+struct hostname_t {
+	unsigned int id;
+	unsigned int length;
+	uint32_t hash;
+	struct hostname_t *next;
+	char name[];
+};
 
 /*************** AUTO GENERATED SECTION FOLLOWS ***************/
-unsigned int resolve_hostname_id(uint32_t ipv4_nbo, const char *hostname);
-void init_hostname_ids(void);
+const struct hostname_t *intern_hostname(const char *hostname, unsigned int length);
+void release_hostname(const struct hostname_t *hostname);
+const struct hostname_t *intern_hostname_str(const char *hostname);
+const struct hostname_t *get_interned_hostname(unsigned int hostname_id);
+unsigned int get_interned_hostname_count(void);
+bool init_hostname_ids(unsigned int max_hostnames);
 void deinit_hostname_ids(void);
 /***************  AUTO GENERATED SECTION ENDS   ***************/
 
@@ -0,0 +1,342 @@
+/**
+ *	ratched - TLS connection router that performs a man-in-the-middle attack
+ *	Copyright (C) 2017-2017 Johannes Bauer
+ *
+ *	This file is part of ratched.
+ *
+ *	ratched is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; this program is ONLY licensed under
+ *	version 3 of the License, later versions are explicitly excluded.
+ *
+ *	ratched is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with ratched; if not, write to the Free Software
+ *	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *	Johannes Bauer <JohannesBauer@gmx.de>
+**/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include "httpframe.h"
+
+static char *trim(char *string) {
+	while ((*string == ' ') || (*string == '\t')) {
+		string++;
+	}
+	int length = strlen(string);
+	while ((length > 0) && ((string[length - 1] == ' ') || (string[length - 1] == '\t') || (string[length - 1] == '\r'))) {
+		string[--length] = 0;
+	}
+	return string;
+}
+
+static char *next_token(char **saveptr) {
+	char *token = *saveptr;
+	if (!token) {
+		return NULL;
+	}
+	char *space = strchr(token, ' ');
+	if (space) {
+		*space = 0;
+		*saveptr = space + 1;
+	} else {
+		*saveptr = NULL;
+	}
+	return token;
+}
+
+static bool parse_start_line(struct http_framer_t *framer, char *line) {
+	struct http_message_t *message = &framer->message;
+	char *saveptr = line;
+	if (framer->is_request) {
+		message->method = next_token(&saveptr);
+		message->uri = next_token(&saveptr);
+		message->version = saveptr;
+		if (!message->method || !message->uri || !message->version) {
+			return false;
+		}
+		return !strncmp(message->version, "HTTP/1.", 7);
+	} else {
+		message->version = next_token(&saveptr);
+		const char *status = next_token(&saveptr);
+		message->reason = saveptr ? saveptr : "";
+		if (!message->version || !status || strncmp(message->version, "HTTP/1.", 7)) {
+			return false;
+		}
+		if ((strlen(status) != 3) || !isdigit(status[0]) || !isdigit(status[1]) || !isdigit(status[2])) {
+			return false;
+		}
+		message->status = atoi(status);
+		return true;
+	}
+}
+
+static const char *find_header(const struct http_message_t *message, const char *name) {
+	for (unsigned int i = 0; i < message->header_count; i++) {
+		if (!strcasecmp(message->headers[i].name, name)) {
+			return message->headers[i].value;
+		}
+	}
+	return NULL;
+}
+
+static bool is_chunked(const char *transfer_encoding) {
+	/* The final transfer coding determines the framing. */
+	const char *last = strrchr(transfer_encoding, ',');
+	last = last ? last + 1 : transfer_encoding;
+	while ((*last == ' ') || (*last == '\t')) {
+		last++;
+	}
+	return !strncasecmp(last, "chunked", 7) && ((last[7] == 0) || (last[7] == ';') || (last[7] == ' '));
+}
+
+static bool parse_header(struct http_framer_t *framer) {
+	struct http_message_t *message = &framer->message;
+	framer->header[framer->header_length] = 0;
+
+	char *saveptr = NULL;
+	char *line = strtok_r(framer->header, "\n", &saveptr);
+	if (!line || !parse_start_line(framer, trim(line))) {
+		return false;
+	}
+
+	while ((line = strtok_r(NULL, "\n", &saveptr)) != NULL) {
+		line = trim(line);
+		if (!*line) {
+			break;
+		}
+		char *colon = strchr(line, ':');
+		if (!colon || (colon == line)) {
+			return false;
+		}
+		if (message->header_count == HTTP_FRAMER_MAX_HEADERS) {
+			/* Excess headers are not reported, but framing continues. */
+			continue;
+		}
+		*colon = 0;
+		message->headers[message->header_count].name = trim(line);
+		message->headers[message->header_count].value = trim(colon + 1);
+		message->header_count++;
+	}
+	return true;
+}
+
+static void start_message(struct http_framer_t *framer) {
+	memset(&framer->message, 0, sizeof(framer->message));
+	framer->message.is_request = framer->is_request;
+	framer->message.offset = framer->offset;
+	framer->header_length = 0;
+	framer->line_length = 0;
+	framer->state = HTTP_FRAMER_HEADER;
+}
+
+static void complete_message(struct http_framer_t *framer) {
+	framer->message.wire_length = framer->offset - framer->message.offset;
+	if (framer->callbacks.complete) {
+		framer->callbacks.complete(&framer->message, framer->callbacks.argument);
+	}
+	start_message(framer);
+}
+
+static void header_complete(struct http_framer_t *framer) {
+	struct http_message_t *message = &framer->message;
+	message->header_length = framer->header_length;
+	message->body_offset = framer->offset;
+	if (!parse_header(framer)) {
+		framer->state = HTTP_FRAMER_FAILED;
+		return;
+	}
+
+	bool no_body = false;
+	if (framer->callbacks.header) {
+		no_body = framer->callbacks.header(message, framer->callbacks.argument);
+	}
+	if (!message->is_request && (((message->status >= 100) && (message->status < 200)) || (message->status == 204) || (message->status == 304))) {
+		no_body = true;
+	}
+	if (no_body) {
+		complete_message(framer);
+		return;
+	}
+
+	const char *transfer_encoding = find_header(message, "Transfer-Encoding");
+	const char *content_length = find_header(message, "Content-Length");
+	if (transfer_encoding && is_chunked(transfer_encoding)) {
+		message->chunked = true;
+		framer->line_length = 0;
+		framer->state = HTTP_FRAMER_CHUNK_SIZE;
+	} else if (content_length) {
+		char *end;
+		unsigned long long length = strtoull(content_length, &end, 10);
+		if ((end == content_length) || (*end != 0)) {
+			framer->state = HTTP_FRAMER_FAILED;
+			return;
+		}
+		if (length == 0) {
+			complete_message(framer);
+		} else {
+			framer->remaining = length;
+			framer->state = HTTP_FRAMER_BODY_LENGTH;
+		}
+	} else if (message->is_request) {
+		complete_message(framer);
+	} else {
+		framer->state = HTTP_FRAMER_BODY_UNTIL_CLOSE;
+	}
+}
+
+/* Accumulates a CRLF-terminated line; returns true once it is complete. */
+static bool line_byte(struct http_framer_t *framer, uint8_t byte) {
+	if (byte == '\n') {
+		if ((framer->line_length > 0) && (framer->line[framer->line_length - 1] == '\r')) {
+			framer->line_length--;
+		}
+		framer->line[framer->line_length] = 0;
+		return true;
+	}
+	if (framer->line_length == HTTP_FRAMER_MAX_LINE_LENGTH) {
+		framer->state = HTTP_FRAMER_FAILED;
+		return false;
+	}
+	framer->line[framer->line_length++] = byte;
+	return false;
+}
+
+static void chunk_size_line(struct http_framer_t *framer) {
+	char *end;
+	unsigned long long size = strtoull(framer->line, &end, 16);
+	framer->line_length = 0;
+	if ((end == framer->line) || ((*end != 0) && (*end != ';') && (*end != ' ') && (*end != '\t'))) {
+		framer->state = HTTP_FRAMER_FAILED;
+		return;
+	}
+	if (size == 0) {
+		framer->state = HTTP_FRAMER_TRAILER;
+	} else {
+		framer->remaining = size;
+		framer->state = HTTP_FRAMER_CHUNK_DATA;
+	}
+}
+
+static unsigned int feed_header(struct http_framer_t *framer, const uint8_t *data, unsigned int length) {
+	unsigned int consumed = 0;
+	while (consumed < length) {
+		uint8_t byte = data[consumed++];
+		framer->offset++;
+		if ((framer->header_length == 0) && ((byte == '\r') || (byte == '\n'))) {
+			/* Tolerate stray line breaks between messages. */
+			framer->message.offset = framer->offset;
+			continue;
+		}
+		if (framer->header_length == HTTP_FRAMER_MAX_HEADER_LENGTH) {
+			framer->state = HTTP_FRAMER_FAILED;
+			break;
+		}
+		framer->header[framer->header_length++] = byte;
+		if (byte == '\n') {
+			const char *end = framer->header + framer->header_length;
+			if (((framer->header_length >= 4) && !memcmp(end - 4, "\r\n\r\n", 4)) || ((framer->header_length >= 2) && !memcmp(end - 2, "\n\n", 2))) {
+				header_complete(framer);
+				break;
+			}
+		}
+	}
+	return consumed;
+}
+
+void http_framer_init(struct http_framer_t *framer, bool is_request, const struct http_framer_callbacks_t *callbacks) {
+	memset(framer, 0, sizeof(*framer));
+	framer->is_request = is_request;
+	if (callbacks) {
+		framer->callbacks = *callbacks;
+	}
+	start_message(framer);
+}
+
+void http_framer_feed(struct http_framer_t *framer, const uint8_t *data, unsigned int length) {
+	while (length > 0) {
+		unsigned int consumed = 0;
+		switch (framer->state) {
+			case HTTP_FRAMER_HEADER:
+				consumed = feed_header(framer, data, length);
+				break;
+
+			case HTTP_FRAMER_BODY_LENGTH:
+			case HTTP_FRAMER_CHUNK_DATA:
+				consumed = (framer->remaining < length) ? framer->remaining : length;
+				framer->remaining -= consumed;
+				framer->offset += consumed;
+				framer->message.body_length += consumed;
+				if (framer->remaining == 0) {
+					if (framer->state == HTTP_FRAMER_BODY_LENGTH) {
+						complete_message(framer);
+					} else {
+						framer->state = HTTP_FRAMER_CHUNK_DATA_END;
+					}
+				}
+				break;
+
+			case HTTP_FRAMER_CHUNK_SIZE:
+			case HTTP_FRAMER_CHUNK_DATA_END:
+			case HTTP_FRAMER_TRAILER:
+				consumed = 1;
+				framer->offset++;
+				if (line_byte(framer, data[0])) {
+					if (framer->state == HTTP_FRAMER_CHUNK_SIZE) {
+						chunk_size_line(framer);
+					} else if (framer->state == HTTP_FRAMER_CHUNK_DATA_END) {
+						framer->state = (framer->line_length == 0) ? HTTP_FRAMER_CHUNK_SIZE : HTTP_FRAMER_FAILED;
+					} else if (framer->line_length == 0) {
+						complete_message(framer);
+					} else {
+						framer->line_length = 0;
+					}
+				}
+				break;
+
+			case HTTP_FRAMER_BODY_UNTIL_CLOSE:
+				consumed = length;
+				framer->offset += length;
+				framer->message.body_length += length;
+				break;
+
+			case HTTP_FRAMER_FAILED:
+				framer->offset += length;
+				return;
+		}
+		data += consumed;
+		length -= consumed;
+	}
+}
+
+void http_framer_finish(struct http_framer_t *framer) {
+	switch (framer->state) {
+		case HTTP_FRAMER_BODY_UNTIL_CLOSE:
+			complete_message(framer);
+			break;
+
+		case HTTP_FRAMER_BODY_LENGTH:
+		case HTTP_FRAMER_CHUNK_SIZE:
+		case HTTP_FRAMER_CHUNK_DATA:
+		case HTTP_FRAMER_CHUNK_DATA_END:
+		case HTTP_FRAMER_TRAILER:
+			framer->message.truncated = true;
+			complete_message(framer);
+			break;
+
+		case HTTP_FRAMER_HEADER:
+		case HTTP_FRAMER_FAILED:
+			break;
+	}
+	framer->state = HTTP_FRAMER_FAILED;
+}
@@ -0,0 +1,102 @@
+/**
+ *	ratched - TLS connection router that performs a man-in-the-middle attack
+ *	Copyright (C) 2017-2017 Johannes Bauer
+ *
+ *	This file is part of ratched.
+ *
+ *	ratched is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; this program is ONLY licensed under
+ *	version 3 of the License, later versions are explicitly excluded.
+ *
+ *	ratched is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with ratched; if not, write to the Free Software
+ *	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *	Johannes Bauer <JohannesBauer@gmx.de>
+**/
+
+
+#ifndef __HTTPFRAME_H__
+#define __HTTPFRAME_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define HTTP_FRAMER_MAX_HEADER_LENGTH		(16 * 1024)
+#define HTTP_FRAMER_MAX_HEADERS				64
+#define HTTP_FRAMER_MAX_LINE_LENGTH			256
+
+enum http_framer_state_t {
+	HTTP_FRAMER_HEADER,
+	HTTP_FRAMER_BODY_LENGTH,
+	HTTP_FRAMER_CHUNK_SIZE,
+	HTTP_FRAMER_CHUNK_DATA,
+	HTTP_FRAMER_CHUNK_DATA_END,
+	HTTP_FRAMER_TRAILER,
+	HTTP_FRAMER_BODY_UNTIL_CLOSE,
+	HTTP_FRAMER_FAILED,
+};
+
+struct http_header_t {
+	const char *name;
+	const char *value;
+};
+
+/* A framed message. All strings point into the framer's header buffer and
+ * are only valid during the callback. Offsets count bytes of the stream that
+ * was fed into the framer, starting at zero. */
+struct http_message_t {
+	bool is_request;
+	const char *method;
+	const char *uri;
+	const char *version;
+	unsigned int status;
+	const char *reason;
+	unsigned int header_count;
+	struct http_header_t headers[HTTP_FRAMER_MAX_HEADERS];
+
+	uint64_t offset;
+	unsigned int header_length;
+	uint64_t body_offset;
+	uint64_t body_length;
+	uint64_t wire_length;
+	bool chunked;
+	bool truncated;
+};
+
+struct http_framer_callbacks_t {
+	/* Called once the header of a message has been parsed; returning true
+	 * means that the message has no body regardless of its headers (e.g., a
+	 * response to a HEAD request). May be NULL. */
+	bool (*header)(const struct http_message_t *message, void *argument);
+	/* Called once a message has been completely received. */
+	void (*complete)(const struct http_message_t *message, void *argument);
+	void *argument;
+};
+
+struct http_framer_t {
+	bool is_request;
+	enum http_framer_state_t state;
+	struct http_framer_callbacks_t callbacks;
+	uint64_t offset;
+	uint64_t remaining;
+	struct http_message_t message;
+	unsigned int header_length;
+	char header[HTTP_FRAMER_MAX_HEADER_LENGTH + 1];
+	unsigned int line_length;
+	char line[HTTP_FRAMER_MAX_LINE_LENGTH + 1];
+};
+
+/*************** AUTO GENERATED SECTION FOLLOWS ***************/
+void http_framer_init(struct http_framer_t *framer, bool is_request, const struct http_framer_callbacks_t *callbacks);
+void http_framer_feed(struct http_framer_t *framer, const uint8_t *data, unsigned int length);
+void http_framer_finish(struct http_framer_t *framer);
+/***************  AUTO GENERATED SECTION ENDS   ***************/
+
+#endif
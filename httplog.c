@@ -0,0 +1,415 @@
+/**
+ *	ratched - TLS connection router that performs a man-in-the-middle attack
+ *	Copyright (C) 2017-2017 Johannes Bauer
+ *
+ *	This file is part of ratched.
+ *
+ *	ratched is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; this program is ONLY licensed under
+ *	version 3 of the License, later versions are explicitly excluded.
+ *
+ *	ratched is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with ratched; if not, write to the Free Software
+ *	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *	Johannes Bauer <JohannesBauer@gmx.de>
+**/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdarg.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include "httplog.h"
+#include "httpframe.h"
+#include "logging.h"
+#include "stats.h"
+#include "ipfwd.h"
+#include "thread.h"
+#include "probes.h"
+#include "lockstat.h"
+
+/* HTTP/1.x messages found in the plaintext of intercepted connections are
+ * written as one JSON object per line into a sidecar file. Framing runs
+ * inline in the forwarding threads and only needs a bounded amount of memory
+ * per connection; the formatted records are handed to a single writer thread
+ * through a bounded queue. When the writer falls behind, records are dropped
+ * instead of holding up the relay. */
+#define HTTPLOG_MAX_QUEUED_BYTES		(4 * 1024 * 1024)
+#define HTTPLOG_MAX_RECORD_LENGTH		(2 * HTTP_FRAMER_MAX_HEADER_LENGTH + 4096)
+#define HTTPLOG_MAX_PENDING_REQUESTS	32
+
+struct httplog_record_t {
+	struct httplog_record_t *next;
+	size_t length;
+	char data[];
+};
+
+struct json_buffer_t {
+	size_t length;
+	bool overflow;
+	char data[HTTPLOG_MAX_RECORD_LENGTH];
+};
+
+struct http_log_direction_t {
+	struct http_log_connection_t *hconn;
+	bool is_request;
+	uint32_t isn;
+	unsigned int message_count;
+	struct http_framer_t framer;
+	struct json_buffer_t buffer;
+};
+
+struct http_log_connection_t {
+	unsigned int id;
+	char client[32];
+	char server[32];
+	char sni[256];
+	bool have_sni;
+	bool have_seqno;
+
+	/* Request methods whose responses are still outstanding; needed to know
+	 * that a response to HEAD carries no body. */
+	struct lockstat_mutex_t lock;
+	bool pending_head[HTTPLOG_MAX_PENDING_REQUESTS];
+	unsigned int pending_first, pending_count;
+
+	struct http_log_direction_t request;
+	struct http_log_direction_t response;
+};
+
+static struct {
+	FILE *f;
+	pthread_t thread;
+	bool thread_running;
+	struct lockstat_mutex_t lock;
+	pthread_cond_t cond;
+	struct httplog_record_t *head, *tail;
+	size_t queued_bytes;
+	bool quit;
+	struct {
+		struct stats_counter_t *records;
+		struct stats_counter_t *records_dropped;
+		struct stats_counter_t *parse_failures;
+	} counters;
+} httplog = {
+	.lock = LOCKSTAT_MUTEX_INITIALIZER("httplog"),
+	.cond = PTHREAD_COND_INITIALIZER,
+};
+
+static void* httplog_writer_thread_fnc(void *argument) {
+	set_thread_name("httplog");
+	lockstat_lock(&httplog.lock);
+	while (true) {
+		while (!httplog.head && !httplog.quit) {
+			lockstat_cond_wait(&httplog.cond, &httplog.lock);
+		}
+		struct httplog_record_t *records = httplog.head;
+		const size_t queued_bytes = httplog.queued_bytes;
+		httplog.head = NULL;
+		httplog.tail = NULL;
+		httplog.queued_bytes = 0;
+		if (!records && httplog.quit) {
+			break;
+		}
+
+		/* Write outside the lock so that producers never wait for I/O. */
+		lockstat_unlock(&httplog.lock);
+		PROBE1(httplog_dequeue, queued_bytes);
+		while (records) {
+			struct httplog_record_t *next = records->next;
+			if (fwrite(records->data, records->length, 1, httplog.f) != 1) {
+				logmsg(LLVL_ERROR, "Failed to write HTTP sidecar record: %s", strerror(errno));
+			}
+			free(records);
+			records = next;
+		}
+		fflush(httplog.f);
+		lockstat_lock(&httplog.lock);
+	}
+	lockstat_unlock(&httplog.lock);
+	return NULL;
+}
+
+static void enqueue_record(unsigned int connection_id, const struct json_buffer_t *buffer) {
+	if (buffer->overflow) {
+		stats_inc(httplog.counters.records_dropped);
+		return;
+	}
+	struct httplog_record_t *record = malloc(sizeof(struct httplog_record_t) + buffer->length);
+	if (!record) {
+		stats_inc(httplog.counters.records_dropped);
+		return;
+	}
+	record->next = NULL;
+	record->length = buffer->length;
+	memcpy(record->data, buffer->data, buffer->length);
+
+	lockstat_lock(&httplog.lock);
+	const bool accept = (httplog.queued_bytes + record->length <= HTTPLOG_MAX_QUEUED_BYTES);
+	if (accept) {
+		if (httplog.tail) {
+			httplog.tail->next = record;
+		} else {
+			httplog.head = record;
+		}
+		httplog.tail = record;
+		httplog.queued_bytes += record->length;
+		pthread_cond_signal(&httplog.cond);
+	}
+	lockstat_unlock(&httplog.lock);
+	PROBE3(httplog_enqueue, connection_id, record->length, accept);
+
+	if (accept) {
+		stats_inc(httplog.counters.records);
+	} else {
+		stats_inc(httplog.counters.records_dropped);
+		free(record);
+	}
+}
+
+static void json_append(struct json_buffer_t *buffer, const char *data, size_t length) {
+	if (buffer->overflow || (buffer->length + length > sizeof(buffer->data))) {
+		buffer->overflow = true;
+		return;
+	}
+	memcpy(buffer->data + buffer->length, data, length);
+	buffer->length += length;
+}
+
+static void json_printf(struct json_buffer_t *buffer, const char *fmt, ...) __attribute__ ((format (printf, 2, 3)));
+
+static void json_printf(struct json_buffer_t *buffer, const char *fmt, ...) {
+	char text[128];
+	va_list ap;
+	va_start(ap, fmt);
+	int length = vsnprintf(text, sizeof(text), fmt, ap);
+	va_end(ap);
+	if ((length < 0) || (length >= sizeof(text))) {
+		buffer->overflow = true;
+		return;
+	}
+	json_append(buffer, text, length);
+}
+
+static void json_string(struct json_buffer_t *buffer, const char *string) {
+	json_append(buffer, "\"", 1);
+	const char *run = string;
+	for (const char *p = string; *p; p++) {
+		const unsigned char c = *p;
+		if ((c >= 0x20) && (c != '"') && (c != '\\') && (c < 0x7f)) {
+			continue;
+		}
+		json_append(buffer, run, p - run);
+		run = p + 1;
+		if (c == '"') {
+			json_append(buffer, "\\\"", 2);
+		} else if (c == '\\') {
+			json_append(buffer, "\\\\", 2);
+		} else {
+			/* Header bytes are not necessarily UTF-8; escape everything that
+			 * is not printable ASCII as a Latin-1 code point. */
+			json_printf(buffer, "\\u%04x", c);
+		}
+	}
+	json_append(buffer, run, strlen(run));
+	json_append(buffer, "\"", 1);
+}
+
+static void json_key_string(struct json_buffer_t *buffer, const char *key, const char *value) {
+	json_printf(buffer, ",\"%s\":", key);
+	json_string(buffer, value);
+}
+
+static void pending_push(struct http_log_connection_t *hconn, bool is_head) {
+	lockstat_lock(&hconn->lock);
+	if (hconn->pending_count == HTTPLOG_MAX_PENDING_REQUESTS) {
+		/* Deeply pipelined client; forget about the oldest request. */
+		hconn->pending_first = (hconn->pending_first + 1) % HTTPLOG_MAX_PENDING_REQUESTS;
+		hconn->pending_count--;
+	}
+	hconn->pending_head[(hconn->pending_first + hconn->pending_count) % HTTPLOG_MAX_PENDING_REQUESTS] = is_head;
+	hconn->pending_count++;
+	lockstat_unlock(&hconn->lock);
+}
+
+static bool pending_pop(struct http_log_connection_t *hconn) {
+	bool is_head = false;
+	lockstat_lock(&hconn->lock);
+	if (hconn->pending_count) {
+		is_head = hconn->pending_head[hconn->pending_first];
+		hconn->pending_first = (hconn->pending_first + 1) % HTTPLOG_MAX_PENDING_REQUESTS;
+		hconn->pending_count--;
+	}
+	lockstat_unlock(&hconn->lock);
+	return is_head;
+}
+
+static bool message_header(const struct http_message_t *message, void *argument) {
+	struct http_log_direction_t *direction = (struct http_log_direction_t*)argument;
+	if (message->is_request) {
+		pending_push(direction->hconn, !strcmp(message->method, "HEAD"));
+		return false;
+	} else if ((message->status >= 100) && (message->status < 200)) {
+		/* Interim response, the final one is still to come. */
+		return false;
+	} else {
+		return pending_pop(direction->hconn);
+	}
+}
+
+static void message_complete(const struct http_message_t *message, void *argument) {
+	struct http_log_direction_t *direction = (struct http_log_direction_t*)argument;
+	struct http_log_connection_t *hconn = direction->hconn;
+	struct json_buffer_t *buffer = &direction->buffer;
+
+	buffer->length = 0;
+	buffer->overflow = false;
+	json_printf(buffer, "{\"connection\":%u,\"message\":%u", hconn->id, direction->message_count++);
+	json_key_string(buffer, "direction", direction->is_request ? "request" : "response");
+	json_key_string(buffer, "client", hconn->client);
+	json_key_string(buffer, "server", hconn->server);
+	if (hconn->have_sni) {
+		json_key_string(buffer, "sni", hconn->sni);
+	}
+	if (message->is_request) {
+		json_key_string(buffer, "method", message->method);
+		json_key_string(buffer, "uri", message->uri);
+		json_key_string(buffer, "version", message->version);
+	} else {
+		json_key_string(buffer, "version", message->version);
+		json_printf(buffer, ",\"status\":%u", message->status);
+		json_key_string(buffer, "reason", message->reason);
+	}
+	json_append(buffer, ",\"headers\":[", 12);
+	for (unsigned int i = 0; i < message->header_count; i++) {
+		json_append(buffer, i ? ",[" : "[", i ? 2 : 1);
+		json_string(buffer, message->headers[i].name);
+		json_append(buffer, ",", 1);
+		json_string(buffer, message->headers[i].value);
+		json_append(buffer, "]", 1);
+	}
+	json_append(buffer, "]", 1);
+	json_printf(buffer, ",\"offset\":%" PRIu64 ",\"header_length\":%u,\"body_offset\":%" PRIu64 ",\"body_length\":%" PRIu64 ",\"wire_length\":%" PRIu64, message->offset, message->header_length, message->body_offset, message->body_length, message->wire_length);
+	if (hconn->have_seqno) {
+		json_printf(buffer, ",\"tcp_seq\":%u,\"body_tcp_seq\":%u", (uint32_t)(direction->isn + message->offset), (uint32_t)(direction->isn + message->body_offset));
+	}
+	json_printf(buffer, ",\"chunked\":%s,\"truncated\":%s}\n", message->chunked ? "true" : "false", message->truncated ? "true" : "false");
+	enqueue_record(hconn->id, buffer);
+}
+
+static void init_direction(struct http_log_connection_t *hconn, struct http_log_direction_t *direction, bool is_request, uint32_t isn) {
+	direction->hconn = hconn;
+	direction->is_request = is_request;
+	direction->isn = isn;
+	const struct http_framer_callbacks_t callbacks = {
+		.header = message_header,
+		.complete = message_complete,
+		.argument = direction,
+	};
+	http_framer_init(&direction->framer, is_request, &callbacks);
+}
+
+struct http_log_connection_t *httplog_connection_new(const struct connection_t *conn) {
+	if (!httplog.thread_running) {
+		return NULL;
+	}
+	struct http_log_connection_t *hconn = calloc(1, sizeof(struct http_log_connection_t));
+	if (!hconn) {
+		logmsg(LLVL_ERROR, "Failed to allocate HTTP sidecar connection: %s", strerror(errno));
+		return NULL;
+	}
+	hconn->id = conn->connection_id;
+	lockstat_mutex_init(&hconn->lock, "httplog.connection");
+
+	snprintf(hconn->client, sizeof(hconn->client), PRI_IPv4 ":%u", FMT_IPv4(conn->connector.ip_nbo), ntohs(conn->connector.port_nbo));
+	snprintf(hconn->server, sizeof(hconn->server), PRI_IPv4 ":%u", FMT_IPv4(conn->acceptor.ip_nbo), ntohs(conn->acceptor.port_nbo));
+	if (conn->acceptor.hostname) {
+		hconn->have_sni = true;
+		snprintf(hconn->sni, sizeof(hconn->sni), "%s", conn->acceptor.hostname);
+	}
+
+	/* When the connection is also written to the capture file, offsets can
+	 * be translated into TCP sequence numbers of the synthetic stream. */
+	hconn->have_seqno = (conn->mtdump != NULL);
+	init_direction(hconn, &hconn->request, true, conn->connector.seqno);
+	init_direction(hconn, &hconn->response, false, conn->acceptor.seqno);
+	return hconn;
+}
+
+void httplog_data(struct http_log_connection_t *hconn, bool direction, const uint8_t *data, unsigned int length) {
+	struct http_log_direction_t *dir = direction ? &hconn->request : &hconn->response;
+	if (dir->framer.state == HTTP_FRAMER_FAILED) {
+		return;
+	}
+	http_framer_feed(&dir->framer, data, length);
+	if (dir->framer.state == HTTP_FRAMER_FAILED) {
+		logmsg(LLVL_DEBUG, "HTTP sidecar: %s stream of connection %u is not HTTP/1.x, no longer framing it.", direction ? "client" : "server", hconn->id);
+		stats_inc(httplog.counters.parse_failures);
+	}
+}
+
+void httplog_connection_free(struct http_log_connection_t *hconn) {
+	if (!hconn) {
+		return;
+	}
+	http_framer_finish(&hconn->request.framer);
+	http_framer_finish(&hconn->response.framer);
+	lockstat_mutex_destroy(&hconn->lock);
+	free(hconn);
+}
+
+bool httplog_init(const char *filename) {
+	httplog.counters.records = stats_counter("http.records");
+	httplog.counters.records_dropped = stats_counter("http.records_dropped");
+	httplog.counters.parse_failures = stats_counter("http.parse_failures");
+
+	httplog.f = fopen(filename, "w");
+	if (!httplog.f) {
+		logmsg(LLVL_ERROR, "Could not open HTTP sidecar file %s for writing: %s", filename, strerror(errno));
+		return false;
+	}
+	return true;
+}
+
+/* Separate from httplog_init() because the file needs to be opened before
+ * daemonizing (relative paths), but the thread has to be created after. */
+bool httplog_start(void) {
+	if (!httplog.f) {
+		return true;
+	}
+	if (pthread_create(&httplog.thread, NULL, httplog_writer_thread_fnc, NULL)) {
+		logmsg(LLVL_ERROR, "Failed to create HTTP sidecar writer thread: %s", strerror(errno));
+		return false;
+	}
+	httplog.thread_running = true;
+	return true;
+}
+
+void httplog_deinit(void) {
+	if (!httplog.f) {
+		return;
+	}
+	if (httplog.thread_running) {
+		lockstat_lock(&httplog.lock);
+		httplog.quit = true;
+		pthread_cond_signal(&httplog.cond);
+		lockstat_unlock(&httplog.lock);
+		pthread_join(httplog.thread, NULL);
+		httplog.thread_running = false;
+	}
+	fclose(httplog.f);
+	httplog.f = NULL;
+}
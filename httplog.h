@@ -0,0 +1,43 @@
+/**
+ *	ratched - TLS connection router that performs a man-in-the-middle attack
+ *	Copyright (C) 2017-2017 Johannes Bauer
+ *
+ *	This file is part of ratched.
+ *
+ *	ratched is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; this program is ONLY licensed under
+ *	version 3 of the License, later versions are explicitly excluded.
+ *
+ *	ratched is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with ratched; if not, write to the Free Software
+ *	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *	Johannes Bauer <JohannesBauer@gmx.de>
+**/
+
+
+#ifndef __HTTPLOG_H__
+#define __HTTPLOG_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "tcpip.h"
+
+struct http_log_connection_t;
+
+/*************** AUTO GENERATED SECTION FOLLOWS ***************/
+bool httplog_init(const char *filename);
+bool httplog_start(void);
+void httplog_deinit(void);
+struct http_log_connection_t *httplog_connection_new(const struct connection_t *conn);
+void httplog_data(struct http_log_connection_t *hconn, bool direction, const uint8_t *data, unsigned int length);
+void httplog_connection_free(struct http_log_connection_t *hconn);
+/***************  AUTO GENERATED SECTION ENDS   ***************/
+
+#endif
@@ -52,6 +52,10 @@ static bool side_plausibility_check(const char *hostname, const char *sidename,
 		logmsg(LLVL_WARN, "%s: Specifying a %s certificate chain file without specifying a %s certificate does not make sense.", hostname, sidename, sidename);
 		return false;
 	}
+	if ((side->tcp_rcvbuf < 0) || (side->tcp_sndbuf < 0) || (side->tcp_notsent_lowat < 0) || (side->tcp_user_timeout < 0) || (side->tcp_keepalive < 0) || (side->tcp_keepalive_interval < 0)) {
+		logmsg(LLVL_ERROR, "%s: TCP options of the %s side must not be negative.", hostname, sidename);
+		return false;
+	}
 	return true;
 }
 
@@ -76,6 +80,17 @@ struct intercept_config_t* intercept_config_new(const char *connection_params, b
 		{ "none",			REJECT_CONNECTION },
 		{ 0 }
 	};
+	const struct lookup_entry_t capture_options[] = {
+		{ "intercepted",	CAPTURE_INTERCEPTED },
+		{ "all",			CAPTURE_ALL },
+		{ "none",			CAPTURE_NONE },
+		{ 0 }
+	};
+	const struct lookup_entry_t cipher_policy_options[] = {
+		{ "static",			CIPHER_POLICY_STATIC },
+		{ "cheapest",		CIPHER_POLICY_CHEAPEST },
+		{ 0 }
+	};
 	const struct lookup_entry_t tls_version_flags[] = {
 		{ "ssl2",			TLS_VERSION_SSL2 },
 		{ "ssl3",			TLS_VERSION_SSL3 },
@@ -87,8 +102,12 @@ struct intercept_config_t* intercept_config_new(const char *connection_params, b
 	};
 	struct keyvaluelist_def_t definition[] = {
 		{ .key = "intercept", .parser = keyvalue_lookup, .target = &config->interception_mode, .argument = (void*)&intercept_options },
+		{ .key = "tcpfastopen", .parser = keyvalue_bool, .target = &config->tcp_fastopen },
+		{ .key = "capture", .parser = keyvalue_lookup, .target = &config->capture_policy, .argument = (void*)&capture_options },
+		{ .key = "cipherpolicy", .parser = keyvalue_lookup, .target = &config->cipher_policy, .argument = (void*)&cipher_policy_options },
 		{ .key = "s_tlsversions", .parser = keyvalue_flags, .target = &config->server.tls_versions, .argument = (void*)&tls_version_flags },
 		{ .key = "s_reqclientcert", .parser = keyvalue_bool, .target = &config->server.request_client_cert },
+		{ .key = "s_mirrorcert", .parser = keyvalue_bool, .target = &config->server.mirror_certificate },
 		{ .key = "s_certfile", .parser = keyvalue_string, .target = &config->server.cert_filename },
 		{ .key = "s_keyfile", .parser = keyvalue_string, .target = &config->server.key_filename },
 		{ .key = "s_chainfile", .parser = keyvalue_string, .target = &config->server.chain_filename },
@@ -97,6 +116,13 @@ struct intercept_config_t* intercept_config_new(const char *connection_params, b
 		{ .key = "s_ciphers", .parser = keyvalue_string, .target = &config->server.ciphersuites },
 		{ .key = "s_groups", .parser = keyvalue_string, .target = &config->server.supported_groups },
 		{ .key = "s_sigalgs", .parser = keyvalue_string, .target = &config->server.signature_algorithms },
+		{ .key = "s_congestion", .parser = keyvalue_string, .target = &config->server.tcp_congestion },
+		{ .key = "s_rcvbuf", .parser = keyvalue_longint, .target = &config->server.tcp_rcvbuf },
+		{ .key = "s_sndbuf", .parser = keyvalue_longint, .target = &config->server.tcp_sndbuf },
+		{ .key = "s_notsentlowat", .parser = keyvalue_longint, .target = &config->server.tcp_notsent_lowat },
+		{ .key = "s_usertimeout", .parser = keyvalue_longint, .target = &config->server.tcp_user_timeout },
+		{ .key = "s_keepalive", .parser = keyvalue_longint, .target = &config->server.tcp_keepalive },
+		{ .key = "s_keepintvl", .parser = keyvalue_longint, .target = &config->server.tcp_keepalive_interval },
 		{ .key = "c_tlsversions", .parser = keyvalue_flags, .target = &config->client.tls_versions, .argument = (void*)&tls_version_flags },
 		{ .key = "c_certfile", .parser = keyvalue_string, .target = &config->client.cert_filename },
 		{ .key = "c_keyfile", .parser = keyvalue_string, .target = &config->client.key_filename },
@@ -104,6 +130,13 @@ struct intercept_config_t* intercept_config_new(const char *connection_params, b
 		{ .key = "c_ciphers", .parser = keyvalue_string, .target = &config->client.ciphersuites },
 		{ .key = "c_groups", .parser = keyvalue_string, .target = &config->client.supported_groups },
 		{ .key = "c_sigalgs", .parser = keyvalue_string, .target = &config->client.signature_algorithms },
+		{ .key = "c_congestion", .parser = keyvalue_string, .target = &config->client.tcp_congestion },
+		{ .key = "c_rcvbuf", .parser = keyvalue_longint, .target = &config->client.tcp_rcvbuf },
+		{ .key = "c_sndbuf", .parser = keyvalue_longint, .target = &config->client.tcp_sndbuf },
+		{ .key = "c_notsentlowat", .parser = keyvalue_longint, .target = &config->client.tcp_notsent_lowat },
+		{ .key = "c_usertimeout", .parser = keyvalue_longint, .target = &config->client.tcp_user_timeout },
+		{ .key = "c_keepalive", .parser = keyvalue_longint, .target = &config->client.tcp_keepalive },
+		{ .key = "c_keepintvl", .parser = keyvalue_longint, .target = &config->client.tcp_keepalive_interval },
 		{ 0 }
 	};
 
@@ -145,6 +178,7 @@ static void intercept_side_config_free(struct intercept_side_config_t *side) {
 	free(side->ca_key_filename);
 	free(side->ciphersuites);
 	free(side->supported_groups);
+	free(side->tcp_congestion);
 	memset(side, 0, sizeof(struct intercept_side_config_t));
 }
 
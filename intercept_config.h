@@ -35,6 +35,19 @@ enum interception_mode_t {
 	REJECT_CONNECTION,
 };
 
+enum capture_policy_t {
+	CAPTURE_POLICY_UNDEFINED = 0,
+	CAPTURE_INTERCEPTED,
+	CAPTURE_ALL,
+	CAPTURE_NONE,
+};
+
+enum cipher_policy_t {
+	CIPHER_POLICY_UNDEFINED = 0,
+	CIPHER_POLICY_STATIC,
+	CIPHER_POLICY_CHEAPEST,
+};
+
 enum tls_version_t {
 	TLS_VERSION_UNDEFINED = 0,
 	TLS_VERSION_SSL2 = (1 << 0),
@@ -48,6 +61,7 @@ enum tls_version_t {
 struct intercept_side_config_t {
 	// Makes only sense for 'server', but easier this way.
 	bool request_client_cert;
+	bool mirror_certificate;
 	uint32_t tls_versions;
 
 	char *cert_filename;
@@ -60,12 +74,23 @@ struct intercept_side_config_t {
 	char *ciphersuites;
 	char *supported_groups;
 	char *signature_algorithms;
+
+	char *tcp_congestion;
+	long int tcp_rcvbuf;
+	long int tcp_sndbuf;
+	long int tcp_notsent_lowat;
+	long int tcp_user_timeout;
+	long int tcp_keepalive;
+	long int tcp_keepalive_interval;
 };
 
 struct intercept_config_t {
 	char *hostname;
 	uint32_t ipv4_nbo;
 	enum interception_mode_t interception_mode;
+	bool tcp_fastopen;
+	enum capture_policy_t capture_policy;
+	enum cipher_policy_t cipher_policy;
 	struct intercept_side_config_t server;
 	struct intercept_side_config_t client;
 };
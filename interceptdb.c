@@ -25,26 +25,216 @@
 #include <string.h>
 #include <errno.h>
 #include <stdint.h>
+#include <pthread.h>
+#include <sys/stat.h>
 #include "interceptdb.h"
 #include "pgmopts.h"
 #include "intercept_config.h"
 #include "certforgery.h"
+#include "openssl_tls.h"
 #include "map.h"
+#include "thread.h"
+#include "logging.h"
+#include "lockstat.h"
+#include "domainlist.h"
+#include "stats.h"
+
+/* Number of idle SSL objects kept for reuse per endpoint context */
+#define SSL_POOL_SIZE				64
 
 static struct intercept_entry_t default_entry;
 static struct map_t *intercept_entry_by_hostname;
 
-struct intercept_entry_t* interceptdb_find_entry(const char *hostname, uint32_t ipv4_nbo) {
-	struct intercept_entry_t *entry = (struct intercept_entry_t*)strmap_get(intercept_entry_by_hostname, hostname);
-	if (!entry) {
+/* Decisions are cached per interned hostname ID so that the string lookup in
+ * the interception database only happens once per distinct host name. The
+ * generation is advanced whenever the cache is cleared after a domain list
+ * reload; a decision is only stored if the generation has not changed since
+ * the lookup began, otherwise it may stem from the replaced list. */
+static struct {
+	struct lockstat_mutex_t lock;
+	unsigned int generation;
+	unsigned int size;
+	struct intercept_entry_t **entries;
+} decision_cache = {
+	.lock = LOCKSTAT_MUTEX_INITIALIZER("decision_cache"),
+};
+
+/* Host names that are neither explicitly configured nor cached are looked up
+ * in the compiled domain list, if any. It is replaced at runtime when its
+ * file changes; lookups and the swap are serialized by the lock so that the
+ * previous mapping can be released right away. Matches resolve to a copy of
+ * the default entry that only differs in its interception mode. */
+static struct {
+	struct lockstat_mutex_t lock;
+	struct domainlist_t *list;
+	struct stat file_stat;
+	struct intercept_entry_t entry_by_mode[REJECT_CONNECTION + 1];
+	struct periodic_thread_t reload_thread;
+	struct stats_counter_t *entries;
+	struct stats_counter_t *hits;
+	struct stats_counter_t *reloads;
+} domain_list = {
+	.lock = LOCKSTAT_MUTEX_INITIALIZER("domain_list"),
+};
+
+static struct intercept_entry_t* decision_cache_get(unsigned int hostname_id, unsigned int *generation) {
+	struct intercept_entry_t *entry = NULL;
+	lockstat_lock(&decision_cache.lock);
+	*generation = decision_cache.generation;
+	if (hostname_id < decision_cache.size) {
+		entry = decision_cache.entries[hostname_id];
+	}
+	lockstat_unlock(&decision_cache.lock);
+	return entry;
+}
+
+static void decision_cache_put(unsigned int hostname_id, struct intercept_entry_t *entry, unsigned int generation) {
+	lockstat_lock(&decision_cache.lock);
+	if (generation != decision_cache.generation) {
+		lockstat_unlock(&decision_cache.lock);
+		return;
+	}
+	if (hostname_id >= decision_cache.size) {
+		unsigned int new_size = decision_cache.size ? decision_cache.size : 1024;
+		while (new_size <= hostname_id) {
+			new_size *= 2;
+		}
+		struct intercept_entry_t **new_entries = realloc(decision_cache.entries, new_size * sizeof(struct intercept_entry_t*));
+		if (new_entries) {
+			memset(new_entries + decision_cache.size, 0, (new_size - decision_cache.size) * sizeof(struct intercept_entry_t*));
+			decision_cache.entries = new_entries;
+			decision_cache.size = new_size;
+		}
+	}
+	if (hostname_id < decision_cache.size) {
+		decision_cache.entries[hostname_id] = entry;
+	}
+	lockstat_unlock(&decision_cache.lock);
+}
+
+static void decision_cache_clear(void) {
+	lockstat_lock(&decision_cache.lock);
+	decision_cache.generation++;
+	if (decision_cache.entries) {
+		memset(decision_cache.entries, 0, decision_cache.size * sizeof(struct intercept_entry_t*));
+	}
+	lockstat_unlock(&decision_cache.lock);
+}
+
+static struct intercept_entry_t* domain_list_find_entry(const char *hostname) {
+	if (!pgm_options->domain_list.filename) {
+		return NULL;
+	}
+	uint8_t mode;
+	lockstat_lock(&domain_list.lock);
+	bool found = domainlist_lookup(domain_list.list, hostname, &mode);
+	lockstat_unlock(&domain_list.lock);
+	if (!found || (mode == INTERCEPTION_MODE_UNDEFINED) || (mode > REJECT_CONNECTION)) {
+		return NULL;
+	}
+	stats_inc(domain_list.hits);
+	return &domain_list.entry_by_mode[mode];
+}
+
+static bool domain_list_file_changed(const struct stat *old_stat, const struct stat *new_stat) {
+	return (old_stat->st_dev != new_stat->st_dev) || (old_stat->st_ino != new_stat->st_ino) || (old_stat->st_size != new_stat->st_size) || (old_stat->st_mtime != new_stat->st_mtime);
+}
+
+static bool domain_list_load(const char *filename) {
+	struct stat file_stat;
+	if (stat(filename, &file_stat)) {
+		logmsg(LLVL_ERROR, "Cannot stat domain list %s: %s", filename, strerror(errno));
+		return false;
+	}
+	/* Remember the file even if it fails to load, so that a broken file is
+	 * only reported once */
+	domain_list.file_stat = file_stat;
+
+	struct domainlist_t *new_list = domainlist_open(filename);
+	if (!new_list) {
+		return false;
+	}
+	lockstat_lock(&domain_list.lock);
+	struct domainlist_t *old_list = domain_list.list;
+	domain_list.list = new_list;
+	lockstat_unlock(&domain_list.lock);
+	domainlist_close(old_list);
+
+	stats_set(domain_list.entries, domainlist_entry_count(new_list));
+	logmsg(LLVL_INFO, "Mapped domain list %s with %u entries.", filename, domainlist_entry_count(new_list));
+	return true;
+}
+
+static void domain_list_check_reload(void *argument) {
+	const char *filename = pgm_options->domain_list.filename;
+	struct stat file_stat;
+	if (stat(filename, &file_stat) || !domain_list_file_changed(&domain_list.file_stat, &file_stat)) {
+		return;
+	}
+	if (domain_list_load(filename)) {
+		/* Decisions that were made with the previous list are stale */
+		decision_cache_clear();
+		stats_inc(domain_list.reloads);
+	}
+}
+
+static bool domain_list_init(void) {
+	if (!pgm_options->domain_list.filename) {
+		return true;
+	}
+	domain_list.entries = stats_counter("domainlist.entries");
+	domain_list.hits = stats_counter("domainlist.hits");
+	domain_list.reloads = stats_counter("domainlist.reloads");
+	for (int mode = OPPORTUNISTIC_TLS_INTERCEPTION; mode <= REJECT_CONNECTION; mode++) {
+		domain_list.entry_by_mode[mode] = default_entry;
+		domain_list.entry_by_mode[mode].interception_mode = mode;
+	}
+	if (!domain_list_load(pgm_options->domain_list.filename)) {
+		return false;
+	}
+	if (pgm_options->domain_list.reload_interval) {
+		start_periodic_thread(&domain_list.reload_thread, "domainlist", pgm_options->domain_list.reload_interval, domain_list_check_reload, NULL);
+	}
+	return true;
+}
+
+static void domain_list_deinit(void) {
+	stop_periodic_thread(&domain_list.reload_thread);
+	domainlist_close(domain_list.list);
+	domain_list.list = NULL;
+}
+
+struct intercept_entry_t* interceptdb_find_entry(const struct hostname_t *hostname, uint32_t ipv4_nbo) {
+	if (!hostname) {
 		return &default_entry;
-	} else {
-		return entry;
 	}
+
+	unsigned int generation;
+	struct intercept_entry_t *entry = decision_cache_get(hostname->id, &generation);
+	if (!entry) {
+		entry = (struct intercept_entry_t*)strmap_get(intercept_entry_by_hostname, hostname->name);
+		if (!entry) {
+			entry = domain_list_find_entry(hostname->name);
+		}
+		if (!entry) {
+			entry = &default_entry;
+		}
+		if (hostname->id) {
+			decision_cache_put(hostname->id, entry, generation);
+		}
+	}
+	return entry;
+}
+
+/* True if the entry applies only because the host is not covered by any
+ * explicit configuration */
+bool interceptdb_is_default_entry(const struct intercept_entry_t *entry) {
+	return entry == &default_entry;
 }
 
 static void initialize_default_intercept_entry(struct intercept_entry_t *new_entry) {
 	new_entry->interception_mode = OPPORTUNISTIC_TLS_INTERCEPTION;
+	new_entry->capture_policy = CAPTURE_INTERCEPTED;
 	new_entry->server_template.tls_versions = TLS_VERSION_TLS10 | TLS_VERSION_TLS11 | TLS_VERSION_TLS12 | TLS_VERSION_TLS13;
 	new_entry->client_template.tls_versions = TLS_VERSION_TLS10 | TLS_VERSION_TLS11 | TLS_VERSION_TLS12 | TLS_VERSION_TLS13;
 }
@@ -79,6 +269,16 @@ static bool init_tls_intercept_entry(struct tls_endpoint_config_t *config, const
 	return true;
 }
 
+static void init_tcp_tuning(struct tcp_tuning_t *tuning, const struct intercept_side_config_t *side_config) {
+	tuning->congestion = side_config->tcp_congestion;
+	tuning->rcvbuf = side_config->tcp_rcvbuf;
+	tuning->sndbuf = side_config->tcp_sndbuf;
+	tuning->notsent_lowat = side_config->tcp_notsent_lowat;
+	tuning->user_timeout_msecs = side_config->tcp_user_timeout;
+	tuning->keepalive_secs = side_config->tcp_keepalive;
+	tuning->keepalive_interval_secs = side_config->tcp_keepalive_interval;
+}
+
 static bool initialize_intercept_entry_from_pgm_config(struct intercept_entry_t *new_entry, const struct intercept_config_t *pgm_config) {
 	memset(new_entry, 0, sizeof(struct intercept_entry_t));
 	initialize_default_intercept_entry(new_entry);
@@ -86,6 +286,15 @@ static bool initialize_intercept_entry_from_pgm_config(struct intercept_entry_t
 		if (pgm_config->interception_mode != INTERCEPTION_MODE_UNDEFINED) {
 			new_entry->interception_mode = pgm_config->interception_mode;
 		}
+		new_entry->tcp_fastopen = pgm_config->tcp_fastopen;
+		new_entry->mirror_upstream_certificate = pgm_config->server.mirror_certificate;
+		if (pgm_config->capture_policy != CAPTURE_POLICY_UNDEFINED) {
+			new_entry->capture_policy = pgm_config->capture_policy;
+		}
+		new_entry->server_template.cheapest_ciphers = (pgm_config->cipher_policy == CIPHER_POLICY_CHEAPEST);
+		new_entry->client_template.cheapest_ciphers = (pgm_config->cipher_policy == CIPHER_POLICY_CHEAPEST);
+		init_tcp_tuning(&new_entry->accepted_tcp, &pgm_config->server);
+		init_tcp_tuning(&new_entry->connected_tcp, &pgm_config->client);
 		new_entry->hostname = pgm_config->hostname;
 		new_entry->ipv4_nbo = pgm_config->ipv4_nbo;
 
@@ -114,36 +323,91 @@ static bool initialize_intercept_entry_from_pgm_config(struct intercept_entry_t
 		new_entry->server_template.ocsp_responder.cert = get_forged_root_certificate();
 		new_entry->server_template.ocsp_responder.key = get_forged_root_key();
 	}
-	return true;
+
+	/* Settings that are identical for every connection of this entry are
+	 * applied once to a shared context */
+	new_entry->server_template.sslctx = openssl_tls_create_context(true, &new_entry->server_template, SSL_POOL_SIZE);
+	new_entry->client_template.sslctx = openssl_tls_create_context(false, &new_entry->client_template, SSL_POOL_SIZE);
+	return new_entry->server_template.sslctx && new_entry->client_template.sslctx;
+}
+
+struct intercept_entry_job_t {
+	struct intercept_entry_t *entry;
+	const struct intercept_config_t *pgm_config;
+	bool success;
+};
+
+static void initialize_intercept_entry_job(unsigned int index, void *vjobs) {
+	struct intercept_entry_job_t *job = ((struct intercept_entry_job_t*)vjobs) + index;
+	job->success = initialize_intercept_entry_from_pgm_config(job->entry, job->pgm_config);
 }
 
 bool init_interceptdb(void) {
-	if (!initialize_intercept_entry_from_pgm_config(&default_entry, pgm_options->default_config)) {
+	intercept_entry_by_hostname = map_new();
+	if (!intercept_entry_by_hostname) {
 		return false;
 	}
 
-	intercept_entry_by_hostname = map_new();
+	/* Create all map entries first (the map is not thread-safe), then
+	 * initialize them in parallel since loading certificates, keys and
+	 * chains for thousands of entries is what dominates startup. */
+	const unsigned int job_count = 1 + pgm_options->custom_configs->element_count;
+	struct intercept_entry_job_t *jobs = calloc(job_count, sizeof(struct intercept_entry_job_t));
+	if (!jobs) {
+		logmsg(LLVL_FATAL, "Unable to allocate %u interception database jobs: %s", job_count, strerror(errno));
+		return false;
+	}
+	jobs[0].entry = &default_entry;
+	jobs[0].pgm_config = pgm_options->default_config;
 	for (int i = 0; i < pgm_options->custom_configs->element_count; i++) {
 		struct intercept_config_t *pgm_config = (struct intercept_config_t *)pgm_options->custom_configs->elements[i]->value.pointer;
 		struct map_element_t *new_map_entry = strmap_set_mem(intercept_entry_by_hostname, pgm_config->hostname, NULL, sizeof(struct intercept_entry_t));
 		if (!new_map_entry) {
+			free(jobs);
 			return false;
 		}
-		struct intercept_entry_t *new_entry = (struct intercept_entry_t*)new_map_entry->value.pointer;
-		initialize_intercept_entry_from_pgm_config(new_entry, pgm_config);
+		jobs[1 + i].entry = (struct intercept_entry_t*)new_map_entry->value.pointer;
+		jobs[1 + i].pgm_config = pgm_config;
 	}
-	return true;
+
+	run_parallel_jobs(job_count, initialize_intercept_entry_job, jobs);
+
+	bool success = true;
+	for (unsigned int i = 0; i < job_count; i++) {
+		if (!jobs[i].success) {
+			logmsg(LLVL_FATAL, "Failed to initialize interception entry for %s.", (jobs[i].entry == &default_entry) ? "default configuration" : jobs[i].pgm_config->hostname);
+			success = false;
+		}
+	}
+	free(jobs);
+	logmsg(LLVL_DEBUG, "Initialized %u interception database entries.", job_count);
+
+	/* Entries of the domain list derive from the initialized default entry */
+	if (success && !domain_list_init()) {
+		logmsg(LLVL_FATAL, "Failed to load domain list %s.", pgm_options->domain_list.filename);
+		success = false;
+	}
+	return success;
 }
 
 static void free_entry(void *vintercept_entry) {
 	struct intercept_entry_t *intercept_entry = (struct intercept_entry_t*)vintercept_entry;
+	openssl_tls_free_context(intercept_entry->client_template.sslctx);
+	openssl_tls_free_context(intercept_entry->server_template.sslctx);
 	free_tls_endpoint_config(&intercept_entry->client_template);
 	free_tls_endpoint_config(&intercept_entry->server_template);
 }
 
 void deinit_interceptdb(void) {
+	domain_list_deinit();
 	free_entry(&default_entry);
 	map_foreach_ptrvalue(intercept_entry_by_hostname, free_entry);
 	map_free(intercept_entry_by_hostname);
+
+	lockstat_lock(&decision_cache.lock);
+	free(decision_cache.entries);
+	decision_cache.entries = NULL;
+	decision_cache.size = 0;
+	lockstat_unlock(&decision_cache.lock);
 }
 
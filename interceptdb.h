@@ -26,17 +26,25 @@
 
 #include "openssl_certs.h"
 #include "intercept_config.h"
+#include "hostname_ids.h"
+#include "ipfwd.h"
 
 struct intercept_entry_t {
 	const char *hostname;
 	uint32_t ipv4_nbo;
 	enum interception_mode_t interception_mode;
+	bool tcp_fastopen;
+	bool mirror_upstream_certificate;
+	enum capture_policy_t capture_policy;
+	struct tcp_tuning_t accepted_tcp;
+	struct tcp_tuning_t connected_tcp;
 	struct tls_endpoint_config_t server_template;
 	struct tls_endpoint_config_t client_template;
 };
 
 /*************** AUTO GENERATED SECTION FOLLOWS ***************/
-struct intercept_entry_t* interceptdb_find_entry(const char *hostname, uint32_t ipv4_nbo);
+struct intercept_entry_t* interceptdb_find_entry(const struct hostname_t *hostname, uint32_t ipv4_nbo);
+bool interceptdb_is_default_entry(const struct intercept_entry_t *entry);
 bool init_interceptdb(void);
 void deinit_interceptdb(void);
 /***************  AUTO GENERATED SECTION ENDS   ***************/
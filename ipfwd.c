@@ -30,12 +30,25 @@
 #include <string.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include "logging.h"
 #include "ipfwd.h"
+#include "thread.h"
+#include "probes.h"
+#include "conntable.h"
+#include "scanner.h"
+
+#define DEFAULT_KEEPALIVE_INTERVAL_SECS		10
 
 struct forwarding_data_t {
 	int read_fd;
 	int write_fd;
+	unsigned int connection_id;
+	struct connection_t *connection;
+	struct scan_relay_t *scan;
+	bool direction;
+	uint64_t bytes_forwarded;
 };
 
 int tcp_accept(uint16_t port_nbo) {
@@ -82,11 +95,76 @@ int tcp_accept(uint16_t port_nbo) {
 	return peer_sd;
 }
 
-int tcp_connect(uint32_t ip_nbo, uint16_t port_nbo) {
+static bool set_int_sockopt(int sd, int level, int optname, const char *optdescription, int value) {
+	if (setsockopt(sd, level, optname, &value, sizeof(value)) < 0) {
+		logmsg(LLVL_WARN, "setsockopt(%s, %d) failed for SD %d: %s", optdescription, value, sd, strerror(errno));
+		return false;
+	}
+	return true;
+}
+
+/* Failing options are logged, but do not prevent the others from being
+ * applied. */
+bool apply_tcp_tuning(int sd, const struct tcp_tuning_t *tuning) {
+	if (!tuning) {
+		return true;
+	}
+	bool success = true;
+	if (tuning->congestion) {
+		if (setsockopt(sd, IPPROTO_TCP, TCP_CONGESTION, tuning->congestion, strlen(tuning->congestion)) < 0) {
+			logmsg(LLVL_WARN, "setsockopt(TCP_CONGESTION, %s) failed for SD %d: %s", tuning->congestion, sd, strerror(errno));
+			success = false;
+		}
+	}
+	if (tuning->rcvbuf) {
+		success = set_int_sockopt(sd, SOL_SOCKET, SO_RCVBUF, "SO_RCVBUF", tuning->rcvbuf) && success;
+	}
+	if (tuning->sndbuf) {
+		success = set_int_sockopt(sd, SOL_SOCKET, SO_SNDBUF, "SO_SNDBUF", tuning->sndbuf) && success;
+	}
+	if (tuning->notsent_lowat) {
+		success = set_int_sockopt(sd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, "TCP_NOTSENT_LOWAT", tuning->notsent_lowat) && success;
+	}
+	if (tuning->user_timeout_msecs) {
+		success = set_int_sockopt(sd, IPPROTO_TCP, TCP_USER_TIMEOUT, "TCP_USER_TIMEOUT", tuning->user_timeout_msecs) && success;
+	}
+	if (tuning->keepalive_secs) {
+		success = set_int_sockopt(sd, SOL_SOCKET, SO_KEEPALIVE, "SO_KEEPALIVE", 1) && success;
+		success = set_int_sockopt(sd, IPPROTO_TCP, TCP_KEEPIDLE, "TCP_KEEPIDLE", tuning->keepalive_secs) && success;
+		/* Once the connection has been idle for long enough, a dead peer
+		 * should be detected after a few quick probes rather than after as
+		 * many idle periods */
+		int interval_secs = tuning->keepalive_interval_secs;
+		if (!interval_secs) {
+			interval_secs = (tuning->keepalive_secs < DEFAULT_KEEPALIVE_INTERVAL_SECS) ? tuning->keepalive_secs : DEFAULT_KEEPALIVE_INTERVAL_SECS;
+		}
+		success = set_int_sockopt(sd, IPPROTO_TCP, TCP_KEEPINTVL, "TCP_KEEPINTVL", interval_secs) && success;
+	}
+	return success;
+}
+
+bool get_tcp_info_snapshot(int sd, struct tcp_info_snapshot_t *snapshot) {
+	struct tcp_info info;
+	socklen_t info_length = sizeof(info);
+	if (getsockopt(sd, IPPROTO_TCP, TCP_INFO, &info, &info_length) < 0) {
+		return false;
+	}
+	*snapshot = (struct tcp_info_snapshot_t) {
+		.rtt_usecs = info.tcpi_rtt,
+		.rttvar_usecs = info.tcpi_rttvar,
+		.total_retransmits = info.tcpi_total_retrans,
+		.lost = info.tcpi_lost,
+		.snd_cwnd = info.tcpi_snd_cwnd,
+	};
+	return true;
+}
+
+static int tuned_tcp_connect(uint32_t ip_nbo, uint16_t port_nbo, const struct tcp_tuning_t *tuning) {
 	int sd = socket(AF_INET, SOCK_STREAM, 0);
 	if (sd == -1) {
 		return -1;
 	}
+	apply_tcp_tuning(sd, tuning);
 
 	struct sockaddr_in peer;
 	memset(&peer, 0, sizeof(peer));
@@ -105,8 +183,82 @@ int tcp_connect(uint32_t ip_nbo, uint16_t port_nbo) {
 	return sd;
 }
 
+int tcp_connect(uint32_t ip_nbo, uint16_t port_nbo) {
+	return tuned_tcp_connect(ip_nbo, port_nbo, NULL);
+}
+
+static bool write_all(int fd, const uint8_t *data, unsigned int length) {
+	while (length) {
+		ssize_t bytes_written = write(fd, data, length);
+		if (bytes_written <= 0) {
+			return false;
+		}
+		data += bytes_written;
+		length -= bytes_written;
+	}
+	return true;
+}
+
+/* Connects to the given peer and sends the initial data. When fast_open is
+ * requested, the data is handed to the kernel together with the connect
+ * request (TCP Fast Open) so that it can be carried in the SYN if a Fast Open
+ * cookie for the peer is available; otherwise the kernel transparently sends
+ * it after the handshake. If the kernel does not support Fast Open at all, a
+ * regular connect and write is done. *sent_in_syn tells whether the data
+ * actually went out with the SYN. The socket is tuned before connecting. */
+int tcp_connect_send(uint32_t ip_nbo, uint16_t port_nbo, const uint8_t *data, unsigned int length, bool fast_open, const struct tcp_tuning_t *tuning, bool *sent_in_syn) {
+	*sent_in_syn = false;
+	if (!fast_open || (length == 0)) {
+		int sd = tuned_tcp_connect(ip_nbo, port_nbo, tuning);
+		if ((sd != -1) && !write_all(sd, data, length)) {
+			logmsg(LLVL_WARN, "Could not write %u bytes of initial data to " PRI_IPv4 ":%d: %s", length, FMT_IPv4(ip_nbo), ntohs(port_nbo), strerror(errno));
+		}
+		return sd;
+	}
+
+	int sd = socket(AF_INET, SOCK_STREAM, 0);
+	if (sd == -1) {
+		return -1;
+	}
+	apply_tcp_tuning(sd, tuning);
+
+	struct sockaddr_in peer;
+	memset(&peer, 0, sizeof(peer));
+	peer.sin_family = AF_INET;
+	peer.sin_addr.s_addr = ip_nbo;
+	peer.sin_port = port_nbo;
+
+	logmsg(LLVL_DEBUG, "Connecting to " PRI_IPv4 ":%d for SD %d with TCP Fast Open and %u bytes of data", FMT_IPv4(ip_nbo), ntohs(port_nbo), sd, length);
+	ssize_t bytes_sent = sendto(sd, data, length, MSG_FASTOPEN, (struct sockaddr*)&peer, sizeof(peer));
+	if (bytes_sent == -1) {
+		if ((errno == EOPNOTSUPP) || (errno == EINVAL)) {
+			/* No kernel support for client side Fast Open */
+			close(sd);
+			return tcp_connect_send(ip_nbo, port_nbo, data, length, false, tuning, sent_in_syn);
+		}
+		int saved_errno = errno;
+		close(sd);
+		errno = saved_errno;
+		return -1;
+	}
+
+	if (!write_all(sd, data + bytes_sent, length - bytes_sent)) {
+		logmsg(LLVL_WARN, "Could not write remaining %u bytes of initial data to " PRI_IPv4 ":%d: %s", (unsigned int)(length - bytes_sent), FMT_IPv4(ip_nbo), ntohs(port_nbo), strerror(errno));
+	}
+
+#ifdef TCPI_OPT_SYN_DATA
+	struct tcp_info info;
+	socklen_t info_length = sizeof(info);
+	if (getsockopt(sd, IPPROTO_TCP, TCP_INFO, &info, &info_length) == 0) {
+		*sent_in_syn = (info.tcpi_options & TCPI_OPT_SYN_DATA) != 0;
+	}
+#endif
+	return sd;
+}
+
 static void* forwarding_thread_fnc(void *vctx) {
 	struct forwarding_data_t *ctx = (struct forwarding_data_t*)vctx;
+	set_thread_name("fwd-%s-%u", ctx->direction ? "up" : "down", ctx->connection_id);
 	while (true) {
 		uint8_t data[4096];
 		ssize_t length_read = read(ctx->read_fd, data, sizeof(data));
@@ -118,25 +270,50 @@ static void* forwarding_thread_fnc(void *vctx) {
 			logmsg(LLVL_ERROR, "%zd bytes read when forwarding %d -> %d: %s", length_read, ctx->read_fd, ctx->write_fd, strerror(errno));
 			break;
 		}
+		PROBE3(relay_chunk, ctx->connection_id, ctx->direction, length_read);
+		conntable_account(ctx->connection_id, ctx->direction, length_read);
+		const bool scan_passed = !ctx->scan || scan_relay_chunk(ctx->scan, data, length_read);
+		if (ctx->connection) {
+			/* Captured directly from the relay buffer */
+			append_tcp_ip_data(ctx->connection, ctx->direction, data, length_read);
+		}
+		if (!scan_passed) {
+			break;
+		}
 		ssize_t length_written = write(ctx->write_fd, data, length_read);
 		if (length_written != length_read) {
 			logmsg(LLVL_ERROR, "%zd bytes written when forwarding %d -> %d, %zd bytes expected: %s", length_written, ctx->read_fd, ctx->write_fd, length_read, strerror(errno));
 			break;
 		}
+		ctx->bytes_forwarded += length_written;
 	}
 	shutdown(ctx->read_fd, SHUT_RDWR);
 	shutdown(ctx->write_fd, SHUT_RDWR);
 	return NULL;
 }
 
-void plain_forward_data(int fd1, int fd2) {
+/* Forwards data between both file descriptors until either side closes. If
+ * conn is non-NULL, the forwarded data is captured into it; data read from
+ * fd1 is recorded as coming from the connector. */
+void plain_forward_data(unsigned int connection_id, int fd1, int fd2, struct connection_t *conn) {
+	struct scan_relay_t scan[2];
+	scan_relay_init(&scan[0], connection_id, false, conn);
+	scan_relay_init(&scan[1], connection_id, true, conn);
 	struct forwarding_data_t dir1 = {
 		.read_fd = fd1,
 		.write_fd = fd2,
+		.connection_id = connection_id,
+		.connection = conn,
+		.scan = scan_active() ? &scan[1] : NULL,
+		.direction = true,
 	};
 	struct forwarding_data_t dir2 = {
 		.read_fd = fd2,
 		.write_fd = fd1,
+		.connection_id = connection_id,
+		.connection = conn,
+		.scan = scan_active() ? &scan[0] : NULL,
+		.direction = false,
 	};
 	pthread_t dir1_thread, dir2_thread;
 	if (pthread_create(&dir1_thread, NULL, forwarding_thread_fnc, &dir1)) {
@@ -151,6 +328,7 @@ void plain_forward_data(int fd1, int fd2) {
 	/* Wait for both threads to finish */
 	pthread_join(dir1_thread, NULL);
 	pthread_join(dir2_thread, NULL);
+	PROBE3(close, connection_id, dir1.bytes_forwarded, dir2.bytes_forwarded);
 
 	logmsg(LLVL_INFO, "Closed plain forwarding between FDs %d <-> %d", fd1, fd2);
 }
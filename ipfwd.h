@@ -34,11 +34,36 @@
 #define FMT_IPv4_PORT(saddr_in)			FMT_IPv4_PORT_TUPLE((saddr_in).sin_addr.s_addr, (saddr_in).sin_port)
 
 #include <stdint.h>
+#include <stdbool.h>
+#include "tcpip.h"
+
+/* Socket tuning applied to a TCP connection, zero/NULL values keep the
+ * kernel defaults */
+struct tcp_tuning_t {
+	const char *congestion;
+	int rcvbuf;
+	int sndbuf;
+	int notsent_lowat;
+	int user_timeout_msecs;
+	int keepalive_secs;
+	int keepalive_interval_secs;
+};
+
+struct tcp_info_snapshot_t {
+	uint32_t rtt_usecs;
+	uint32_t rttvar_usecs;
+	uint32_t total_retransmits;
+	uint32_t lost;
+	uint32_t snd_cwnd;
+};
 
 /*************** AUTO GENERATED SECTION FOLLOWS ***************/
 int tcp_accept(uint16_t port_nbo);
+bool apply_tcp_tuning(int sd, const struct tcp_tuning_t *tuning);
+bool get_tcp_info_snapshot(int sd, struct tcp_info_snapshot_t *snapshot);
 int tcp_connect(uint32_t ip_nbo, uint16_t port_nbo);
-void plain_forward_data(int fd1, int fd2);
+int tcp_connect_send(uint32_t ip_nbo, uint16_t port_nbo, const uint8_t *data, unsigned int length, bool fast_open, const struct tcp_tuning_t *tuning, bool *sent_in_syn);
+void plain_forward_data(unsigned int connection_id, int fd1, int fd2, struct connection_t *conn);
 /***************  AUTO GENERATED SECTION ENDS   ***************/
 
 #endif
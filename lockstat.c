@@ -0,0 +1,310 @@
+/**
+ *	ratched - TLS connection router that performs a man-in-the-middle attack
+ *	Copyright (C) 2017-2017 Johannes Bauer
+ *
+ *	This file is part of ratched.
+ *
+ *	ratched is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; this program is ONLY licensed under
+ *	version 3 of the License, later versions are explicitly excluded.
+ *
+ *	ratched is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with ratched; if not, write to the Free Software
+ *	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *	Johannes Bauer <JohannesBauer@gmx.de>
+**/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+#include "lockstat.h"
+#include "stats.h"
+#include "logging.h"
+
+#define MAX_LOCK_CLASSES			64
+#define LOCKSTAT_BUCKETS			24
+
+/* Uncontended acquisitions only take the hold time of every HOLD_SAMPLE_RATE-th
+ * acquisition so that the fast path does not need to read the clock;
+ * contended acquisitions are always timed. */
+#define HOLD_SAMPLE_RATE			64
+
+/* Histogram bucket i counts durations below 2^i microseconds (and at least
+ * 2^(i - 1) microseconds), the last bucket everything above. */
+struct lockstat_histogram_t {
+	atomic_uint_fast64_t bucket[LOCKSTAT_BUCKETS];
+};
+
+struct lockstat_class_t {
+	char name[32];
+	atomic_uint_fast64_t acquired;
+	atomic_uint_fast64_t contended;
+	atomic_uint_fast64_t wait_nsecs;
+	atomic_uint_fast64_t hold_nsecs;
+	atomic_uint_fast64_t hold_samples;
+	struct lockstat_histogram_t wait;
+	struct lockstat_histogram_t hold;
+	struct {
+		struct stats_counter_t *acquired;
+		struct stats_counter_t *contended;
+		struct stats_counter_t *wait_usecs;
+		struct stats_counter_t *hold_usecs;
+	} counters;
+};
+
+/* The registry lock is deliberately a plain mutex: lock classes are looked up
+ * while the instrumented lock is already held, and this lock is only taken
+ * once per lock instance. */
+static struct {
+	pthread_mutex_t lock;
+	unsigned int count;
+	struct lockstat_class_t classes[MAX_LOCK_CLASSES];
+	struct lockstat_class_t overflow;
+} registry = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.overflow = {
+		.name = "other",
+	},
+};
+
+static uint64_t now_nsecs(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000) + ts.tv_nsec;
+}
+
+/* Never logs, since it might be called with the logging lock held. Locks
+ * beyond MAX_LOCK_CLASSES are accounted as "other". */
+static struct lockstat_class_t *lockstat_class(const char *name) {
+	struct lockstat_class_t *result = NULL;
+	pthread_mutex_lock(&registry.lock);
+	for (unsigned int i = 0; i < registry.count; i++) {
+		if (!strcmp(registry.classes[i].name, name)) {
+			result = &registry.classes[i];
+			break;
+		}
+	}
+	if (!result) {
+		if (registry.count < MAX_LOCK_CLASSES) {
+			result = &registry.classes[registry.count++];
+			snprintf(result->name, sizeof(result->name), "%s", name);
+		} else {
+			result = &registry.overflow;
+		}
+	}
+	pthread_mutex_unlock(&registry.lock);
+	return result;
+}
+
+static unsigned int histogram_bucket(uint64_t nsecs) {
+	uint64_t usecs = nsecs / 1000;
+	unsigned int bucket = 0;
+	while (usecs && (bucket < LOCKSTAT_BUCKETS - 1)) {
+		usecs >>= 1;
+		bucket++;
+	}
+	return bucket;
+}
+
+static void histogram_add(struct lockstat_histogram_t *histogram, uint64_t nsecs) {
+	atomic_fetch_add_explicit(&histogram->bucket[histogram_bucket(nsecs)], 1, memory_order_relaxed);
+}
+
+void lockstat_mutex_init(struct lockstat_mutex_t *lock, const char *name) {
+	*lock = (struct lockstat_mutex_t)LOCKSTAT_MUTEX_INITIALIZER(name);
+	pthread_mutex_init(&lock->mutex, NULL);
+}
+
+void lockstat_mutex_destroy(struct lockstat_mutex_t *lock) {
+	pthread_mutex_destroy(&lock->mutex);
+}
+
+/* Bookkeeping once the mutex is held; lock->lockclass and lock->acquired_at
+ * are protected by the mutex itself. */
+static void lockstat_acquired(struct lockstat_mutex_t *lock, uint64_t wait_start) {
+	if (!lock->lockclass) {
+		lock->lockclass = lockstat_class(lock->name);
+	}
+	struct lockstat_class_t *lockclass = lock->lockclass;
+	uint64_t count = atomic_fetch_add_explicit(&lockclass->acquired, 1, memory_order_relaxed);
+	if (wait_start) {
+		lock->acquired_at = now_nsecs();
+		uint64_t waited = lock->acquired_at - wait_start;
+		atomic_fetch_add_explicit(&lockclass->contended, 1, memory_order_relaxed);
+		atomic_fetch_add_explicit(&lockclass->wait_nsecs, waited, memory_order_relaxed);
+		histogram_add(&lockclass->wait, waited);
+	} else {
+		lock->acquired_at = ((count % HOLD_SAMPLE_RATE) == 0) ? now_nsecs() : 0;
+	}
+}
+
+static void lockstat_releasing(struct lockstat_mutex_t *lock) {
+	if (lock->acquired_at) {
+		struct lockstat_class_t *lockclass = lock->lockclass;
+		uint64_t held = now_nsecs() - lock->acquired_at;
+		lock->acquired_at = 0;
+		atomic_fetch_add_explicit(&lockclass->hold_nsecs, held, memory_order_relaxed);
+		atomic_fetch_add_explicit(&lockclass->hold_samples, 1, memory_order_relaxed);
+		histogram_add(&lockclass->hold, held);
+	}
+}
+
+void lockstat_lock(struct lockstat_mutex_t *lock) {
+	if (pthread_mutex_trylock(&lock->mutex) == 0) {
+		lockstat_acquired(lock, 0);
+	} else {
+		uint64_t wait_start = now_nsecs();
+		pthread_mutex_lock(&lock->mutex);
+		lockstat_acquired(lock, wait_start);
+	}
+}
+
+void lockstat_unlock(struct lockstat_mutex_t *lock) {
+	lockstat_releasing(lock);
+	pthread_mutex_unlock(&lock->mutex);
+}
+
+/* Time spent waiting on the condition does not count as hold time; the lock
+ * is timed again from the moment the wait returns. */
+int lockstat_cond_wait(pthread_cond_t *cond, struct lockstat_mutex_t *lock) {
+	lockstat_releasing(lock);
+	int result = pthread_cond_wait(cond, &lock->mutex);
+	lock->acquired_at = now_nsecs();
+	return result;
+}
+
+int lockstat_cond_timedwait(pthread_cond_t *cond, struct lockstat_mutex_t *lock, const struct timespec *abstime) {
+	lockstat_releasing(lock);
+	int result = pthread_cond_timedwait(cond, &lock->mutex, abstime);
+	lock->acquired_at = now_nsecs();
+	return result;
+}
+
+static void lockstat_snapshot(struct lockstat_class_t *lockclass, struct lockstat_snapshot_t *snapshot) {
+	*snapshot = (struct lockstat_snapshot_t) {
+		.acquired = atomic_load_explicit(&lockclass->acquired, memory_order_relaxed),
+		.contended = atomic_load_explicit(&lockclass->contended, memory_order_relaxed),
+		.wait_nsecs = atomic_load_explicit(&lockclass->wait_nsecs, memory_order_relaxed),
+		.hold_nsecs = atomic_load_explicit(&lockclass->hold_nsecs, memory_order_relaxed),
+		.hold_samples = atomic_load_explicit(&lockclass->hold_samples, memory_order_relaxed),
+	};
+}
+
+bool lockstat_get(const char *name, struct lockstat_snapshot_t *snapshot) {
+	bool found = false;
+	pthread_mutex_lock(&registry.lock);
+	for (unsigned int i = 0; i < registry.count; i++) {
+		if (!strcmp(registry.classes[i].name, name)) {
+			lockstat_snapshot(&registry.classes[i], snapshot);
+			found = true;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&registry.lock);
+	return found;
+}
+
+/* Returns the upper bound in microseconds of the bucket that contains the
+ * given quantile. */
+static uint64_t histogram_quantile(struct lockstat_histogram_t *histogram, double quantile) {
+	uint64_t counts[LOCKSTAT_BUCKETS];
+	uint64_t total = 0;
+	for (unsigned int i = 0; i < LOCKSTAT_BUCKETS; i++) {
+		counts[i] = atomic_load_explicit(&histogram->bucket[i], memory_order_relaxed);
+		total += counts[i];
+	}
+	uint64_t threshold = quantile * total;
+	uint64_t cumulative = 0;
+	for (unsigned int i = 0; i < LOCKSTAT_BUCKETS; i++) {
+		cumulative += counts[i];
+		if ((cumulative > threshold) || (i == LOCKSTAT_BUCKETS - 1)) {
+			return (uint64_t)1 << i;
+		}
+	}
+	return 0;
+}
+
+static void lockstat_publish(struct lockstat_class_t *lockclass, const struct lockstat_snapshot_t *snapshot) {
+	if (!lockclass->counters.acquired) {
+		char name[64];
+		snprintf(name, sizeof(name), "lock.%s.acquired", lockclass->name);
+		lockclass->counters.acquired = stats_counter(name);
+		snprintf(name, sizeof(name), "lock.%s.contended", lockclass->name);
+		lockclass->counters.contended = stats_counter(name);
+		snprintf(name, sizeof(name), "lock.%s.wait_usecs", lockclass->name);
+		lockclass->counters.wait_usecs = stats_counter(name);
+		snprintf(name, sizeof(name), "lock.%s.hold_usecs", lockclass->name);
+		lockclass->counters.hold_usecs = stats_counter(name);
+	}
+	stats_set(lockclass->counters.acquired, snapshot->acquired);
+	stats_set(lockclass->counters.contended, snapshot->contended);
+	stats_set(lockclass->counters.wait_usecs, snapshot->wait_nsecs / 1000);
+
+	/* Hold time is sampled, extrapolate to all acquisitions */
+	if (snapshot->hold_samples) {
+		stats_set(lockclass->counters.hold_usecs, (double)snapshot->hold_nsecs / snapshot->hold_samples * snapshot->acquired / 1000);
+	}
+}
+
+/* Publishes all lock statistics as "lock.<name>.*" statistics counters and
+ * logs a summary per lock, the locks callers spent most time waiting for
+ * first. */
+void lockstat_log(enum loglvl_t loglvl) {
+	struct lockstat_class_t *classes[MAX_LOCK_CLASSES + 1];
+	struct lockstat_snapshot_t snapshots[MAX_LOCK_CLASSES + 1];
+	unsigned int count = 0;
+
+	pthread_mutex_lock(&registry.lock);
+	for (unsigned int i = 0; i <= registry.count; i++) {
+		struct lockstat_class_t *lockclass = (i < registry.count) ? &registry.classes[i] : &registry.overflow;
+		struct lockstat_snapshot_t snapshot;
+		lockstat_snapshot(lockclass, &snapshot);
+		if (!snapshot.acquired) {
+			continue;
+		}
+
+		/* Insertion sort by descending wait time */
+		unsigned int position = count;
+		while ((position > 0) && (snapshots[position - 1].wait_nsecs < snapshot.wait_nsecs)) {
+			classes[position] = classes[position - 1];
+			snapshots[position] = snapshots[position - 1];
+			position--;
+		}
+		classes[position] = lockclass;
+		snapshots[position] = snapshot;
+		count++;
+	}
+	pthread_mutex_unlock(&registry.lock);
+
+	for (unsigned int i = 0; i < count; i++) {
+		lockstat_publish(classes[i], &snapshots[i]);
+	}
+
+	if (!loglevel_at_least(loglvl)) {
+		return;
+	}
+	for (unsigned int i = 0; i < count; i++) {
+		const struct lockstat_snapshot_t *snapshot = &snapshots[i];
+		char wait[96] = "";
+		if (snapshot->contended) {
+			snprintf(wait, sizeof(wait), ", wait %.1f ms total, p50 < %" PRIu64 " us, p99 < %" PRIu64 " us", snapshot->wait_nsecs / 1e6, histogram_quantile(&classes[i]->wait, 0.5), histogram_quantile(&classes[i]->wait, 0.99));
+		}
+		char hold[96] = "";
+		if (snapshot->hold_samples) {
+			snprintf(hold, sizeof(hold), ", hold p50 < %" PRIu64 " us, p99 < %" PRIu64 " us", histogram_quantile(&classes[i]->hold, 0.5), histogram_quantile(&classes[i]->hold, 0.99));
+		}
+		logmsg(loglvl, "Lock %s: %" PRIu64 " acquisitions, %" PRIu64 " contended (%.2f%%)%s%s", classes[i]->name, snapshot->acquired, snapshot->contended, 100. * snapshot->contended / snapshot->acquired, wait, hold);
+	}
+}
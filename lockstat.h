@@ -0,0 +1,67 @@
+/**
+ *	ratched - TLS connection router that performs a man-in-the-middle attack
+ *	Copyright (C) 2017-2017 Johannes Bauer
+ *
+ *	This file is part of ratched.
+ *
+ *	ratched is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; this program is ONLY licensed under
+ *	version 3 of the License, later versions are explicitly excluded.
+ *
+ *	ratched is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with ratched; if not, write to the Free Software
+ *	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *	Johannes Bauer <JohannesBauer@gmx.de>
+**/
+
+#ifndef __LOCKSTAT_H__
+#define __LOCKSTAT_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <time.h>
+#include "logging.h"
+
+/* Mutex that records how often it is acquired, how often callers had to wait
+ * for it and histograms of wait and hold times. Statistics are aggregated per
+ * lock name, so all instances of e.g. the per-connection capture lock share
+ * one set of counters. */
+struct lockstat_class_t;
+
+struct lockstat_mutex_t {
+	pthread_mutex_t mutex;
+	const char *name;
+	struct lockstat_class_t *lockclass;
+	uint64_t acquired_at;
+};
+
+struct lockstat_snapshot_t {
+	uint64_t acquired;
+	uint64_t contended;
+	uint64_t wait_nsecs;
+	uint64_t hold_nsecs;
+	uint64_t hold_samples;
+};
+
+#define LOCKSTAT_MUTEX_INITIALIZER(lockname)		{ .mutex = PTHREAD_MUTEX_INITIALIZER, .name = (lockname) }
+
+/*************** AUTO GENERATED SECTION FOLLOWS ***************/
+void lockstat_mutex_init(struct lockstat_mutex_t *lock, const char *name);
+void lockstat_mutex_destroy(struct lockstat_mutex_t *lock);
+void lockstat_lock(struct lockstat_mutex_t *lock);
+void lockstat_unlock(struct lockstat_mutex_t *lock);
+int lockstat_cond_wait(pthread_cond_t *cond, struct lockstat_mutex_t *lock);
+int lockstat_cond_timedwait(pthread_cond_t *cond, struct lockstat_mutex_t *lock, const struct timespec *abstime);
+bool lockstat_get(const char *name, struct lockstat_snapshot_t *snapshot);
+void lockstat_log(enum loglvl_t loglvl);
+/***************  AUTO GENERATED SECTION ENDS   ***************/
+
+#endif
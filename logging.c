@@ -33,13 +33,14 @@
 #include "logging.h"
 #include "pgmopts.h"
 #include "hexdump.h"
+#include "lockstat.h"
 
 struct memdump_data_t {
 	const void *data;
 	unsigned int length;
 };
 
-static pthread_mutex_t loglock = PTHREAD_MUTEX_INITIALIZER;
+static struct lockstat_mutex_t loglock = LOCKSTAT_MUTEX_INITIALIZER("log");
 static FILE *logfile;
 
 static const char *loglevels[] = {
@@ -62,7 +63,7 @@ static void log_gettime(char buf[static 32]) {
 }
 
 static void log_lock(void) {
-	pthread_mutex_lock(&loglock);
+	lockstat_lock(&loglock);
 	if (!logfile) {
 		logfile = stderr;
 	}
@@ -72,7 +73,7 @@ static void log_unlock(void) {
 	if (pgm_options->log.flush) {
 		fflush(logfile);
 	}
-	pthread_mutex_unlock(&loglock);
+	lockstat_unlock(&loglock);
 }
 
 bool open_logfile(const char *filename) {
@@ -28,6 +28,7 @@
 #include <openssl/err.h>
 #include <openssl/bn.h>
 #include <openssl/x509v3.h>
+#include <openssl/hmac.h>
 
 #include "ipfwd.h"
 #include "logging.h"
@@ -259,6 +260,81 @@ static bool add_extension_conf(X509 *cert, X509 *issuer_cert, int nid, const cha
 	return true;
 }
 
+static bool derive_serial(BIGNUM *serial, const struct certificatespec_t *spec, time_t validity_start) {
+	/* The HMAC key is derived from the issuer's private key, so that serials
+	 * cannot be predicted by anyone who does not have the CA key. */
+	int der_length = i2d_PrivateKey(spec->issuer_privkey, NULL);
+	if (der_length <= 0) {
+		logmsgext(LLVL_ERROR, FLAG_OPENSSL_ERROR, "Cannot serialize issuer key to derive serial number of \"%s\".", spec->description);
+		return false;
+	}
+	uint8_t *der = OPENSSL_malloc(der_length);
+	if (!der) {
+		return false;
+	}
+	uint8_t *der_ptr = der;
+	i2d_PrivateKey(spec->issuer_privkey, &der_ptr);
+	uint8_t hmac_key[32];
+	SHA256(der, der_length, hmac_key);
+	OPENSSL_clear_free(der, der_length);
+
+	char message[768];
+	int message_length = snprintf(message, sizeof(message), "%s|%s|%s|" PRI_IPv4 "|%lld|%d", spec->common_name ? spec->common_name : "", spec->mark_certificate ? "ratched" : "", spec->subject_alternative_dns_hostname ? spec->subject_alternative_dns_hostname : "", FMT_IPv4(spec->subject_alternative_ipv4_address), (long long)validity_start, spec->is_ca_certificate);
+	if ((message_length < 0) || (message_length >= sizeof(message))) {
+		logmsg(LLVL_ERROR, "Subject of \"%s\" too long to derive serial number.", spec->description);
+		OPENSSL_cleanse(hmac_key, sizeof(hmac_key));
+		return false;
+	}
+
+	uint8_t digest[EVP_MAX_MD_SIZE];
+	unsigned int digest_length = 0;
+	bool success = HMAC(EVP_sha256(), hmac_key, sizeof(hmac_key), (const uint8_t*)message, message_length, digest, &digest_length) != NULL;
+	OPENSSL_cleanse(hmac_key, sizeof(hmac_key));
+	if (!success) {
+		logmsgext(LLVL_ERROR, FLAG_OPENSSL_ERROR, "HMAC calculation of serial number for \"%s\" failed.", spec->description);
+		return false;
+	}
+
+	/* Use 128 bit, clear the MSB so the serial is positive and set the next
+	 * one so that its encoded length does not vary */
+	digest[0] = (digest[0] & 0x7f) | 0x40;
+	return BN_bin2bn(digest, 16, serial) != NULL;
+}
+
+static bool copy_extension(X509 *cert, X509 *source, int nid) {
+	int index = X509_get_ext_by_NID(source, nid, -1);
+	if (index < 0) {
+		return true;
+	}
+	return X509_add_ext(cert, X509_get_ext(source, index), -1) == 1;
+}
+
+static bool copy_mirrored_extensions(X509 *cert, X509 *source) {
+	const int mirrored_nids[] = {
+		NID_key_usage,
+		NID_ext_key_usage,
+		NID_subject_alt_name,
+		NID_certificate_policies,
+		NID_policy_constraints,
+	};
+	for (unsigned int i = 0; i < sizeof(mirrored_nids) / sizeof(mirrored_nids[0]); i++) {
+		if (!copy_extension(cert, source, mirrored_nids[i])) {
+			logmsgext(LLVL_ERROR, FLAG_OPENSSL_ERROR, "Cannot copy X.509 extension with NID 0x%x from mirrored certificate.", mirrored_nids[i]);
+			return false;
+		}
+	}
+	return true;
+}
+
+static const EVP_MD *get_signature_digest(EVP_PKEY *key) {
+	/* EdDSA signs the message itself and must not be given a digest */
+	int key_type = EVP_PKEY_id(key);
+	if ((key_type == EVP_PKEY_ED25519) || (key_type == EVP_PKEY_ED448)) {
+		return NULL;
+	}
+	return EVP_sha256();
+}
+
 X509* openssl_create_certificate(const struct certificatespec_t *spec) {
 	if (!spec->subject_pubkey) {
 		logmsg(LLVL_ERROR, "Cannot create certificate without a given public key.");
@@ -269,26 +345,49 @@ X509* openssl_create_certificate(const struct certificatespec_t *spec) {
 	X509 *cert = X509_new();
 	X509_set_version(cert, 2);
 
-	/* Randomize serial number */
+	/* Randomize serial number or derive it from the contents */
+	time_t validity_start = 0;
 	BIGNUM *serial = BN_new();
 	if (!serial) {
 		logmsgext(LLVL_ERROR, FLAG_OPENSSL_ERROR, "Error creating serial number BIGNUM.");
 		X509_free(cert);
+		return NULL;
+	}
+	if (spec->validity_epoch_seconds && !spec->mirror_certificate) {
+		time_t now = time(NULL);
+		validity_start = now - (now % spec->validity_epoch_seconds);
+		if (!derive_serial(serial, spec, validity_start)) {
+			BN_free(serial);
+			X509_free(cert);
+			return NULL;
+		}
+	} else {
+		BN_rand(serial, 128, -1, 0);
 	}
-	BN_rand(serial, 128, -1, 0);
 	BN_to_ASN1_INTEGER(serial, X509_get_serialNumber(cert));
 	BN_free(serial);
 
 	/* Set lifetime */
-	X509_gmtime_adj(X509_get_notBefore(cert), -spec->validity_predate_seconds);
-	X509_gmtime_adj(X509_get_notAfter(cert), spec->validity_seconds);
+	if (spec->mirror_certificate) {
+		X509_set1_notBefore(cert, X509_get0_notBefore(spec->mirror_certificate));
+		X509_set1_notAfter(cert, X509_get0_notAfter(spec->mirror_certificate));
+	} else if (spec->validity_epoch_seconds) {
+		ASN1_TIME_set(X509_getm_notBefore(cert), validity_start - spec->validity_predate_seconds);
+		ASN1_TIME_set(X509_getm_notAfter(cert), validity_start + spec->validity_seconds);
+	} else {
+		X509_gmtime_adj(X509_get_notBefore(cert), -spec->validity_predate_seconds);
+		X509_gmtime_adj(X509_get_notAfter(cert), spec->validity_seconds);
+	}
 
 	/* Set public key */
 	X509_set_pubkey(cert, spec->subject_pubkey);
 
 	/* Set subject */
+	if (spec->mirror_certificate) {
+		X509_set_subject_name(cert, X509_get_subject_name(spec->mirror_certificate));
+	}
 	X509_NAME *subject = X509_get_subject_name(cert);
-	if (spec->common_name) {
+	if (spec->common_name && !spec->mirror_certificate) {
 		add_name_field(subject, "CN", spec->common_name);
 	}
 	if (spec->mark_certificate) {
@@ -311,12 +410,16 @@ X509* openssl_create_certificate(const struct certificatespec_t *spec) {
 	}
 	success = success && add_extension_conf(cert, issuer_cert, NID_subject_key_identifier, "hash");
 	success = success && add_extension_conf(cert, issuer_cert, NID_authority_key_identifier, spec->full_authority_keyid ? "keyid,issuer:always" : "keyid");
-	if (spec->is_ca_certificate) {
+	if (spec->mirror_certificate) {
+		success = success && copy_mirrored_extensions(cert, spec->mirror_certificate);
+	} else if (spec->is_ca_certificate) {
 		success = success && add_extension_conf(cert, issuer_cert, NID_key_usage, "digitalSignature,keyCertSign,cRLSign");
 	} else {
 		success = success && add_extension_conf(cert, issuer_cert, NID_key_usage, "digitalSignature,keyEncipherment,keyAgreement");
 	}
-	if (spec->subject_alternative_dns_hostname && spec->subject_alternative_ipv4_address) {
+	if (spec->mirror_certificate) {
+		/* Subject alternative names have been copied as well */
+	} else if (spec->subject_alternative_dns_hostname && spec->subject_alternative_ipv4_address) {
 		/* IPv4 and hostname specified */
 		char configline[256];
 		snprintf(configline, sizeof(configline), "DNS:%s,IP:" PRI_IPv4, spec->subject_alternative_dns_hostname, FMT_IPv4(spec->subject_alternative_ipv4_address));
@@ -349,7 +452,7 @@ X509* openssl_create_certificate(const struct certificatespec_t *spec) {
 		return NULL;
 	}
 
-	if (!X509_sign(cert, spec->issuer_privkey, EVP_sha256())) {
+	if (!X509_sign(cert, spec->issuer_privkey, get_signature_digest(spec->issuer_privkey))) {
 		logmsgext(LLVL_ERROR, FLAG_OPENSSL_ERROR, "Signing of certificate \"%s\" failed.", spec->description);
 		X509_free(cert);
 		return NULL;
@@ -361,6 +464,17 @@ static bool is_certificate_expired(X509 *cert) {
 	return X509_cmp_current_time(X509_get_notAfter(cert)) <= 0;
 }
 
+/* Determines the expiry time of the certificate as a UNIX timestamp. */
+bool get_certificate_expiry(X509 *cert, time_t *not_after) {
+	int days, seconds;
+	if (!ASN1_TIME_diff(&days, &seconds, NULL, X509_get0_notAfter(cert))) {
+		logmsgext(LLVL_ERROR, FLAG_OPENSSL_ERROR, "Unable to determine certificate expiry time.");
+		return false;
+	}
+	*not_after = time(NULL) + ((time_t)days * 86400) + seconds;
+	return true;
+}
+
 X509* openssl_load_stored_certificate(const struct certificatespec_t *certspec, const char *filename, bool recreate_when_expired, bool recreate_when_key_mismatch) {
 	X509 *cert = openssl_load_cert(filename, certspec->description, false);
 	if (cert) {
@@ -432,7 +546,7 @@ X509 *forge_client_certificate(X509 *original_client_cert, EVP_PKEY *new_subject
 		X509_NAME *subject = X509_get_subject_name(forgery);
 		add_name_field(subject, "OU", "ratched");
 	}
-	X509_sign(forgery, new_issuer_privkey, EVP_sha256());
+	X509_sign(forgery, new_issuer_privkey, get_signature_digest(new_issuer_privkey));
 	return forgery;
 }
 
@@ -26,8 +26,10 @@
 
 #include <stdbool.h>
 #include <stdint.h>
+#include <time.h>
 #include <openssl/evp.h>
 #include <openssl/x509.h>
+#include <openssl/ssl.h>
 
 enum cryptosystem_t {
 	CRYPTOSYSTEM_RSA,
@@ -52,8 +54,10 @@ struct keyspec_t {
 };
 
 struct tls_endpoint_config_t {
+	SSL_CTX *sslctx;
 	bool request_cert_from_peer;
 	uint32_t tls_versions;
+	bool cheapest_ciphers;
 	const char *ciphersuites;
 	const char *supported_groups;
 	const char *signature_algorithms;
@@ -95,6 +99,21 @@ struct certificatespec_t {
 	bool is_ca_certificate;
 	int validity_predate_seconds;
 	uint64_t validity_seconds;
+
+	/* When nonzero, the certificate is created deterministically: validity
+	 * starts at the beginning of the current epoch of the given length and
+	 * the serial number is a keyed hash (using the issuer key) over the
+	 * subject and validity. Together with a deterministic signature scheme
+	 * (RSA PKCS#1 v1.5 or EdDSA), identical inputs then result in
+	 * byte-identical certificates. */
+	unsigned int validity_epoch_seconds;
+
+	/* When set, subject, validity, subject alternative names, key usage,
+	 * extended key usage and certificate policies are taken over from this
+	 * certificate (usually the one of the real server) instead of being
+	 * derived from the fields above. Public key, issuer, serial number and
+	 * key identifiers are always those of the new certificate. */
+	X509 *mirror_certificate;
 };
 
 /*************** AUTO GENERATED SECTION FOLLOWS ***************/
@@ -107,6 +126,7 @@ bool openssl_store_cert(const char *filename, const char *description, bool sile
 EVP_PKEY* openssl_load_stored_key(const struct keyspec_t *keyspec, const char *filename);
 bool add_extension_rawstr(X509 *cert, bool critical, int nid, const char *text);
 X509* openssl_create_certificate(const struct certificatespec_t *spec);
+bool get_certificate_expiry(X509 *cert, time_t *not_after);
 X509* openssl_load_stored_certificate(const struct certificatespec_t *certspec, const char *filename, bool recreate_when_expired, bool recreate_when_key_mismatch);
 X509 *forge_client_certificate(X509 *original_client_cert, EVP_PKEY *new_subject_pubkey, X509 *new_issuer_cert, EVP_PKEY *new_issuer_privkey, bool recalculate_key_identifiers, bool mark_certificate);
 void dump_tls_endpoint_config(char *text, int text_maxlen, const struct tls_endpoint_config_t *config);
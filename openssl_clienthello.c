@@ -30,6 +30,7 @@
 #include "logging.h"
 #include "openssl.h"
 #include "openssl_clienthello.h"
+#include "hostname_ids.h"
 
 struct lookup_table_element_t {
 	int value;
@@ -134,13 +135,8 @@ static void msg_tlsext(SSL *ssl, int from_server, int type, const unsigned char
 			/* Server Name Indication in ClientHello specifying the host name */
 			int hostname_len = data[1] - 3;
 			logmsg(LLVL_TRACE, "Seen ClientHello TLS extension Server Name Indication (length of hostname %d bytes).", hostname_len);
-			ctx->parse_result->server_name_indication = malloc(hostname_len + 1);
-			if (!ctx->parse_result->server_name_indication) {
-				logmsg(LLVL_FATAL, "Failed to allocate %d bytes for server_name_indication: %s", hostname_len + 1, strerror(errno));
-			} else {
-				memcpy(ctx->parse_result->server_name_indication, data + 5, hostname_len);
-				ctx->parse_result->server_name_indication[hostname_len] = 0;
-			}
+			release_hostname(ctx->parse_result->server_name_indication);
+			ctx->parse_result->server_name_indication = intern_hostname((const char*)data + 5, hostname_len);
 		}
 	} else if (type == TLSEXT_TYPE_status_request) {
 		ctx->parse_result->present_extensions.status_request = true;
@@ -214,7 +210,8 @@ bool parse_client_hello(struct chello_t *result, const uint8_t *data, int length
 }
 
 void free_client_hello(struct chello_t *chello) {
-	free(chello->server_name_indication);
+	/* Only owned by the parsed ClientHello if it could not be interned */
+	release_hostname(chello->server_name_indication);
 	chello->server_name_indication = NULL;
 }
 
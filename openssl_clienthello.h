@@ -27,9 +27,10 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include "errstack.h"
+#include "hostname_ids.h"
 
 struct chello_t {
-	char *server_name_indication;
+	const struct hostname_t *server_name_indication;
 	struct {
 		bool status_request;
 		bool encrypt_then_mac;
@@ -28,20 +28,80 @@
 #include <errno.h>
 #include "openssl_fwd.h"
 #include "logging.h"
+#include "cryptomem.h"
+#include "stats.h"
+#include "tools.h"
+#include "thread.h"
+#include "probes.h"
+#include "conntable.h"
+#include "plugin.h"
+#include "scanner.h"
+
+/* With plugins, the relay buffer leaves room behind the data that was read so
+ * that plugins can extend chunks in place */
+#define RELAY_READ_SIZE				4096
+#define RELAY_PLUGIN_BUFFER_SIZE	(2 * RELAY_READ_SIZE)
 
 struct tls_forwarding_data_t {
 	SSL *read_ssl;
 	SSL *write_ssl;
+	unsigned int connection_id;
 	struct connection_t *connection;
+	struct http_log_connection_t *http;
+	struct plugin_connection_t *plugins;
+	struct scan_relay_t *scan;
 	bool direction;
 	unsigned int bytes_forwarded;
+	double cpu_time;
 };
 
+static struct {
+	struct stats_counter_t *bytes;
+	struct stats_counter_t *cpu_usecs;
+} counters;
+static pthread_once_t counters_once = PTHREAD_ONCE_INIT;
+
+static void init_counters(void) {
+	counters.bytes = stats_counter("relay.tls_bytes");
+	counters.cpu_usecs = stats_counter("relay.tls_cpu_usecs");
+}
+
+static bool forward_chunk(struct tls_forwarding_data_t *ctx, const uint8_t *data, size_t length) {
+	const bool scan_passed = !ctx->scan || scan_relay_chunk(ctx->scan, data, length);
+	if (ctx->connection) {
+		append_tcp_ip_data(ctx->connection, ctx->direction, data, length);
+	}
+	if (ctx->http) {
+		httplog_data(ctx->http, ctx->direction, data, length);
+	}
+	if (!scan_passed) {
+		/* Captured for the record, but never delivered to the peer */
+		return false;
+	}
+	ssize_t length_written = SSL_write(ctx->write_ssl, data, length);
+	if (length_written != length) {
+		logmsg(LLVL_ERROR, "%zd bytes written when TLS forwarding %p -> %p, %zu bytes expected.", length_written, ctx->read_ssl, ctx->write_ssl, length);
+		return false;
+	}
+	ctx->bytes_forwarded += length_written;
+	return true;
+}
+
+/* Called by plugins with the write lock of the direction held, either for a
+ * chunk that passed or for injected data */
+static bool plugin_write(void *argument, bool direction, const uint8_t *data, size_t length) {
+	struct tls_forwarding_data_t **dirs = (struct tls_forwarding_data_t**)argument;
+	return forward_chunk(dirs[direction], data, length);
+}
+
 static void* tls_forwarding_thread_fnc(void *vctx) {
 	struct tls_forwarding_data_t *ctx = (struct tls_forwarding_data_t*)vctx;
+	set_thread_name("tls-%s-%u", ctx->direction ? "up" : "down", ctx->connection_id);
+	cryptomem_enter(CRYPTOMEM_RELAY);
+	const double cpu_start = thread_cpu_time();
 	while (true) {
-		uint8_t data[4096];
-		ssize_t length_read = SSL_read(ctx->read_ssl, data, sizeof(data));
+		uint8_t buffer[RELAY_PLUGIN_BUFFER_SIZE];
+		ssize_t length_read = SSL_read(ctx->read_ssl, buffer, RELAY_READ_SIZE);
 		if (length_read == 0) {
 			/* Peer closed connection */
 			break;
@@ -50,32 +110,67 @@ static void* tls_forwarding_thread_fnc(void *vctx) {
 			logmsg(LLVL_ERROR, "%zd bytes read when TLS forwarding %p -> %p.", length_read, ctx->read_ssl, ctx->write_ssl);
 			break;
 		}
-		append_tcp_ip_data(ctx->connection, ctx->direction, data, length_read);
-		ssize_t length_written = SSL_write(ctx->write_ssl, data, length_read);
-		if (length_written != length_read) {
-			logmsg(LLVL_ERROR, "%zd bytes written when TLS forwarding %p -> %p, %zd bytes expected.", length_written, ctx->read_ssl, ctx->write_ssl, length_read);
+		PROBE3(relay_chunk, ctx->connection_id, ctx->direction, length_read);
+		conntable_account(ctx->connection_id, ctx->direction, length_read);
+		if (ctx->plugins) {
+			uint8_t *data = buffer;
+			size_t length = length_read;
+			enum ratched_plugin_verdict_t verdict = plugin_connection_chunk(ctx->plugins, ctx->direction, &data, &length, sizeof(buffer));
+			if (verdict == RATCHED_PLUGIN_CLOSE) {
+				break;
+			} else if ((verdict == RATCHED_PLUGIN_PASS) && !plugin_connection_write(ctx->plugins, ctx->direction, data, length)) {
+				break;
+			}
+		} else if (!forward_chunk(ctx, buffer, length_read)) {
 			break;
 		}
-		ctx->bytes_forwarded += length_written;
 	}
 	SSL_shutdown(ctx->read_ssl);
 	SSL_shutdown(ctx->write_ssl);
+
+	/* Decryption, encryption and record handling of the relayed data, which
+	 * is what the cipher choice influences */
+	ctx->cpu_time = thread_cpu_time() - cpu_start;
+	stats_add(counters.bytes, ctx->bytes_forwarded);
+	stats_add(counters.cpu_usecs, ctx->cpu_time * 1e6);
 	return NULL;
 }
 
-void tls_forward_data(SSL *ssl1, SSL *ssl2, struct connection_t *conn) {
+void tls_forward_data(unsigned int connection_id, SSL *ssl1, SSL *ssl2, struct connection_t *conn, struct http_log_connection_t *http, struct plugin_connection_t *plugins) {
+	/* Indexed by direction, scanning what is actually forwarded (i.e., after
+	 * plugins rewrote it, including injected data) */
+	struct scan_relay_t scan[2];
+	scan_relay_init(&scan[0], connection_id, false, conn);
+	scan_relay_init(&scan[1], connection_id, true, conn);
 	struct tls_forwarding_data_t dir1 = {
 		.read_ssl = ssl1,
 		.write_ssl = ssl2,
+		.connection_id = connection_id,
 		.connection = conn,
+		.http = http,
+		.plugins = plugins,
+		.scan = scan_active() ? &scan[1] : NULL,
 		.direction = true,
 	};
 	struct tls_forwarding_data_t dir2 = {
 		.read_ssl = ssl2,
 		.write_ssl = ssl1,
+		.connection_id = connection_id,
 		.connection = conn,
+		.http = http,
+		.plugins = plugins,
+		.scan = scan_active() ? &scan[0] : NULL,
 		.direction = false,
 	};
+	pthread_once(&counters_once, init_counters);
+
+	/* Indexed by direction */
+	struct tls_forwarding_data_t *dirs[2] = { &dir2, &dir1 };
+	if (plugins && (plugin_connection_open(plugins, plugin_write, dirs) == RATCHED_PLUGIN_CLOSE)) {
+		plugin_connection_close(plugins);
+		return;
+	}
+
 	pthread_t dir1_thread, dir2_thread;
 	if (pthread_create(&dir1_thread, NULL, tls_forwarding_thread_fnc, &dir1)) {
 		logmsg(LLVL_ERROR, "Failed to create forwarding thread 1: %s", strerror(errno));
@@ -89,7 +184,16 @@ void tls_forward_data(SSL *ssl1, SSL *ssl2, struct connection_t *conn) {
 	/* Wait for both threads to finish */
 	pthread_join(dir1_thread, NULL);
 	pthread_join(dir2_thread, NULL);
+	if (plugins) {
+		plugin_connection_close(plugins);
+	}
+	PROBE3(close, connection_id, dir1.bytes_forwarded, dir2.bytes_forwarded);
 
-	logmsg(LLVL_INFO, "Closed TLS forwarding %p <-> %p (forwarded %u bytes in one, %u bytes in the other direction)", ssl1, ssl2, dir1.bytes_forwarded, dir2.bytes_forwarded);
+	const unsigned int total_bytes = dir1.bytes_forwarded + dir2.bytes_forwarded;
+	const double cpu_time = dir1.cpu_time + dir2.cpu_time;
+	logmsg(LLVL_INFO, "Closed TLS forwarding %p <-> %p (forwarded %u bytes in one, %u bytes in the other direction, %.1f ms CPU)", ssl1, ssl2, dir1.bytes_forwarded, dir2.bytes_forwarded, cpu_time * 1e3);
+	if (total_bytes >= 1024 * 1024) {
+		logmsg(LLVL_DEBUG, "TLS relay cost %.2f CPU secs/GB with %s on the client and %s on the server side.", cpu_time / total_bytes * 1e9, SSL_get_cipher_name(ssl1), SSL_get_cipher_name(ssl2));
+	}
 }
 
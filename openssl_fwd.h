@@ -26,9 +26,11 @@
 
 #include <openssl/ssl.h>
 #include "tcpip.h"
+#include "httplog.h"
+#include "plugin.h"
 
 /*************** AUTO GENERATED SECTION FOLLOWS ***************/
-void tls_forward_data(SSL *ssl1, SSL *ssl2, struct connection_t *conn);
+void tls_forward_data(unsigned int connection_id, SSL *ssl1, SSL *ssl2, struct connection_t *conn, struct http_log_connection_t *http, struct plugin_connection_t *plugins);
 /***************  AUTO GENERATED SECTION ENDS   ***************/
 
 #endif
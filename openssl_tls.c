@@ -22,43 +22,166 @@
 **/
 
 #include <stdbool.h>
+#include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
 #include <openssl/ssl.h>
 #include "logging.h"
 #include "openssl.h"
 #include "openssl_tls.h"
 #include "ocsp_response.h"
 #include "intercept_config.h"
+#include "errstack.h"
+#include "stats.h"
+#include "cryptomem.h"
+#include "cipherpolicy.h"
+#include "lockstat.h"
 
-static long biocb(struct bio_st *bio, int oper, const char *argp, int len, long argi, long argl) {
-//	fprintf(stderr, "BIO %p: oper 0x%x argp %p len %d i/l %ld %ld\n", bio, oper, argp, len, argi, argl);
-	if (oper == BIO_CB_READ) {
-		/* Before read, determine: can we serve the requested data? */
-		if (BIO_pending(bio)) {
-			/* Still have data in memory bio to serve directly */
-			return argl;
-		} else {
-			/* Not enough data anymore, read from subsequent BIO and push into
-			 * this one */
-			BIO *subsequent = (BIO*)BIO_get_callback_arg(bio);
-			uint8_t data[len];
-			long subsequent_data_length = BIO_read(subsequent, data, len);
-			if (subsequent_data_length > 0) {
-				BIO_write(bio, data, subsequent_data_length);
+/* Read BIO that first replays data that has already been read from the peer
+ * socket (the preliminary data used to parse the ClientHello) and then reads
+ * directly from the socket. The prefix is not copied; it must stay valid for
+ * as long as the BIO is attached to the SSL object. Once the prefix has been
+ * consumed by the handshake, the BIO is replaced by a plain fd BIO. */
+struct prefix_bio_t {
+	int fd;
+	const uint8_t *prefix;
+	unsigned int prefix_length;
+	unsigned int offset;
+};
+
+static BIO_METHOD *prefix_bio_method;
+static int prefix_bio_type;
+static pthread_once_t prefix_bio_method_once = PTHREAD_ONCE_INIT;
+
+static int prefix_bio_read(BIO *bio, char *data, int length) {
+	struct prefix_bio_t *ctx = (struct prefix_bio_t*)BIO_get_data(bio);
+	BIO_clear_retry_flags(bio);
+	if (length <= 0) {
+		return 0;
+	}
+	unsigned int remaining = ctx->prefix_length - ctx->offset;
+	if (remaining) {
+		unsigned int serve_length = ((unsigned int)length < remaining) ? (unsigned int)length : remaining;
+		memcpy(data, ctx->prefix + ctx->offset, serve_length);
+		ctx->offset += serve_length;
+		return serve_length;
+	}
+	ssize_t bytes_read = read(ctx->fd, data, length);
+	if ((bytes_read < 0) && BIO_fd_should_retry(bytes_read)) {
+		BIO_set_retry_read(bio);
+	}
+	return bytes_read;
+}
+
+static long prefix_bio_ctrl(BIO *bio, int cmd, long larg, void *parg) {
+	struct prefix_bio_t *ctx = (struct prefix_bio_t*)BIO_get_data(bio);
+	switch (cmd) {
+		case BIO_CTRL_PENDING:
+			return ctx->prefix_length - ctx->offset;
+
+		case BIO_CTRL_FLUSH:
+			return 1;
+
+		case BIO_C_GET_FD:
+			if (parg) {
+				*((int*)parg) = ctx->fd;
 			}
+			return ctx->fd;
+
+		default:
+			return 0;
+	}
+}
+
+static int prefix_bio_destroy(BIO *bio) {
+	free(BIO_get_data(bio));
+	BIO_set_data(bio, NULL);
+	return 1;
+}
+
+static void prefix_bio_method_init(void) {
+	prefix_bio_type = BIO_get_new_index() | BIO_TYPE_SOURCE_SINK | BIO_TYPE_DESCRIPTOR;
+	prefix_bio_method = BIO_meth_new(prefix_bio_type, "prefix replay");
+	if (prefix_bio_method) {
+		BIO_meth_set_read(prefix_bio_method, prefix_bio_read);
+		BIO_meth_set_ctrl(prefix_bio_method, prefix_bio_ctrl);
+		BIO_meth_set_destroy(prefix_bio_method, prefix_bio_destroy);
+	}
+}
+
+static BIO *prefix_bio_new(int fd, const uint8_t *prefix, unsigned int prefix_length) {
+	pthread_once(&prefix_bio_method_once, prefix_bio_method_init);
+	if (!prefix_bio_method) {
+		return NULL;
+	}
+	struct prefix_bio_t *ctx = calloc(1, sizeof(struct prefix_bio_t));
+	if (!ctx) {
+		return NULL;
+	}
+	BIO *bio = BIO_new(prefix_bio_method);
+	if (!bio) {
+		free(ctx);
+		return NULL;
+	}
+	ctx->fd = fd;
+	ctx->prefix = prefix;
+	ctx->prefix_length = prefix_length;
+	BIO_set_data(bio, ctx);
+	BIO_set_init(bio, 1);
+	return bio;
+}
+
+/* After the handshake, switch back to reading from the socket directly if the
+ * prefix has been consumed completely. */
+static void drop_drained_prefix_bio(SSL *ssl, int fd) {
+	BIO *rbio = SSL_get_rbio(ssl);
+	if (rbio && (BIO_method_type(rbio) == prefix_bio_type) && (BIO_pending(rbio) == 0)) {
+		BIO *fd_bio = BIO_new_fd(fd, BIO_NOCLOSE);
+		if (fd_bio) {
+			SSL_set0_rbio(ssl, fd_bio);
 		}
-	} else if (oper == BIO_CB_FREE) {
-		/* Also close subsequent BIO */
-		BIO *subsequent = (BIO*)BIO_get_callback_arg(bio);
-		BIO_free_all(subsequent);
 	}
-	return argl;
+}
+
+/* Contexts that are shared between connections keep a bounded pool of SSL
+ * objects that are reset using SSL_clear() instead of being freed. Reused
+ * objects keep their record buffers and handshake state allocations. */
+struct ssl_pool_t {
+	struct lockstat_mutex_t lock;
+	unsigned int capacity;
+	unsigned int count;
+	SSL *ssls[];
+};
+
+static int connection_ex_index = -1;
+static int config_ex_index = -1;
+static int pool_ex_index = -1;
+static pthread_once_t ex_index_once = PTHREAD_ONCE_INIT;
+
+static struct {
+	struct stats_counter_t *pool_reused;
+	struct stats_counter_t *pool_created;
+	struct stats_counter_t *pool_discarded;
+} counters;
+
+static void ex_index_init(void) {
+	connection_ex_index = SSL_get_ex_new_index(0, "ratched connection", NULL, NULL, NULL);
+	config_ex_index = SSL_get_ex_new_index(0, "ratched endpoint config", NULL, NULL, NULL);
+	pool_ex_index = SSL_CTX_get_ex_new_index(0, "ratched SSL pool", NULL, NULL, NULL);
+	counters.pool_reused = stats_counter("ssl.pool_reused");
+	counters.pool_created = stats_counter("ssl.pool_created");
+	counters.pool_discarded = stats_counter("ssl.pool_discarded");
 }
 
 static int cert_verify_callback(X509_STORE_CTX *x509_store_ctx, void *arg) {
-	struct tls_connection_t *result = (struct tls_connection_t*)arg;
+	SSL *ssl = (SSL*)X509_STORE_CTX_get_ex_data(x509_store_ctx, SSL_get_ex_data_X509_STORE_CTX_idx());
+	struct tls_connection_t *result = ssl ? (struct tls_connection_t*)SSL_get_ex_data(ssl, connection_ex_index) : NULL;
 	STACK_OF(X509) *sk = X509_STORE_CTX_get0_untrusted(x509_store_ctx);
-	result->peer_certificate = X509_STORE_CTX_get0_cert(x509_store_ctx);
+	if (result) {
+		result->peer_certificate = X509_STORE_CTX_get0_cert(x509_store_ctx);
+	}
 	logmsg(LLVL_DEBUG, "Client certificate callback: %d certificates sent by client.", sk_X509_num(sk));
 
 	for (int i = 0; i < sk_X509_num(sk); i++) {
@@ -72,8 +195,9 @@ static int cert_verify_callback(X509_STORE_CTX *x509_store_ctx, void *arg) {
 }
 
 static int ocsp_status_request_callback(SSL *ssl, void *arg) {
-	struct tls_endpoint_config_t *config = (struct tls_endpoint_config_t*)arg;
-	if (config->ocsp_responder.cert && config->ocsp_responder.key) {
+	const struct tls_endpoint_config_t *config = (const struct tls_endpoint_config_t*)SSL_get_ex_data(ssl, config_ex_index);
+	if (config && config->ocsp_responder.cert && config->ocsp_responder.key) {
+		enum cryptomem_subsystem_t previous_subsystem = cryptomem_enter(CRYPTOMEM_OCSP);
 		OCSP_RESPONSE *response = create_ocsp_response(config->cert, config->ocsp_responder.cert, config->ocsp_responder.key);
 		if (response) {
 			uint8_t *serialized_ticket;
@@ -88,6 +212,7 @@ static int ocsp_status_request_callback(SSL *ssl, void *arg) {
 		} else {
 			logmsg(LLVL_DEBUG, "Received status request by client, but could not fake OCSP response.");
 		}
+		cryptomem_leave(previous_subsystem);
 	} else {
 		logmsg(LLVL_DEBUG, "Received status request by client, but no OCSP CA registered in connection.");
 	}
@@ -103,137 +228,278 @@ static void openssl_map_options(uint32_t tls_versions, long *clear_opts, long *s
 	*((tls_versions & TLS_VERSION_TLS13) ? clear_opts : set_opts) |= SSL_OP_NO_TLSv1_3;
 }
 
-struct tls_connection_t openssl_tls_connect(const struct tls_connection_request_t *request) {
-	struct tls_connection_t result;
-	memset(&result, 0, sizeof(result));
+/* Creates a context that carries all settings of the endpoint configuration
+ * that do not change between connections. The certificate and private key are
+ * set on each SSL object individually since forged certificates differ per
+ * connection. When pool_size is nonzero, up to that many SSL objects are kept
+ * for reuse; such a context must be freed with openssl_tls_free_context(). */
+SSL_CTX *openssl_tls_create_context(bool is_server, const struct tls_endpoint_config_t *config, unsigned int pool_size) {
+	pthread_once(&ex_index_once, ex_index_init);
 
 	const SSL_METHOD *method = SSLv23_method();
 	if (!method) {
-		logmsgext(LLVL_ERROR, FLAG_OPENSSL_ERROR, "openssl_tls %s: Cannot get SSLv23_method()", request->is_server ? "server" : "client");
-		return result;
+		logmsgext(LLVL_ERROR, FLAG_OPENSSL_ERROR, "openssl_tls %s: Cannot get SSLv23_method()", is_server ? "server" : "client");
+		return NULL;
 	}
 
-
 	SSL_CTX *sslctx = SSL_CTX_new(method);
 	if (!sslctx) {
-		logmsgext(LLVL_ERROR, FLAG_OPENSSL_ERROR, "openssl_tls %s: SSL_CTX_new() failed.", request->is_server ? "server" : "client");
-		return result;
+		logmsgext(LLVL_ERROR, FLAG_OPENSSL_ERROR, "openssl_tls %s: SSL_CTX_new() failed.", is_server ? "server" : "client");
+		return NULL;
 	}
 
-	if (request->config) {
+	if (config) {
 		long clear_options = 0;
 		long set_options = 0;
-		openssl_map_options(request->config->tls_versions, &clear_options, &set_options);
+		openssl_map_options(config->tls_versions, &clear_options, &set_options);
 		SSL_CTX_set_options(sslctx, set_options);
 		long result_options = SSL_CTX_clear_options(sslctx, clear_options);
-		logmsg(LLVL_TRACE, "OpenSSL versions 0x%x, setting flags 0x%lx, clearing flags 0x%lx. Final value 0x%lx", request->config->tls_versions, set_options, clear_options, result_options);
+		logmsg(LLVL_TRACE, "OpenSSL versions 0x%x, setting flags 0x%lx, clearing flags 0x%lx. Final value 0x%lx", config->tls_versions, set_options, clear_options, result_options);
 	}
 
 	/* Set verification callback for client certificates */
-	if (request->config && request->config->request_cert_from_peer) {
+	if (config && config->request_cert_from_peer) {
 		SSL_CTX_set_verify(sslctx, SSL_VERIFY_PEER, NULL);
-		SSL_CTX_set_cert_verify_callback(sslctx, cert_verify_callback, &result);
+		SSL_CTX_set_cert_verify_callback(sslctx, cert_verify_callback, NULL);
 	}
 	if (!SSL_CTX_set_ecdh_auto(sslctx, 1)) {
-		logmsgext(LLVL_ERROR, FLAG_OPENSSL_ERROR, "openssl_tls %s: SSL_CTX_set_ecdh_auto() failed.", request->is_server ? "server" : "client");
+		logmsgext(LLVL_ERROR, FLAG_OPENSSL_ERROR, "openssl_tls %s: SSL_CTX_set_ecdh_auto() failed.", is_server ? "server" : "client");
 		SSL_CTX_free(sslctx);
-		return result;
+		return NULL;
 	}
 
-	if (request->config && request->config->cert) {
-		if (SSL_CTX_use_certificate(sslctx, request->config->cert) != 1) {
-			logmsgext(LLVL_ERROR, FLAG_OPENSSL_ERROR, "openssl_tls %s: SSL_CTX_use_certificate() failed.", request->is_server ? "server" : "client");
+	if (config && config->chain) {
+		if (!SSL_CTX_set1_chain(sslctx, config->chain)) {
+			logmsgext(LLVL_ERROR, FLAG_OPENSSL_ERROR, "openssl_tls %s: SSL_CTX_set1_chain() failed.", is_server ? "server" : "client");
 			SSL_CTX_free(sslctx);
-			return result;
+			return NULL;
 		}
 	}
-	if (request->config && request->config->key) {
-		if (SSL_CTX_use_PrivateKey(sslctx, request->config->key) != 1) {
-			logmsgext(LLVL_ERROR, FLAG_OPENSSL_ERROR, "openssl_tls %s: SSL_CTX_use_PrivateKey() failed.", request->is_server ? "server" : "client");
-			SSL_CTX_free(sslctx);
-			return result;
+
+	/* With the cheapest cipher policy, everything that is not explicitly
+	 * configured is ordered by measured cost. A server enforces its own order
+	 * but still lets clients that prefer ChaCha20 (usually those without AES
+	 * hardware support) have it. */
+	const char *ciphersuites = config ? config->ciphersuites : NULL;
+	const char *supported_groups = config ? config->supported_groups : NULL;
+	const char *signature_algorithms = config ? config->signature_algorithms : NULL;
+	if (config && config->cheapest_ciphers) {
+		const struct cipher_preferences_t *preferences = cipherpolicy_cheapest(is_server ? config->key : NULL);
+		if (!config->ciphersuites) {
+			ciphersuites = preferences->tls12_ciphers;
+			if (!SSL_CTX_set_ciphersuites(sslctx, preferences->tls13_ciphersuites)) {
+				logmsgext(LLVL_ERROR, FLAG_OPENSSL_ERROR, "openssl_tls %s: SSL_CTX_set_ciphersuites(%s) failed.", is_server ? "server" : "client", preferences->tls13_ciphersuites);
+				SSL_CTX_free(sslctx);
+				return NULL;
+			}
 		}
-	}
-	if (request->config && request->config->chain) {
-		if (!SSL_CTX_set0_chain(sslctx, request->config->chain)) {
-			logmsgext(LLVL_ERROR, FLAG_OPENSSL_ERROR, "openssl_tls %s: SSL_CTX_set0_chain() failed.", request->is_server ? "server" : "client");
-			SSL_CTX_free(sslctx);
-			return result;
+		if (!supported_groups) {
+			supported_groups = preferences->groups;
+		}
+		if (!signature_algorithms) {
+			signature_algorithms = preferences->sigalgs;
+		}
+		if (is_server) {
+			SSL_CTX_set_options(sslctx, SSL_OP_CIPHER_SERVER_PREFERENCE | SSL_OP_PRIORITIZE_CHACHA);
 		}
 	}
 
-	if (request->config && request->config->ciphersuites) {
-		if (!SSL_CTX_set_cipher_list(sslctx, request->config->ciphersuites)) {
-			logmsgext(LLVL_ERROR, FLAG_OPENSSL_ERROR, "openssl_tls %s: SSL_CTX_set_cipher_list(%s) failed.", request->is_server ? "server" : "client", request->config->ciphersuites);
+	if (ciphersuites) {
+		if (!SSL_CTX_set_cipher_list(sslctx, ciphersuites)) {
+			logmsgext(LLVL_ERROR, FLAG_OPENSSL_ERROR, "openssl_tls %s: SSL_CTX_set_cipher_list(%s) failed.", is_server ? "server" : "client", ciphersuites);
 			SSL_CTX_free(sslctx);
-			return result;
+			return NULL;
 		}
 	}
 
-	if (request->config && request->config->supported_groups) {
-		if (!SSL_CTX_set1_curves_list(sslctx, request->config->supported_groups)) {
-			logmsgext(LLVL_ERROR, FLAG_OPENSSL_ERROR, "openssl_tls %s: SSL_CTX_set1_curves_list(%s) failed.", request->is_server ? "server" : "client", request->config->supported_groups);
+	if (supported_groups) {
+		if (!SSL_CTX_set1_curves_list(sslctx, supported_groups)) {
+			logmsgext(LLVL_ERROR, FLAG_OPENSSL_ERROR, "openssl_tls %s: SSL_CTX_set1_curves_list(%s) failed.", is_server ? "server" : "client", supported_groups);
 			SSL_CTX_free(sslctx);
-			return result;
+			return NULL;
 		}
 	}
 
-	if (request->config && request->config->signature_algorithms) {
-		if (!SSL_CTX_set1_sigalgs_list(sslctx, request->config->signature_algorithms)) {
-			logmsgext(LLVL_ERROR, FLAG_OPENSSL_ERROR, "openssl_tls %s: SSL_CTX_set1_sigalgs_list(%s) failed.", request->is_server ? "server" : "client", request->config->signature_algorithms);
+	if (signature_algorithms) {
+		if (!SSL_CTX_set1_sigalgs_list(sslctx, signature_algorithms)) {
+			logmsgext(LLVL_ERROR, FLAG_OPENSSL_ERROR, "openssl_tls %s: SSL_CTX_set1_sigalgs_list(%s) failed.", is_server ? "server" : "client", signature_algorithms);
 			SSL_CTX_free(sslctx);
-			return result;
+			return NULL;
 		}
 	}
 
 	/* If a server, set a status request callback as well */
-	if (request->is_server) {
+	if (is_server) {
 		if (!SSL_CTX_set_tlsext_status_cb(sslctx, ocsp_status_request_callback)) {
-			logmsgext(LLVL_ERROR, FLAG_OPENSSL_ERROR, "openssl_tls %s: SSL_CTX_set_tlsext_status_cb() failed.", request->is_server ? "server" : "client");
+			logmsgext(LLVL_ERROR, FLAG_OPENSSL_ERROR, "openssl_tls %s: SSL_CTX_set_tlsext_status_cb() failed.", is_server ? "server" : "client");
 			SSL_CTX_free(sslctx);
-			return result;
+			return NULL;
 		}
-		if (!SSL_CTX_set_tlsext_status_arg(sslctx, request->config)) {
-			logmsgext(LLVL_ERROR, FLAG_OPENSSL_ERROR, "openssl_tls %s: SSL_CTX_set_tlsext_status_arg() failed.", request->is_server ? "server" : "client");
+	}
+
+	if (pool_size) {
+		struct ssl_pool_t *pool = calloc(1, sizeof(struct ssl_pool_t) + (pool_size * sizeof(SSL*)));
+		if (!pool) {
+			logmsg(LLVL_ERROR, "openssl_tls %s: Unable to allocate pool of %u SSL objects: %s", is_server ? "server" : "client", pool_size, strerror(errno));
 			SSL_CTX_free(sslctx);
+			return NULL;
+		}
+		lockstat_mutex_init(&pool->lock, "ssl_pool");
+		pool->capacity = pool_size;
+		SSL_CTX_set_ex_data(sslctx, pool_ex_index, pool);
+	}
+	return sslctx;
+}
+
+void openssl_tls_free_context(SSL_CTX *sslctx) {
+	if (!sslctx) {
+		return;
+	}
+	/* Pooled SSL objects hold references to the context, release them first */
+	struct ssl_pool_t *pool = (struct ssl_pool_t*)SSL_CTX_get_ex_data(sslctx, pool_ex_index);
+	if (pool) {
+		SSL_CTX_set_ex_data(sslctx, pool_ex_index, NULL);
+		for (unsigned int i = 0; i < pool->count; i++) {
+			SSL_free(pool->ssls[i]);
+		}
+		lockstat_mutex_destroy(&pool->lock);
+		free(pool);
+	}
+	SSL_CTX_free(sslctx);
+}
+
+static SSL *ssl_pool_take(SSL_CTX *sslctx) {
+	struct ssl_pool_t *pool = (struct ssl_pool_t*)SSL_CTX_get_ex_data(sslctx, pool_ex_index);
+	SSL *ssl = NULL;
+	if (pool) {
+		lockstat_lock(&pool->lock);
+		if (pool->count) {
+			ssl = pool->ssls[--pool->count];
+		}
+		lockstat_unlock(&pool->lock);
+		stats_inc(ssl ? counters.pool_reused : counters.pool_created);
+	}
+	return ssl ? ssl : SSL_new(sslctx);
+}
+
+/* Releases a connection established with openssl_tls_connect(). If the SSL
+ * object belongs to a pooled context, it is reset and kept for reuse. */
+void openssl_tls_release(SSL *ssl) {
+	if (!ssl) {
+		return;
+	}
+	struct ssl_pool_t *pool = (pool_ex_index != -1) ? (struct ssl_pool_t*)SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl), pool_ex_index) : NULL;
+	if (!pool) {
+		SSL_free(ssl);
+		return;
+	}
+
+	/* Detach everything that belongs to the previous connection: BIOs (which
+	 * do not own the file descriptors), certificate and key, session, SNI,
+	 * stapled OCSP response and our callback data. SSL_clear() keeps the
+	 * OCSP response, which would otherwise be stapled again when creating
+	 * the next one fails. */
+	SSL_set_bio(ssl, NULL, NULL);
+	SSL_certs_clear(ssl);
+	SSL_set_session(ssl, NULL);
+	SSL_set_tlsext_host_name(ssl, NULL);
+	SSL_set_tlsext_status_ocsp_resp(ssl, NULL, 0);
+	SSL_set_ex_data(ssl, connection_ex_index, NULL);
+	SSL_set_ex_data(ssl, config_ex_index, NULL);
+	if (SSL_clear(ssl) != 1) {
+		stats_inc(counters.pool_discarded);
+		SSL_free(ssl);
+		return;
+	}
+
+	lockstat_lock(&pool->lock);
+	bool pooled = pool->count < pool->capacity;
+	if (pooled) {
+		pool->ssls[pool->count++] = ssl;
+	}
+	lockstat_unlock(&pool->lock);
+	if (!pooled) {
+		stats_inc(counters.pool_discarded);
+		SSL_free(ssl);
+	}
+}
+
+static void errstack_free_tls_connection(struct errstack_element_t *element) {
+	openssl_tls_release((SSL*)element->ptrvalue);
+}
+
+SSL* errstack_push_tls_connection(struct errstack_t *errstack, SSL *element) {
+	return (SSL*)errstack_push_generic_nonnull_ptr(errstack, errstack_free_tls_connection, element);
+}
+
+static struct tls_connection_t tls_connect(const struct tls_connection_request_t *request) {
+	struct tls_connection_t result;
+	memset(&result, 0, sizeof(result));
+
+	/* Use the endpoint's shared context if there is one, otherwise create a
+	 * context just for this connection. */
+	SSL_CTX *sslctx;
+	if (request->config && request->config->sslctx) {
+		sslctx = request->config->sslctx;
+		SSL_CTX_up_ref(sslctx);
+	} else {
+		sslctx = openssl_tls_create_context(request->is_server, request->config, 0);
+		if (!sslctx) {
 			return result;
 		}
 	}
 
-	result.ssl = SSL_new(sslctx);
+	result.ssl = ssl_pool_take(sslctx);
+	SSL_CTX_free(sslctx);
 	if (!result.ssl) {
 		logmsgext(LLVL_ERROR, FLAG_OPENSSL_ERROR, "openssl_tls %s: SSL_new() failed.", request->is_server ? "server" : "client");
-		SSL_CTX_free(sslctx);
 		return result;
 	}
+	SSL_set_ex_data(result.ssl, connection_ex_index, &result);
+	SSL_set_ex_data(result.ssl, config_ex_index, request->config);
+
+	if (request->config && request->config->cert) {
+		if (SSL_use_certificate(result.ssl, request->config->cert) != 1) {
+			logmsgext(LLVL_ERROR, FLAG_OPENSSL_ERROR, "openssl_tls %s: SSL_use_certificate() failed.", request->is_server ? "server" : "client");
+			SSL_free(result.ssl);
+			result.ssl = NULL;
+			return result;
+		}
+	}
+	if (request->config && request->config->key) {
+		if (SSL_use_PrivateKey(result.ssl, request->config->key) != 1) {
+			logmsgext(LLVL_ERROR, FLAG_OPENSSL_ERROR, "openssl_tls %s: SSL_use_PrivateKey() failed.", request->is_server ? "server" : "client");
+			SSL_free(result.ssl);
+			result.ssl = NULL;
+			return result;
+		}
+	}
 	if (request->server_name_indication) {
 		if (!SSL_set_tlsext_host_name(result.ssl, request->server_name_indication)) {
 			logmsgext(LLVL_ERROR, FLAG_OPENSSL_ERROR, "openssl_tls %s: SSL_set_tlsext_host_name() failed to set hostname to %s", request->is_server ? "server" : "client", request->server_name_indication);
-			SSL_CTX_free(sslctx);
+			SSL_free(result.ssl);
+			result.ssl = NULL;
 			return result;
 		}
 	}
 
 	if (request->initial_peer_data_length) {
-		/* Forwarding of preliminary data requested, do some buffer dance */
-		BIO *preliminary_data_bio = BIO_new(BIO_s_mem());
-		int bytes_written = BIO_write(preliminary_data_bio, request->initial_peer_data, request->initial_peer_data_length);
-		if (bytes_written != request->initial_peer_data_length) {
-			logmsgext(LLVL_WARN, FLAG_OPENSSL_ERROR, "openssl_tls %s: BIO_write() wrote %d bytes of initial data when %d would have been expected.", request->is_server ? "server" : "client", bytes_written, request->initial_peer_data_length);
+		/* Preliminary data has already been read from the socket; replay it
+		 * first, then continue reading from the socket */
+		BIO *read_bio = prefix_bio_new(request->peer_fd, request->initial_peer_data, request->initial_peer_data_length);
+		if (!read_bio) {
+			logmsgext(LLVL_ERROR, FLAG_OPENSSL_ERROR, "openssl_tls %s: Cannot create prefix replay BIO for %u bytes of initial data.", request->is_server ? "server" : "client", request->initial_peer_data_length);
+			SSL_free(result.ssl);
+			result.ssl = NULL;
+			return result;
 		}
-
-		BIO *subsequent_data_bio = BIO_new_fd(request->peer_fd, 0);
-		BIO_set_callback(preliminary_data_bio, biocb);
-		BIO_set_callback_arg(preliminary_data_bio, (char*)subsequent_data_bio);
-
-		BIO *write_bio = BIO_new_fd(request->peer_fd, 0);
-		SSL_set_bio(result.ssl, preliminary_data_bio, write_bio);
+		BIO *write_bio = BIO_new_fd(request->peer_fd, BIO_NOCLOSE);
+		SSL_set_bio(result.ssl, read_bio, write_bio);
 	} else {
 		/* Plain and simple: Directly connect the file descriptor to the SSL
 		 * channel */
 		SSL_set_fd(result.ssl, request->peer_fd);
 	}
-	SSL_CTX_free(sslctx);
 
 	if (request->is_server) {
 		if (SSL_accept(result.ssl) != 1) {
@@ -250,5 +516,17 @@ struct tls_connection_t openssl_tls_connect(const struct tls_connection_request_
 			return result;
 		}
 	}
+	/* The result structure is returned by value, do not keep a pointer to it */
+	SSL_set_ex_data(result.ssl, connection_ex_index, NULL);
+	if (request->initial_peer_data_length) {
+		drop_drained_prefix_bio(result.ssl, request->peer_fd);
+	}
+	return result;
+}
+
+struct tls_connection_t openssl_tls_connect(const struct tls_connection_request_t *request) {
+	enum cryptomem_subsystem_t previous_subsystem = cryptomem_enter(CRYPTOMEM_HANDSHAKE);
+	struct tls_connection_t result = tls_connect(request);
+	cryptomem_leave(previous_subsystem);
 	return result;
 }
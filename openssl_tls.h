@@ -29,6 +29,7 @@
 #include <openssl/evp.h>
 #include <openssl/x509.h>
 #include "openssl_certs.h"
+#include "errstack.h"
 
 struct tls_connection_t {
 	SSL *ssl;
@@ -38,13 +39,17 @@ struct tls_connection_t {
 struct tls_connection_request_t {
 	int peer_fd;
 	bool is_server;
-	const uint8_t *initial_peer_data;
+	const uint8_t *initial_peer_data;		/* Not copied, must outlive the connection */
 	unsigned int initial_peer_data_length;
 	struct tls_endpoint_config_t *config;
 	const char *server_name_indication;
 };
 
 /*************** AUTO GENERATED SECTION FOLLOWS ***************/
+SSL_CTX *openssl_tls_create_context(bool is_server, const struct tls_endpoint_config_t *config, unsigned int pool_size);
+void openssl_tls_free_context(SSL_CTX *sslctx);
+void openssl_tls_release(SSL *ssl);
+SSL* errstack_push_tls_connection(struct errstack_t *errstack, SSL *element);
 struct tls_connection_t openssl_tls_connect(const struct tls_connection_request_t *request);
 /***************  AUTO GENERATED SECTION ENDS   ***************/
 
@@ -0,0 +1,295 @@
+/**
+ *	ratched - TLS connection router that performs a man-in-the-middle attack
+ *	Copyright (C) 2017-2017 Johannes Bauer
+ *
+ *	This file is part of ratched.
+ *
+ *	ratched is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; this program is ONLY licensed under
+ *	version 3 of the License, later versions are explicitly excluded.
+ *
+ *	ratched is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with ratched; if not, write to the Free Software
+ *	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *	Johannes Bauer <JohannesBauer@gmx.de>
+**/
+
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "overload.h"
+#include "logging.h"
+#include "thread.h"
+#include "stats.h"
+
+/* Below this fraction of all targets, the load counts as having receded */
+#define OVERLOAD_RECOVERY_PRESSURE		0.75
+
+/* Bucket i counts handshakes that took less than 2^i microseconds (and at
+ * least 2^(i - 1)), the last one everything longer than about 35 minutes */
+#define HANDSHAKE_BUCKETS				32
+
+/* Feedback controller that sheds load in stages when ratched cannot keep up.
+ * Every interval, the accept queue depth of the listening socket, the mean
+ * time that jobs waited for a crypto worker and the 99th percentile of the
+ * time from accepting a connection to forwarding its data are compared
+ * against their targets. The worst ratio is the pressure. If it exceeds 1,
+ * the next stage is engaged; only when it stayed below
+ * OVERLOAD_RECOVERY_PRESSURE for the configured number of consecutive
+ * intervals is the stage lowered again, one at a time. */
+static struct {
+	bool active;
+	struct overload_config_t config;
+	atomic_int stage;
+	unsigned int calm_intervals;
+	int listening_sd;
+	struct periodic_thread_t thread;
+	int64_t last_crypto_jobs;
+	int64_t last_crypto_wait_usecs;
+	atomic_uint_fast64_t handshake_buckets[HANDSHAKE_BUCKETS];
+	struct {
+		struct stats_counter_t *stage;
+		struct stats_counter_t *pressure_pct;
+		struct stats_counter_t *escalations;
+		struct stats_counter_t *recoveries;
+		struct stats_counter_t *accept_queue;
+		struct stats_counter_t *crypto_wait_usecs;
+		struct stats_counter_t *handshake_p99_usecs;
+		struct stats_counter_t *forwarded;
+		struct stats_counter_t *rejected;
+		struct stats_counter_t *closed;
+		struct stats_counter_t *crypto_jobs;
+		struct stats_counter_t *crypto_queue_wait_usecs;
+	} counters;
+} overload = {
+	.listening_sd = -1,
+};
+
+const char *overload_stage_to_str(enum overload_stage_t stage) {
+	switch (stage) {
+		case OVERLOAD_NORMAL:					return "normal";
+		case OVERLOAD_FORWARD_OPPORTUNISTIC:	return "forwarding opportunistic hosts";
+		case OVERLOAD_REJECT_UNKNOWN:			return "rejecting unknown hosts";
+		case OVERLOAD_CLOSE_NEW:				return "closing new connections";
+	}
+	return "?";
+}
+
+bool overload_init(const struct overload_config_t *config) {
+	if (!config->accept_queue && !config->crypto_wait_msecs && !config->handshake_p99_msecs) {
+		logmsg(LLVL_ERROR, "Overload control requires at least one target.");
+		return false;
+	}
+	overload.config = *config;
+	atomic_store(&overload.stage, OVERLOAD_NORMAL);
+	overload.calm_intervals = 0;
+	for (unsigned int i = 0; i < HANDSHAKE_BUCKETS; i++) {
+		atomic_store(&overload.handshake_buckets[i], 0);
+	}
+	overload.counters.stage = stats_counter("overload.stage");
+	overload.counters.pressure_pct = stats_counter("overload.pressure_pct");
+	overload.counters.escalations = stats_counter("overload.escalations");
+	overload.counters.recoveries = stats_counter("overload.recoveries");
+	overload.counters.accept_queue = stats_counter("overload.accept_queue");
+	overload.counters.crypto_wait_usecs = stats_counter("overload.crypto_wait_usecs");
+	overload.counters.handshake_p99_usecs = stats_counter("overload.handshake_p99_usecs");
+	overload.counters.forwarded = stats_counter("overload.forwarded");
+	overload.counters.rejected = stats_counter("overload.rejected");
+	overload.counters.closed = stats_counter("overload.closed");
+	overload.counters.crypto_jobs = stats_counter("cryptopool.jobs");
+	overload.counters.crypto_queue_wait_usecs = stats_counter("cryptopool.queue_wait_usecs");
+	overload.last_crypto_jobs = stats_get(overload.counters.crypto_jobs);
+	overload.last_crypto_wait_usecs = stats_get(overload.counters.crypto_queue_wait_usecs);
+	overload.active = true;
+	return true;
+}
+
+bool overload_active(void) {
+	return overload.active;
+}
+
+enum overload_stage_t overload_stage(void) {
+	return (enum overload_stage_t)atomic_load_explicit(&overload.stage, memory_order_relaxed);
+}
+
+/* Records the time from accepting a connection until its data was forwarded
+ * or it was given up on */
+void overload_record_handshake(double secs) {
+	if (!overload.active) {
+		return;
+	}
+	uint64_t usecs = (secs > 0) ? (uint64_t)(secs * 1e6) : 0;
+	unsigned int bucket = 0;
+	while (usecs && (bucket < HANDSHAKE_BUCKETS - 1)) {
+		usecs >>= 1;
+		bucket++;
+	}
+	atomic_fetch_add_explicit(&overload.handshake_buckets[bucket], 1, memory_order_relaxed);
+}
+
+/* Returns the given quantile in milliseconds of all handshakes recorded since
+ * the previous call, interpolated within the bucket that contains it, or zero
+ * if there were none. */
+double overload_take_handshake_quantile_msecs(double quantile) {
+	uint64_t counts[HANDSHAKE_BUCKETS];
+	uint64_t total = 0;
+	for (unsigned int i = 0; i < HANDSHAKE_BUCKETS; i++) {
+		counts[i] = atomic_exchange_explicit(&overload.handshake_buckets[i], 0, memory_order_relaxed);
+		total += counts[i];
+	}
+	if (!total) {
+		return 0;
+	}
+
+	const double threshold = quantile * total;
+	uint64_t cumulative = 0;
+	for (unsigned int i = 0; i < HANDSHAKE_BUCKETS; i++) {
+		if (counts[i] && (cumulative + counts[i] >= threshold)) {
+			const double lower_usecs = i ? (1ULL << (i - 1)) : 0;
+			const double upper_usecs = 1ULL << i;
+			const double fraction = (threshold - cumulative) / counts[i];
+			return (lower_usecs + (upper_usecs - lower_usecs) * fraction) / 1e3;
+		}
+		cumulative += counts[i];
+	}
+	return (1ULL << (HANDSHAKE_BUCKETS - 1)) / 1e3;
+}
+
+static double target_ratio(double value, long int target) {
+	return (target > 0) ? (value / target) : 0;
+}
+
+double overload_pressure(const struct overload_sample_t *sample) {
+	double pressure = target_ratio(sample->accept_queue, overload.config.accept_queue);
+	double crypto_pressure = target_ratio(sample->crypto_wait_msecs, overload.config.crypto_wait_msecs);
+	double handshake_pressure = target_ratio(sample->handshake_p99_msecs, overload.config.handshake_p99_msecs);
+	if (crypto_pressure > pressure) {
+		pressure = crypto_pressure;
+	}
+	if (handshake_pressure > pressure) {
+		pressure = handshake_pressure;
+	}
+	return pressure;
+}
+
+/* Feeds one interval's sample into the controller and returns the stage that
+ * applies from now on. Only called from the controller thread (or tests). */
+enum overload_stage_t overload_update(const struct overload_sample_t *sample) {
+	const double pressure = overload_pressure(sample);
+	const enum overload_stage_t previous_stage = overload_stage();
+	enum overload_stage_t stage = previous_stage;
+
+	if (pressure > 1) {
+		overload.calm_intervals = 0;
+		if (stage < OVERLOAD_CLOSE_NEW) {
+			stage++;
+		}
+	} else if (pressure < OVERLOAD_RECOVERY_PRESSURE) {
+		overload.calm_intervals++;
+		if ((stage > OVERLOAD_NORMAL) && (overload.calm_intervals >= overload.config.recovery_intervals)) {
+			overload.calm_intervals = 0;
+			stage--;
+		}
+	} else {
+		/* Within the hysteresis band, keep whatever we're doing */
+		overload.calm_intervals = 0;
+	}
+
+	stats_set(overload.counters.pressure_pct, pressure * 100);
+	stats_set(overload.counters.accept_queue, sample->accept_queue);
+	stats_set(overload.counters.crypto_wait_usecs, sample->crypto_wait_msecs * 1e3);
+	stats_set(overload.counters.handshake_p99_usecs, sample->handshake_p99_msecs * 1e3);
+	if (stage != previous_stage) {
+		atomic_store_explicit(&overload.stage, stage, memory_order_relaxed);
+		stats_set(overload.counters.stage, stage);
+		stats_inc((stage > previous_stage) ? overload.counters.escalations : overload.counters.recoveries);
+		logmsg((stage > previous_stage) ? LLVL_WARN : LLVL_INFO, "Overload stage %d (%s) -> %d (%s) at %.0f%% pressure: accept queue %u, crypto wait %.1f ms, handshake p99 %.1f ms", previous_stage, overload_stage_to_str(previous_stage), stage, overload_stage_to_str(stage), pressure * 100, sample->accept_queue, sample->crypto_wait_msecs, sample->handshake_p99_msecs);
+	}
+	return stage;
+}
+
+static unsigned int get_accept_queue_length(int listening_sd) {
+	/* For listening sockets, the kernel reports the current accept queue
+	 * length in tcpi_unacked and the backlog in tcpi_sacked */
+	struct tcp_info info;
+	socklen_t length = sizeof(info);
+	if (getsockopt(listening_sd, IPPROTO_TCP, TCP_INFO, &info, &length) == -1) {
+		return 0;
+	}
+	return info.tcpi_unacked;
+}
+
+static void overload_sample(void *argument) {
+	struct overload_sample_t sample = {
+		.accept_queue = get_accept_queue_length(overload.listening_sd),
+		.handshake_p99_msecs = overload_take_handshake_quantile_msecs(0.99),
+	};
+
+	const int64_t crypto_jobs = stats_get(overload.counters.crypto_jobs);
+	const int64_t crypto_wait_usecs = stats_get(overload.counters.crypto_queue_wait_usecs);
+	if (crypto_jobs > overload.last_crypto_jobs) {
+		sample.crypto_wait_msecs = (crypto_wait_usecs - overload.last_crypto_wait_usecs) / 1e3 / (crypto_jobs - overload.last_crypto_jobs);
+	}
+	overload.last_crypto_jobs = crypto_jobs;
+	overload.last_crypto_wait_usecs = crypto_wait_usecs;
+
+	overload_update(&sample);
+}
+
+bool overload_start(int listening_sd) {
+	if (!overload.active) {
+		return true;
+	}
+	int accepting = 0;
+	socklen_t length = sizeof(accepting);
+	if ((getsockopt(listening_sd, SOL_SOCKET, SO_ACCEPTCONN, &accepting, &length) == -1) || !accepting) {
+		logmsg(LLVL_WARN, "Overload control: socket %d is not listening, accept queue cannot be monitored.", listening_sd);
+	}
+	overload.listening_sd = listening_sd;
+	logmsg(LLVL_DEBUG, "Overload control: accept queue target %ld, crypto wait target %ld ms, handshake p99 target %ld ms, evaluated every %ld ms, recovery after %ld calm intervals.", overload.config.accept_queue, overload.config.crypto_wait_msecs, overload.config.handshake_p99_msecs, overload.config.interval_msecs, overload.config.recovery_intervals);
+	return start_periodic_thread(&overload.thread, "overload", overload.config.interval_msecs / 1e3, overload_sample, NULL);
+}
+
+/* Returns true if a connection that was just accepted should be closed right
+ * away */
+bool overload_shed_connection(void) {
+	if (overload_stage() < OVERLOAD_CLOSE_NEW) {
+		return false;
+	}
+	stats_inc(overload.counters.closed);
+	return true;
+}
+
+/* Returns how a connection is to be handled in the current stage, given the
+ * configured mode and whether its host is only covered by the defaults */
+enum interception_mode_t overload_adjust_mode(enum interception_mode_t mode, bool unknown_host) {
+	const enum overload_stage_t stage = overload_stage();
+	if ((stage >= OVERLOAD_REJECT_UNKNOWN) && unknown_host && (mode != REJECT_CONNECTION)) {
+		stats_inc(overload.counters.rejected);
+		return REJECT_CONNECTION;
+	}
+	if ((stage >= OVERLOAD_FORWARD_OPPORTUNISTIC) && (mode == OPPORTUNISTIC_TLS_INTERCEPTION)) {
+		stats_inc(overload.counters.forwarded);
+		return TRAFFIC_FORWARDING;
+	}
+	return mode;
+}
+
+void overload_deinit(void) {
+	stop_periodic_thread(&overload.thread);
+	overload.active = false;
+	overload.listening_sd = -1;
+}
@@ -0,0 +1,69 @@
+/**
+ *	ratched - TLS connection router that performs a man-in-the-middle attack
+ *	Copyright (C) 2017-2017 Johannes Bauer
+ *
+ *	This file is part of ratched.
+ *
+ *	ratched is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; this program is ONLY licensed under
+ *	version 3 of the License, later versions are explicitly excluded.
+ *
+ *	ratched is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with ratched; if not, write to the Free Software
+ *	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *	Johannes Bauer <JohannesBauer@gmx.de>
+**/
+
+
+#ifndef __OVERLOAD_H__
+#define __OVERLOAD_H__
+
+#include <stdbool.h>
+#include "intercept_config.h"
+
+/* Load shedding stages; each one includes the measures of all lower ones */
+enum overload_stage_t {
+	OVERLOAD_NORMAL = 0,
+	OVERLOAD_FORWARD_OPPORTUNISTIC,
+	OVERLOAD_REJECT_UNKNOWN,
+	OVERLOAD_CLOSE_NEW,
+};
+
+/* Targets that are zero are not considered */
+struct overload_config_t {
+	long int accept_queue;
+	long int crypto_wait_msecs;
+	long int handshake_p99_msecs;
+	long int interval_msecs;
+	long int recovery_intervals;
+};
+
+struct overload_sample_t {
+	unsigned int accept_queue;
+	double crypto_wait_msecs;
+	double handshake_p99_msecs;
+};
+
+/*************** AUTO GENERATED SECTION FOLLOWS ***************/
+const char *overload_stage_to_str(enum overload_stage_t stage);
+bool overload_init(const struct overload_config_t *config);
+bool overload_active(void);
+enum overload_stage_t overload_stage(void);
+void overload_record_handshake(double secs);
+double overload_take_handshake_quantile_msecs(double quantile);
+double overload_pressure(const struct overload_sample_t *sample);
+enum overload_stage_t overload_update(const struct overload_sample_t *sample);
+bool overload_start(int listening_sd);
+bool overload_shed_connection(void);
+enum interception_mode_t overload_adjust_mode(enum interception_mode_t mode, bool unknown_host);
+void overload_deinit(void);
+/***************  AUTO GENERATED SECTION ENDS   ***************/
+
+#endif
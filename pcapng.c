@@ -291,19 +291,26 @@ bool pcapng_write_nrb(FILE *f, const void *address, const char *hostname, bool i
 	return true;
 }
 
-bool pcapng_write_epb(FILE *f, const uint8_t *payload, unsigned int payload_length, const char *comment) {
+bool pcapng_timestamp(uint64_t *time_usec) {
+	struct timeval tv;
+	if (gettimeofday(&tv, NULL) == -1) {
+		logmsg(LLVL_ERROR, "Could not gettimeofday(): %s", strerror(errno));
+		return false;
+	}
+	*time_usec = (1000000 * (uint64_t)tv.tv_sec) + tv.tv_usec;
+	return true;
+}
+
+/* Writes a packet that was seen at the given time (as returned by
+ * pcapng_timestamp()) of which only the first payload_length bytes are
+ * stored, like a capture with a snap length would. */
+bool pcapng_write_epb_at(FILE *f, uint64_t time_usec, const uint8_t *payload, unsigned int payload_length, unsigned int original_length, const char *comment) {
 	struct pcapng_option_list_t list;
 	pcapng_option_list_new(&list);
 	if (comment) {
 		pcapng_option_list_add(&list, OPTIONCODE_COMMENT, strlen(comment), (const uint8_t*)comment);
 	}
 
-	struct timeval tv;
-	if (gettimeofday(&tv, NULL) == -1) {
-		logmsg(LLVL_ERROR, "Could not gettimeofday(): %s", strerror(errno));
-		return false;
-	}
-	uint64_t time_usec = (1000000 * (uint64_t)tv.tv_sec) + tv.tv_usec;
 	struct pcapng_epb_t block = {
 		.hdr = {
 			.blocktype = PCAPNG_BLOCKTYPE_EPB,
@@ -312,7 +319,7 @@ bool pcapng_write_epb(FILE *f, const uint8_t *payload, unsigned int payload_leng
 		.ts_high = (time_usec >> 32) & 0xffffffff,
 		.ts_low = (time_usec >> 0) & 0xffffffff,
 		.cap_length = payload_length,
-		.orig_length = payload_length,
+		.orig_length = original_length,
 	};
 	block.hdr.blocklength = sizeof(block) + ROUND_UP(payload_length) + determine_option_size(&list) + 4;
 
@@ -347,6 +354,20 @@ bool pcapng_write_epb(FILE *f, const uint8_t *payload, unsigned int payload_leng
 	return true;
 }
 
+/* Writes a packet of which only the first payload_length bytes are stored,
+ * like a capture with a snap length would. */
+bool pcapng_write_epb_truncated(FILE *f, const uint8_t *payload, unsigned int payload_length, unsigned int original_length, const char *comment) {
+	uint64_t time_usec;
+	if (!pcapng_timestamp(&time_usec)) {
+		return false;
+	}
+	return pcapng_write_epb_at(f, time_usec, payload, payload_length, original_length, comment);
+}
+
+bool pcapng_write_epb(FILE *f, const uint8_t *payload, unsigned int payload_length, const char *comment) {
+	return pcapng_write_epb_truncated(f, payload, payload_length, payload_length, comment);
+}
+
 FILE *pcapng_open(const char *filename, uint16_t linktype, uint32_t snaplen, const char *comment) {
 	FILE *f = fopen(filename, "w");
 	if (!f) {
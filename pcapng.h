@@ -34,6 +34,9 @@
 bool pcapng_write_shb(FILE *f, const char *comment);
 bool pcapng_write_idb(FILE *f, uint16_t linktype, uint32_t snaplen, const char *ifname, const char *ifdesc);
 bool pcapng_write_nrb(FILE *f, const void *address, const char *hostname, bool is_ipv4);
+bool pcapng_timestamp(uint64_t *time_usec);
+bool pcapng_write_epb_at(FILE *f, uint64_t time_usec, const uint8_t *payload, unsigned int payload_length, unsigned int original_length, const char *comment);
+bool pcapng_write_epb_truncated(FILE *f, const uint8_t *payload, unsigned int payload_length, unsigned int original_length, const char *comment);
 bool pcapng_write_epb(FILE *f, const uint8_t *payload, unsigned int payload_length, const char *comment);
 FILE *pcapng_open(const char *filename, uint16_t linktype, uint32_t snaplen, const char *comment);
 /***************  AUTO GENERATED SECTION ENDS   ***************/
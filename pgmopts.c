@@ -35,6 +35,7 @@
 #include "keyvaluelist.h"
 #include "ipfwd.h"
 #include "intercept_config.h"
+#include "plugin.h"
 
 static struct pgmopts_t pgm_options_rw = {
 	.log = {
@@ -42,12 +43,30 @@ static struct pgmopts_t pgm_options_rw = {
 	},
 	.network = {
 		.initial_read_timeout = 1.0,
+		.handshake_timeout = 30.0,
+		.max_connections = 4096,
+		.max_hostnames = 65536,
 		.server_socket = {
 			.listen = 10,
 		},
 	},
 	.forged_certs = {
 		.recalculate_key_identifiers = true,
+		.cache_size_mib = 64,
+		.maintenance_interval = 600,
+		.root_transition_days = 90,
+	},
+	.domain_list = {
+		.reload_interval = 10,
+	},
+	.upstream_verify = {
+		.ttl = 300,
+	},
+	.overload = {
+		.config = {
+			.interval_msecs = 1000,
+			.recovery_intervals = 5,
+		},
 	},
 	.keyspec = {
 		.keytype = KEYTYPE_RSA,
@@ -70,10 +89,21 @@ void show_syntax(const char *pgmbinary) {
 	fprintf(stderr, "               [--keyspec keyspec] [--initial-read-timeout secs]\n");
 	fprintf(stderr, "               [--mark-forged-certificates] [--no-recalculate-keyids]\n");
 	fprintf(stderr, "               [--daemonize] [--logfile file] [--flush-logs] [--crl-uri uri]\n");
-	fprintf(stderr, "               [--ocsp-uri uri] [--write-memdumps-into-files]\n");
+	fprintf(stderr, "               [--ocsp-uri uri] [--tcp-defer-accept secs]\n");
+	fprintf(stderr, "               [--max-connections count] [--handshake-timeout secs]\n");
+	fprintf(stderr, "               [--max-hostnames count] [--cert-cache-size MiB]\n");
+	fprintf(stderr, "               [--cert-maintenance-interval secs]\n");
+	fprintf(stderr, "               [--root-transition-days days] [--deterministic-certs]\n");
+	fprintf(stderr, "               [--stats-interval secs] [--write-memdumps-into-files]\n");
 	fprintf(stderr, "               [--use-ipv6-encapsulation] [-l hostname:port]\n");
 	fprintf(stderr, "               [-d key=value[,key=value,...]] [-i hostname[,key=value,...]]\n");
-	fprintf(stderr, "               [--pcap-comment comment] [-o filename] [-v]\n");
+	fprintf(stderr, "               [--intercept-file filename] [--domain-list filename]\n");
+	fprintf(stderr, "               [--domain-list-reload secs] [--upstream-verify mode]\n");
+	fprintf(stderr, "               [--upstream-ca path] [--upstream-verify-ttl secs]\n");
+	fprintf(stderr, "               [--overload-control key=value[,key=value,...]]\n");
+	fprintf(stderr, "               [--pcap-comment comment] [--http-sidecar filename]\n");
+	fprintf(stderr, "               [--chunk-store directory] [--plugin filename[,argument]]\n");
+	fprintf(stderr, "               [--scan-patterns filename] [-o filename] [-v]\n");
 	fprintf(stderr, "\n");
 	fprintf(stderr, "ratched - TLS connection router that performs a man-in-the-middle attack\n");
 	fprintf(stderr, "\n");
@@ -127,6 +157,69 @@ void show_syntax(const char *pgmbinary) {
 	fprintf(stderr, "  --ocsp-uri uri        Encode the given URI into the Authority Info Access\n");
 	fprintf(stderr, "                        X.509 extension of server certificates as the OCSP\n");
 	fprintf(stderr, "                        responder URI.\n");
+	fprintf(stderr, "  --tcp-defer-accept secs\n");
+	fprintf(stderr, "                        Set TCP_DEFER_ACCEPT on the listening socket so that\n");
+	fprintf(stderr, "                        connections are only handed to ratched once the client\n");
+	fprintf(stderr, "                        has sent data (usually the ClientHello), waiting for\n");
+	fprintf(stderr, "                        at most the given number of seconds. This saves a\n");
+	fprintf(stderr, "                        wakeup per connection, but delays protocols in which\n");
+	fprintf(stderr, "                        the server speaks first. Disabled by default.\n");
+	fprintf(stderr, "  --max-connections count\n");
+	fprintf(stderr, "                        Maximum number of connections that are handled at the\n");
+	fprintf(stderr, "                        same time. State for all of them is preallocated in a\n");
+	fprintf(stderr, "                        connection table at startup; connections that are\n");
+	fprintf(stderr, "                        accepted while the table is full are closed\n");
+	fprintf(stderr, "                        immediately. Defaults to 4096.\n");
+	fprintf(stderr, "  --handshake-timeout secs\n");
+	fprintf(stderr, "                        Time in seconds (as a floating point number) after\n");
+	fprintf(stderr, "                        which a connection that has not started forwarding\n");
+	fprintf(stderr, "                        data yet, i.e., that is still waiting for the\n");
+	fprintf(stderr, "                        ClientHello, for the outgoing connection or in one of\n");
+	fprintf(stderr, "                        the TLS handshakes, is forcibly closed. Zero disables\n");
+	fprintf(stderr, "                        the timeout. Defaults to 30 secs.\n");
+	fprintf(stderr, "  --max-hostnames count\n");
+	fprintf(stderr, "                        Maximum number of distinct host names (as requested by\n");
+	fprintf(stderr, "                        clients through the Server Name Indication) that are\n");
+	fprintf(stderr, "                        remembered for the lifetime of the process. Per-host\n");
+	fprintf(stderr, "                        caches, such as the one for forged certificates, are\n");
+	fprintf(stderr, "                        keyed off these; once the limit is reached,\n");
+	fprintf(stderr, "                        connections to further host names are still handled,\n");
+	fprintf(stderr, "                        but their certificates are forged anew for every\n");
+	fprintf(stderr, "                        connection. Defaults to 65536.\n");
+	fprintf(stderr, "  --cert-cache-size MiB\n");
+	fprintf(stderr, "                        Amount of memory in MiB that the cache of forged\n");
+	fprintf(stderr, "                        server certificates may use. Certificates are held in\n");
+	fprintf(stderr, "                        their compact DER encoding and the least recently used\n");
+	fprintf(stderr, "                        ones are evicted once this budget is exceeded.\n");
+	fprintf(stderr, "                        Defaults to 64 MiB.\n");
+	fprintf(stderr, "  --cert-maintenance-interval secs\n");
+	fprintf(stderr, "                        Interval in seconds in which a background task renews\n");
+	fprintf(stderr, "                        cached forged certificates that are about to expire,\n");
+	fprintf(stderr, "                        checks whether the root certificate needs to be rolled\n");
+	fprintf(stderr, "                        over and updates certificate age statistics. Zero\n");
+	fprintf(stderr, "                        disables the background task. Defaults to 600 secs.\n");
+	fprintf(stderr, "  --root-transition-days days\n");
+	fprintf(stderr, "                        When the root certificate has less than this many days\n");
+	fprintf(stderr, "                        of validity left, a successor with identical key and\n");
+	fprintf(stderr, "                        subject is issued and stored as root.crt (the old one\n");
+	fprintf(stderr, "                        is kept as root-previous.crt). Both are valid during\n");
+	fprintf(stderr, "                        the transition window, so clients can be migrated to\n");
+	fprintf(stderr, "                        the new root before the old one expires. Defaults to\n");
+	fprintf(stderr, "                        90 days.\n");
+	fprintf(stderr, "  --deterministic-certs\n");
+	fprintf(stderr, "                        Forge server certificates deterministically: their\n");
+	fprintf(stderr, "                        validity starts at the beginning of the current week\n");
+	fprintf(stderr, "                        and their serial number is derived from a hash keyed\n");
+	fprintf(stderr, "                        with the CA key over host name, address and validity.\n");
+	fprintf(stderr, "                        Multiple ratched instances that share their\n");
+	fprintf(stderr, "                        configuration directory (i.e., the same CA and server\n");
+	fprintf(stderr, "                        keys) thus create identical certificates for identical\n");
+	fprintf(stderr, "                        hosts without coordination, as long as the CA signs\n");
+	fprintf(stderr, "                        deterministically (RSA or EdDSA keys, but not ECDSA).\n");
+	fprintf(stderr, "  --stats-interval secs\n");
+	fprintf(stderr, "                        Periodically log all internal statistics counters at\n");
+	fprintf(stderr, "                        the given interval in seconds. By default, statistics\n");
+	fprintf(stderr, "                        are only logged at shutdown.\n");
 	fprintf(stderr, "  --write-memdumps-into-files\n");
 	fprintf(stderr, "                        When dumping a piece of memory in the log, also output\n");
 	fprintf(stderr, "                        its binary equivalent into a file called\n");
@@ -156,9 +249,122 @@ void show_syntax(const char *pgmbinary) {
 	fprintf(stderr, "                        more than one host. Additional arguments can be\n");
 	fprintf(stderr, "                        specified in a key=value fashion to further define\n");
 	fprintf(stderr, "                        interception parameters for that particular host.\n");
+	fprintf(stderr, "  --intercept-file filename\n");
+	fprintf(stderr, "                        Read additional interception rules from the given\n");
+	fprintf(stderr, "                        file. Each non-empty line that does not start with '#'\n");
+	fprintf(stderr, "                        is treated exactly like the argument of an --intercept\n");
+	fprintf(stderr, "                        option, i.e., it contains a hostname followed by\n");
+	fprintf(stderr, "                        optional key=value arguments, separated by commas. Can\n");
+	fprintf(stderr, "                        be specified multiple times.\n");
+	fprintf(stderr, "  --domain-list filename\n");
+	fprintf(stderr, "                        Decide the interception mode of host names that are\n");
+	fprintf(stderr, "                        not explicitly configured via --intercept by looking\n");
+	fprintf(stderr, "                        them up in the given compiled domain list. Such lists\n");
+	fprintf(stderr, "                        may contain millions of names (e.g., blocklists whose\n");
+	fprintf(stderr, "                        hosts are rejected or allowlists whose hosts are only\n");
+	fprintf(stderr, "                        forwarded) and are created offline by\n");
+	fprintf(stderr, "                        domainlist/compile_domainlist. The file is mapped into\n");
+	fprintf(stderr, "                        memory instead of being loaded, so that startup is\n");
+	fprintf(stderr, "                        instant, its pages are shared by all processes that\n");
+	fprintf(stderr, "                        use it and every lookup is a constant number of hash\n");
+	fprintf(stderr, "                        probes per label of the host name.\n");
+	fprintf(stderr, "  --domain-list-reload secs\n");
+	fprintf(stderr, "                        Interval in seconds in which the domain list file is\n");
+	fprintf(stderr, "                        checked for having been replaced. A replaced list is\n");
+	fprintf(stderr, "                        mapped and swapped in while connections continue to be\n");
+	fprintf(stderr, "                        served; decisions made with the previous list are\n");
+	fprintf(stderr, "                        discarded. Zero disables the check. Defaults to 10\n");
+	fprintf(stderr, "                        secs.\n");
+	fprintf(stderr, "  --upstream-verify mode\n");
+	fprintf(stderr, "                        Verify the certificate chain that each upstream server\n");
+	fprintf(stderr, "                        presents against a trust store and the host name the\n");
+	fprintf(stderr, "                        client requested (or, if the client sent no Server\n");
+	fprintf(stderr, "                        Name Indication, the address that was connected to).\n");
+	fprintf(stderr, "                        In 'report' mode, the outcome is logged and annotated\n");
+	fprintf(stderr, "                        in the PCAPNG file; in 'enforce' mode, connections to\n");
+	fprintf(stderr, "                        servers that fail verification are additionally closed\n");
+	fprintf(stderr, "                        before any data is forwarded. The outcome is cached\n");
+	fprintf(stderr, "                        per chain and name, see --upstream-verify-ttl.\n");
+	fprintf(stderr, "                        Verification is disabled by default.\n");
+	fprintf(stderr, "  --upstream-ca path    File or directory (in OpenSSL hashed format) with the\n");
+	fprintf(stderr, "                        trusted root certificates that upstream chains are\n");
+	fprintf(stderr, "                        verified against. Defaults to the trust store that\n");
+	fprintf(stderr, "                        OpenSSL was configured with.\n");
+	fprintf(stderr, "  --upstream-verify-ttl secs\n");
+	fprintf(stderr, "                        Time in seconds for which the outcome of verifying a\n");
+	fprintf(stderr, "                        particular upstream certificate chain is reused for\n");
+	fprintf(stderr, "                        later connections. Successful verifications are never\n");
+	fprintf(stderr, "                        cached beyond the point at which the first certificate\n");
+	fprintf(stderr, "                        of the chain expires. Defaults to 300 secs.\n");
+	fprintf(stderr, "  --overload-control key=value[,key=value,...]\n");
+	fprintf(stderr, "                        Shed load in stages when ratched cannot keep up\n");
+	fprintf(stderr, "                        instead of letting handshake latency grow until all\n");
+	fprintf(stderr, "                        clients time out. Targets are given as accept=count\n");
+	fprintf(stderr, "                        (connections waiting in the listen queue),\n");
+	fprintf(stderr, "                        cryptowait=msecs (mean time that verification jobs\n");
+	fprintf(stderr, "                        wait for a crypto worker) and handshake=msecs (99th\n");
+	fprintf(stderr, "                        percentile of the time from accepting a connection\n");
+	fprintf(stderr, "                        until data is forwarded); targets that are not given\n");
+	fprintf(stderr, "                        are not considered. Every interval=msecs (default\n");
+	fprintf(stderr, "                        1000), the worst ratio of measured value to target is\n");
+	fprintf(stderr, "                        determined. Whenever it exceeds 1, the next stage is\n");
+	fprintf(stderr, "                        engaged: first, hosts in opportunistic mode are\n");
+	fprintf(stderr, "                        forwarded without interception; then, connections to\n");
+	fprintf(stderr, "                        hosts that are not explicitly configured via\n");
+	fprintf(stderr, "                        --intercept, --intercept-file or --domain-list are\n");
+	fprintf(stderr, "                        rejected; finally, all new connections are closed\n");
+	fprintf(stderr, "                        right after being accepted. A stage is only left again\n");
+	fprintf(stderr, "                        once the ratio stayed below 0.75 for recover=count\n");
+	fprintf(stderr, "                        consecutive intervals (default 5).\n");
 	fprintf(stderr, "  --pcap-comment comment\n");
 	fprintf(stderr, "                        Store a particular piece of information inside the\n");
 	fprintf(stderr, "                        PCAPNG header as a comment.\n");
+	fprintf(stderr, "  --http-sidecar filename\n");
+	fprintf(stderr, "                        Frame HTTP/1.x requests and responses found inside\n");
+	fprintf(stderr, "                        intercepted TLS connections and write one JSON record\n");
+	fprintf(stderr, "                        per message into the given file. Records contain the\n");
+	fprintf(stderr, "                        request or response line, headers and the stream\n");
+	fprintf(stderr, "                        offsets of header and body, which refer back into the\n");
+	fprintf(stderr, "                        synthetic TCP stream of the PCAPNG file. Records are\n");
+	fprintf(stderr, "                        dropped rather than ever delaying forwarded traffic.\n");
+	fprintf(stderr, "  --chunk-store directory\n");
+	fprintf(stderr, "                        Deduplicate captured payload. Data of each connection\n");
+	fprintf(stderr, "                        is split into content-defined chunks which are stored\n");
+	fprintf(stderr, "                        once, addressed by their SHA-256 hash, inside the\n");
+	fprintf(stderr, "                        given directory. Chunks that are already present in\n");
+	fprintf(stderr, "                        the store are written to the PCAPNG file as truncated\n");
+	fprintf(stderr, "                        packets which only carry a reference to the chunk. Use\n");
+	fprintf(stderr, "                        chunkstore/rehydrate.py together with the same\n");
+	fprintf(stderr, "                        directory to turn such a capture back into a regular\n");
+	fprintf(stderr, "                        PCAPNG file.\n");
+	fprintf(stderr, "  --plugin filename[,argument]\n");
+	fprintf(stderr, "                        Load a plugin from the given shared object. Plugins\n");
+	fprintf(stderr, "                        are called when an intercepted TLS connection starts\n");
+	fprintf(stderr, "                        and ends and for every chunk of plaintext relayed in\n");
+	fprintf(stderr, "                        either direction, which they may inspect, modify in\n");
+	fprintf(stderr, "                        place, hold back, replace or answer themselves by\n");
+	fprintf(stderr, "                        injecting data; see ratched_plugin.h for the\n");
+	fprintf(stderr, "                        interface. Everything following the first comma is\n");
+	fprintf(stderr, "                        passed to the plugin's initialization function. Can be\n");
+	fprintf(stderr, "                        specified multiple times, in which case chunks pass\n");
+	fprintf(stderr, "                        through the plugins in the given order.\n");
+	fprintf(stderr, "  --scan-patterns filename\n");
+	fprintf(stderr, "                        Scan all relayed data, i.e., plaintext of intercepted\n");
+	fprintf(stderr, "                        TLS connections after plugins processed it as well as\n");
+	fprintf(stderr, "                        plainly forwarded connections, for the literal byte\n");
+	fprintf(stderr, "                        patterns listed in the given file. Each non-empty line\n");
+	fprintf(stderr, "                        that does not start with '#' contains a pattern name,\n");
+	fprintf(stderr, "                        colon-separated flags and the pattern itself (the rest\n");
+	fprintf(stderr, "                        of the line, in which a backslash followed by s, t, r,\n");
+	fprintf(stderr, "                        n, another backslash or xNN with two hex digits\n");
+	fprintf(stderr, "                        denotes a space, tab, carriage return, line feed,\n");
+	fprintf(stderr, "                        backslash or arbitrary byte), separated by whitespace.\n");
+	fprintf(stderr, "                        With the 'report' flag, a match is logged and\n");
+	fprintf(stderr, "                        annotated as a packet comment in the PCAPNG file; with\n");
+	fprintf(stderr, "                        'terminate', the chunk that completes the match is not\n");
+	fprintf(stderr, "                        forwarded and the connection is closed. All patterns\n");
+	fprintf(stderr, "                        are matched in a single pass, so the cost per byte\n");
+	fprintf(stderr, "                        does not grow with their number.\n");
 	fprintf(stderr, "  -o filename, --outfile filename\n");
 	fprintf(stderr, "                        Specifies the PCAPNG file that the intercepted traffic\n");
 	fprintf(stderr, "                        is written to. Mandatory argument.\n");
@@ -178,6 +384,35 @@ void show_syntax(const char *pgmbinary) {
 	fprintf(stderr, "                        simply forwards everything unmodified. 'reject'\n");
 	fprintf(stderr, "                        closes the connection altogether, regardless of the\n");
 	fprintf(stderr, "                        type of seen traffic.\n");
+	fprintf(stderr, "  tcpfastopen=bool      When forwarding traffic unmodified, send the data\n");
+	fprintf(stderr, "                        that the client initially sent to the server together\n");
+	fprintf(stderr, "                        with the connection request using TCP Fast Open.\n");
+	fprintf(stderr, "                        Saves one round trip when the kernel holds a Fast\n");
+	fprintf(stderr, "                        Open cookie for the server (requires bit 1 of the\n");
+	fprintf(stderr, "                        net.ipv4.tcp_fastopen sysctl) and silently falls back\n");
+	fprintf(stderr, "                        to a regular connection otherwise. Defaults to off.\n");
+	fprintf(stderr, "  capture=[intercepted|all|none]\n");
+	fprintf(stderr, "                        Specifies which connections are written to the PCAPNG\n");
+	fprintf(stderr, "                        file. By default, only TLS-intercepted connections\n");
+	fprintf(stderr, "                        are captured. 'all' additionally captures connections\n");
+	fprintf(stderr, "                        that are forwarded unmodified (non-TLS traffic or\n");
+	fprintf(stderr, "                        hosts that are not intercepted), so that the capture\n");
+	fprintf(stderr, "                        shows everything that went through ratched. 'none'\n");
+	fprintf(stderr, "                        does not capture the connection at all.\n");
+	fprintf(stderr, "  cipherpolicy=[static|cheapest]\n");
+	fprintf(stderr, "                        Specifies how the cipher suites, key agreement groups\n");
+	fprintf(stderr, "                        and signature algorithms of both TLS connections are\n");
+	fprintf(stderr, "                        chosen. 'static' (the default) uses the library\n");
+	fprintf(stderr, "                        defaults or whatever is given via the s_/c_ ciphers,\n");
+	fprintf(stderr, "                        groups and sigalgs options. 'cheapest' measures once\n");
+	fprintf(stderr, "                        at startup how much CPU time the available AEAD\n");
+	fprintf(stderr, "                        ciphers and key agreement groups cost on this machine\n");
+	fprintf(stderr, "                        and prefers the cheapest ones on both legs; the\n");
+	fprintf(stderr, "                        ratched server side enforces its own order, but still\n");
+	fprintf(stderr, "                        picks ChaCha20-Poly1305 for clients that prefer it\n");
+	fprintf(stderr, "                        (typically those without AES hardware support).\n");
+	fprintf(stderr, "                        Explicitly given cipher, group or sigalg strings take\n");
+	fprintf(stderr, "                        precedence.\n");
 	fprintf(stderr, "  s_tlsversions=versions\n");
 	fprintf(stderr, "                        Colon-separated string that specifies the acceptable\n");
 	fprintf(stderr, "                        TLS version for the ratched server component. Valid\n");
@@ -189,6 +424,23 @@ void show_syntax(const char *pgmbinary) {
 	fprintf(stderr, "                        keyfile) is given, forge all metadata of the incoming\n");
 	fprintf(stderr, "                        certificate. If a certfile/keyfile is given, this\n");
 	fprintf(stderr, "                        option is implied.\n");
+	fprintf(stderr, "  s_mirrorcert=bool     Instead of forging a minimal server certificate that\n");
+	fprintf(stderr, "                        only contains the host name, mirror the certificate\n");
+	fprintf(stderr, "                        of the actual server: subject, subject alternative\n");
+	fprintf(stderr, "                        names, key usage, extended key usage, validity and\n");
+	fprintf(stderr, "                        policy extensions are copied from it, while key,\n");
+	fprintf(stderr, "                        issuer and serial number are ratched's. Since the\n");
+	fprintf(stderr, "                        upstream certificate needs to be known for this, the\n");
+	fprintf(stderr, "                        connection to the server is made before the client\n");
+	fprintf(stderr, "                        handshake the first time a host is seen. Mirrored\n");
+	fprintf(stderr, "                        certificates are cached by the fingerprint of the\n");
+	fprintf(stderr, "                        upstream certificate and the most recent one is\n");
+	fprintf(stderr, "                        presented right away on later connections to the same\n");
+	fprintf(stderr, "                        host, which are then handled in the usual order; if\n");
+	fprintf(stderr, "                        the server's certificate changed meanwhile, the next\n");
+	fprintf(stderr, "                        connection sees the updated mirror. Not combinable\n");
+	fprintf(stderr, "                        with forged client certificates on the first\n");
+	fprintf(stderr, "                        connection to a host. Defaults to off.\n");
 	fprintf(stderr, "  s_certfile=filename   Specifies an X.509 certificate in PEM format that\n");
 	fprintf(stderr, "                        should be used by ratched as the server certificate.\n");
 	fprintf(stderr, "                        By default, this certificate is automatically\n");
@@ -209,6 +461,32 @@ void show_syntax(const char *pgmbinary) {
 	fprintf(stderr, "                        server uses.\n");
 	fprintf(stderr, "  s_sigalgs=algs        The key agreement 'signature algorithms' string which\n");
 	fprintf(stderr, "                        the ratched TLS server uses.\n");
+	fprintf(stderr, "  s_congestion=algorithm\n");
+	fprintf(stderr, "                        TCP congestion control algorithm (e.g., cubic or bbr)\n");
+	fprintf(stderr, "                        of the connection that the client made to ratched.\n");
+	fprintf(stderr, "                        The algorithm needs to be available in the kernel.\n");
+	fprintf(stderr, "                        Defaults to the system default.\n");
+	fprintf(stderr, "  s_rcvbuf=bytes        Receive buffer size (SO_RCVBUF) of the connection\n");
+	fprintf(stderr, "                        that the client made to ratched. Defaults to kernel\n");
+	fprintf(stderr, "                        auto-tuning.\n");
+	fprintf(stderr, "  s_sndbuf=bytes        Send buffer size (SO_SNDBUF) of the connection that\n");
+	fprintf(stderr, "                        the client made to ratched. Defaults to kernel auto-\n");
+	fprintf(stderr, "                        tuning.\n");
+	fprintf(stderr, "  s_notsentlowat=bytes  Limit for unsent data queued in the kernel\n");
+	fprintf(stderr, "                        (TCP_NOTSENT_LOWAT) on the connection that the client\n");
+	fprintf(stderr, "                        made to ratched. Defaults to the system default.\n");
+	fprintf(stderr, "  s_usertimeout=msecs   Time that transmitted data may remain unacknowledged\n");
+	fprintf(stderr, "                        before the connection that the client made to ratched\n");
+	fprintf(stderr, "                        is closed (TCP_USER_TIMEOUT). Defaults to the system\n");
+	fprintf(stderr, "                        default.\n");
+	fprintf(stderr, "  s_keepalive=secs      Enable TCP keepalive on the connection that the\n");
+	fprintf(stderr, "                        client made to ratched, with the first probe after\n");
+	fprintf(stderr, "                        the given idle time. Disabled by default.\n");
+	fprintf(stderr, "  s_keepintvl=secs      Interval between TCP keepalive probes on the\n");
+	fprintf(stderr, "                        connection that the client made to ratched once it\n");
+	fprintf(stderr, "                        has been idle for the keepalive time. Defaults to 10\n");
+	fprintf(stderr, "                        seconds or the keepalive idle time, whichever is\n");
+	fprintf(stderr, "                        shorter.\n");
 	fprintf(stderr, "  c_tlsversions=versions\n");
 	fprintf(stderr, "                        Colon-separated string that specifies the acceptable\n");
 	fprintf(stderr, "                        TLS version for the ratched client component. Valid\n");
@@ -230,6 +508,23 @@ void show_syntax(const char *pgmbinary) {
 	fprintf(stderr, "                        client uses.\n");
 	fprintf(stderr, "  c_sigalgs=algs        The key agreement 'signature algorithms' string which\n");
 	fprintf(stderr, "                        the ratched TLS client uses.\n");
+	fprintf(stderr, "  c_congestion=algorithm\n");
+	fprintf(stderr, "                        TCP congestion control algorithm of the connection\n");
+	fprintf(stderr, "                        that ratched makes to the server. Set before\n");
+	fprintf(stderr, "                        connecting.\n");
+	fprintf(stderr, "  c_rcvbuf=bytes        Receive buffer size of the connection that ratched\n");
+	fprintf(stderr, "                        makes to the server. Set before connecting so that\n");
+	fprintf(stderr, "                        the window scale fits the buffer.\n");
+	fprintf(stderr, "  c_sndbuf=bytes        Send buffer size of the connection that ratched makes\n");
+	fprintf(stderr, "                        to the server.\n");
+	fprintf(stderr, "  c_notsentlowat=bytes  Limit for unsent data queued in the kernel on the\n");
+	fprintf(stderr, "                        connection that ratched makes to the server.\n");
+	fprintf(stderr, "  c_usertimeout=msecs   TCP user timeout of the connection that ratched makes\n");
+	fprintf(stderr, "                        to the server.\n");
+	fprintf(stderr, "  c_keepalive=secs      Enable TCP keepalive on the connection that ratched\n");
+	fprintf(stderr, "                        makes to the server.\n");
+	fprintf(stderr, "  c_keepintvl=secs      Interval between TCP keepalive probes on the\n");
+	fprintf(stderr, "                        connection that ratched makes to the server.\n");
 	fprintf(stderr, "\n");
 	fprintf(stderr, "examples:\n");
 	fprintf(stderr, "    $ ratched -o output.pcapng\n");
@@ -303,12 +598,32 @@ enum cmdline_arg_t {
 	ARG_FLUSH_LOGS,
 	ARG_CRL_URI,
 	ARG_OCSP_URI,
+	ARG_TCP_DEFER_ACCEPT,
+	ARG_MAX_CONNECTIONS,
+	ARG_HANDSHAKE_TIMEOUT,
+	ARG_MAX_HOSTNAMES,
+	ARG_CERT_CACHE_SIZE,
+	ARG_CERT_MAINTENANCE_INTERVAL,
+	ARG_ROOT_TRANSITION_DAYS,
+	ARG_DETERMINISTIC_CERTS,
+	ARG_STATS_INTERVAL,
 	ARG_WRITE_MEMDUMPS_INTO_FILES,
 	ARG_USE_IPV6_ENCAPSULATION,
 	ARG_LISTEN,
 	ARG_DEFAULTS,
 	ARG_INTERCEPT,
+	ARG_INTERCEPT_FILE,
+	ARG_DOMAIN_LIST,
+	ARG_DOMAIN_LIST_RELOAD,
+	ARG_UPSTREAM_VERIFY,
+	ARG_UPSTREAM_CA,
+	ARG_UPSTREAM_VERIFY_TTL,
+	ARG_OVERLOAD_CONTROL,
 	ARG_PCAP_COMMENT,
+	ARG_HTTP_SIDECAR,
+	ARG_CHUNK_STORE,
+	ARG_PLUGIN,
+	ARG_SCAN_PATTERNS,
 	ARG_OUTFILE,
 	ARG_VERBOSE,
 };
@@ -331,6 +646,36 @@ static bool set_default_config_dir(void) {
 	return true;
 }
 
+static bool parse_overload_control(const char *arg) {
+	struct overload_config_t *config = &pgm_options_rw.overload.config;
+	struct keyvaluelist_def_t definition[] = {
+		{ .key = "accept", .parser = keyvalue_longint, .target = &config->accept_queue },
+		{ .key = "cryptowait", .parser = keyvalue_longint, .target = &config->crypto_wait_msecs },
+		{ .key = "handshake", .parser = keyvalue_longint, .target = &config->handshake_p99_msecs },
+		{ .key = "interval", .parser = keyvalue_longint, .target = &config->interval_msecs },
+		{ .key = "recover", .parser = keyvalue_longint, .target = &config->recovery_intervals },
+		{ 0 }
+	};
+	if (parse_keyvalue_list(arg, 0, definition, NULL) == -1) {
+		snprintf(parsing_error, sizeof(parsing_error), "invalid overload control parameters: %s", arg);
+		return false;
+	}
+	if ((config->accept_queue < 0) || (config->crypto_wait_msecs < 0) || (config->handshake_p99_msecs < 0)) {
+		snprintf(parsing_error, sizeof(parsing_error), "overload control targets must not be negative");
+		return false;
+	}
+	if (!config->accept_queue && !config->crypto_wait_msecs && !config->handshake_p99_msecs) {
+		snprintf(parsing_error, sizeof(parsing_error), "overload control requires at least one of the accept, cryptowait or handshake targets");
+		return false;
+	}
+	if ((config->interval_msecs <= 0) || (config->recovery_intervals <= 0)) {
+		snprintf(parsing_error, sizeof(parsing_error), "overload control interval and recovery count must be positive");
+		return false;
+	}
+	pgm_options_rw.overload.enabled = true;
+	return true;
+}
+
 static bool parse_keyspec(const char *arg) {
 	struct stringlist_t list;
 	parse_stringlist(&list, arg, ":");
@@ -389,6 +734,37 @@ static bool append_custom_intercept_config(const char *connection_params) {
 	return true;
 }
 
+static bool append_custom_intercept_config_file(const char *filename) {
+	FILE *f = fopen(filename, "r");
+	if (!f) {
+		snprintf(parsing_error, sizeof(parsing_error), "cannot open intercept file %s: %s", filename, strerror(errno));
+		return false;
+	}
+
+	bool success = true;
+	char *line = NULL;
+	size_t line_alloced = 0;
+	unsigned int line_no = 0;
+	while (getline(&line, &line_alloced, f) != -1) {
+		line_no++;
+		line[strcspn(line, "\r\n")] = 0;
+		const char *rule = line + strspn(line, " \t");
+		if ((rule[0] == 0) || (rule[0] == '#')) {
+			continue;
+		}
+		if (!append_custom_intercept_config(rule)) {
+			if (!strlen(parsing_error)) {
+				snprintf(parsing_error, sizeof(parsing_error), "invalid interception rule in %s line %u", filename, line_no);
+			}
+			success = false;
+			break;
+		}
+	}
+	free(line);
+	fclose(f);
+	return success;
+}
+
 bool parse_options(int argc, char **argv) {
 	pgm_options_rw.custom_configs = map_new();
 	pgm_options_rw.network.server_socket.ipv4_nbo = htonl(IPv4ADDR(127, 0, 0, 1));
@@ -410,12 +786,32 @@ bool parse_options(int argc, char **argv) {
 		{ "flush-logs",                  no_argument,       0, ARG_FLUSH_LOGS },
 		{ "crl-uri",                     required_argument, 0, ARG_CRL_URI },
 		{ "ocsp-uri",                    required_argument, 0, ARG_OCSP_URI },
+		{ "tcp-defer-accept",            required_argument, 0, ARG_TCP_DEFER_ACCEPT },
+		{ "max-connections",             required_argument, 0, ARG_MAX_CONNECTIONS },
+		{ "handshake-timeout",           required_argument, 0, ARG_HANDSHAKE_TIMEOUT },
+		{ "max-hostnames",               required_argument, 0, ARG_MAX_HOSTNAMES },
+		{ "cert-cache-size",             required_argument, 0, ARG_CERT_CACHE_SIZE },
+		{ "cert-maintenance-interval",   required_argument, 0, ARG_CERT_MAINTENANCE_INTERVAL },
+		{ "root-transition-days",        required_argument, 0, ARG_ROOT_TRANSITION_DAYS },
+		{ "deterministic-certs",         no_argument,       0, ARG_DETERMINISTIC_CERTS },
+		{ "stats-interval",              required_argument, 0, ARG_STATS_INTERVAL },
 		{ "write-memdumps-into-files",   no_argument,       0, ARG_WRITE_MEMDUMPS_INTO_FILES },
 		{ "use-ipv6-encapsulation",      no_argument,       0, ARG_USE_IPV6_ENCAPSULATION },
 		{ "listen",                      required_argument, 0, ARG_LISTEN },
 		{ "defaults",                    required_argument, 0, ARG_DEFAULTS },
 		{ "intercept",                   required_argument, 0, ARG_INTERCEPT },
+		{ "intercept-file",              required_argument, 0, ARG_INTERCEPT_FILE },
+		{ "domain-list",                 required_argument, 0, ARG_DOMAIN_LIST },
+		{ "domain-list-reload",          required_argument, 0, ARG_DOMAIN_LIST_RELOAD },
+		{ "upstream-verify",             required_argument, 0, ARG_UPSTREAM_VERIFY },
+		{ "upstream-ca",                 required_argument, 0, ARG_UPSTREAM_CA },
+		{ "upstream-verify-ttl",         required_argument, 0, ARG_UPSTREAM_VERIFY_TTL },
+		{ "overload-control",            required_argument, 0, ARG_OVERLOAD_CONTROL },
 		{ "pcap-comment",                required_argument, 0, ARG_PCAP_COMMENT },
+		{ "http-sidecar",                required_argument, 0, ARG_HTTP_SIDECAR },
+		{ "chunk-store",                 required_argument, 0, ARG_CHUNK_STORE },
+		{ "plugin",                      required_argument, 0, ARG_PLUGIN },
+		{ "scan-patterns",               required_argument, 0, ARG_SCAN_PATTERNS },
 		{ "outfile",                     required_argument, 0, ARG_OUTFILE },
 		{ "verbose",                     no_argument,       0, ARG_VERBOSE },
 		{ 0 }
@@ -495,6 +891,74 @@ bool parse_options(int argc, char **argv) {
 				pgm_options_rw.forged_certs.ocsp_responder_uri = optarg;
 				break;
 
+			case ARG_TCP_DEFER_ACCEPT:
+				if (atoi(optarg) < 0) {
+					snprintf(parsing_error, sizeof(parsing_error), "TCP defer accept timeout must not be negative");
+					return false;
+				}
+				pgm_options_rw.network.defer_accept_secs = atoi(optarg);
+				break;
+
+			case ARG_MAX_CONNECTIONS:
+				if ((atoi(optarg) <= 0) || (atoi(optarg) > 1048576)) {
+					snprintf(parsing_error, sizeof(parsing_error), "maximum number of connections must be between 1 and 1048576");
+					return false;
+				}
+				pgm_options_rw.network.max_connections = atoi(optarg);
+				break;
+
+			case ARG_HANDSHAKE_TIMEOUT:
+				pgm_options_rw.network.handshake_timeout = atof(optarg);
+				if (pgm_options_rw.network.handshake_timeout < 0) {
+					snprintf(parsing_error, sizeof(parsing_error), "handshake timeout must not be negative");
+					return false;
+				}
+				break;
+
+			case ARG_MAX_HOSTNAMES:
+				if (atoi(optarg) <= 0) {
+					snprintf(parsing_error, sizeof(parsing_error), "maximum number of host names must be positive");
+					return false;
+				}
+				pgm_options_rw.network.max_hostnames = atoi(optarg);
+				break;
+
+			case ARG_CERT_CACHE_SIZE:
+				if (atoi(optarg) <= 0) {
+					snprintf(parsing_error, sizeof(parsing_error), "certificate cache size must be a positive value");
+					return false;
+				}
+				pgm_options_rw.forged_certs.cache_size_mib = atoi(optarg);
+				break;
+
+			case ARG_CERT_MAINTENANCE_INTERVAL:
+				if (atoi(optarg) < 0) {
+					snprintf(parsing_error, sizeof(parsing_error), "certificate maintenance interval must not be negative");
+					return false;
+				}
+				pgm_options_rw.forged_certs.maintenance_interval = atoi(optarg);
+				break;
+
+			case ARG_ROOT_TRANSITION_DAYS:
+				if ((atoi(optarg) < 0) || (atoi(optarg) >= 365 * 5)) {
+					snprintf(parsing_error, sizeof(parsing_error), "root certificate transition window must be between 0 and 1824 days");
+					return false;
+				}
+				pgm_options_rw.forged_certs.root_transition_days = atoi(optarg);
+				break;
+
+			case ARG_DETERMINISTIC_CERTS:
+				pgm_options_rw.forged_certs.deterministic = true;
+				break;
+
+			case ARG_STATS_INTERVAL:
+				if (atoi(optarg) < 0) {
+					snprintf(parsing_error, sizeof(parsing_error), "statistics interval must not be negative");
+					return false;
+				}
+				pgm_options_rw.log.stats_interval = atoi(optarg);
+				break;
+
 			case ARG_WRITE_MEMDUMPS_INTO_FILES:
 				pgm_options_rw.log.write_memdumps_into_files = true;
 				break;
@@ -530,10 +994,84 @@ bool parse_options(int argc, char **argv) {
 				}
 				break;
 
+			case ARG_INTERCEPT_FILE:
+				if (!append_custom_intercept_config_file(optarg)) {
+					return false;
+				}
+				break;
+
+			case ARG_DOMAIN_LIST:
+				pgm_options_rw.domain_list.filename = optarg;
+				break;
+
+			case ARG_DOMAIN_LIST_RELOAD:
+				if (atoi(optarg) < 0) {
+					snprintf(parsing_error, sizeof(parsing_error), "domain list reload interval must not be negative");
+					return false;
+				}
+				pgm_options_rw.domain_list.reload_interval = atoi(optarg);
+				break;
+
+			case ARG_UPSTREAM_VERIFY:
+				if (!strcmp(optarg, "report")) {
+					pgm_options_rw.upstream_verify.mode = CHAINVERIFY_REPORT;
+				} else if (!strcmp(optarg, "enforce")) {
+					pgm_options_rw.upstream_verify.mode = CHAINVERIFY_ENFORCE;
+				} else {
+					snprintf(parsing_error, sizeof(parsing_error), "upstream verification mode must be either 'report' or 'enforce'");
+					return false;
+				}
+				break;
+
+			case ARG_UPSTREAM_CA:
+				pgm_options_rw.upstream_verify.trust_store = optarg;
+				break;
+
+			case ARG_UPSTREAM_VERIFY_TTL:
+				if (atoi(optarg) < 0) {
+					snprintf(parsing_error, sizeof(parsing_error), "upstream verification TTL must not be negative");
+					return false;
+				}
+				pgm_options_rw.upstream_verify.ttl = atoi(optarg);
+				break;
+
+			case ARG_OVERLOAD_CONTROL:
+				if (!parse_overload_control(optarg)) {
+					return false;
+				}
+				break;
+
 			case ARG_PCAP_COMMENT:
 				pgm_options_rw.pcapng.comment = optarg;
 				break;
 
+			case ARG_HTTP_SIDECAR:
+				pgm_options_rw.pcapng.http_sidecar_filename = optarg;
+				break;
+
+			case ARG_CHUNK_STORE:
+				pgm_options_rw.pcapng.chunk_store_directory = optarg;
+				break;
+
+			case ARG_PLUGIN:
+				if (pgm_options_rw.plugins.count >= MAX_PLUGINS) {
+					snprintf(parsing_error, sizeof(parsing_error), "at most %d plugins can be loaded", MAX_PLUGINS);
+					return false;
+				} else {
+					char *comma = strchr(optarg, ',');
+					if (comma) {
+						*comma = 0;
+					}
+					pgm_options_rw.plugins.plugin[pgm_options_rw.plugins.count].filename = optarg;
+					pgm_options_rw.plugins.plugin[pgm_options_rw.plugins.count].argument = comma ? comma + 1 : NULL;
+					pgm_options_rw.plugins.count++;
+				}
+				break;
+
+			case ARG_SCAN_PATTERNS:
+				pgm_options_rw.scan.patterns_filename = optarg;
+				break;
+
 			case ARG_OUTFILE_SHORT:
 			case ARG_OUTFILE:
 				pgm_options_rw.pcapng.filename = optarg;
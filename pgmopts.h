@@ -28,6 +28,9 @@
 #include <stdbool.h>
 #include "map.h"
 #include "logging.h"
+#include "plugin.h"
+#include "chainverify.h"
+#include "overload.h"
 
 enum keytype_t {
 	KEYTYPE_RSA,
@@ -40,6 +43,8 @@ struct pgmopts_t {
 	struct {
 		const char *filename;
 		const char *comment;
+		const char *http_sidecar_filename;
+		const char *chunk_store_directory;
 		bool use_ipv6_encapsulation;
 	} pcapng;
 
@@ -49,6 +54,7 @@ struct pgmopts_t {
 		bool flush;
 		bool dump_certificates;
 		bool write_memdumps_into_files;
+		unsigned int stats_interval;
 	} log;
 
 	struct {
@@ -67,17 +73,53 @@ struct pgmopts_t {
 			uint16_t port_nbo;
 		} local_forwarding;
 		double initial_read_timeout;
+		unsigned int defer_accept_secs;
+		unsigned int max_connections;
+		double handshake_timeout;
+		unsigned int max_hostnames;
 	} network;
 
 	struct {
 		const char *crl_uri, *ocsp_responder_uri;
 		bool mark_forged_certificates;
 		bool recalculate_key_identifiers;
+		unsigned int cache_size_mib;
+		unsigned int maintenance_interval;
+		unsigned int root_transition_days;
+		bool deterministic;
 	} forged_certs;
 
+	struct {
+		unsigned int count;
+		struct {
+			const char *filename;
+			const char *argument;
+		} plugin[MAX_PLUGINS];
+	} plugins;
+
+	struct {
+		const char *patterns_filename;
+	} scan;
+
 	struct intercept_config_t *default_config;
 	struct map_t *custom_configs;
 
+	struct {
+		const char *filename;
+		unsigned int reload_interval;
+	} domain_list;
+
+	struct {
+		enum chainverify_mode_t mode;
+		const char *trust_store;
+		unsigned int ttl;
+	} upstream_verify;
+
+	struct {
+		bool enabled;
+		struct overload_config_t config;
+	} overload;
+
 	struct {
 		enum keytype_t keytype;
 		union {
@@ -0,0 +1,292 @@
+/**
+ *	ratched - TLS connection router that performs a man-in-the-middle attack
+ *	Copyright (C) 2017-2017 Johannes Bauer
+ *
+ *	This file is part of ratched.
+ *
+ *	ratched is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; this program is ONLY licensed under
+ *	version 3 of the License, later versions are explicitly excluded.
+ *
+ *	ratched is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with ratched; if not, write to the Free Software
+ *	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *	Johannes Bauer <JohannesBauer@gmx.de>
+**/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <dlfcn.h>
+#include "plugin.h"
+#include "logging.h"
+#include "lockstat.h"
+#include "stats.h"
+
+struct plugin_instance_t {
+	const struct ratched_plugin_t *plugin;
+	void *handle;
+	size_t max_held_bytes;
+};
+
+/* What a plugin sees of a connection, one per plugin and connection. The
+ * public part comes first so that the connection handle that the plugin
+ * passes back to inject() can be converted into this structure. */
+struct plugin_state_t {
+	struct ratched_plugin_connection_t pub;
+	struct plugin_connection_t *owner;
+	const struct plugin_instance_t *instance;
+	size_t held_bytes[2];
+};
+
+struct plugin_connection_t {
+	plugin_write_fnc_t write_fnc;
+	void *write_argument;
+	struct lockstat_mutex_t write_lock[2];
+	struct plugin_state_t state[MAX_PLUGINS];
+};
+
+static struct {
+	unsigned int count;
+	struct plugin_instance_t instance[MAX_PLUGINS];
+	struct stats_counter_t *chunks;
+	struct stats_counter_t *held_bytes;
+	struct stats_counter_t *injected_bytes;
+	struct stats_counter_t *closed;
+} plugins;
+
+static void __attribute__ ((format (printf, 2, 3))) plugin_log(enum ratched_plugin_loglvl_t level, const char *msg, ...) {
+	static const enum loglvl_t loglvl_map[] = {
+		[RATCHED_PLUGIN_LOG_ERROR] = LLVL_ERROR,
+		[RATCHED_PLUGIN_LOG_WARN] = LLVL_WARN,
+		[RATCHED_PLUGIN_LOG_INFO] = LLVL_INFO,
+		[RATCHED_PLUGIN_LOG_DEBUG] = LLVL_DEBUG,
+	};
+	enum loglvl_t loglvl = (level <= RATCHED_PLUGIN_LOG_DEBUG) ? loglvl_map[level] : LLVL_DEBUG;
+	if (!loglevel_at_least(loglvl)) {
+		return;
+	}
+	char buffer[512];
+	va_list ap;
+	va_start(ap, msg);
+	vsnprintf(buffer, sizeof(buffer), msg, ap);
+	va_end(ap);
+	logmsg(loglvl, "Plugin: %s", buffer);
+}
+
+static bool plugin_inject(struct ratched_plugin_connection_t *conn, bool client_to_server, const uint8_t *data, size_t length) {
+	struct plugin_state_t *state = (struct plugin_state_t*)conn;
+	struct plugin_connection_t *pconn = state->owner;
+	if (!pconn->write_fnc) {
+		logmsg(LLVL_ERROR, "Plugin %s tried to inject %zu bytes into connection %u which is not forwarding.", state->instance->plugin->name, length, conn->connection_id);
+		return false;
+	}
+	lockstat_lock(&pconn->write_lock[client_to_server]);
+	state->held_bytes[client_to_server] = (length < state->held_bytes[client_to_server]) ? (state->held_bytes[client_to_server] - length) : 0;
+	bool success = pconn->write_fnc(pconn->write_argument, client_to_server, data, length);
+	lockstat_unlock(&pconn->write_lock[client_to_server]);
+	stats_add(plugins.injected_bytes, length);
+	return success;
+}
+
+static const struct ratched_plugin_api_t plugin_api = {
+	.abi_version = RATCHED_PLUGIN_ABI_VERSION,
+	.log = plugin_log,
+	.inject = plugin_inject,
+};
+
+/* Adds a plugin to the end of the chain. Also used for plugins that are
+ * linked into the binary, e.g., in tests. */
+bool plugins_register(const struct ratched_plugin_t *plugin, const char *argument) {
+	if (plugins.count >= MAX_PLUGINS) {
+		logmsg(LLVL_ERROR, "At most %d plugins can be loaded.", MAX_PLUGINS);
+		return false;
+	}
+	if (plugin->abi_version != RATCHED_PLUGIN_ABI_VERSION) {
+		logmsg(LLVL_ERROR, "Plugin %s was built for plugin ABI version %u, but this ratched provides version %u.", plugin->name ? plugin->name : "?", plugin->abi_version, RATCHED_PLUGIN_ABI_VERSION);
+		return false;
+	}
+	if (plugin->init && !plugin->init(&plugin_api, argument)) {
+		logmsg(LLVL_ERROR, "Initialization of plugin %s failed.", plugin->name);
+		return false;
+	}
+	if (plugins.count == 0) {
+		plugins.chunks = stats_counter("plugin.chunks");
+		plugins.held_bytes = stats_counter("plugin.held_bytes");
+		plugins.injected_bytes = stats_counter("plugin.injected_bytes");
+		plugins.closed = stats_counter("plugin.closed");
+	}
+	plugins.instance[plugins.count++] = (struct plugin_instance_t) {
+		.plugin = plugin,
+		.max_held_bytes = plugin->max_held_bytes ? plugin->max_held_bytes : PLUGIN_DEFAULT_MAX_HELD,
+	};
+	logmsg(LLVL_INFO, "Plugin %s registered%s%s.", plugin->name, argument ? " with argument " : "", argument ? argument : "");
+	return true;
+}
+
+bool plugins_load(const char *filename, const char *argument) {
+	void *handle = dlopen(filename, RTLD_NOW | RTLD_LOCAL);
+	if (!handle) {
+		logmsg(LLVL_ERROR, "Could not load plugin %s: %s", filename, dlerror());
+		return false;
+	}
+	const struct ratched_plugin_t *plugin = dlsym(handle, RATCHED_PLUGIN_SYMBOL);
+	if (!plugin) {
+		logmsg(LLVL_ERROR, "Plugin %s does not export the symbol \"%s\".", filename, RATCHED_PLUGIN_SYMBOL);
+		dlclose(handle);
+		return false;
+	}
+	if (!plugins_register(plugin, argument)) {
+		dlclose(handle);
+		return false;
+	}
+	plugins.instance[plugins.count - 1].handle = handle;
+	return true;
+}
+
+bool plugins_active(void) {
+	return plugins.count > 0;
+}
+
+void plugins_deinit(void) {
+	while (plugins.count) {
+		struct plugin_instance_t *instance = &plugins.instance[--plugins.count];
+		if (instance->plugin->deinit) {
+			instance->plugin->deinit();
+		}
+		if (instance->handle) {
+			dlclose(instance->handle);
+		}
+	}
+}
+
+/* Returns NULL when no plugins are loaded, so that relaying takes the
+ * regular path without any locking. */
+struct plugin_connection_t *plugin_connection_new(const struct connection_t *description) {
+	if (!plugins_active()) {
+		return NULL;
+	}
+	struct plugin_connection_t *pconn = calloc(1, sizeof(*pconn));
+	if (!pconn) {
+		logmsg(LLVL_FATAL, "Failed to allocate plugin state for connection %u.", description->connection_id);
+		return NULL;
+	}
+	lockstat_mutex_init(&pconn->write_lock[0], "plugin.write");
+	lockstat_mutex_init(&pconn->write_lock[1], "plugin.write");
+	for (unsigned int i = 0; i < plugins.count; i++) {
+		pconn->state[i] = (struct plugin_state_t) {
+			.pub = {
+				.connection_id = description->connection_id,
+				.client_ip_nbo = description->connector.ip_nbo,
+				.client_port_nbo = description->connector.port_nbo,
+				.server_ip_nbo = description->acceptor.ip_nbo,
+				.server_port_nbo = description->acceptor.port_nbo,
+				.server_name = description->acceptor.hostname,
+			},
+			.owner = pconn,
+			.instance = &plugins.instance[i],
+		};
+	}
+	return pconn;
+}
+
+void plugin_connection_free(struct plugin_connection_t *pconn) {
+	if (!pconn) {
+		return;
+	}
+	lockstat_mutex_destroy(&pconn->write_lock[0]);
+	lockstat_mutex_destroy(&pconn->write_lock[1]);
+	free(pconn);
+}
+
+enum ratched_plugin_verdict_t plugin_connection_open(struct plugin_connection_t *pconn, plugin_write_fnc_t write_fnc, void *write_argument) {
+	pconn->write_fnc = write_fnc;
+	pconn->write_argument = write_argument;
+	for (unsigned int i = 0; i < plugins.count; i++) {
+		struct plugin_state_t *state = &pconn->state[i];
+		if (state->instance->plugin->connection_open && (state->instance->plugin->connection_open(&state->pub) == RATCHED_PLUGIN_CLOSE)) {
+			logmsg(LLVL_DEBUG, "Plugin %s closed connection %u when it was opened.", state->instance->plugin->name, state->pub.connection_id);
+			stats_inc(plugins.closed);
+			return RATCHED_PLUGIN_CLOSE;
+		}
+	}
+	return RATCHED_PLUGIN_PASS;
+}
+
+void plugin_connection_close(struct plugin_connection_t *pconn) {
+	for (unsigned int i = 0; i < plugins.count; i++) {
+		struct plugin_state_t *state = &pconn->state[i];
+		if (state->instance->plugin->connection_close) {
+			state->instance->plugin->connection_close(&state->pub);
+		}
+	}
+	pconn->write_fnc = NULL;
+}
+
+/* Runs a relayed chunk through the chain of plugins. On return, *data and
+ * *length describe what is to be forwarded if the verdict is PASS. */
+enum ratched_plugin_verdict_t plugin_connection_chunk(struct plugin_connection_t *pconn, bool direction, uint8_t **data, size_t *length, size_t capacity) {
+	uint8_t *const buffer = *data;
+	struct ratched_plugin_chunk_t chunk = {
+		.client_to_server = direction,
+		.data = buffer,
+		.length = *length,
+		.capacity = capacity,
+	};
+	stats_inc(plugins.chunks);
+	for (unsigned int i = 0; i < plugins.count; i++) {
+		struct plugin_state_t *state = &pconn->state[i];
+		if (!state->instance->plugin->chunk) {
+			continue;
+		}
+		enum ratched_plugin_verdict_t verdict = state->instance->plugin->chunk(&state->pub, &chunk);
+		if ((chunk.data >= buffer) && (chunk.data <= buffer + capacity)) {
+			/* Still inside the relay buffer, check it has not been overrun */
+			if (chunk.data + chunk.length > buffer + capacity) {
+				logmsg(LLVL_ERROR, "Plugin %s extended a chunk of connection %u beyond the buffer capacity of %zu bytes, closing connection.", state->instance->plugin->name, state->pub.connection_id, capacity);
+				verdict = RATCHED_PLUGIN_CLOSE;
+			}
+			chunk.capacity = buffer + capacity - chunk.data;
+		} else {
+			/* Plugin replaced the data by a buffer of its own */
+			chunk.capacity = chunk.length;
+		}
+
+		if (verdict == RATCHED_PLUGIN_HOLD) {
+			lockstat_lock(&pconn->write_lock[direction]);
+			state->held_bytes[direction] += chunk.length;
+			const bool over_budget = state->held_bytes[direction] > state->instance->max_held_bytes;
+			lockstat_unlock(&pconn->write_lock[direction]);
+			stats_add(plugins.held_bytes, chunk.length);
+			if (over_budget) {
+				logmsg(LLVL_ERROR, "Plugin %s holds more than %zu bytes of connection %u, closing connection.", state->instance->plugin->name, state->instance->max_held_bytes, state->pub.connection_id);
+				verdict = RATCHED_PLUGIN_CLOSE;
+			}
+		}
+		if (verdict == RATCHED_PLUGIN_CLOSE) {
+			stats_inc(plugins.closed);
+		}
+		if (verdict != RATCHED_PLUGIN_PASS) {
+			return verdict;
+		}
+	}
+	*data = chunk.data;
+	*length = chunk.length;
+	return RATCHED_PLUGIN_PASS;
+}
+
+bool plugin_connection_write(struct plugin_connection_t *pconn, bool direction, const uint8_t *data, size_t length) {
+	lockstat_lock(&pconn->write_lock[direction]);
+	bool success = pconn->write_fnc(pconn->write_argument, direction, data, length);
+	lockstat_unlock(&pconn->write_lock[direction]);
+	return success;
+}
@@ -0,0 +1,56 @@
+/**
+ *	ratched - TLS connection router that performs a man-in-the-middle attack
+ *	Copyright (C) 2017-2017 Johannes Bauer
+ *
+ *	This file is part of ratched.
+ *
+ *	ratched is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; this program is ONLY licensed under
+ *	version 3 of the License, later versions are explicitly excluded.
+ *
+ *	ratched is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with ratched; if not, write to the Free Software
+ *	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *	Johannes Bauer <JohannesBauer@gmx.de>
+**/
+
+
+#ifndef __PLUGIN_H__
+#define __PLUGIN_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "ratched_plugin.h"
+#include "tcpip.h"
+
+#define MAX_PLUGINS					8
+#define PLUGIN_DEFAULT_MAX_HELD		(1024 * 1024)
+
+/* Writes data that a plugin let pass or injected to the peer in the given
+ * direction */
+typedef bool (*plugin_write_fnc_t)(void *argument, bool direction, const uint8_t *data, size_t length);
+
+struct plugin_connection_t;
+
+/*************** AUTO GENERATED SECTION FOLLOWS ***************/
+bool plugins_register(const struct ratched_plugin_t *plugin, const char *argument);
+bool plugins_load(const char *filename, const char *argument);
+bool plugins_active(void);
+void plugins_deinit(void);
+struct plugin_connection_t *plugin_connection_new(const struct connection_t *description);
+void plugin_connection_free(struct plugin_connection_t *pconn);
+enum ratched_plugin_verdict_t plugin_connection_open(struct plugin_connection_t *pconn, plugin_write_fnc_t write_fnc, void *write_argument);
+void plugin_connection_close(struct plugin_connection_t *pconn);
+enum ratched_plugin_verdict_t plugin_connection_chunk(struct plugin_connection_t *pconn, bool direction, uint8_t **data, size_t *length, size_t capacity);
+bool plugin_connection_write(struct plugin_connection_t *pconn, bool direction, const uint8_t *data, size_t length);
+/***************  AUTO GENERATED SECTION ENDS   ***************/
+
+#endif
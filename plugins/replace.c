@@ -0,0 +1,79 @@
+/**
+ *	ratched - TLS connection router that performs a man-in-the-middle attack
+ *	Copyright (C) 2017-2017 Johannes Bauer
+ *
+ *	This file is part of ratched.
+ *
+ *	ratched is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; this program is ONLY licensed under
+ *	version 3 of the License, later versions are explicitly excluded.
+ *
+ *	ratched is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with ratched; if not, write to the Free Software
+ *	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *	Johannes Bauer <JohannesBauer@gmx.de>
+**/
+
+
+/* Example plugin that replaces a string in relayed plaintext by another one
+ * of the same length, in place, e.g. to downgrade a header:
+ *
+ *   ratched --plugin plugins/replace.so,gzip=xxxx ...
+ *
+ * Occurrences that straddle the boundary of two chunks are not replaced. */
+
+#include <stdlib.h>
+#include <string.h>
+#include <ratched_plugin.h>
+
+static const struct ratched_plugin_api_t *api;
+static char *search, *replacement;
+static size_t length;
+
+static bool replace_init(const struct ratched_plugin_api_t *plugin_api, const char *argument) {
+	api = plugin_api;
+	const char *separator = argument ? strchr(argument, '=') : NULL;
+	if (!separator || (separator == argument) || (strlen(separator + 1) != (size_t)(separator - argument))) {
+		api->log(RATCHED_PLUGIN_LOG_ERROR, "replace: argument must be search=replacement with both strings of equal, nonzero length.");
+		return false;
+	}
+	length = separator - argument;
+	search = strndup(argument, length);
+	replacement = strdup(separator + 1);
+	api->log(RATCHED_PLUGIN_LOG_INFO, "replace: replacing \"%s\" by \"%s\".", search, replacement);
+	return search && replacement;
+}
+
+static void replace_deinit(void) {
+	free(search);
+	free(replacement);
+}
+
+static enum ratched_plugin_verdict_t replace_chunk(struct ratched_plugin_connection_t *conn, struct ratched_plugin_chunk_t *chunk) {
+	uint8_t *end = chunk->data + chunk->length;
+	uint8_t *match = chunk->data;
+	while ((end - match >= length) && (match = memchr(match, search[0], end - match - length + 1))) {
+		if (!memcmp(match, search, length)) {
+			memcpy(match, replacement, length);
+			match += length;
+		} else {
+			match++;
+		}
+	}
+	return RATCHED_PLUGIN_PASS;
+}
+
+const struct ratched_plugin_t ratched_plugin = {
+	.abi_version = RATCHED_PLUGIN_ABI_VERSION,
+	.name = "replace",
+	.init = replace_init,
+	.deinit = replace_deinit,
+	.chunk = replace_chunk,
+};
@@ -0,0 +1,48 @@
+/**
+ *	ratched - TLS connection router that performs a man-in-the-middle attack
+ *	Copyright (C) 2017-2017 Johannes Bauer
+ *
+ *	This file is part of ratched.
+ *
+ *	ratched is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; this program is ONLY licensed under
+ *	version 3 of the License, later versions are explicitly excluded.
+ *
+ *	ratched is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with ratched; if not, write to the Free Software
+ *	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *	Johannes Bauer <JohannesBauer@gmx.de>
+**/
+
+#ifndef __PROBES_H__
+#define __PROBES_H__
+
+/* Static tracepoints (USDT) at the connection pipeline boundaries. With
+ * <sys/sdt.h> available, every probe compiles to a single nop plus an ELF
+ * note describing where its arguments live; nothing is executed until a
+ * tracer such as bpftrace or perf attaches to it. Without the header, the
+ * probes vanish entirely. All probes live in the "ratched" provider and
+ * carry the connection ID as their first argument, see bpftrace/ for
+ * examples. */
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+
+#define PROBE1(name, a1)							DTRACE_PROBE1(ratched, name, a1)
+#define PROBE2(name, a1, a2)						DTRACE_PROBE2(ratched, name, a1, a2)
+#define PROBE3(name, a1, a2, a3)					DTRACE_PROBE3(ratched, name, a1, a2, a3)
+#define PROBE4(name, a1, a2, a3, a4)				DTRACE_PROBE4(ratched, name, a1, a2, a3, a4)
+#else
+#define PROBE1(name, a1)							do { (void)(a1); } while (0)
+#define PROBE2(name, a1, a2)						do { (void)(a1); (void)(a2); } while (0)
+#define PROBE3(name, a1, a2, a3)					do { (void)(a1); (void)(a2); (void)(a3); } while (0)
+#define PROBE4(name, a1, a2, a3, a4)				do { (void)(a1); (void)(a2); (void)(a3); (void)(a4); } while (0)
+#endif
+
+#endif
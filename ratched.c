@@ -33,8 +33,35 @@
 #include "daemonize.h"
 #include "interceptdb.h"
 #include "hostname_ids.h"
+#include "tools.h"
+#include "thread.h"
+#include "stats.h"
+#include "cryptomem.h"
+#include "httplog.h"
+#include "chunkstore.h"
+#include "lockstat.h"
+#include "conntable.h"
+#include "plugin.h"
+#include "scanner.h"
+#include "cryptopool.h"
+#include "chainverify.h"
+#include "overload.h"
+
+static void log_statistics(void *argument) {
+	lockstat_log(LLVL_DEBUG);
+	conntable_log(LLVL_INFO);
+	stats_log(LLVL_INFO);
+}
+
+static void log_startup_phase(const char *phase, double *phase_start) {
+	double now = monotonic_time();
+	logmsg(LLVL_INFO, "Startup phase \"%s\" took %.3f secs.", phase, now - *phase_start);
+	*phase_start = now;
+}
 
 int main(int argc, char **argv) {
+	const double startup_begin = monotonic_time();
+	double phase_start = startup_begin;
 	if (!parse_options(argc, argv)) {
 		show_syntax(argv[0]);
 		exit(EXIT_FAILURE);
@@ -52,7 +79,17 @@ int main(int argc, char **argv) {
 		exit(EXIT_FAILURE);
 	}
 
-	init_hostname_ids();
+	log_startup_phase("option parsing", &phase_start);
+
+	if (!init_hostname_ids(pgm_options->network.max_hostnames)) {
+		logmsg(LLVL_FATAL, "Could not initialize hostname table.");
+		exit(EXIT_FAILURE);
+	}
+
+	if (!conntable_init(pgm_options->network.max_connections, connection_data_size())) {
+		logmsg(LLVL_FATAL, "Could not initialize connection table.");
+		exit(EXIT_FAILURE);
+	}
 
 	struct multithread_dumper_t mtdump;
 	if (!open_pcap_write(&mtdump, pgm_options->pcapng.filename, pgm_options->pcapng.comment)) {
@@ -60,15 +97,69 @@ int main(int argc, char **argv) {
 		exit(EXIT_FAILURE);
 	}
 
+	if (pgm_options->pcapng.chunk_store_directory) {
+		mtdump.chunkstore = chunkstore_open(pgm_options->pcapng.chunk_store_directory);
+		if (!mtdump.chunkstore) {
+			logmsg(LLVL_FATAL, "Could not open chunk store %s.", pgm_options->pcapng.chunk_store_directory);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (pgm_options->pcapng.http_sidecar_filename && !httplog_init(pgm_options->pcapng.http_sidecar_filename)) {
+		logmsg(LLVL_FATAL, "Could not open HTTP sidecar file %s for writing.", pgm_options->pcapng.http_sidecar_filename);
+		exit(EXIT_FAILURE);
+	}
+
+	if (pgm_options->scan.patterns_filename && !scan_init(pgm_options->scan.patterns_filename)) {
+		logmsg(LLVL_FATAL, "Could not load scan patterns from %s.", pgm_options->scan.patterns_filename);
+		exit(EXIT_FAILURE);
+	}
+
 	if (pgm_options->operation.daemonize && !daemonize()) {
 		logmsg(LLVL_FATAL, "Requested daemonization failed.");
 		exit(EXIT_FAILURE);
 	}
 
+	if (!httplog_start()) {
+		logmsg(LLVL_FATAL, "Could not start writing HTTP sidecar file.");
+		exit(EXIT_FAILURE);
+	}
+
+	cryptomem_init();
 	openssl_init();
+	for (unsigned int i = 0; i < pgm_options->plugins.count; i++) {
+		if (!plugins_load(pgm_options->plugins.plugin[i].filename, pgm_options->plugins.plugin[i].argument)) {
+			logmsg(LLVL_FATAL, "Could not load plugin %s.", pgm_options->plugins.plugin[i].filename);
+			exit(EXIT_FAILURE);
+		}
+	}
+	if (pgm_options->upstream_verify.mode != CHAINVERIFY_OFF) {
+		if (!chainverify_init(pgm_options->upstream_verify.trust_store, pgm_options->upstream_verify.ttl)) {
+			logmsg(LLVL_FATAL, "Could not initialize upstream certificate verification.");
+			exit(EXIT_FAILURE);
+		}
+		cryptopool_init(get_parallel_worker_count());
+	}
+	if (pgm_options->overload.enabled && !overload_init(&pgm_options->overload.config)) {
+		logmsg(LLVL_FATAL, "Could not initialize overload control.");
+		exit(EXIT_FAILURE);
+	}
+	log_startup_phase("setup", &phase_start);
 	if (certforgery_init()) {
+		log_startup_phase("certificate forgery initialization", &phase_start);
 		if (init_interceptdb()) {
+			log_startup_phase("interception database initialization", &phase_start);
+			logmsg(LLVL_INFO, "Startup completed after %.3f secs.", monotonic_time() - startup_begin);
+			struct periodic_thread_t stats_thread = { 0 };
+			if (pgm_options->log.stats_interval > 0) {
+				start_periodic_thread(&stats_thread, "stats", pgm_options->log.stats_interval, log_statistics, NULL);
+			}
 			start_forwarding(&mtdump);
+			overload_deinit();
+			stop_periodic_thread(&stats_thread);
+			lockstat_log(LLVL_INFO);
+			stats_log(LLVL_INFO);
+			scan_log(LLVL_INFO);
 			deinit_interceptdb();
 		} else {
 			logmsg(LLVL_FATAL, "Cannot continue without properly initialized interception database.");
@@ -78,8 +169,15 @@ int main(int argc, char **argv) {
 		logmsg(LLVL_FATAL, "Cannot continue without proper certificates and keys.");
 	}
 
+	plugins_deinit();
+	scan_deinit();
+	cryptopool_deinit();
+	chainverify_deinit();
 	openssl_deinit();
+	httplog_deinit();
+	chunkstore_close(mtdump.chunkstore);
 	close_pcap(&mtdump);
+	conntable_deinit();
 	deinit_hostname_ids();
 	free_pgm_options();
 
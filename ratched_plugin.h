@@ -0,0 +1,115 @@
+/**
+ *	ratched - TLS connection router that performs a man-in-the-middle attack
+ *	Copyright (C) 2017-2017 Johannes Bauer
+ *
+ *	This file is part of ratched.
+ *
+ *	ratched is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; this program is ONLY licensed under
+ *	version 3 of the License, later versions are explicitly excluded.
+ *
+ *	ratched is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with ratched; if not, write to the Free Software
+ *	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *	Johannes Bauer <JohannesBauer@gmx.de>
+**/
+
+
+#ifndef __RATCHED_PLUGIN_H__
+#define __RATCHED_PLUGIN_H__
+
+/* Interface between ratched and in-process plugins that inspect or rewrite
+ * the plaintext of intercepted TLS connections. This header is all a plugin
+ * needs: it is compiled into a shared object (e.g., with "gcc -shared -fPIC")
+ * which exports a "struct ratched_plugin_t ratched_plugin" and is loaded with
+ * the --plugin option. Plugins do not link against any ratched symbols, all
+ * services are provided through the API table that is passed to init().
+ *
+ * Rules that every plugin must follow:
+ *
+ *   - The chunk callback runs on the relay thread of the respective
+ *     direction. While it runs, nothing more is read in that direction, so a
+ *     slow plugin throttles the sender through TCP flow control. Callbacks
+ *     for the two directions of one connection may run concurrently, so
+ *     per-connection state that both directions touch needs to be protected
+ *     by the plugin.
+ *   - chunk->data points into ratched's relay buffer and is only valid during
+ *     the callback. It may be modified in place, shortened or extended up to
+ *     chunk->capacity bytes; whatever chunk->data/chunk->length describe on
+ *     return with RATCHED_PLUGIN_PASS is forwarded.
+ *   - RATCHED_PLUGIN_HOLD forwards nothing. The plugin must copy what it
+ *     wants to keep and later release it with api->inject() in the same
+ *     direction. Held bytes are accounted per connection and direction
+ *     against max_held_bytes; a plugin that holds more than that gets the
+ *     connection closed.
+ *   - api->inject() writes data to the peer in the given direction,
+ *     bypassing any plugins that come later in the chain. It may be called
+ *     from any callback of the connection (including for the opposite
+ *     direction) but must not be called after connection_close() returned.
+ *   - RATCHED_PLUGIN_CLOSE terminates the connection.
+ *
+ * All callbacks are optional. What is captured to the PCAPNG file is the
+ * data actually sent to the peers, i.e., after plugins have acted on it. */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define RATCHED_PLUGIN_ABI_VERSION		1
+#define RATCHED_PLUGIN_SYMBOL			"ratched_plugin"
+
+enum ratched_plugin_verdict_t {
+	RATCHED_PLUGIN_PASS = 0,
+	RATCHED_PLUGIN_HOLD = 1,
+	RATCHED_PLUGIN_CLOSE = 2,
+};
+
+enum ratched_plugin_loglvl_t {
+	RATCHED_PLUGIN_LOG_ERROR = 0,
+	RATCHED_PLUGIN_LOG_WARN = 1,
+	RATCHED_PLUGIN_LOG_INFO = 2,
+	RATCHED_PLUGIN_LOG_DEBUG = 3,
+};
+
+struct ratched_plugin_connection_t {
+	unsigned int connection_id;
+	uint32_t client_ip_nbo;
+	uint16_t client_port_nbo;
+	uint32_t server_ip_nbo;
+	uint16_t server_port_nbo;
+	const char *server_name;		/* NULL if the client sent no SNI */
+	void *state;					/* For the plugin's own use */
+};
+
+struct ratched_plugin_chunk_t {
+	bool client_to_server;
+	uint8_t *data;
+	size_t length;
+	size_t capacity;
+};
+
+struct ratched_plugin_api_t {
+	unsigned int abi_version;
+	void (*log)(enum ratched_plugin_loglvl_t level, const char *msg, ...) __attribute__ ((format (printf, 2, 3)));
+	bool (*inject)(struct ratched_plugin_connection_t *conn, bool client_to_server, const uint8_t *data, size_t length);
+};
+
+struct ratched_plugin_t {
+	unsigned int abi_version;
+	const char *name;
+	size_t max_held_bytes;
+	bool (*init)(const struct ratched_plugin_api_t *api, const char *argument);
+	void (*deinit)(void);
+	enum ratched_plugin_verdict_t (*connection_open)(struct ratched_plugin_connection_t *conn);
+	void (*connection_close)(struct ratched_plugin_connection_t *conn);
+	enum ratched_plugin_verdict_t (*chunk)(struct ratched_plugin_connection_t *conn, struct ratched_plugin_chunk_t *chunk);
+};
+
+#endif
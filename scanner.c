@@ -0,0 +1,456 @@
+/**
+ *	ratched - TLS connection router that performs a man-in-the-middle attack
+ *	Copyright (C) 2017-2017 Johannes Bauer
+ *
+ *	This file is part of ratched.
+ *
+ *	ratched is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; this program is ONLY licensed under
+ *	version 3 of the License, later versions are explicitly excluded.
+ *
+ *	ratched is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with ratched; if not, write to the Free Software
+ *	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *	Johannes Bauer <JohannesBauer@gmx.de>
+**/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include "scanner.h"
+#include "keyvaluelist.h"
+#include "stats.h"
+
+#define OUTPUT_FLAG					(1U << 31)
+#define STATE_MASK					(~OUTPUT_FLAG)
+#define MAX_TRANSITION_TABLE_BYTES	(256 * 1024 * 1024)
+
+static struct {
+	struct scanner_t *scanner;
+	struct stats_counter_t *bytes;
+	struct stats_counter_t *matches;
+	struct stats_counter_t *terminated;
+} scan;
+
+struct scanner_t *scanner_new(void) {
+	struct scanner_t *scanner = calloc(1, sizeof(struct scanner_t));
+	if (!scanner) {
+		logmsg(LLVL_FATAL, "Failed to allocate scanner: %s", strerror(errno));
+	}
+	return scanner;
+}
+
+bool scanner_add_pattern(struct scanner_t *scanner, const char *name, const uint8_t *data, unsigned int length, uint32_t flags) {
+	if (length == 0) {
+		logmsg(LLVL_ERROR, "Scan pattern %s is empty.", name);
+		return false;
+	}
+	if (scanner->pattern_count == scanner->pattern_alloced) {
+		unsigned int new_alloced = scanner->pattern_alloced ? (2 * scanner->pattern_alloced) : 16;
+		struct scan_pattern_t *new_patterns = realloc(scanner->patterns, sizeof(struct scan_pattern_t) * new_alloced);
+		if (!new_patterns) {
+			logmsg(LLVL_FATAL, "Failed to grow scan pattern list: %s", strerror(errno));
+			return false;
+		}
+		scanner->patterns = new_patterns;
+		scanner->pattern_alloced = new_alloced;
+	}
+	struct scan_pattern_t *pattern = &scanner->patterns[scanner->pattern_count];
+	*pattern = (struct scan_pattern_t) {
+		.name = strdup(name),
+		.data = malloc(length),
+		.length = length,
+		.flags = flags,
+	};
+	atomic_init(&pattern->matches, 0);
+	if (!pattern->name || !pattern->data) {
+		logmsg(LLVL_FATAL, "Failed to allocate scan pattern %s: %s", name, strerror(errno));
+		free(pattern->name);
+		free(pattern->data);
+		return false;
+	}
+	memcpy(pattern->data, data, length);
+	scanner->pattern_count++;
+	return true;
+}
+
+static void set_start_bigram(struct scanner_t *scanner, unsigned int bigram) {
+	scanner->start_bigrams[bigram / 64] |= (1ULL << (bigram % 64));
+}
+
+static inline bool is_start_bigram(const struct scanner_t *scanner, const uint8_t *data) {
+	const unsigned int bigram = (data[0] << 8) | data[1];
+	return (scanner->start_bigrams[bigram / 64] >> (bigram % 64)) & 1;
+}
+
+static inline uint32_t *state_transitions(const struct scanner_t *scanner, uint32_t state) {
+	return scanner->transitions + ((size_t)state * scanner->class_count);
+}
+
+/* Builds the trie of all patterns, then completes it into a DFA in
+ * breadth-first order: missing transitions of a state are those of its
+ * failure state, which is always shallower and therefore already complete.
+ * Transitions into states at which some pattern ends (directly or through
+ * the chain of failure states) carry OUTPUT_FLAG, so that scanning only
+ * looks at the output tables when there actually is a match. */
+bool scanner_compile(struct scanner_t *scanner) {
+	unsigned int max_states = 1;
+	memset(scanner->byte_class, 0, sizeof(scanner->byte_class));
+	memset(scanner->start_bigrams, 0, sizeof(scanner->start_bigrams));
+	scanner->class_count = 1;
+	for (unsigned int i = 0; i < scanner->pattern_count; i++) {
+		const struct scan_pattern_t *pattern = &scanner->patterns[i];
+		max_states += pattern->length;
+		for (unsigned int j = 0; j < pattern->length; j++) {
+			if (!scanner->byte_class[pattern->data[j]]) {
+				scanner->byte_class[pattern->data[j]] = scanner->class_count++;
+			}
+		}
+		if (pattern->length == 1) {
+			for (unsigned int second = 0; second < 256; second++) {
+				set_start_bigram(scanner, (pattern->data[0] << 8) | second);
+			}
+		} else {
+			set_start_bigram(scanner, (pattern->data[0] << 8) | pattern->data[1]);
+		}
+	}
+
+	if ((uint64_t)max_states * scanner->class_count * sizeof(uint32_t) > MAX_TRANSITION_TABLE_BYTES) {
+		logmsg(LLVL_ERROR, "Scan patterns are too large: %u states with %u byte classes exceed the transition table limit of %u MiB.", max_states, scanner->class_count, MAX_TRANSITION_TABLE_BYTES / 1024 / 1024);
+		return false;
+	}
+	free(scanner->transitions);
+	free(scanner->output);
+	free(scanner->output_link);
+	scanner->transitions = calloc((size_t)max_states * scanner->class_count, sizeof(uint32_t));
+	scanner->output = malloc(max_states * sizeof(int32_t));
+	scanner->output_link = calloc(max_states, sizeof(uint32_t));
+	uint32_t *failure = calloc(max_states, sizeof(uint32_t));
+	uint32_t *queue = malloc(max_states * sizeof(uint32_t));
+	if (!scanner->transitions || !scanner->output || !scanner->output_link || !failure || !queue) {
+		logmsg(LLVL_FATAL, "Failed to allocate scanner automaton for %u states: %s", max_states, strerror(errno));
+		free(failure);
+		free(queue);
+		return false;
+	}
+	for (unsigned int i = 0; i < max_states; i++) {
+		scanner->output[i] = -1;
+	}
+
+	/* Trie */
+	scanner->state_count = 1;
+	for (unsigned int i = 0; i < scanner->pattern_count; i++) {
+		const struct scan_pattern_t *pattern = &scanner->patterns[i];
+		uint32_t state = 0;
+		for (unsigned int j = 0; j < pattern->length; j++) {
+			uint32_t *next = &state_transitions(scanner, state)[scanner->byte_class[pattern->data[j]]];
+			if (!*next) {
+				*next = scanner->state_count++;
+			}
+			state = *next;
+		}
+		if (scanner->output[state] != -1) {
+			logmsg(LLVL_ERROR, "Scan patterns %s and %s are identical.", scanner->patterns[scanner->output[state]].name, pattern->name);
+			free(failure);
+			free(queue);
+			return false;
+		}
+		scanner->output[state] = i;
+	}
+
+	/* Failure function and completion of the transition table. Class 0
+	 * (bytes that appear in no pattern) always leads back to the start
+	 * state, which calloc() already took care of. */
+	unsigned int queue_head = 0, queue_tail = 0;
+	for (unsigned int c = 1; c < scanner->class_count; c++) {
+		uint32_t child = state_transitions(scanner, 0)[c];
+		if (child) {
+			queue[queue_tail++] = child;
+		}
+	}
+	while (queue_head < queue_tail) {
+		const uint32_t state = queue[queue_head++];
+		uint32_t *transitions = state_transitions(scanner, state);
+		const uint32_t *fail_transitions = state_transitions(scanner, failure[state]);
+		for (unsigned int c = 1; c < scanner->class_count; c++) {
+			const uint32_t child = transitions[c];
+			if (child) {
+				failure[child] = fail_transitions[c];
+				scanner->output_link[child] = (scanner->output[failure[child]] != -1) ? failure[child] : scanner->output_link[failure[child]];
+				queue[queue_tail++] = child;
+			} else {
+				transitions[c] = fail_transitions[c];
+			}
+		}
+	}
+	free(failure);
+	free(queue);
+
+	const size_t transition_count = (size_t)scanner->state_count * scanner->class_count;
+	for (size_t i = 0; i < transition_count; i++) {
+		const uint32_t target = scanner->transitions[i];
+		if ((scanner->output[target] != -1) || scanner->output_link[target]) {
+			scanner->transitions[i] |= OUTPUT_FLAG;
+		}
+	}
+	logmsg(LLVL_DEBUG, "Compiled %u scan patterns into %u states with %u byte classes (%zu kiB transition table).", scanner->pattern_count, scanner->state_count, scanner->class_count, transition_count * sizeof(uint32_t) / 1024);
+	return true;
+}
+
+void scanner_free(struct scanner_t *scanner) {
+	if (!scanner) {
+		return;
+	}
+	for (unsigned int i = 0; i < scanner->pattern_count; i++) {
+		free(scanner->patterns[i].name);
+		free(scanner->patterns[i].data);
+	}
+	free(scanner->patterns);
+	free(scanner->transitions);
+	free(scanner->output);
+	free(scanner->output_link);
+	free(scanner);
+}
+
+static bool report_matches(const struct scanner_t *scanner, uint32_t state, uint64_t end_offset, scan_match_callback_t callback, void *argument) {
+	if (scanner->output[state] == -1) {
+		state = scanner->output_link[state];
+	}
+	while (state) {
+		struct scan_pattern_t *pattern = &scanner->patterns[scanner->output[state]];
+		atomic_fetch_add_explicit(&pattern->matches, 1, memory_order_relaxed);
+		if (!callback(pattern, end_offset, argument)) {
+			return false;
+		}
+		state = scanner->output_link[state];
+	}
+	return true;
+}
+
+bool scanner_scan(const struct scanner_t *scanner, struct scan_stream_t *stream, const uint8_t *data, size_t length, scan_match_callback_t callback, void *argument) {
+	const uint8_t *const end = data + length;
+	const uint8_t *p = data;
+	uint32_t state = stream->state;
+	bool keep_scanning = true;
+	while (p < end) {
+		if (state == 0) {
+			/* No partial match in progress: skip all positions at which no
+			 * pattern can start */
+			while ((p + 1 < end) && !is_start_bigram(scanner, p)) {
+				p++;
+			}
+		}
+		const uint32_t next = state_transitions(scanner, state)[scanner->byte_class[*p++]];
+		state = next & STATE_MASK;
+		if (next & OUTPUT_FLAG) {
+			const uint64_t end_offset = stream->offset + (p - data);
+			if (!report_matches(scanner, state, end_offset, callback, argument)) {
+				keep_scanning = false;
+				break;
+			}
+		}
+	}
+	stream->state = state;
+	stream->offset += length;
+	return keep_scanning;
+}
+
+static int parse_hex_digit(char c) {
+	if ((c >= '0') && (c <= '9')) {
+		return c - '0';
+	} else if ((c >= 'a') && (c <= 'f')) {
+		return c - 'a' + 10;
+	} else if ((c >= 'A') && (c <= 'F')) {
+		return c - 'A' + 10;
+	}
+	return -1;
+}
+
+/* Decodes \\, \n, \r, \t, \s (space) and \xNN escapes in place; returns the
+ * decoded length or -1 on a malformed escape */
+static int unescape_pattern(char *text) {
+	char *out = text;
+	for (const char *in = text; *in; in++) {
+		if (*in != '\\') {
+			*out++ = *in;
+			continue;
+		}
+		in++;
+		switch (*in) {
+			case '\\':	*out++ = '\\'; break;
+			case 'n':	*out++ = '\n'; break;
+			case 'r':	*out++ = '\r'; break;
+			case 't':	*out++ = '\t'; break;
+			case 's':	*out++ = ' '; break;
+			case 'x': {
+				int high = parse_hex_digit(in[1]);
+				int low = (high != -1) ? parse_hex_digit(in[2]) : -1;
+				if (low == -1) {
+					return -1;
+				}
+				*out++ = (high << 4) | low;
+				in += 2;
+				break;
+			}
+			default:
+				return -1;
+		}
+	}
+	return out - text;
+}
+
+static const struct lookup_entry_t scan_flag_table[] = {
+	{ "report", SCAN_REPORT },
+	{ "terminate", SCAN_TERMINATE },
+	{ 0 },
+};
+
+/* Each non-empty line that does not start with '#' contains the name of a
+ * pattern, its colon-separated flags and the pattern itself (the rest of the
+ * line, with escapes), separated by whitespace:
+ *
+ *   aws_access_key   report             AKIA
+ *   github_token     report:terminate   ghp_
+ *   basic_auth       report             Authorization:\sBasic\s
+ */
+struct scanner_t *scanner_load_file(const char *filename) {
+	FILE *f = fopen(filename, "r");
+	if (!f) {
+		logmsg(LLVL_ERROR, "Cannot open scan pattern file %s: %s", filename, strerror(errno));
+		return NULL;
+	}
+	struct scanner_t *scanner = scanner_new();
+	bool success = (scanner != NULL);
+	char *line = NULL;
+	size_t line_alloced = 0;
+	unsigned int line_no = 0;
+	while (success && (getline(&line, &line_alloced, f) != -1)) {
+		line_no++;
+		line[strcspn(line, "\r\n")] = 0;
+		char *name = line + strspn(line, " \t");
+		if ((name[0] == 0) || (name[0] == '#')) {
+			continue;
+		}
+		char *flags = name + strcspn(name, " \t");
+		if (*flags) {
+			*flags++ = 0;
+			flags += strspn(flags, " \t");
+		}
+		char *text = flags + strcspn(flags, " \t");
+		if (*text) {
+			*text++ = 0;
+			text += strspn(text, " \t");
+		}
+		uint32_t flag_value = 0;
+		int length;
+		if ((flags[0] == 0) || (text[0] == 0)) {
+			logmsg(LLVL_ERROR, "%s line %u: expected pattern name, flags and pattern.", filename, line_no);
+			success = false;
+		} else if (!keyvalue_flags(flags, (void*)scan_flag_table, &flag_value)) {
+			logmsg(LLVL_ERROR, "%s line %u: invalid flags \"%s\".", filename, line_no, flags);
+			success = false;
+		} else if ((length = unescape_pattern(text)) <= 0) {
+			logmsg(LLVL_ERROR, "%s line %u: invalid escape sequence in pattern %s.", filename, line_no, name);
+			success = false;
+		} else {
+			success = scanner_add_pattern(scanner, name, (const uint8_t*)text, length, flag_value);
+		}
+	}
+	free(line);
+	fclose(f);
+
+	if (success && (scanner->pattern_count == 0)) {
+		logmsg(LLVL_ERROR, "Scan pattern file %s does not contain any patterns.", filename);
+		success = false;
+	}
+	if (success) {
+		success = scanner_compile(scanner);
+	}
+	if (!success) {
+		scanner_free(scanner);
+		return NULL;
+	}
+	return scanner;
+}
+
+bool scan_init(const char *filename) {
+	scan.scanner = scanner_load_file(filename);
+	if (!scan.scanner) {
+		return false;
+	}
+	scan.bytes = stats_counter("scan.bytes");
+	scan.matches = stats_counter("scan.matches");
+	scan.terminated = stats_counter("scan.terminated");
+	logmsg(LLVL_INFO, "Scanning relayed data for %u patterns from %s.", scan.scanner->pattern_count, filename);
+	return true;
+}
+
+void scan_deinit(void) {
+	scanner_free(scan.scanner);
+	scan.scanner = NULL;
+}
+
+bool scan_active(void) {
+	return scan.scanner != NULL;
+}
+
+void scan_relay_init(struct scan_relay_t *relay, unsigned int connection_id, bool direction, struct connection_t *capture) {
+	*relay = (struct scan_relay_t) {
+		.connection_id = connection_id,
+		.direction = direction,
+		.capture = capture,
+	};
+}
+
+static bool relay_match(const struct scan_pattern_t *pattern, uint64_t end_offset, void *argument) {
+	struct scan_relay_t *relay = (struct scan_relay_t*)argument;
+	stats_inc(scan.matches);
+	if (pattern->flags & SCAN_REPORT) {
+		char comment[256];
+		snprintf(comment, sizeof(comment), "Scan match: pattern %s ends at %s stream offset %" PRIu64 "%s", pattern->name, relay->direction ? "client-to-server" : "server-to-client", end_offset, (pattern->flags & SCAN_TERMINATE) ? ", connection terminated" : "");
+		logmsg(LLVL_WARN, "Connection %u: %s", relay->connection_id, comment);
+		if (relay->capture) {
+			annotate_tcp_ip_connection(relay->capture, relay->direction, comment);
+		}
+	}
+	if (pattern->flags & SCAN_TERMINATE) {
+		relay->terminate = true;
+		return false;
+	}
+	return true;
+}
+
+/* Scans a chunk before it is forwarded. Returns false if a pattern that
+ * terminates the connection was found, in which case the chunk must not be
+ * forwarded. */
+bool scan_relay_chunk(struct scan_relay_t *relay, const uint8_t *data, size_t length) {
+	stats_add(scan.bytes, length);
+	scanner_scan(scan.scanner, &relay->stream, data, length, relay_match, relay);
+	if (relay->terminate) {
+		stats_inc(scan.terminated);
+	}
+	return !relay->terminate;
+}
+
+void scan_log(enum loglvl_t loglvl) {
+	if (!scan.scanner || !loglevel_at_least(loglvl)) {
+		return;
+	}
+	for (unsigned int i = 0; i < scan.scanner->pattern_count; i++) {
+		const struct scan_pattern_t *pattern = &scan.scanner->patterns[i];
+		uint64_t matches = atomic_load_explicit(&pattern->matches, memory_order_relaxed);
+		if (matches) {
+			logmsg(loglvl, "Scan pattern %s matched %" PRIu64 " times.", pattern->name, matches);
+		}
+	}
+}
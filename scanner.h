@@ -0,0 +1,101 @@
+/**
+ *	ratched - TLS connection router that performs a man-in-the-middle attack
+ *	Copyright (C) 2017-2017 Johannes Bauer
+ *
+ *	This file is part of ratched.
+ *
+ *	ratched is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; this program is ONLY licensed under
+ *	version 3 of the License, later versions are explicitly excluded.
+ *
+ *	ratched is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with ratched; if not, write to the Free Software
+ *	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *	Johannes Bauer <JohannesBauer@gmx.de>
+**/
+
+
+#ifndef __SCANNER_H__
+#define __SCANNER_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include "tcpip.h"
+#include "logging.h"
+
+enum scan_flag_t {
+	SCAN_REPORT = (1 << 0),
+	SCAN_TERMINATE = (1 << 1),
+};
+
+struct scan_pattern_t {
+	char *name;
+	uint8_t *data;
+	unsigned int length;
+	uint32_t flags;
+	atomic_uint_fast64_t matches;
+};
+
+/* Multi-pattern matcher: an Aho-Corasick automaton compiled into a complete
+ * transition table (a DFA) over byte classes, so that every input byte
+ * costs exactly one table lookup. Bytes that do not occur in any pattern
+ * share one class, which keeps the table narrow. In the start state, a
+ * bitmap of all two-byte pattern prefixes is used to skip over input at
+ * which no pattern can begin without touching the table at all. */
+struct scanner_t {
+	unsigned int pattern_count;
+	unsigned int pattern_alloced;
+	struct scan_pattern_t *patterns;
+	unsigned int state_count;
+	unsigned int class_count;
+	uint8_t byte_class[256];
+	uint32_t *transitions;
+	int32_t *output;
+	uint32_t *output_link;
+	uint64_t start_bigrams[65536 / 64];
+};
+
+/* Scanning state of one direction of one stream; matches that straddle the
+ * boundary between two chunks are found since the automaton state is kept
+ * across calls */
+struct scan_stream_t {
+	uint32_t state;
+	uint64_t offset;
+};
+
+/* Returns false to stop scanning the current chunk */
+typedef bool (*scan_match_callback_t)(const struct scan_pattern_t *pattern, uint64_t end_offset, void *argument);
+
+struct scan_relay_t {
+	struct scan_stream_t stream;
+	unsigned int connection_id;
+	bool direction;
+	struct connection_t *capture;
+	bool terminate;
+};
+
+/*************** AUTO GENERATED SECTION FOLLOWS ***************/
+struct scanner_t *scanner_new(void);
+bool scanner_add_pattern(struct scanner_t *scanner, const char *name, const uint8_t *data, unsigned int length, uint32_t flags);
+bool scanner_compile(struct scanner_t *scanner);
+void scanner_free(struct scanner_t *scanner);
+bool scanner_scan(const struct scanner_t *scanner, struct scan_stream_t *stream, const uint8_t *data, size_t length, scan_match_callback_t callback, void *argument);
+struct scanner_t *scanner_load_file(const char *filename);
+bool scan_init(const char *filename);
+void scan_deinit(void);
+bool scan_active(void);
+void scan_relay_init(struct scan_relay_t *relay, unsigned int connection_id, bool direction, struct connection_t *capture);
+bool scan_relay_chunk(struct scan_relay_t *relay, const uint8_t *data, size_t length);
+void scan_log(enum loglvl_t loglvl);
+/***************  AUTO GENERATED SECTION ENDS   ***************/
+
+#endif
@@ -31,6 +31,8 @@
 #include <sys/time.h>
 #include <pthread.h>
 #include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <linux/netfilter_ipv4.h>
 #include <openssl/ssl.h>
 #include <openssl/x509.h>
@@ -51,66 +53,191 @@
 #include "errstack.h"
 #include "openssl.h"
 #include "hostname_ids.h"
+#include "stats.h"
+#include "cryptomem.h"
+#include "httplog.h"
+#include "probes.h"
+#include "conntable.h"
+#include "chainverify.h"
+#include "overload.h"
+#include "plugin.h"
 
 static struct atomic_t active_client_connections;
 static bool quit;
 static int listening_sd;
 
+static struct {
+	struct stats_counter_t *tfo_syn_data;
+	struct stats_counter_t *tfo_fallback;
+	struct stats_counter_t *accepted_retransmits;
+	struct stats_counter_t *connected_retransmits;
+} counters;
+
+#define MAX_PRELIMINARY_DATA_LEN		4096
+
+struct preliminary_data_t {
+	uint8_t data[MAX_PRELIMINARY_DATA_LEN];
+	ssize_t data_length;
+	bool seen_clienthello;
+	struct chello_t parsed_data;
+};
+
+/* Per-connection data that only the connection's own thread uses. It is the
+ * cold part of the connection's slot in the connection table. */
 struct client_thread_data_t {
+	struct conn_slot_t *slot;
+	unsigned int connection_id;
 	int accepted_sd;
 	uint32_t source_ip_nbo;
 	uint16_t source_port_nbo;
 	uint32_t destination_ip_nbo;
 	uint16_t destination_port_nbo;
 	struct multithread_dumper_t *mtdump;
+	double accepted_at;
+	bool handshake_recorded;
+	struct connection_t conn;
+	struct preliminary_data_t preliminary_data;
 };
 
-#define MAX_PRELIMINARY_DATA_LEN		4096
+static void errstack_free_conn_slot(struct errstack_element_t *element) {
+	conntable_free((struct conn_slot_t*)element->ptrvalue);
+}
 
-struct preliminary_data_t {
-	uint8_t data[MAX_PRELIMINARY_DATA_LEN];
-	ssize_t data_length;
-	bool seen_clienthello;
-	struct chello_t parsed_data;
-};
+static void errstack_retract_connected_fd(struct errstack_element_t *element) {
+	conntable_set_fd((struct conn_slot_t*)element->ptrvalue, CONN_FD_CONNECTED, -1);
+}
 
 static void retrieve_and_parse_preliminary_data(struct errstack_t *es, int read_sd, struct preliminary_data_t *preliminary_data) {
 	/* Init structure somewhat (not the buffer though, that'd be pointless) */
 	preliminary_data->data_length = 0;
 	memset(&preliminary_data->parsed_data, 0, sizeof(struct chello_t));
 
-	/* Connection to target suceeded. First read some bytes that the client
-	 * (presumably) has sent so far. */
-	bool data_available = select_read(read_sd, pgm_options->network.initial_read_timeout);
-	if (data_available) {
-		preliminary_data->data_length = read(read_sd, preliminary_data->data, MAX_PRELIMINARY_DATA_LEN);
+	/* First read some bytes that the client (presumably) has sent so far.
+	 * Usually (and with TCP_DEFER_ACCEPT almost always) the ClientHello is
+	 * already there, so try without waiting for readability first. */
+	preliminary_data->data_length = recv(read_sd, preliminary_data->data, MAX_PRELIMINARY_DATA_LEN, MSG_DONTWAIT);
+	if ((preliminary_data->data_length == -1) && ((errno == EAGAIN) || (errno == EWOULDBLOCK))) {
+		preliminary_data->data_length = 0;
+		bool data_available = select_read(read_sd, pgm_options->network.initial_read_timeout);
+		if (data_available) {
+			preliminary_data->data_length = read(read_sd, preliminary_data->data, MAX_PRELIMINARY_DATA_LEN);
+		} else {
+			logmsg(LLVL_DEBUG, "Initial client connection timed out after %.1f sec.", pgm_options->network.initial_read_timeout);
+		}
+	}
+	if (preliminary_data->data_length != 0) {
 		logmsg(LLVL_DEBUG, "Initial client connection returned %zd bytes.", preliminary_data->data_length);
-	} else {
-		logmsg(LLVL_DEBUG, "Initial client connection timed out after %.1f sec.", pgm_options->network.initial_read_timeout);
 	}
 
 	/* Now try to parse these bytes as a ClientHello message, if possible */
 	if (preliminary_data->data_length > 0) {
 		preliminary_data->seen_clienthello = parse_client_hello(&preliminary_data->parsed_data, preliminary_data->data, preliminary_data->data_length);
+		errstack_push_client_hello(es, &preliminary_data->parsed_data);
 		if (preliminary_data->seen_clienthello) {
-			errstack_push_client_hello(es, &preliminary_data->parsed_data);
-			logmsg(LLVL_DEBUG, "Successfully parsed ClientHello message from preliminary data. SNI %s", preliminary_data->parsed_data.server_name_indication ? preliminary_data->parsed_data.server_name_indication : "not present");
+			logmsg(LLVL_DEBUG, "Successfully parsed ClientHello message from preliminary data. SNI %s", preliminary_data->parsed_data.server_name_indication ? preliminary_data->parsed_data.server_name_indication->name : "not present");
 		} else {
 			logmsg(LLVL_WARN, "The %zd initial bytes couldn't be parsed as a ClientHello.", preliminary_data->data_length);
 		}
 	}
 }
 
-static void start_plain_forwarding(const struct preliminary_data_t *preliminary_data, int accepted_fd, int connected_fd) {
-	/* First write the preliminary data to its peer, then forward the rest of the data */
+static int connect_to_destination(struct errstack_t *es, const struct client_thread_data_t *ctx, const struct preliminary_data_t *preliminary_data, bool fast_open, const struct tcp_tuning_t *tuning) {
+	bool sent_in_syn;
+	const unsigned int initial_length = (preliminary_data && (preliminary_data->data_length > 0)) ? preliminary_data->data_length : 0;
+	int connected_sd = errstack_push_fd(es, tcp_connect_send(ctx->destination_ip_nbo, ctx->destination_port_nbo, preliminary_data ? preliminary_data->data : NULL, initial_length, fast_open, tuning, &sent_in_syn));
+	if (connected_sd == -1) {
+		logmsg(LLVL_ERROR, "Outgoing connection to " PRI_IPv4_PORT " failed, closing accepted connection: %s", FMT_IPv4_PORT_TUPLE(ctx->destination_ip_nbo, ctx->destination_port_nbo), strerror(errno));
+		return connected_sd;
+	}
+	/* Retracted before the descriptor is closed */
+	conntable_set_fd(ctx->slot, CONN_FD_CONNECTED, connected_sd);
+	errstack_push_generic_ptr(es, errstack_retract_connected_fd, ctx->slot);
+	if (fast_open && initial_length) {
+		stats_inc(sent_in_syn ? counters.tfo_syn_data : counters.tfo_fallback);
+		logmsg(LLVL_DEBUG, "%u bytes of initial data sent to " PRI_IPv4_PORT " %s.", initial_length, FMT_IPv4_PORT_TUPLE(ctx->destination_ip_nbo, ctx->destination_port_nbo), sent_in_syn ? "in SYN using TCP Fast Open" : "after handshake (TCP Fast Open not used)");
+	}
+	return connected_sd;
+}
+
+/* Logs the state of a TCP connection when forwarding on it has finished */
+static void log_tcp_info(const char *description, int sd, struct stats_counter_t *retransmits) {
+	struct tcp_info_snapshot_t snapshot;
+	if (!get_tcp_info_snapshot(sd, &snapshot)) {
+		return;
+	}
+	stats_add(retransmits, snapshot.total_retransmits);
+	logmsg(LLVL_DEBUG, "TCP %s connection: RTT %.1f ms (variance %.1f ms), %u retransmits, %u lost, cwnd %u", description, snapshot.rtt_usecs / 1000., snapshot.rttvar_usecs / 1000., snapshot.total_retransmits, snapshot.lost, snapshot.snd_cwnd);
+}
+
+static void describe_connection(struct connection_t *conn, const struct client_thread_data_t *ctx, const struct hostname_t *sni) {
+	*conn = (struct connection_t) {
+		.connection_id = ctx->connection_id,
+		.acceptor = {
+			.ip_nbo = ctx->destination_ip_nbo,
+			.port_nbo = ctx->destination_port_nbo,
+			.hostname = sni ? sni->name : NULL,
+			.hostname_id = sni ? sni->id : 0,
+		},
+		.connector = {
+			.ip_nbo = ctx->source_ip_nbo,
+			.port_nbo = ctx->source_port_nbo,
+		},
+	};
+}
+
+static void start_capture(struct connection_t *conn, const struct client_thread_data_t *ctx, const struct hostname_t *sni, const char *comment) {
+	describe_connection(conn, ctx, sni);
+	create_tcp_ip_connection(ctx->mtdump, conn, comment, pgm_options->pcapng.use_ipv6_encapsulation);
+}
+
+static void finish_capture(struct connection_t *conn) {
+	teardown_tcp_ip_connection(conn, false);
+	flush_tcp_ip_connection(conn);
+}
+
+static void start_plain_forwarding(struct errstack_t *es, struct intercept_entry_t *decision, struct client_thread_data_t *ctx) {
+	const struct preliminary_data_t *preliminary_data = &ctx->preliminary_data;
+	/* Connect and pass the preliminary data to the peer, then forward the
+	 * rest of the data */
 	logmsg(LLVL_INFO, "Direct and unmodified forwarding of traffic, not intercepting.");
-	if (preliminary_data->data_length > 0) {
-		ssize_t bytes_written = write(connected_fd, preliminary_data->data, preliminary_data->data_length);
-		if (bytes_written != preliminary_data->data_length) {
-			logmsg(LLVL_WARN, "Preliminary data read was %zd bytes, but only %zd bytes written.", preliminary_data->data_length, bytes_written);
+	int connected_fd = connect_to_destination(es, ctx, preliminary_data, decision->tcp_fastopen, &decision->connected_tcp);
+	if (connected_fd == -1) {
+		return;
+	}
+	conntable_set_state(ctx->slot, CONN_FORWARDING);
+	conntable_set_deadline(ctx->slot, 0);
+
+	struct connection_t *conn = &ctx->conn;
+	const bool capture = (decision->capture_policy == CAPTURE_ALL);
+	if (capture) {
+		const struct hostname_t *sni = preliminary_data->parsed_data.server_name_indication;
+		char comment[256];
+		snprintf(comment, sizeof(comment), "Forwarded unmodified, %zd bytes initial data, Server Name Indication %s, " PRI_IPv4 ":%u", (preliminary_data->data_length > 0) ? preliminary_data->data_length : 0, sni ? sni->name : "not present", FMT_IPv4(ctx->destination_ip_nbo), ntohs(ctx->destination_port_nbo));
+		start_capture(conn, ctx, sni, comment);
+		if (preliminary_data->data_length > 0) {
+			/* Already sent to the peer while connecting */
+			append_tcp_ip_data(conn, true, preliminary_data->data, preliminary_data->data_length);
 		}
 	}
-	plain_forward_data(accepted_fd, connected_fd);
+	if (preliminary_data->data_length > 0) {
+		conntable_account(ctx->connection_id, true, preliminary_data->data_length);
+	}
+	plain_forward_data(ctx->connection_id, ctx->accepted_sd, connected_fd, capture ? conn : NULL);
+	conntable_set_state(ctx->slot, CONN_CLOSING);
+	log_tcp_info("accepted", ctx->accepted_sd, counters.accepted_retransmits);
+	log_tcp_info("connected", connected_fd, counters.connected_retransmits);
+	if (capture) {
+		finish_capture(conn);
+	}
+}
+
+/* Feeds the time from accept until forwarding (or failure) of an intercepted
+ * connection into overload control, once per connection */
+static void record_handshake_latency(struct client_thread_data_t *ctx) {
+	if (!ctx->handshake_recorded) {
+		ctx->handshake_recorded = true;
+		overload_record_handshake(monotonic_time() - ctx->accepted_at);
+	}
 }
 
 static void log_tls_endpoint_config(enum loglvl_t loglvl, const char *description, const struct tls_endpoint_config_t *config) {
@@ -121,11 +248,33 @@ static void log_tls_endpoint_config(enum loglvl_t loglvl, const char *descriptio
 	}
 }
 
-static void start_tls_forwarding(struct intercept_entry_t *decision, const struct client_thread_data_t *ctx, const struct preliminary_data_t *preliminary_data, int accepted_fd, int connected_fd) {
+static struct tls_connection_t connect_upstream_tls(struct errstack_t *es, const struct client_thread_data_t *ctx, struct tls_endpoint_config_t *client_config, int connected_fd) {
+	const struct hostname_t *sni = ctx->preliminary_data.parsed_data.server_name_indication;
+	struct tls_connection_request_t client_request = {
+		.is_server = false,
+		.peer_fd = connected_fd,
+		.config = client_config,
+		.server_name_indication = sni ? sni->name : NULL,
+	};
+	PROBE2(handshake_start, ctx->connection_id, "connected");
+	struct tls_connection_t connected_ssl = openssl_tls_connect(&client_request);
+	PROBE3(handshake_end, ctx->connection_id, "connected", connected_ssl.ssl != NULL);
+	errstack_push_tls_connection(es, connected_ssl.ssl);
+	return connected_ssl;
+}
+
+static void start_tls_forwarding(struct intercept_entry_t *decision, struct client_thread_data_t *ctx) {
 	struct errstack_t es = ERRSTACK_INIT;
+	const struct preliminary_data_t *preliminary_data = &ctx->preliminary_data;
+	const int accepted_fd = ctx->accepted_sd;
+	const struct hostname_t *sni = preliminary_data->parsed_data.server_name_indication;
 
-	/* Now perform TLS handshake with the accepted peer first */
+	/* Now perform TLS handshake with the accepted peer first (unless the
+	 * upstream certificate needs to be mirrored and isn't known yet) */
 	struct tls_endpoint_config_t server_config = decision->server_template;
+	struct tls_endpoint_config_t client_config = decision->client_template;
+	const bool mirror = decision->mirror_upstream_certificate && !server_config.cert;
+	struct tls_connection_t connected_ssl = { 0 };
 	log_tls_endpoint_config(LLVL_TRACE, "Server TLS endpoint configuration template", &server_config);
 
 	if (!server_config.key) {
@@ -134,20 +283,48 @@ static void start_tls_forwarding(struct intercept_entry_t *decision, const struc
 		return;
 	}
 
+	if (!server_config.cert && !server_config.certificate_authority.cert) {
+		logmsg(LLVL_ERROR, "TLS forwarding not possible. Tried to generate server certificate, but CA certificate is missing.");
+		errstack_pop_all(&es);
+		return;
+	}
+	if (!server_config.cert && !server_config.certificate_authority.key) {
+		logmsg(LLVL_ERROR, "TLS forwarding not possible. Tried to generate server certificate, but CA private key is missing.");
+		errstack_pop_all(&es);
+		return;
+	}
+
+	/* Connect upstream before answering the client, so that a client whose
+	 * destination is unreachable is dropped instead of completing a
+	 * handshake that cannot be forwarded */
+	int connected_fd = connect_to_destination(&es, ctx, NULL, false, &decision->connected_tcp);
+	if (connected_fd == -1) {
+		errstack_pop_all(&es);
+		return;
+	}
+
 	if (!server_config.cert) {
 		/* No static configuration for that host, dynamically generate
 		 * server certificate */
-		if (!server_config.certificate_authority.cert) {
-			logmsg(LLVL_ERROR, "TLS forwarding not possible. Tried to generate server certificate, but CA certificate is missing.");
-			errstack_pop_all(&es);
-			return;
-		}
-		if (!server_config.certificate_authority.key) {
-			logmsg(LLVL_ERROR, "TLS forwarding not possible. Tried to generate server certificate, but CA private key is missing.");
-			errstack_pop_all(&es);
-			return;
+		PROBE2(forge_start, ctx->connection_id, "server");
+		if (mirror) {
+			server_config.cert = get_mirrored_certificate_for_server(sni, ctx->destination_ip_nbo);
+			if (!server_config.cert) {
+				/* First time we see this host, need to learn what the
+				 * upstream certificate looks like before we can answer the
+				 * client */
+				connected_ssl = connect_upstream_tls(&es, ctx, &client_config, connected_fd);
+				if (!connected_ssl.ssl) {
+					logmsg(LLVL_ERROR, "TLS handshake with " PRI_IPv4_PORT " failed, cannot mirror its certificate.", FMT_IPv4_PORT_TUPLE(ctx->destination_ip_nbo, ctx->destination_port_nbo));
+					errstack_pop_all(&es);
+					return;
+				}
+				server_config.cert = mirror_certificate_for_server(sni, ctx->destination_ip_nbo, SSL_get0_peer_certificate(connected_ssl.ssl), NULL);
+			}
+		} else {
+			server_config.cert = forge_certificate_for_server(sni, ctx->destination_ip_nbo);
 		}
-		server_config.cert = forge_certificate_for_server(preliminary_data->parsed_data.server_name_indication, ctx->destination_ip_nbo);
+		PROBE3(forge_end, ctx->connection_id, "server", server_config.cert != NULL);
 		errstack_push_X509(&es, server_config.cert);
 	}
 
@@ -160,20 +337,31 @@ static void start_tls_forwarding(struct intercept_entry_t *decision, const struc
 		.initial_peer_data = preliminary_data->data,
 		.initial_peer_data_length = preliminary_data->data_length,
 	};
+	PROBE2(handshake_start, ctx->connection_id, "accepted");
 	struct tls_connection_t accepted_ssl = openssl_tls_connect(&server_request);
-	errstack_push_SSL(&es, accepted_ssl.ssl);
+	PROBE3(handshake_end, ctx->connection_id, "accepted", accepted_ssl.ssl != NULL);
+	errstack_push_tls_connection(&es, accepted_ssl.ssl);
 
 	/* Did the accepted peer send a client certificate? */
-	struct tls_endpoint_config_t client_config = decision->client_template;
 	log_tls_endpoint_config(LLVL_TRACE, "Client TLS endpoint configuration template", &client_config);
 
-	if (accepted_ssl.ssl && accepted_ssl.peer_certificate)  {
+	if (connected_ssl.ssl) {
+		/* Already connected upstream to mirror its certificate, too late
+		 * for presenting a client certificate */
+		if (accepted_ssl.peer_certificate) {
+			logmsg(LLVL_WARN, "Client presented a certificate, but connection to " PRI_IPv4_PORT " was already established to mirror the server certificate.", FMT_IPv4_PORT_TUPLE(ctx->destination_ip_nbo, ctx->destination_port_nbo));
+		}
+	} else if (accepted_ssl.ssl && accepted_ssl.peer_certificate)  {
 		if (!client_config.cert) {
 			/* Client certificates are used, but no static client
 			 * certificate configuration found. Dynamically generate
 			 * client certificate. */
 			client_config.key = get_tls_client_key();
+			PROBE2(forge_start, ctx->connection_id, "client");
+			enum cryptomem_subsystem_t previous_subsystem = cryptomem_enter(CRYPTOMEM_FORGING);
 			client_config.cert = forge_client_certificate(accepted_ssl.peer_certificate, client_config.key, NULL, client_config.key, pgm_options->forged_certs.recalculate_key_identifiers, pgm_options->forged_certs.mark_forged_certificates);
+			cryptomem_leave(previous_subsystem);
+			PROBE3(forge_end, ctx->connection_id, "client", client_config.cert != NULL);
 			log_cert(LLVL_DEBUG, client_config.cert, "Dynamically created client certificate");
 		} else {
 			X509_up_ref(client_config.cert);
@@ -182,37 +370,65 @@ static void start_tls_forwarding(struct intercept_entry_t *decision, const struc
 	}
 	log_tls_endpoint_config(LLVL_TRACE, "Client TLS endpoint final configuration", &client_config);
 
+	if (!accepted_ssl.ssl) {
+		logmsg(LLVL_ERROR, "TLS handshake with accepted peer failed, closing connection to " PRI_IPv4_PORT ".", FMT_IPv4_PORT_TUPLE(ctx->destination_ip_nbo, ctx->destination_port_nbo));
+		errstack_pop_all(&es);
+		return;
+	}
+
 	/* And do a TLS handshake with the connected peer as well */
-	struct tls_connection_request_t client_request = {
-		.is_server = false,
-		.peer_fd = connected_fd,
-		.config = &client_config,
-		.server_name_indication = preliminary_data->parsed_data.server_name_indication,
-	};
-	struct tls_connection_t connected_ssl = openssl_tls_connect(&client_request);
-	errstack_push_SSL(&es, connected_ssl.ssl);
+	if (!connected_ssl.ssl) {
+		connected_ssl = connect_upstream_tls(&es, ctx, &client_config, connected_fd);
+		if (mirror && connected_ssl.ssl) {
+			/* Presented the host's previous mirror; if the server's
+			 * certificate has changed since, have the next connection see
+			 * the updated one */
+			X509 *mirrored_cert = mirror_certificate_for_server(sni, ctx->destination_ip_nbo, SSL_get0_peer_certificate(connected_ssl.ssl), server_config.cert);
+			X509_free(mirrored_cert);
+		}
+	}
+
+	/* Check who we're actually talking to upstream, if requested */
+	char upstream_verification[128] = "";
+	struct chainverify_result_t verify_result;
+	if (connected_ssl.ssl && chainverify_peer(connected_ssl.ssl, sni ? sni->name : NULL, ctx->destination_ip_nbo, &verify_result)) {
+		chainverify_describe(&verify_result, upstream_verification, sizeof(upstream_verification));
+		PROBE4(upstream_verify, ctx->connection_id, verify_result.verified, verify_result.cached, verify_result.error);
+		logmsg(verify_result.verified ? LLVL_DEBUG : LLVL_WARN, "Upstream certificate of " PRI_IPv4_PORT " (Server Name Indication %s): %s", FMT_IPv4_PORT_TUPLE(ctx->destination_ip_nbo, ctx->destination_port_nbo), sni ? sni->name : "not present", upstream_verification);
+		if (!verify_result.verified && (pgm_options->upstream_verify.mode == CHAINVERIFY_ENFORCE)) {
+			logmsg(LLVL_ERROR, "Refusing to forward data to " PRI_IPv4_PORT ", upstream certificate verification failed.", FMT_IPv4_PORT_TUPLE(ctx->destination_ip_nbo, ctx->destination_port_nbo));
+			errstack_pop_all(&es);
+			return;
+		}
+	}
 
 	/* Then forward the TLS channels */
 	if (connected_ssl.ssl && accepted_ssl.ssl) {
+		conntable_set_state(ctx->slot, CONN_FORWARDING);
+		conntable_set_deadline(ctx->slot, 0);
+		record_handshake_latency(ctx);
+
 		/* Create a connection to dump data into */
-		struct connection_t conn = {
-			.acceptor = {
-				.ip_nbo = ctx->destination_ip_nbo,
-				.port_nbo = ctx->destination_port_nbo,
-				.hostname = preliminary_data->parsed_data.server_name_indication,
-				.hostname_id = resolve_hostname_id(ctx->destination_ip_nbo, preliminary_data->parsed_data.server_name_indication),
-			},
-			.connector = {
-				.ip_nbo = ctx->source_ip_nbo,
-				.port_nbo = ctx->source_port_nbo,
-			},
-		};
-		char comment[256];
-		snprintf(comment, sizeof(comment), "%zd bytes ClientHello, Server Name Indication %s, " PRI_IPv4 ":%u", preliminary_data->data_length, preliminary_data->parsed_data.server_name_indication ? preliminary_data->parsed_data.server_name_indication : "not present", FMT_IPv4(conn.acceptor.ip_nbo), ntohs(conn.acceptor.port_nbo));
-		create_tcp_ip_connection(ctx->mtdump, &conn, comment, pgm_options->pcapng.use_ipv6_encapsulation);
-		tls_forward_data(accepted_ssl.ssl, connected_ssl.ssl, &conn);
-		teardown_tcp_ip_connection(&conn, false);
-		flush_tcp_ip_connection(&conn);
+		struct connection_t *conn = &ctx->conn;
+		const bool capture = (decision->capture_policy != CAPTURE_NONE);
+		if (capture) {
+			char comment[384];
+			snprintf(comment, sizeof(comment), "%zd bytes ClientHello, Server Name Indication %s, " PRI_IPv4 ":%u%s%s", preliminary_data->data_length, sni ? sni->name : "not present", FMT_IPv4(ctx->destination_ip_nbo), ntohs(ctx->destination_port_nbo), upstream_verification[0] ? ", upstream certificate " : "", upstream_verification);
+			start_capture(conn, ctx, sni, comment);
+		} else {
+			describe_connection(conn, ctx, sni);
+		}
+		struct http_log_connection_t *http = httplog_connection_new(conn);
+		struct plugin_connection_t *plugins = plugin_connection_new(conn);
+		tls_forward_data(ctx->connection_id, accepted_ssl.ssl, connected_ssl.ssl, capture ? conn : NULL, http, plugins);
+		plugin_connection_free(plugins);
+		httplog_connection_free(http);
+		conntable_set_state(ctx->slot, CONN_CLOSING);
+		log_tcp_info("accepted", accepted_fd, counters.accepted_retransmits);
+		log_tcp_info("connected", connected_fd, counters.connected_retransmits);
+		if (capture) {
+			finish_capture(conn);
+		}
 	} else {
 		logmsg(LLVL_ERROR, "One TLS connection couldn't be established (connected %p, accepted %p). Cannot forward.", connected_ssl.ssl, accepted_ssl.ssl);
 	}
@@ -221,59 +437,95 @@ static void start_tls_forwarding(struct intercept_entry_t *decision, const struc
 
 static void client_thread_fnc(void *vctx) {
 	struct client_thread_data_t *ctx = (struct client_thread_data_t*)vctx;
+	set_thread_name("conn-%u", ctx->connection_id);
 	struct errstack_t es = ERRSTACK_INIT;
 	errstack_push_atomic_dec(&es, &active_client_connections);
-	errstack_push_malloc(&es, ctx);
 	errstack_push_fd(&es, ctx->accepted_sd);
 
-	/* Create client connection first */
-	int connected_sd = errstack_push_fd(&es, tcp_connect(ctx->destination_ip_nbo, ctx->destination_port_nbo));
-	if (connected_sd == -1) {
-		/* Connection to client failed. */
-		logmsg(LLVL_ERROR, "Outgoing connection to " PRI_IPv4_PORT " failed, closing accepted connection: %s", FMT_IPv4_PORT_TUPLE(ctx->destination_ip_nbo, ctx->destination_port_nbo), strerror(errno));
-		errstack_pop_all(&es);
-		return;
-	}
+	/* Releasing the slot (and with it ctx) happens before the accepted
+	 * descriptor is closed, since the descriptor must be retracted from the
+	 * connection table first */
+	errstack_push_generic_ptr(&es, errstack_free_conn_slot, ctx->slot);
 
-	struct preliminary_data_t preliminary_data;
-	retrieve_and_parse_preliminary_data(&es, ctx->accepted_sd, &preliminary_data);
+	/* The outgoing connection is only created once it is known how the
+	 * connection is handled, so that the client's initial data can be sent
+	 * along with the connection request (TCP Fast Open). */
+	struct preliminary_data_t *preliminary_data = &ctx->preliminary_data;
+	retrieve_and_parse_preliminary_data(&es, ctx->accepted_sd, preliminary_data);
 
 	/* Given all the facts, determine if and how we should intercept the
 	 * connection. Look up the entry in the interception DB */
-	struct intercept_entry_t *decision = interceptdb_find_entry(preliminary_data.parsed_data.server_name_indication, ctx->destination_ip_nbo);
+	struct intercept_entry_t *decision = interceptdb_find_entry(preliminary_data->parsed_data.server_name_indication, ctx->destination_ip_nbo);
 	logmsg(LLVL_DEBUG, "Connection to " PRI_IPv4_PORT " in interception mode %s.", FMT_IPv4_PORT_TUPLE(ctx->destination_ip_nbo, ctx->destination_port_nbo), interception_mode_to_str(decision->interception_mode));
+	PROBE4(decision, ctx->connection_id, decision->interception_mode, preliminary_data->data_length, preliminary_data->parsed_data.server_name_indication ? preliminary_data->parsed_data.server_name_indication->name : "");
 
-	if (decision->interception_mode == REJECT_CONNECTION) {
+	/* Under overload, we might not be able to afford what's configured */
+	const enum interception_mode_t mode = overload_adjust_mode(decision->interception_mode, interceptdb_is_default_entry(decision));
+	if (mode != decision->interception_mode) {
+		logmsg(LLVL_DEBUG, "Overload stage %d, handling connection to " PRI_IPv4_PORT " in interception mode %s instead.", overload_stage(), FMT_IPv4_PORT_TUPLE(ctx->destination_ip_nbo, ctx->destination_port_nbo), interception_mode_to_str(mode));
+	}
+	conntable_set_mode(ctx->slot, mode);
+	conntable_set_state(ctx->slot, CONN_HANDSHAKE);
+	apply_tcp_tuning(ctx->accepted_sd, &decision->accepted_tcp);
+
+	if (mode == REJECT_CONNECTION) {
 		/* Do nothing, just close connection. */
-	} else if ((decision->interception_mode == TRAFFIC_FORWARDING) || ((decision->interception_mode == OPPORTUNISTIC_TLS_INTERCEPTION) && !preliminary_data.seen_clienthello))  {
+		conntable_set_state(ctx->slot, CONN_CLOSING);
+		PROBE3(close, ctx->connection_id, 0, 0);
+	} else if ((mode == TRAFFIC_FORWARDING) || ((mode == OPPORTUNISTIC_TLS_INTERCEPTION) && !preliminary_data->seen_clienthello))  {
 		/* We either wanted to forward this connection from the get-go or we
 		 * tried opportunstic interception but couldn't parse a ClientHello
 		 * from the client data (or received no data). Engage unmodified
 		 * forwarding of traffic. */
-		start_plain_forwarding(&preliminary_data, ctx->accepted_sd, connected_sd);
-	} else if ((decision->interception_mode == OPPORTUNISTIC_TLS_INTERCEPTION) || (decision->interception_mode == MANDATORY_TLS_INTERCEPTION)) {
+		start_plain_forwarding(&es, decision, ctx);
+	} else if ((mode == OPPORTUNISTIC_TLS_INTERCEPTION) || (mode == MANDATORY_TLS_INTERCEPTION)) {
 		/* Do TLS interception */
-		start_tls_forwarding(decision, ctx, &preliminary_data, ctx->accepted_sd, connected_sd);
+		start_tls_forwarding(decision, ctx);
+		record_handshake_latency(ctx);
 	} else {
-		logmsg(LLVL_FATAL, "Programming error: got interception mode 0x%x", decision->interception_mode);
+		logmsg(LLVL_FATAL, "Programming error: got interception mode 0x%x", mode);
 	}
 	errstack_pop_all(&es);
 }
 
-static void start_client_thread(struct multithread_dumper_t *mtdump, int accepted_sd, const struct sockaddr_in *source, const struct sockaddr_in *destination) {
-	struct client_thread_data_t *threaddata = calloc(sizeof(*threaddata), 1);
+static void start_client_thread(struct multithread_dumper_t *mtdump, int accepted_sd, double accepted_at, const struct sockaddr_in *source, const struct sockaddr_in *destination) {
+	struct conn_slot_t *slot = conntable_alloc(accepted_sd, pgm_options->network.handshake_timeout);
+	if (!slot) {
+		logmsg(LLVL_WARN, "Connection table is full (%u connections), closing accepted FD %d.", pgm_options->network.max_connections, accepted_sd);
+		close(accepted_sd);
+		return;
+	}
+	struct client_thread_data_t *threaddata = conntable_cold(slot);
+	threaddata->slot = slot;
+	threaddata->connection_id = conntable_id(slot);
 	threaddata->accepted_sd = accepted_sd;
 	threaddata->source_ip_nbo = source->sin_addr.s_addr;
 	threaddata->source_port_nbo = source->sin_port;
 	threaddata->destination_ip_nbo = destination->sin_addr.s_addr;
 	threaddata->destination_port_nbo = destination->sin_port;
 	threaddata->mtdump = mtdump;
+	threaddata->accepted_at = accepted_at;
+	threaddata->handshake_recorded = false;
+	PROBE3(accept, threaddata->connection_id, ntohl(threaddata->source_ip_nbo), ntohs(threaddata->source_port_nbo));
 	atomic_inc(&active_client_connections);
 	if (!start_detached_thread(client_thread_fnc, threaddata)) {
 		logmsg(LLVL_ERROR, "Error starting client thread for accepted FD %d: %s", accepted_sd, strerror(errno));
+		conntable_free(slot);
+		close(accepted_sd);
+		atomic_dec(&active_client_connections);
 	}
 }
 
+/* Size of the per-connection data that the connection table has to hold for
+ * every slot */
+size_t connection_data_size(void) {
+	return sizeof(struct client_thread_data_t);
+}
+
+static void expire_connections(void *argument) {
+	conntable_expire();
+}
+
 void stop_forwarding(bool force) {
 	/* Do not call 'logmsg' here, it might deadlock from signal handler because
 	 * it tries to acquire a mutex */
@@ -287,6 +539,10 @@ void stop_forwarding(bool force) {
 
 bool start_forwarding(struct multithread_dumper_t *mtdump) {
 	atomic_init(&active_client_connections);
+	counters.tfo_syn_data = stats_counter("tfo.syn_data");
+	counters.tfo_fallback = stats_counter("tfo.fallback");
+	counters.accepted_retransmits = stats_counter("tcp.accepted_retransmits");
+	counters.connected_retransmits = stats_counter("tcp.connected_retransmits");
 
     listening_sd = socket(AF_INET, SOCK_STREAM, 0);
 	if (listening_sd == -1) {
@@ -303,6 +559,13 @@ bool start_forwarding(struct multithread_dumper_t *mtdump) {
 		}
 	}
 
+	if (pgm_options->network.defer_accept_secs) {
+		int defer_secs = pgm_options->network.defer_accept_secs;
+		if (setsockopt(listening_sd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &defer_secs, sizeof(defer_secs)) < 0) {
+			logmsg(LLVL_WARN, "setsockopt(TCP_DEFER_ACCEPT) failed, accepting connections immediately: %s", strerror(errno));
+		}
+	}
+
 	struct sockaddr_in serv_addr;
     memset(&serv_addr, 0, sizeof(serv_addr));
     serv_addr.sin_family = AF_INET;
@@ -323,6 +586,17 @@ bool start_forwarding(struct multithread_dumper_t *mtdump) {
 
 	logmsg(LLVL_INFO, "Listening for incoming connections on " PRI_IPv4_PORT, FMT_IPv4_PORT(serv_addr));
 
+	/* Check deadlines at a quarter of the timeout, but at least once per
+	 * second */
+	struct periodic_thread_t expiry_thread = { 0 };
+	if (pgm_options->network.handshake_timeout > 0) {
+		const double interval = (pgm_options->network.handshake_timeout < 4) ? (pgm_options->network.handshake_timeout / 4) : 1;
+		start_periodic_thread(&expiry_thread, "conntimer", interval, expire_connections, NULL);
+	}
+	if (!overload_start(listening_sd)) {
+		logmsg(LLVL_WARN, "Overload control could not be started, all connections will be accepted regardless of load.");
+	}
+
 	while (!quit) {
 		struct sockaddr_in client_addr;
 		socklen_t socklen = sizeof(client_addr);
@@ -335,6 +609,12 @@ bool start_forwarding(struct multithread_dumper_t *mtdump) {
 				continue;
 			}
 		}
+		if (overload_shed_connection()) {
+			/* Cheapest possible answer, no thread and no logging */
+			close(connsd);
+			continue;
+		}
+		const double accepted_at = monotonic_time();
 		logmsg(LLVL_INFO, "New incoming connection from " PRI_IPv4_PORT, FMT_IPv4_PORT(client_addr));
 
 		struct sockaddr_in original_addr;
@@ -357,7 +637,7 @@ bool start_forwarding(struct multithread_dumper_t *mtdump) {
 				}
 			}
 			if (start_client) {
-				start_client_thread(mtdump, connsd, &client_addr, &original_addr);
+				start_client_thread(mtdump, connsd, accepted_at, &client_addr, &original_addr);
 			}
 		}
 
@@ -373,6 +653,7 @@ bool start_forwarding(struct multithread_dumper_t *mtdump) {
 	/* Wait for all further communication to cease */
 	logmsg(LLVL_DEBUG, "Waiting for remaining %d connection(s) to close.", active_client_connections.value);
 	atomic_wait_until_value(&active_client_connections, 0);
+	stop_periodic_thread(&expiry_thread);
 
 	return true;
 }
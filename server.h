@@ -25,9 +25,11 @@
 #define __SERVER_H__
 
 #include <stdbool.h>
+#include <stddef.h>
 #include "tcpip.h"
 
 /*************** AUTO GENERATED SECTION FOLLOWS ***************/
+size_t connection_data_size(void);
 void stop_forwarding(bool force);
 bool start_forwarding(struct multithread_dumper_t *mtdump);
 /***************  AUTO GENERATED SECTION ENDS   ***************/
@@ -0,0 +1,137 @@
+/**
+ *	ratched - TLS connection router that performs a man-in-the-middle attack
+ *	Copyright (C) 2017-2017 Johannes Bauer
+ *
+ *	This file is part of ratched.
+ *
+ *	ratched is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; this program is ONLY licensed under
+ *	version 3 of the License, later versions are explicitly excluded.
+ *
+ *	ratched is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with ratched; if not, write to the Free Software
+ *	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *	Johannes Bauer <JohannesBauer@gmx.de>
+**/
+
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include "stats.h"
+#include "logging.h"
+
+/* Named statistics counters. Counters are created once (typically during
+ * initialization of a subsystem) and never removed, so pointers to them stay
+ * valid and updating them is a single relaxed atomic operation. */
+#define MAX_STATS_COUNTERS		256
+#define MAX_STATS_NAME_LENGTH	48
+
+struct stats_counter_t {
+	char name[MAX_STATS_NAME_LENGTH];
+	atomic_int_fast64_t value;
+};
+
+static struct {
+	pthread_mutex_t lock;
+	unsigned int count;
+	struct stats_counter_t counters[MAX_STATS_COUNTERS];
+} stats = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static struct stats_counter_t overflow_counter;
+
+struct stats_counter_t *stats_counter(const char *name) {
+	struct stats_counter_t *result = NULL;
+	pthread_mutex_lock(&stats.lock);
+	for (unsigned int i = 0; i < stats.count; i++) {
+		if (!strcmp(stats.counters[i].name, name)) {
+			result = &stats.counters[i];
+			break;
+		}
+	}
+	if (!result) {
+		if (stats.count < MAX_STATS_COUNTERS) {
+			result = &stats.counters[stats.count++];
+			snprintf(result->name, sizeof(result->name), "%s", name);
+			atomic_init(&result->value, 0);
+		} else {
+			logmsg(LLVL_ERROR, "Too many statistics counters, cannot register %s.", name);
+			result = &overflow_counter;
+		}
+	}
+	pthread_mutex_unlock(&stats.lock);
+	return result;
+}
+
+void stats_add(struct stats_counter_t *counter, int64_t value) {
+	atomic_fetch_add_explicit(&counter->value, value, memory_order_relaxed);
+}
+
+void stats_inc(struct stats_counter_t *counter) {
+	stats_add(counter, 1);
+}
+
+void stats_set(struct stats_counter_t *counter, int64_t value) {
+	atomic_store_explicit(&counter->value, value, memory_order_relaxed);
+}
+
+int64_t stats_get(const struct stats_counter_t *counter) {
+	return atomic_load_explicit(&((struct stats_counter_t*)counter)->value, memory_order_relaxed);
+}
+
+void stats_foreach(void (*callback)(const char *name, int64_t value, void *argument), void *argument) {
+	pthread_mutex_lock(&stats.lock);
+	unsigned int count = stats.count;
+	pthread_mutex_unlock(&stats.lock);
+	for (unsigned int i = 0; i < count; i++) {
+		callback(stats.counters[i].name, stats_get(&stats.counters[i]), argument);
+	}
+}
+
+struct stats_log_buffer_t {
+	char text[1024];
+	unsigned int length;
+	enum loglvl_t loglvl;
+};
+
+static void stats_log_flush(struct stats_log_buffer_t *buffer) {
+	if (buffer->length) {
+		logmsg(buffer->loglvl, "Statistics: %s", buffer->text);
+		buffer->length = 0;
+		buffer->text[0] = 0;
+	}
+}
+
+static void stats_log_counter(const char *name, int64_t value, void *vbuffer) {
+	struct stats_log_buffer_t *buffer = (struct stats_log_buffer_t*)vbuffer;
+	char entry[MAX_STATS_NAME_LENGTH + 32];
+	int entry_length = snprintf(entry, sizeof(entry), "%s%s=%" PRId64, buffer->length ? " " : "", name, value);
+	if (buffer->length + entry_length >= sizeof(buffer->text)) {
+		stats_log_flush(buffer);
+		entry_length = snprintf(entry, sizeof(entry), "%s=%" PRId64, name, value);
+	}
+	memcpy(buffer->text + buffer->length, entry, entry_length + 1);
+	buffer->length += entry_length;
+}
+
+void stats_log(enum loglvl_t loglvl) {
+	if (!loglevel_at_least(loglvl)) {
+		return;
+	}
+	struct stats_log_buffer_t buffer = {
+		.loglvl = loglvl,
+	};
+	stats_foreach(stats_log_counter, &buffer);
+	stats_log_flush(&buffer);
+}
@@ -0,0 +1,44 @@
+/**
+ *	ratched - TLS connection router that performs a man-in-the-middle attack
+ *	Copyright (C) 2017-2017 Johannes Bauer
+ *
+ *	This file is part of ratched.
+ *
+ *	ratched is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; this program is ONLY licensed under
+ *	version 3 of the License, later versions are explicitly excluded.
+ *
+ *	ratched is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with ratched; if not, write to the Free Software
+ *	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *	Johannes Bauer <JohannesBauer@gmx.de>
+**/
+
+
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include <stdint.h>
+#include <inttypes.h>
+#include "logging.h"
+
+struct stats_counter_t;
+
+/*************** AUTO GENERATED SECTION FOLLOWS ***************/
+struct stats_counter_t *stats_counter(const char *name);
+void stats_add(struct stats_counter_t *counter, int64_t value);
+void stats_inc(struct stats_counter_t *counter);
+void stats_set(struct stats_counter_t *counter, int64_t value);
+int64_t stats_get(const struct stats_counter_t *counter);
+void stats_foreach(void (*callback)(const char *name, int64_t value, void *argument), void *argument);
+void stats_log(enum loglvl_t loglvl);
+/***************  AUTO GENERATED SECTION ENDS   ***************/
+
+#endif
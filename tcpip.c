@@ -26,12 +26,18 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <arpa/inet.h>
+#include <stdlib.h>
 #include <pthread.h>
 #include <errno.h>
 #include "logging.h"
+#include "stats.h"
+#include "thread.h"
 #include "tcpip.h"
 #include "pcapng.h"
 #include "ipfwd.h"
+#include "cdc.h"
+#include "chunkstore.h"
+#include "probes.h"
 
 #define IPv4_VERSION_IHL_DEFAULT	0x45
 #define IPv4_PROTOCOL_TCP			6
@@ -46,6 +52,18 @@
 #define TCP_FLAG_ECN		(1 << 6)
 #define TCP_FLAG_CWR		(1 << 7)
 
+/* Chunks shorter than this are always captured inline; for them the
+ * reference would not save enough to be worth the store lookup. */
+#define CHUNK_DEDUP_MIN_LENGTH		1024
+
+/* Relay threads never write the capture file. Each packet is built in a
+ * record of its own and queued under the capture lock, which also orders the
+ * sequence numbers of both directions of a connection; a writer thread takes
+ * the whole queue at once and writes it outside the lock. Since dropping
+ * packets would break the reassembled TCP streams, producers wait instead
+ * when the writer has fallen behind by this much. */
+#define CAPTURE_MAX_QUEUED_BYTES	(64 * 1024 * 1024)
+
 struct ipv4_hdr_t {
 	uint8_t version_ihl;
 	uint8_t tos;
@@ -97,6 +115,29 @@ union packet_t {
 	struct packet6_t pkt6;
 };
 
+enum capture_record_type_t {
+	CAPTURE_PACKET,
+	CAPTURE_NAME_RESOLUTION,
+};
+
+/* A packet (of which data holds the captured part, headers first) or a name
+ * resolution record (data holds the address). The text is the packet comment
+ * or the host name and is stored after the data. */
+struct capture_record_t {
+	struct capture_record_t *next;
+	enum capture_record_type_t type;
+	unsigned int length;
+	unsigned int original_length;
+	uint64_t time_usec;
+	const char *text;
+	bool data_segment;
+	bool direction;
+	bool deduplicated;
+	unsigned int connection_id;
+	unsigned int payload_length;
+	uint8_t data[];
+};
+
 static void set_tcp_header(struct tcp_hdr_t *tcp, uint8_t tcp_flags) {
 	tcp->data_offset = TCP_DATA_OFFSET_DEFAULT;
 	tcp->window = htons(16 * 1024);
@@ -123,17 +164,131 @@ static int set_tcp_ip4_header(struct packet4_t *pkt, int payload_length, const c
 	return total_length;
 }
 
-static void write_tcp_ip_packet(struct connection_t *conn, union packet_t *pkt, int payload_length, uint8_t tcp_flags, const char *comment) {
-	int total_length = 0;
-	const void *pktbuf = NULL;
-	if (!conn->ipv6_encapsulation) {
-		total_length = set_tcp_ip4_header(&pkt->pkt4, payload_length, comment, tcp_flags);
-		pktbuf = &pkt->pkt4;
+/* With a chunk store, payload is not captured packet by packet but in
+ * content-defined chunks per direction. Chunks that are already in the store
+ * are written as truncated packets without payload; the packet comment
+ * references the chunk so that the capture can be rehydrated later. Since
+ * chunks are emitted only once complete, pending data of one direction is
+ * flushed as soon as the other direction sends, which keeps the order of
+ * request and response in the capture intact. */
+struct capture_chunking_t {
+	struct lockstat_mutex_t lock;
+	struct connection_t *conn;
+	struct cdc_chunker_t chunker[2];
+};
+
+struct chunk_emit_ctx_t {
+	struct connection_t *conn;
+	bool direction;
+};
+
+static unsigned int tcp_ip_header_length(const struct connection_t *conn) {
+	return conn->ipv6_encapsulation ? sizeof(struct packet6_t) : sizeof(struct packet4_t);
+}
+
+static struct capture_record_t *new_capture_record(enum capture_record_type_t type, unsigned int length, const char *text) {
+	const size_t text_size = text ? (strlen(text) + 1) : 0;
+	struct capture_record_t *record = malloc(sizeof(struct capture_record_t) + length + text_size);
+	if (!record) {
+		logmsg(LLVL_ERROR, "Failed to allocate capture record of %u bytes, it is missing from the capture: %s", length, strerror(errno));
+		return NULL;
+	}
+	memset(record, 0, sizeof(struct capture_record_t));
+	record->type = type;
+	record->length = length;
+	record->original_length = length;
+	if (text) {
+		char *text_copy = (char*)record->data + length;
+		memcpy(text_copy, text, text_size);
+		record->text = text_copy;
+	}
+	return record;
+}
+
+/* Creates a packet of which only the first captured_payload_length bytes of
+ * payload are kept; the headers are filled in when it is queued. */
+static struct capture_record_t *new_packet_record(const struct connection_t *conn, const uint8_t *payload, unsigned int payload_length, unsigned int captured_payload_length, const char *comment) {
+	const unsigned int header_length = tcp_ip_header_length(conn);
+	struct capture_record_t *record = new_capture_record(CAPTURE_PACKET, header_length + captured_payload_length, comment);
+	if (record) {
+		memset(record->data, 0, header_length);
+		if (captured_payload_length) {
+			memcpy(record->data + header_length, payload, captured_payload_length);
+		}
+		record->original_length = header_length + payload_length;
+	}
+	return record;
+}
+
+/* Called with the capture lock held, which is released while waiting. Records
+ * of a connection still end up in order because their sequence numbers are
+ * only assigned afterwards. */
+static void wait_for_queue_space(struct multithread_dumper_t *mtdump) {
+	if (mtdump->queued_bytes > CAPTURE_MAX_QUEUED_BYTES) {
+		stats_inc(mtdump->queue_full);
+		while (mtdump->queued_bytes > CAPTURE_MAX_QUEUED_BYTES) {
+			lockstat_cond_wait(&mtdump->space_cond, &mtdump->mutex);
+		}
+	}
+}
+
+/* Called with the capture lock held */
+static void queue_capture_record(struct multithread_dumper_t *mtdump, struct capture_record_t *record) {
+	record->next = NULL;
+	if (mtdump->tail) {
+		mtdump->tail->next = record;
 	} else {
-		total_length = set_tcp_ip6_header(&pkt->pkt6, payload_length, comment, tcp_flags);
-		pktbuf = &pkt->pkt6;
+		mtdump->head = record;
 	}
-	pcapng_write_epb(conn->mtdump->f, pktbuf, total_length, comment);
+	mtdump->tail = record;
+	mtdump->queued_bytes += sizeof(struct capture_record_t) + record->length;
+	pthread_cond_signal(&mtdump->queue_cond);
+}
+
+static void write_capture_record(FILE *f, const struct capture_record_t *record) {
+	if (record->type == CAPTURE_NAME_RESOLUTION) {
+		pcapng_write_nrb(f, record->data, record->text, record->length == sizeof(uint32_t));
+		return;
+	}
+	pcapng_write_epb_at(f, record->time_usec, record->data, record->length, record->original_length, record->text);
+	if (record->data_segment) {
+		PROBE4(capture_dequeue, record->connection_id, record->direction, record->payload_length, record->deduplicated);
+	}
+}
+
+static void* capture_writer_thread_fnc(void *argument) {
+	struct multithread_dumper_t *mtdump = (struct multithread_dumper_t*)argument;
+	set_thread_name("capture");
+	lockstat_lock(&mtdump->mutex);
+	while (true) {
+		while (!mtdump->head && !mtdump->flush_requested && !mtdump->quit) {
+			lockstat_cond_wait(&mtdump->queue_cond, &mtdump->mutex);
+		}
+		struct capture_record_t *records = mtdump->head;
+		const bool flush = mtdump->flush_requested;
+		mtdump->head = NULL;
+		mtdump->tail = NULL;
+		mtdump->queued_bytes = 0;
+		mtdump->flush_requested = false;
+		pthread_cond_broadcast(&mtdump->space_cond);
+		if (!records && !flush && mtdump->quit) {
+			break;
+		}
+
+		lockstat_unlock(&mtdump->mutex);
+		while (records) {
+			struct capture_record_t *next = records->next;
+			write_capture_record(mtdump->f, records);
+			free(records);
+			records = next;
+		}
+		if (flush) {
+			fflush(mtdump->f);
+		}
+		lockstat_lock(&mtdump->mutex);
+	}
+	lockstat_unlock(&mtdump->mutex);
+	return NULL;
 }
 
 static void tcp_load_packet_address(struct tcp_hdr_t *tcp, struct connection_t *conn, bool direction, int payload_len) {
@@ -163,50 +318,32 @@ static void ipv4_load_packet_address(struct packet4_t *pkt, struct connection_t
 	tcp_load_packet_address(&pkt->tcp, conn, direction, payload_len);
 }
 
+static void ipv6_load_6to4_address(uint8_t ip6[static 16], uint32_t ip_nbo, uint32_t hostname_id) {
+	/* 2002:IPv4:hostname ID (low 16 bit)::hostname ID (high 16 bit) */
+	uint32_t ip = ntohl(ip_nbo);
+	ip6[0] = 0x20;
+	ip6[1] = 0x02;
+	ip6[2] = (ip >> 24) & 0xff;
+	ip6[3] = (ip >> 16) & 0xff;
+	ip6[4] = (ip >> 8) & 0xff;
+	ip6[5] = (ip >> 0) & 0xff;
+	ip6[6] = (hostname_id >> 8) & 0xff;
+	ip6[7] = (hostname_id >> 0) & 0xff;
+	ip6[8] = (hostname_id >> 24) & 0xff;
+	ip6[9] = (hostname_id >> 16) & 0xff;
+}
+
 static void ipv6_load_packet_address(struct packet6_t *pkt, struct connection_t *conn, bool direction, int payload_len) {
 	/* Use 6to4 encapsulation */
 	memset(pkt->ipv6.source_ip6, 0, 16);
 	memset(pkt->ipv6.destination_ip6, 0, 16);
 
-
-	uint32_t connector_ip = ntohl(conn->connector.ip_nbo);
-	uint32_t acceptor_ip = ntohl(conn->acceptor.ip_nbo);
 	if (direction) {
-		pkt->ipv6.source_ip6[0] = 0x20;
-		pkt->ipv6.source_ip6[1] = 0x02;
-		pkt->ipv6.source_ip6[2] = (connector_ip >> 24) & 0xff;
-		pkt->ipv6.source_ip6[3] = (connector_ip >> 16) & 0xff;
-		pkt->ipv6.source_ip6[4] = (connector_ip >> 8) & 0xff;
-		pkt->ipv6.source_ip6[5] = (connector_ip >> 0) & 0xff;
-		pkt->ipv6.source_ip6[6] = (conn->connector.hostname_id >> 8) & 0xff;
-		pkt->ipv6.source_ip6[7] = (conn->connector.hostname_id >> 0) & 0xff;
-
-		pkt->ipv6.destination_ip6[0] = 0x20;
-		pkt->ipv6.destination_ip6[1] = 0x02;
-		pkt->ipv6.destination_ip6[2] = (acceptor_ip >> 24) & 0xff;
-		pkt->ipv6.destination_ip6[3] = (acceptor_ip >> 16) & 0xff;
-		pkt->ipv6.destination_ip6[4] = (acceptor_ip >> 8) & 0xff;
-		pkt->ipv6.destination_ip6[5] = (acceptor_ip >> 0) & 0xff;
-		pkt->ipv6.destination_ip6[6] = (conn->acceptor.hostname_id >> 8) & 0xff;
-		pkt->ipv6.destination_ip6[7] = (conn->acceptor.hostname_id >> 0) & 0xff;
+		ipv6_load_6to4_address(pkt->ipv6.source_ip6, conn->connector.ip_nbo, conn->connector.hostname_id);
+		ipv6_load_6to4_address(pkt->ipv6.destination_ip6, conn->acceptor.ip_nbo, conn->acceptor.hostname_id);
 	} else {
-		pkt->ipv6.source_ip6[0] = 0x20;
-		pkt->ipv6.source_ip6[1] = 0x02;
-		pkt->ipv6.source_ip6[2] = (acceptor_ip >> 24) & 0xff;
-		pkt->ipv6.source_ip6[3] = (acceptor_ip >> 16) & 0xff;
-		pkt->ipv6.source_ip6[4] = (acceptor_ip >> 8) & 0xff;
-		pkt->ipv6.source_ip6[5] = (acceptor_ip >> 0) & 0xff;
-		pkt->ipv6.source_ip6[6] = (conn->acceptor.hostname_id >> 8) & 0xff;
-		pkt->ipv6.source_ip6[7] = (conn->acceptor.hostname_id >> 0) & 0xff;
-
-		pkt->ipv6.destination_ip6[0] = 0x20;
-		pkt->ipv6.destination_ip6[1] = 0x02;
-		pkt->ipv6.destination_ip6[2] = (connector_ip >> 24) & 0xff;
-		pkt->ipv6.destination_ip6[3] = (connector_ip >> 16) & 0xff;
-		pkt->ipv6.destination_ip6[4] = (connector_ip >> 8) & 0xff;
-		pkt->ipv6.destination_ip6[5] = (connector_ip >> 0) & 0xff;
-		pkt->ipv6.destination_ip6[6] = (conn->connector.hostname_id >> 8) & 0xff;
-		pkt->ipv6.destination_ip6[7] = (conn->connector.hostname_id >> 0) & 0xff;
+		ipv6_load_6to4_address(pkt->ipv6.source_ip6, conn->acceptor.ip_nbo, conn->acceptor.hostname_id);
+		ipv6_load_6to4_address(pkt->ipv6.destination_ip6, conn->connector.ip_nbo, conn->connector.hostname_id);
 	}
 	tcp_load_packet_address(&pkt->tcp, conn, direction, payload_len);
 }
@@ -219,114 +356,239 @@ static void tcpip_load_packet_address(union packet_t *pkt, struct connection_t *
 	}
 }
 
-void create_tcp_ip_connection(struct multithread_dumper_t *mtdump, struct connection_t *conn, const char *comment, bool use_ipv6_encapsulation) {
-	union packet_t pkt;
-	memset(&pkt, 0, sizeof(pkt));
-
-	pthread_mutex_lock(&mtdump->mutex);
+/* Called with the capture lock held. Advances the sequence number by
+ * seqno_advance also when the record could not be allocated, so that the
+ * following packets of the connection stay consistent. */
+static void queue_tcp_ip_packet(struct connection_t *conn, struct capture_record_t *record, bool direction, int seqno_advance, uint8_t tcp_flags) {
+	union packet_t scratch;
+	union packet_t *pkt = record ? (union packet_t*)record->data : &scratch;
+	tcpip_load_packet_address(pkt, conn, direction, seqno_advance);
+	if (!record) {
+		return;
+	}
 
-	conn->mtdump = mtdump;
-	conn->ipv6_encapsulation = use_ipv6_encapsulation;
+	const int payload_length = record->original_length - tcp_ip_header_length(conn);
+	if (!conn->ipv6_encapsulation) {
+		set_tcp_ip4_header(&pkt->pkt4, payload_length, record->text, tcp_flags);
+	} else {
+		set_tcp_ip6_header(&pkt->pkt6, payload_length, record->text, tcp_flags);
+	}
+	pcapng_timestamp(&record->time_usec);
+	queue_capture_record(conn->mtdump, record);
+}
 
-	tcpip_load_packet_address(&pkt, conn, true, 1);
+static struct capture_record_t *new_name_record(const struct connection_t *conn, uint32_t ip_nbo, uint32_t hostname_id, const char *hostname) {
+	struct capture_record_t *record = NULL;
 	if (!conn->ipv6_encapsulation) {
-		if (conn->connector.hostname) {
-			pcapng_write_nrb(mtdump->f, &conn->connector.ip_nbo, conn->connector.hostname, true);
-		}
-		if (conn->acceptor.hostname) {
-			pcapng_write_nrb(mtdump->f, &conn->acceptor.ip_nbo, conn->acceptor.hostname, true);
+		if (hostname) {
+			record = new_capture_record(CAPTURE_NAME_RESOLUTION, sizeof(uint32_t), hostname);
+			if (record) {
+				memcpy(record->data, &ip_nbo, sizeof(uint32_t));
+			}
 		}
 	} else {
-		if (conn->connector.hostname) {
-			pcapng_write_nrb(mtdump->f, pkt.pkt6.ipv6.source_ip6, conn->connector.hostname, false);
-		} else {
+		char ipv4[16];
+		if (!hostname) {
 			/* If we don't have an IPv6 hostname, we transcribe the IPv4
 			 * address as "hostname" for nice display in Wireshark */
-			char ipv4[16];
-			snprintf(ipv4, sizeof(ipv4), PRI_IPv4, FMT_IPv4(conn->connector.ip_nbo));
-			pcapng_write_nrb(mtdump->f, pkt.pkt6.ipv6.source_ip6, ipv4, false);
+			snprintf(ipv4, sizeof(ipv4), PRI_IPv4, FMT_IPv4(ip_nbo));
+			hostname = ipv4;
 		}
-		if (conn->acceptor.hostname) {
-			pcapng_write_nrb(mtdump->f, pkt.pkt6.ipv6.destination_ip6, conn->acceptor.hostname, false);
+		record = new_capture_record(CAPTURE_NAME_RESOLUTION, 16, hostname);
+		if (record) {
+			memset(record->data, 0, 16);
+			ipv6_load_6to4_address(record->data, ip_nbo, hostname_id);
+		}
+	}
+	return record;
+}
+
+void create_tcp_ip_connection(struct multithread_dumper_t *mtdump, struct connection_t *conn, const char *comment, bool use_ipv6_encapsulation) {
+	conn->mtdump = mtdump;
+	conn->ipv6_encapsulation = use_ipv6_encapsulation;
+	conn->chunking = NULL;
+	if (mtdump->chunkstore) {
+		conn->chunking = malloc(sizeof(struct capture_chunking_t));
+		if (conn->chunking) {
+			lockstat_mutex_init(&conn->chunking->lock, "capture.chunking");
+			conn->chunking->conn = conn;
+			cdc_init(&conn->chunking->chunker[0]);
+			cdc_init(&conn->chunking->chunker[1]);
 		} else {
-			/* If we don't have an IPv6 hostname, we transcribe the IPv4
-			 * address as "hostname" for nice display in Wireshark */
-			char ipv4[16];
-			snprintf(ipv4, sizeof(ipv4), PRI_IPv4, FMT_IPv4(conn->acceptor.ip_nbo));
-			pcapng_write_nrb(mtdump->f, pkt.pkt6.ipv6.destination_ip6, ipv4, false);
+			logmsg(LLVL_ERROR, "Failed to allocate capture chunking state, capturing connection without deduplication: %s", strerror(errno));
 		}
 	}
-	write_tcp_ip_packet(conn, &pkt, 0, TCP_FLAG_SYN, comment);
 
-	tcpip_load_packet_address(&pkt, conn, false, 1);
-	write_tcp_ip_packet(conn, &pkt, 0, TCP_FLAG_SYN | TCP_FLAG_ACK, NULL);
+	struct capture_record_t *connector_name = new_name_record(conn, conn->connector.ip_nbo, conn->connector.hostname_id, conn->connector.hostname);
+	struct capture_record_t *acceptor_name = new_name_record(conn, conn->acceptor.ip_nbo, conn->acceptor.hostname_id, conn->acceptor.hostname);
+	struct capture_record_t *syn = new_packet_record(conn, NULL, 0, 0, comment);
+	struct capture_record_t *syn_ack = new_packet_record(conn, NULL, 0, 0, NULL);
+	struct capture_record_t *ack = new_packet_record(conn, NULL, 0, 0, NULL);
 
-	tcpip_load_packet_address(&pkt, conn, true, 0);
-	write_tcp_ip_packet(conn, &pkt, 0, TCP_FLAG_ACK, NULL);
-	pthread_mutex_unlock(&mtdump->mutex);
+	lockstat_lock(&mtdump->mutex);
+	wait_for_queue_space(mtdump);
+	if (connector_name) {
+		queue_capture_record(mtdump, connector_name);
+	}
+	if (acceptor_name) {
+		queue_capture_record(mtdump, acceptor_name);
+	}
+	queue_tcp_ip_packet(conn, syn, true, 1, TCP_FLAG_SYN);
+	queue_tcp_ip_packet(conn, syn_ack, false, 1, TCP_FLAG_SYN | TCP_FLAG_ACK);
+	queue_tcp_ip_packet(conn, ack, true, 0, TCP_FLAG_ACK);
+	lockstat_unlock(&mtdump->mutex);
 }
 
-void append_tcp_ip_data(struct connection_t *conn, bool direction, const uint8_t *payload, int payload_len) {
-	uint8_t pktbuf[sizeof(union packet_t) + payload_len];
-	union packet_t *pkt = (union packet_t*)pktbuf;
-	memset(pktbuf, 0, sizeof(pktbuf));
+/* Payload of a segment that is referenced in the chunk store is not captured;
+ * the packet is truncated and its comment holds the reference. */
+static void queue_data_segment(struct connection_t *conn, bool direction, const uint8_t *payload, int payload_len, const char *chunk_reference) {
+	struct capture_record_t *segment = new_packet_record(conn, payload, payload_len, chunk_reference ? 0 : payload_len, chunk_reference);
+	struct capture_record_t *ack = new_packet_record(conn, NULL, 0, 0, NULL);
+	if (segment) {
+		segment->data_segment = true;
+		segment->direction = direction;
+		segment->deduplicated = (chunk_reference != NULL);
+		segment->connection_id = conn->connection_id;
+		segment->payload_length = payload_len;
+	}
 
-	if (!conn->ipv6_encapsulation) {
-		memcpy(&pkt->pkt4.payload, payload, payload_len);
-	} else {
-		memcpy(&pkt->pkt6.payload, payload, payload_len);
+	lockstat_lock(&conn->mtdump->mutex);
+	wait_for_queue_space(conn->mtdump);
+	queue_tcp_ip_packet(conn, segment, direction, payload_len, 0);
+	queue_tcp_ip_packet(conn, ack, !direction, 0, TCP_FLAG_ACK);
+	lockstat_unlock(&conn->mtdump->mutex);
+}
+
+static void emit_chunk(const uint8_t *data, unsigned int length, void *argument) {
+	const struct chunk_emit_ctx_t *ctx = (const struct chunk_emit_ctx_t*)argument;
+	if (length >= CHUNK_DEDUP_MIN_LENGTH) {
+		uint8_t digest[CHUNKSTORE_DIGEST_LENGTH];
+		chunkstore_digest(data, length, digest);
+		if (chunkstore_reference(ctx->conn->mtdump->chunkstore, digest, data, length)) {
+			char reference[128];
+			chunkstore_format_reference(digest, reference, sizeof(reference));
+			queue_data_segment(ctx->conn, ctx->direction, data, length, reference);
+			return;
+		}
 	}
+	queue_data_segment(ctx->conn, ctx->direction, data, length, NULL);
+}
 
-	pthread_mutex_lock(&conn->mtdump->mutex);
-	tcpip_load_packet_address(pkt, conn, direction, payload_len);
-	write_tcp_ip_packet(conn, pkt, payload_len, 0, NULL);
+static void flush_chunker(struct capture_chunking_t *chunking, bool direction) {
+	struct chunk_emit_ctx_t ctx = {
+		.conn = chunking->conn,
+		.direction = direction,
+	};
+	cdc_flush(&chunking->chunker[direction ? 1 : 0], emit_chunk, &ctx);
+}
+
+void append_tcp_ip_data(struct connection_t *conn, bool direction, const uint8_t *payload, int payload_len) {
+	struct capture_chunking_t *chunking = conn->chunking;
+	PROBE3(capture_enqueue, conn->connection_id, direction, payload_len);
+	if (!chunking) {
+		queue_data_segment(conn, direction, payload, payload_len, NULL);
+		return;
+	}
 
-	tcpip_load_packet_address(pkt, conn, !direction, 0);
-	write_tcp_ip_packet(conn, pkt, 0, TCP_FLAG_ACK, NULL);
-	pthread_mutex_unlock(&conn->mtdump->mutex);
+	lockstat_lock(&chunking->lock);
+	flush_chunker(chunking, !direction);
+	struct chunk_emit_ctx_t ctx = {
+		.conn = conn,
+		.direction = direction,
+	};
+	cdc_feed(&chunking->chunker[direction ? 1 : 0], payload, payload_len, emit_chunk, &ctx);
+	lockstat_unlock(&chunking->lock);
 }
 
 void append_tcp_ip_string(struct connection_t *conn, bool direction, const char *string) {
 	append_tcp_ip_data(conn, direction, (const uint8_t*)string, strlen(string));
 }
 
-void teardown_tcp_ip_connection(struct connection_t *conn, bool direction) {
-	union packet_t pkt;
-	memset(&pkt, 0, sizeof(pkt));
+/* Writes an empty ACK segment that carries only a packet comment, e.g. to
+ * mark an event at the current position of the stream. Pending chunked data
+ * of that direction is written first so that the comment appears after all
+ * payload that preceded it. */
+void annotate_tcp_ip_connection(struct connection_t *conn, bool direction, const char *comment) {
+	if (conn->chunking) {
+		lockstat_lock(&conn->chunking->lock);
+		flush_chunker(conn->chunking, direction);
+		lockstat_unlock(&conn->chunking->lock);
+	}
+
+	struct capture_record_t *annotation = new_packet_record(conn, NULL, 0, 0, comment);
+	lockstat_lock(&conn->mtdump->mutex);
+	wait_for_queue_space(conn->mtdump);
+	queue_tcp_ip_packet(conn, annotation, direction, 0, TCP_FLAG_ACK);
+	lockstat_unlock(&conn->mtdump->mutex);
+}
 
-	pthread_mutex_lock(&conn->mtdump->mutex);
-	tcpip_load_packet_address(&pkt, conn, direction, 1);
-	write_tcp_ip_packet(conn, &pkt, 0, TCP_FLAG_FIN, NULL);
+void teardown_tcp_ip_connection(struct connection_t *conn, bool direction) {
+	if (conn->chunking) {
+		flush_chunker(conn->chunking, true);
+		flush_chunker(conn->chunking, false);
+		lockstat_mutex_destroy(&conn->chunking->lock);
+		free(conn->chunking);
+		conn->chunking = NULL;
+	}
 
-	tcpip_load_packet_address(&pkt, conn, !direction, 1);
-	write_tcp_ip_packet(conn, &pkt, 0, TCP_FLAG_FIN | TCP_FLAG_ACK, NULL);
+	struct capture_record_t *fin = new_packet_record(conn, NULL, 0, 0, NULL);
+	struct capture_record_t *fin_ack = new_packet_record(conn, NULL, 0, 0, NULL);
+	struct capture_record_t *ack = new_packet_record(conn, NULL, 0, 0, NULL);
 
-	tcpip_load_packet_address(&pkt, conn, direction, 0);
-	write_tcp_ip_packet(conn, &pkt, 0, TCP_FLAG_ACK, NULL);
-	pthread_mutex_unlock(&conn->mtdump->mutex);
+	lockstat_lock(&conn->mtdump->mutex);
+	wait_for_queue_space(conn->mtdump);
+	queue_tcp_ip_packet(conn, fin, direction, 1, TCP_FLAG_FIN);
+	queue_tcp_ip_packet(conn, fin_ack, !direction, 1, TCP_FLAG_FIN | TCP_FLAG_ACK);
+	queue_tcp_ip_packet(conn, ack, direction, 0, TCP_FLAG_ACK);
+	lockstat_unlock(&conn->mtdump->mutex);
 }
 
+/* Has the writer flush the capture file once everything that has been queued
+ * so far is written. */
 void flush_tcp_ip_connection(struct connection_t *conn) {
-	pthread_mutex_lock(&conn->mtdump->mutex);
-	fflush(conn->mtdump->f);
-	pthread_mutex_unlock(&conn->mtdump->mutex);
+	lockstat_lock(&conn->mtdump->mutex);
+	conn->mtdump->flush_requested = true;
+	pthread_cond_signal(&conn->mtdump->queue_cond);
+	lockstat_unlock(&conn->mtdump->mutex);
 }
 
 bool open_pcap_write(struct multithread_dumper_t *mtdump, const char *filename, const char *comment) {
 	memset(mtdump, 0, sizeof(struct multithread_dumper_t));
-	pthread_mutex_init(&mtdump->mutex, NULL);
 
 	mtdump->f = pcapng_open(filename, LINKTYPE_RAW, 65535, comment);
 	if (!mtdump->f) {
 		logmsg(LLVL_ERROR, "Error opening %s for writing: %s", filename, strerror(errno));
-		pthread_mutex_destroy(&mtdump->mutex);
 		return false;
 	}
+	lockstat_mutex_init(&mtdump->mutex, "capture");
+	pthread_cond_init(&mtdump->queue_cond, NULL);
+	pthread_cond_init(&mtdump->space_cond, NULL);
+	mtdump->queue_full = stats_counter("capture.queue_full");
+
+	int result = pthread_create(&mtdump->writer, NULL, capture_writer_thread_fnc, mtdump);
+	if (result) {
+		logmsg(LLVL_ERROR, "Could not start capture writer thread: %s", strerror(result));
+		close_pcap(mtdump);
+		return false;
+	}
+	mtdump->writer_running = true;
 	return true;
 }
 
 bool close_pcap(struct multithread_dumper_t *mtdump) {
+	if (mtdump->writer_running) {
+		/* The writer drains everything that is still queued before it
+		 * terminates. */
+		lockstat_lock(&mtdump->mutex);
+		mtdump->quit = true;
+		pthread_cond_signal(&mtdump->queue_cond);
+		lockstat_unlock(&mtdump->mutex);
+		pthread_join(mtdump->writer, NULL);
+		mtdump->writer_running = false;
+	}
 	fclose(mtdump->f);
-	pthread_mutex_destroy(&mtdump->mutex);
+	pthread_cond_destroy(&mtdump->queue_cond);
+	pthread_cond_destroy(&mtdump->space_cond);
+	lockstat_mutex_destroy(&mtdump->mutex);
 	return true;
 }
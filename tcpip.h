@@ -28,28 +28,46 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <pthread.h>
+#include "lockstat.h"
+
+struct capture_record_t;
+struct stats_counter_t;
 
 struct multithread_dumper_t {
-	pthread_mutex_t mutex;
+	struct lockstat_mutex_t mutex;
+	pthread_cond_t queue_cond;
+	pthread_cond_t space_cond;
+	struct capture_record_t *head, *tail;
+	size_t queued_bytes;
+	bool flush_requested;
+	bool quit;
+	pthread_t writer;
+	bool writer_running;
 	FILE *f;
+	struct chunkstore_t *chunkstore;
+	struct stats_counter_t *queue_full;
 };
 
+struct capture_chunking_t;
+
 struct connection_t {
+	unsigned int connection_id;
 	bool ipv6_encapsulation;
 	struct multithread_dumper_t *mtdump;
+	struct capture_chunking_t *chunking;
 	struct {
 		uint32_t ip_nbo;
 		uint16_t port_nbo;
 		uint32_t seqno;
 		const char *hostname;
-		uint16_t hostname_id;
+		uint32_t hostname_id;
 	} connector;
 	struct {
 		uint32_t ip_nbo;
 		uint16_t port_nbo;
 		uint32_t seqno;
 		const char *hostname;
-		uint16_t hostname_id;
+		uint32_t hostname_id;
 	} acceptor;
 };
 
@@ -57,6 +75,7 @@ struct connection_t {
 void create_tcp_ip_connection(struct multithread_dumper_t *mtdump, struct connection_t *conn, const char *comment, bool use_ipv6_encapsulation);
 void append_tcp_ip_data(struct connection_t *conn, bool direction, const uint8_t *payload, int payload_len);
 void append_tcp_ip_string(struct connection_t *conn, bool direction, const char *string);
+void annotate_tcp_ip_connection(struct connection_t *conn, bool direction, const char *comment);
 void teardown_tcp_ip_connection(struct connection_t *conn, bool direction);
 void flush_tcp_ip_connection(struct connection_t *conn);
 bool open_pcap_write(struct multithread_dumper_t *mtdump, const char *filename, const char *comment);
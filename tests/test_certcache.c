@@ -0,0 +1,160 @@
+/**
+ *	ratched - TLS connection router that performs a man-in-the-middle attack
+ *	Copyright (C) 2017-2017 Johannes Bauer
+ *
+ *	This file is part of ratched.
+ *
+ *	ratched is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; this program is ONLY licensed under
+ *	version 3 of the License, later versions are explicitly excluded.
+ *
+ *	ratched is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with ratched; if not, write to the Free Software
+ *	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *	Johannes Bauer <JohannesBauer@gmx.de>
+**/
+
+
+#include "testbed.h"
+#include <openssl.h>
+#include <openssl_certs.h>
+#include <certcache.h>
+
+static X509 *load_test_certificate(void) {
+	X509 *crt = openssl_load_cert("local.crt", "local.crt", false);
+	test_assert(crt);
+	return crt;
+}
+
+static void test_certcache_basic(void) {
+	openssl_init();
+	X509 *crt = load_test_certificate();
+	struct certcache_t *cache = certcache_new(1024 * 1024, 16);
+	test_assert(cache);
+
+	uint32_t key = 1234;
+	test_assert(certcache_get(cache, &key, sizeof(key)) == NULL);
+	test_assert(certcache_put(cache, &key, sizeof(key), crt, false));
+	test_assert(!certcache_put(cache, &key, sizeof(key), crt, false));
+
+	X509 *cached = certcache_get(cache, &key, sizeof(key));
+	test_assert(cached);
+	test_assert(X509_cmp(cached, crt) == 0);
+	X509_free(cached);
+
+	struct certcache_stats_t stats;
+	certcache_get_stats(cache, &stats);
+	test_assert(stats.entry_count == 1);
+	test_assert(stats.misses == 1);
+	test_assert(stats.hot_hits == 1);
+	test_assert(stats.bytes_used > (unsigned int)i2d_X509(crt, NULL));
+
+	certcache_free(cache);
+	X509_free(crt);
+	openssl_deinit();
+}
+
+static void test_certcache_der_tier(void) {
+	openssl_init();
+	X509 *crt = load_test_certificate();
+	/* No hot tier at all, every hit needs to be decoded from DER */
+	struct certcache_t *cache = certcache_new(16 * 1024 * 1024, 0);
+	test_assert(cache);
+
+	for (uint32_t key = 0; key < 5000; key++) {
+		test_assert(certcache_put(cache, &key, sizeof(key), crt, false));
+	}
+	for (uint32_t key = 0; key < 5000; key += 97) {
+		X509 *cached = certcache_get(cache, &key, sizeof(key));
+		test_assert(cached);
+		test_assert(X509_cmp(cached, crt) == 0);
+		X509_free(cached);
+	}
+
+	struct certcache_stats_t stats;
+	certcache_get_stats(cache, &stats);
+	test_assert(stats.hot_hits == 0);
+	test_assert(stats.der_hits == 52);
+
+	certcache_free(cache);
+	X509_free(crt);
+	openssl_deinit();
+}
+
+static void test_certcache_eviction(void) {
+	openssl_init();
+	X509 *crt = load_test_certificate();
+	const unsigned int der_length = i2d_X509(crt, NULL);
+	struct certcache_t *cache = certcache_new(100 * (der_length + 128), 8);
+	test_assert(cache);
+
+	for (uint32_t key = 0; key < 1000; key++) {
+		test_assert(certcache_put(cache, &key, sizeof(key), crt, false));
+
+		/* Keep the very first entry alive by using it */
+		uint32_t first = 0;
+		X509 *cached = certcache_get(cache, &first, sizeof(first));
+		test_assert(cached);
+		X509_free(cached);
+	}
+
+	struct certcache_stats_t stats;
+	certcache_get_stats(cache, &stats);
+	test_assert(stats.bytes_used <= 100 * (der_length + 128));
+	test_assert(stats.entry_count < 1000);
+	test_assert(stats.evictions == 1000 - stats.entry_count);
+
+	uint32_t key = 1;
+	test_assert(certcache_get(cache, &key, sizeof(key)) == NULL);
+	key = 999;
+	X509 *cached = certcache_get(cache, &key, sizeof(key));
+	test_assert(cached);
+	X509_free(cached);
+
+	certcache_free(cache);
+	X509_free(crt);
+	openssl_deinit();
+}
+
+static void count_scanned_entry(const struct certcache_entry_info_t *info, void *vcount) {
+	unsigned int *count = (unsigned int*)vcount;
+	test_assert(info->key_length == sizeof(uint32_t));
+	test_assert(info->not_after > 0);
+	test_assert(info->created > 0);
+	(*count)++;
+}
+
+static void test_certcache_scan(void) {
+	openssl_init();
+	X509 *crt = load_test_certificate();
+	struct certcache_t *cache = certcache_new(16 * 1024 * 1024, 8);
+	test_assert(cache);
+
+	for (uint32_t key = 0; key < 3000; key++) {
+		test_assert(certcache_put(cache, &key, sizeof(key), crt, false));
+	}
+	unsigned int count = 0;
+	certcache_scan(cache, count_scanned_entry, &count);
+	test_assert(count == 3000);
+
+	certcache_free(cache);
+	X509_free(crt);
+	openssl_deinit();
+}
+
+int main(int argc, char **argv) {
+	test_start(argc, argv);
+	test_certcache_basic();
+	test_certcache_der_tier();
+	test_certcache_eviction();
+	test_certcache_scan();
+	test_finished();
+	return 0;
+}
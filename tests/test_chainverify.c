@@ -0,0 +1,238 @@
+/**
+ *	ratched - TLS connection router that performs a man-in-the-middle attack
+ *	Copyright (C) 2017-2017 Johannes Bauer
+ *
+ *	This file is part of ratched.
+ *
+ *	ratched is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; this program is ONLY licensed under
+ *	version 3 of the License, later versions are explicitly excluded.
+ *
+ *	ratched is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with ratched; if not, write to the Free Software
+ *	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *	Johannes Bauer <JohannesBauer@gmx.de>
+**/
+
+
+#include "testbed.h"
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <openssl.h>
+#include <openssl_certs.h>
+#include <stats.h>
+#include <cryptopool.h>
+#include <chainverify.h>
+
+#define TRUST_STORE_FILENAME		"chainverify_root.crt"
+
+struct test_pki_t {
+	EVP_PKEY *key;
+	X509 *root;
+	X509 *server;
+	STACK_OF(X509) *chain;
+};
+
+static void create_test_pki(struct test_pki_t *pki, const char *hostname, uint64_t server_validity_seconds) {
+	struct keyspec_t keyspec = {
+		.description = "test key",
+		.cryptosystem = CRYPTOSYSTEM_ECC_FP,
+		.ecc_fp = {
+			.curve_name = "prime256v1",
+		},
+	};
+	pki->key = openssl_create_key(&keyspec);
+	test_assert(pki->key);
+
+	struct certificatespec_t root_spec = {
+		.description = "test root",
+		.subject_pubkey = pki->key,
+		.issuer_privkey = pki->key,
+		.common_name = "Test root",
+		.is_ca_certificate = true,
+		.validity_predate_seconds = 3600,
+		.validity_seconds = 86400,
+	};
+	pki->root = openssl_create_certificate(&root_spec);
+	test_assert(pki->root);
+
+	struct certificatespec_t server_spec = {
+		.description = "test server",
+		.subject_pubkey = pki->key,
+		.issuer_privkey = pki->key,
+		.issuer_certificate = pki->root,
+		.common_name = hostname,
+		.subject_alternative_dns_hostname = hostname,
+		.subject_alternative_ipv4_address = htonl(0x7f000001),
+		.validity_predate_seconds = 3600,
+		.validity_seconds = server_validity_seconds,
+	};
+	pki->server = openssl_create_certificate(&server_spec);
+	test_assert(pki->server);
+
+	pki->chain = sk_X509_new_null();
+	test_assert(pki->chain);
+	sk_X509_push(pki->chain, pki->server);
+}
+
+static void free_test_pki(struct test_pki_t *pki) {
+	sk_X509_free(pki->chain);
+	X509_free(pki->server);
+	X509_free(pki->root);
+	EVP_PKEY_free(pki->key);
+}
+
+static void test_chainverify_basic(void) {
+	openssl_init();
+	struct test_pki_t pki;
+	create_test_pki(&pki, "foo.example.com", 86400);
+	test_assert(openssl_store_cert(TRUST_STORE_FILENAME, "test root", false, pki.root));
+	test_assert(chainverify_init(TRUST_STORE_FILENAME, 60));
+	test_assert(chainverify_active());
+
+	struct chainverify_result_t result;
+	chainverify_chain(pki.chain, "foo.example.com", 0, &result);
+	test_assert(result.verified);
+	test_assert(!result.cached);
+
+	chainverify_chain(pki.chain, "foo.example.com", 0, &result);
+	test_assert(result.verified);
+	test_assert(result.cached);
+
+	/* Same chain, but different name: separate cache entry */
+	chainverify_chain(pki.chain, "bar.example.com", 0, &result);
+	test_assert(!result.verified);
+	test_assert(!result.cached);
+	test_assert(result.error == X509_V_ERR_HOSTNAME_MISMATCH);
+	chainverify_chain(pki.chain, "bar.example.com", 0, &result);
+	test_assert(!result.verified);
+	test_assert(result.cached);
+	test_assert(result.error == X509_V_ERR_HOSTNAME_MISMATCH);
+
+	/* Without a name, the IP address is checked */
+	chainverify_chain(pki.chain, NULL, htonl(0x7f000001), &result);
+	test_assert(result.verified);
+	chainverify_chain(pki.chain, NULL, htonl(0x7f000002), &result);
+	test_assert(!result.verified);
+	test_assert(result.error == X509_V_ERR_IP_ADDRESS_MISMATCH);
+
+	char text[128];
+	chainverify_describe(&result, text, sizeof(text));
+	test_assert(strstr(text, "failed"));
+
+	chainverify_chain(NULL, "foo.example.com", 0, &result);
+	test_assert(!result.verified);
+
+	chainverify_deinit();
+	test_assert(!chainverify_active());
+	unlink(TRUST_STORE_FILENAME);
+	free_test_pki(&pki);
+	openssl_deinit();
+}
+
+static void test_chainverify_untrusted(void) {
+	openssl_init();
+	struct test_pki_t trusted, untrusted;
+	create_test_pki(&trusted, "foo.example.com", 86400);
+	create_test_pki(&untrusted, "foo.example.com", 86400);
+	test_assert(openssl_store_cert(TRUST_STORE_FILENAME, "test root", false, trusted.root));
+	test_assert(chainverify_init(TRUST_STORE_FILENAME, 60));
+
+	struct chainverify_result_t result;
+	chainverify_chain(untrusted.chain, "foo.example.com", 0, &result);
+	test_assert(!result.verified);
+	test_assert(result.error == X509_V_ERR_UNABLE_TO_GET_ISSUER_CERT_LOCALLY);
+	test_assert(result.error_depth == 0);
+
+	/* Supplying the root as part of the chain doesn't make it trusted */
+	sk_X509_push(untrusted.chain, untrusted.root);
+	chainverify_chain(untrusted.chain, "foo.example.com", 0, &result);
+	test_assert(!result.verified);
+	test_assert(!result.cached);
+	sk_X509_pop(untrusted.chain);
+
+	chainverify_deinit();
+	unlink(TRUST_STORE_FILENAME);
+	free_test_pki(&untrusted);
+	free_test_pki(&trusted);
+	openssl_deinit();
+}
+
+static void test_chainverify_expiry(void) {
+	openssl_init();
+	struct test_pki_t pki;
+	/* Server certificate expires in two seconds; the cached result must not
+	 * outlive it even though the TTL is longer */
+	create_test_pki(&pki, "foo.example.com", 2);
+	test_assert(openssl_store_cert(TRUST_STORE_FILENAME, "test root", false, pki.root));
+	test_assert(chainverify_init(TRUST_STORE_FILENAME, 60));
+
+	struct chainverify_result_t result;
+	chainverify_chain(pki.chain, "foo.example.com", 0, &result);
+	test_assert(result.verified);
+	chainverify_chain(pki.chain, "foo.example.com", 0, &result);
+	test_assert(result.verified);
+	test_assert(result.cached);
+	sleep(3);
+	chainverify_chain(pki.chain, "foo.example.com", 0, &result);
+	test_assert(!result.verified);
+	test_assert(!result.cached);
+	test_assert(result.error == X509_V_ERR_CERT_HAS_EXPIRED);
+	chainverify_deinit();
+
+	/* A TTL of zero disables caching */
+	free_test_pki(&pki);
+	create_test_pki(&pki, "foo.example.com", 86400);
+	test_assert(openssl_store_cert(TRUST_STORE_FILENAME, "test root", false, pki.root));
+	test_assert(chainverify_init(TRUST_STORE_FILENAME, 0));
+	chainverify_chain(pki.chain, "foo.example.com", 0, &result);
+	test_assert(result.verified);
+	chainverify_chain(pki.chain, "foo.example.com", 0, &result);
+	test_assert(result.verified);
+	test_assert(!result.cached);
+
+	chainverify_deinit();
+	unlink(TRUST_STORE_FILENAME);
+	free_test_pki(&pki);
+	openssl_deinit();
+}
+
+static void test_chainverify_pool(void) {
+	openssl_init();
+	struct test_pki_t pki;
+	create_test_pki(&pki, "foo.example.com", 86400);
+	test_assert(openssl_store_cert(TRUST_STORE_FILENAME, "test root", false, pki.root));
+	test_assert(chainverify_init(TRUST_STORE_FILENAME, 60));
+	test_assert(cryptopool_init(2));
+
+	struct chainverify_result_t result;
+	chainverify_chain(pki.chain, "foo.example.com", 0, &result);
+	test_assert(result.verified);
+	test_assert(!result.cached);
+	chainverify_chain(pki.chain, "bar.example.com", 0, &result);
+	test_assert(!result.verified);
+	test_assert(stats_get(stats_counter("cryptopool.jobs")) >= 2);
+
+	cryptopool_deinit();
+	chainverify_deinit();
+	unlink(TRUST_STORE_FILENAME);
+	free_test_pki(&pki);
+	openssl_deinit();
+}
+
+int main(int argc, char **argv) {
+	test_start(argc, argv);
+	test_chainverify_basic();
+	test_chainverify_untrusted();
+	test_chainverify_expiry();
+	test_chainverify_pool();
+	test_finished();
+	return 0;
+}
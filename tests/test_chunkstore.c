@@ -0,0 +1,189 @@
+/**
+ *	ratched - TLS connection router that performs a man-in-the-middle attack
+ *	Copyright (C) 2017-2017 Johannes Bauer
+ *
+ *	This file is part of ratched.
+ *
+ *	ratched is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; this program is ONLY licensed under
+ *	version 3 of the License, later versions are explicitly excluded.
+ *
+ *	ratched is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with ratched; if not, write to the Free Software
+ *	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *	Johannes Bauer <JohannesBauer@gmx.de>
+**/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "testbed.h"
+#include <cdc.h>
+#include <chunkstore.h>
+
+#define MAX_BOUNDARIES		256
+
+struct boundaries_t {
+	unsigned int count;
+	uint64_t offset;
+	uint64_t ends[MAX_BOUNDARIES];
+};
+
+static void record_boundary(const uint8_t *data, unsigned int length, void *argument) {
+	struct boundaries_t *boundaries = (struct boundaries_t*)argument;
+	boundaries->offset += length;
+	if (boundaries->count < MAX_BOUNDARIES) {
+		boundaries->ends[boundaries->count++] = boundaries->offset;
+	}
+}
+
+static void random_data(uint8_t *data, unsigned int length) {
+	uint32_t state = 0x12345678;
+	for (unsigned int i = 0; i < length; i++) {
+		state = (state * 1103515245) + 12345;
+		data[i] = state >> 16;
+	}
+}
+
+static void chunk_data(const uint8_t *data, unsigned int length, unsigned int feed_size, struct boundaries_t *boundaries) {
+	static struct cdc_chunker_t chunker;
+	memset(boundaries, 0, sizeof(*boundaries));
+	cdc_init(&chunker);
+	for (unsigned int i = 0; i < length; i += feed_size) {
+		unsigned int remaining = length - i;
+		cdc_feed(&chunker, data + i, (remaining < feed_size) ? remaining : feed_size, record_boundary, boundaries);
+	}
+	cdc_flush(&chunker, record_boundary, boundaries);
+}
+
+static void test_cdc_stable_boundaries(void) {
+	subtest_start();
+	const unsigned int length = 512 * 1024;
+	uint8_t *data = malloc(length);
+	test_assert(data);
+	random_data(data, length);
+
+	struct boundaries_t whole, split;
+	chunk_data(data, length, length, &whole);
+	test_assert(whole.count > 8);
+	test_assert_int_eq(whole.ends[whole.count - 1], length);
+	for (unsigned int i = 0; i < whole.count; i++) {
+		uint64_t chunk_length = whole.ends[i] - (i ? whole.ends[i - 1] : 0);
+		test_assert(chunk_length <= CDC_MAX_CHUNK_SIZE);
+		if (i != whole.count - 1) {
+			test_assert(chunk_length >= CDC_MIN_CHUNK_SIZE);
+		}
+	}
+
+	/* Independent of how data is fed */
+	chunk_data(data, length, 1000, &split);
+	test_assert_int_eq(split.count, whole.count);
+	test_assert(!memcmp(split.ends, whole.ends, sizeof(uint64_t) * whole.count));
+
+	/* Inserting data in front only changes the first chunk(s) */
+	const unsigned int prefix = 777;
+	uint8_t *shifted = malloc(length + prefix);
+	test_assert(shifted);
+	memset(shifted, 'x', prefix);
+	memcpy(shifted + prefix, data, length);
+	chunk_data(shifted, length + prefix, 4096, &split);
+	unsigned int common = 0;
+	for (unsigned int i = 0; i < split.count; i++) {
+		for (unsigned int j = 0; j < whole.count; j++) {
+			if (split.ends[i] == whole.ends[j] + prefix) {
+				common++;
+			}
+		}
+	}
+	test_assert(common >= whole.count - 2);
+
+	free(shifted);
+	free(data);
+	subtest_finished();
+}
+
+static void test_chunkstore_put(void) {
+	subtest_start();
+	const char *directory = "chunkstore.test";
+	struct chunkstore_t *store = chunkstore_open(directory);
+	test_assert(store);
+
+	uint8_t data[4096];
+	random_data(data, sizeof(data));
+	data[0] ^= time(NULL) & 0xff;
+	data[1] ^= (time(NULL) >> 8) & 0xff;
+	uint8_t digest[CHUNKSTORE_DIGEST_LENGTH];
+	chunkstore_digest(data, sizeof(data), digest);
+
+	enum chunkstore_result_t result = chunkstore_put(store, digest, data, sizeof(data));
+	test_assert((result == CHUNK_STORED) || (result == CHUNK_PRESENT));
+	test_assert_int_eq(chunkstore_put(store, digest, data, sizeof(data)), CHUNK_PRESENT);
+
+	char reference[128];
+	chunkstore_format_reference(digest, reference, sizeof(reference));
+	test_assert(!strncmp(reference, CHUNKSTORE_REFERENCE_PREFIX, strlen(CHUNKSTORE_REFERENCE_PREFIX)));
+	const char *hex = reference + strlen(CHUNKSTORE_REFERENCE_PREFIX);
+	test_assert_int_eq(strlen(hex), 2 * CHUNKSTORE_DIGEST_LENGTH);
+
+	char path[256];
+	snprintf(path, sizeof(path), "%s/%.2s/%s", directory, hex, hex);
+	struct stat statbuf;
+	test_assert(stat(path, &statbuf) == 0);
+	test_assert_int_eq(statbuf.st_size, sizeof(data));
+
+	chunkstore_close(store);
+	subtest_finished();
+}
+
+static void test_chunkstore_reference(void) {
+	subtest_start();
+	struct chunkstore_t *store = chunkstore_open("chunkstore.test");
+	test_assert(store);
+
+	uint8_t data[4096];
+	random_data(data, sizeof(data));
+	data[0] ^= 0x55;
+	data[2] ^= time(NULL) & 0xff;
+	data[3] ^= (time(NULL) >> 8) & 0xff;
+	uint8_t digest[CHUNKSTORE_DIGEST_LENGTH];
+	chunkstore_digest(data, sizeof(data), digest);
+
+	/* Unknown at first, then referenced once the writer has stored it. A new
+	 * instance learns about chunks already on disk the same way. */
+	for (int pass = 0; pass < 2; pass++) {
+		if (pass) {
+			chunkstore_close(store);
+			store = chunkstore_open("chunkstore.test");
+			test_assert(store);
+		}
+		test_assert(!chunkstore_reference(store, digest, data, sizeof(data)));
+		bool referenced = false;
+		for (int i = 0; (i < 500) && !referenced; i++) {
+			usleep(10 * 1000);
+			referenced = chunkstore_reference(store, digest, data, sizeof(data));
+		}
+		test_assert(referenced);
+	}
+	chunkstore_close(store);
+	subtest_finished();
+}
+
+int main(int argc, char **argv) {
+	test_start(argc, argv);
+	test_cdc_stable_boundaries();
+	test_chunkstore_put();
+	test_chunkstore_reference();
+	test_finished();
+	return 0;
+}
@@ -0,0 +1,156 @@
+/**
+ *	ratched - TLS connection router that performs a man-in-the-middle attack
+ *	Copyright (C) 2017-2017 Johannes Bauer
+ *
+ *	This file is part of ratched.
+ *
+ *	ratched is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; this program is ONLY licensed under
+ *	version 3 of the License, later versions are explicitly excluded.
+ *
+ *	ratched is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with ratched; if not, write to the Free Software
+ *	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *	Johannes Bauer <JohannesBauer@gmx.de>
+**/
+
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "testbed.h"
+#include <conntable.h>
+
+struct cold_data_t {
+	unsigned int value;
+	char buffer[1000];
+};
+
+static void test_conntable_generations(void) {
+	subtest_start();
+	test_assert(conntable_init(3, sizeof(struct cold_data_t)));
+
+	struct conn_slot_t *slots[3];
+	unsigned int ids[3];
+	for (int i = 0; i < 3; i++) {
+		slots[i] = conntable_alloc(-1, 0);
+		test_assert(slots[i] != NULL);
+		ids[i] = conntable_id(slots[i]);
+		struct cold_data_t *cold = conntable_cold(slots[i]);
+		test_assert_int_eq(cold->value, 0);
+		cold->value = 100 + i;
+	}
+	test_assert(conntable_alloc(-1, 0) == NULL);
+	test_assert(ids[0] != ids[1]);
+	test_assert(ids[1] != ids[2]);
+
+	/* A recycled slot gets a new ID and cleared cold data, the old ID no
+	 * longer resolves */
+	conntable_free(slots[1]);
+	struct conn_slot_t *reused = conntable_alloc(-1, 0);
+	test_assert(reused == slots[1]);
+	test_assert(conntable_id(reused) != ids[1]);
+	test_assert_int_eq(((struct cold_data_t*)conntable_cold(reused))->value, 0);
+	test_assert_int_eq(((struct cold_data_t*)conntable_cold(slots[2]))->value, 102);
+
+	struct conn_info_t info;
+	test_assert(!conntable_get(ids[1], &info));
+	test_assert(conntable_get(conntable_id(reused), &info));
+	test_assert_int_eq(info.state, CONN_ACCEPTED);
+
+	for (int i = 0; i < 3; i++) {
+		conntable_free(slots[i]);
+	}
+	test_assert(!conntable_get(ids[0], &info));
+	conntable_deinit();
+	subtest_finished();
+}
+
+static bool count_forwarding(const struct conn_info_t *info, void *argument) {
+	unsigned int *count = (unsigned int*)argument;
+	if (info->state == CONN_FORWARDING) {
+		(*count)++;
+	}
+	return true;
+}
+
+static void test_conntable_accounting(void) {
+	subtest_start();
+	test_assert(conntable_init(16, sizeof(struct cold_data_t)));
+
+	struct conn_slot_t *slot_a = conntable_alloc(-1, 0);
+	struct conn_slot_t *slot_b = conntable_alloc(-1, 0);
+	conntable_set_state(slot_a, CONN_FORWARDING);
+	conntable_set_mode(slot_a, 3);
+	conntable_account(conntable_id(slot_a), true, 100);
+	conntable_account(conntable_id(slot_a), true, 23);
+	conntable_account(conntable_id(slot_a), false, 4567);
+
+	struct conn_info_t info;
+	test_assert(conntable_get(conntable_id(slot_a), &info));
+	test_assert_int_eq(info.state, CONN_FORWARDING);
+	test_assert_int_eq(info.interception_mode, 3);
+	test_assert_int_eq(info.bytes_up, 123);
+	test_assert_int_eq(info.bytes_down, 4567);
+
+	unsigned int forwarding = 0;
+	test_assert_int_eq(conntable_foreach(count_forwarding, &forwarding), 2);
+	test_assert_int_eq(forwarding, 1);
+
+	/* Byte counts of a stale ID must not end up at the slot's new owner */
+	unsigned int stale_id = conntable_id(slot_b);
+	conntable_free(slot_b);
+	slot_b = conntable_alloc(-1, 0);
+	conntable_account(stale_id, true, 1000);
+	test_assert(conntable_get(conntable_id(slot_b), &info));
+	test_assert_int_eq(info.bytes_up, 0);
+
+	conntable_free(slot_a);
+	conntable_free(slot_b);
+	conntable_deinit();
+	subtest_finished();
+}
+
+static void test_conntable_expire(void) {
+	subtest_start();
+	test_assert(conntable_init(4, sizeof(struct cold_data_t)));
+
+	int fds[2];
+	test_assert(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+	struct conn_slot_t *expiring = conntable_alloc(fds[0], 0.05);
+	struct conn_slot_t *forwarding = conntable_alloc(-1, 0.05);
+	conntable_set_state(forwarding, CONN_FORWARDING);
+	test_assert_int_eq(conntable_expire(), 0);
+
+	usleep(100 * 1000);
+	test_assert_int_eq(conntable_expire(), 1);
+	test_assert_int_eq(conntable_expire(), 0);
+
+	/* Peer now sees EOF since our end was shut down */
+	char buf[16];
+	test_assert_int_eq(read(fds[1], buf, sizeof(buf)), 0);
+
+	conntable_free(expiring);
+	conntable_free(forwarding);
+	close(fds[0]);
+	close(fds[1]);
+	conntable_deinit();
+	subtest_finished();
+}
+
+int main(int argc, char **argv) {
+	test_start(argc, argv);
+	test_conntable_generations();
+	test_conntable_accounting();
+	test_conntable_expire();
+	test_finished();
+	return 0;
+}
@@ -0,0 +1,140 @@
+/**
+ *	ratched - TLS connection router that performs a man-in-the-middle attack
+ *	Copyright (C) 2017-2017 Johannes Bauer
+ *
+ *	This file is part of ratched.
+ *
+ *	ratched is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; this program is ONLY licensed under
+ *	version 3 of the License, later versions are explicitly excluded.
+ *
+ *	ratched is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with ratched; if not, write to the Free Software
+ *	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *	Johannes Bauer <JohannesBauer@gmx.de>
+**/
+
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <openssl/crypto.h>
+#include "testbed.h"
+#include <cryptomem.h>
+#include <stats.h>
+
+static int64_t counter_value(const char *name) {
+	cryptomem_flush_thread_statistics();
+	return stats_get(stats_counter(name));
+}
+
+static void test_cryptomem_accounting(void) {
+	subtest_start();
+	int64_t forging_before = counter_value("mem.forging.live_bytes");
+	int64_t ocsp_before = counter_value("mem.ocsp.live_bytes");
+	int64_t allocations_before = counter_value("mem.forging.allocations");
+
+	enum cryptomem_subsystem_t previous = cryptomem_enter(CRYPTOMEM_FORGING);
+	void *forging = OPENSSL_malloc(100);
+	test_assert(forging);
+	previous = cryptomem_enter(CRYPTOMEM_OCSP);
+	void *ocsp = OPENSSL_malloc(5000);
+	test_assert(ocsp);
+	cryptomem_leave(previous);
+	cryptomem_leave(CRYPTOMEM_OTHER);
+
+	test_assert_int_eq(counter_value("mem.forging.live_bytes") - forging_before, 100);
+	test_assert_int_eq(counter_value("mem.ocsp.live_bytes") - ocsp_before, 5000);
+	test_assert_int_eq(counter_value("mem.forging.allocations") - allocations_before, 1);
+
+	/* Frees are accounted to the subsystem the block was allocated for */
+	OPENSSL_free(forging);
+	OPENSSL_free(ocsp);
+	test_assert_int_eq(counter_value("mem.forging.live_bytes"), forging_before);
+	test_assert_int_eq(counter_value("mem.ocsp.live_bytes"), ocsp_before);
+	subtest_finished();
+}
+
+static void test_cryptomem_thread_cache(void) {
+	subtest_start();
+	void *first = OPENSSL_malloc(200);
+	test_assert(first);
+	OPENSSL_free(first);
+	void *second = OPENSSL_malloc(180);
+	test_assert(first == second);
+	OPENSSL_free(second);
+	subtest_finished();
+}
+
+static void test_cryptomem_realloc(void) {
+	subtest_start();
+	uint8_t *data = OPENSSL_malloc(10);
+	test_assert(data);
+	for (unsigned int i = 0; i < 10; i++) {
+		data[i] = i;
+	}
+	data = OPENSSL_realloc(data, 20);
+	test_assert(data);
+	data = OPENSSL_realloc(data, 100000);
+	test_assert(data);
+	for (unsigned int i = 0; i < 10; i++) {
+		test_assert_int_eq(data[i], i);
+	}
+	data = OPENSSL_realloc(data, 5);
+	test_assert(data);
+	for (unsigned int i = 0; i < 5; i++) {
+		test_assert_int_eq(data[i], i);
+	}
+	OPENSSL_free(data);
+	subtest_finished();
+}
+
+#define CONCURRENT_THREADS		8
+#define CONCURRENT_ALLOCATIONS	10000
+
+static void* allocate_many_thread_fnc(void *arg) {
+	cryptomem_enter(CRYPTOMEM_RELAY);
+	void *blocks[16] = { 0 };
+	for (unsigned int i = 0; i < CONCURRENT_ALLOCATIONS; i++) {
+		unsigned int slot = i % 16;
+		OPENSSL_free(blocks[slot]);
+		blocks[slot] = OPENSSL_malloc(1 + ((i * 37) % 6000));
+	}
+	for (unsigned int i = 0; i < 16; i++) {
+		OPENSSL_free(blocks[i]);
+	}
+	return NULL;
+}
+
+static void test_cryptomem_concurrent(void) {
+	subtest_start();
+	int64_t relay_before = counter_value("mem.relay.live_bytes");
+	pthread_t threads[CONCURRENT_THREADS];
+	for (unsigned int i = 0; i < CONCURRENT_THREADS; i++) {
+		pthread_create(&threads[i], NULL, allocate_many_thread_fnc, NULL);
+	}
+	for (unsigned int i = 0; i < CONCURRENT_THREADS; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	/* Exiting threads flush their statistics */
+	test_assert_int_eq(counter_value("mem.relay.live_bytes"), relay_before);
+	test_assert_int_eq(counter_value("mem.relay.allocations"), CONCURRENT_THREADS * CONCURRENT_ALLOCATIONS);
+	subtest_finished();
+}
+
+int main(int argc, char **argv) {
+	test_start(argc, argv);
+	test_assert(cryptomem_init());
+	test_cryptomem_accounting();
+	test_cryptomem_thread_cache();
+	test_cryptomem_realloc();
+	test_cryptomem_concurrent();
+	test_finished();
+	return 0;
+}
@@ -0,0 +1,176 @@
+/**
+ *	ratched - TLS connection router that performs a man-in-the-middle attack
+ *	Copyright (C) 2017-2017 Johannes Bauer
+ *
+ *	This file is part of ratched.
+ *
+ *	ratched is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; this program is ONLY licensed under
+ *	version 3 of the License, later versions are explicitly excluded.
+ *
+ *	ratched is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with ratched; if not, write to the Free Software
+ *	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *	Johannes Bauer <JohannesBauer@gmx.de>
+**/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "testbed.h"
+#include <domainlist.h>
+
+static const char *filename = "domainlist.test";
+
+static void test_domainlist_lookup(void) {
+	subtest_start();
+	struct domainlist_builder_t *builder = domainlist_builder_new();
+	test_assert(domainlist_builder_add(builder, "Exact.Example.COM.", 1));
+	test_assert(domainlist_builder_add(builder, ".tree.example", 2));
+	test_assert(domainlist_builder_add(builder, "*.star.example", 3));
+	test_assert(domainlist_builder_add(builder, "exact.example.com", 4));
+	test_assert(!domainlist_builder_add(builder, "in valid", 5));
+	test_assert(!domainlist_builder_add(builder, "a..b", 5));
+	test_assert(!domainlist_builder_add(builder, ".", 5));
+	test_assert(domainlist_builder_write(builder, filename));
+	test_assert_int_eq(builder->count, 3);
+	domainlist_builder_free(builder);
+
+	struct domainlist_t *list = domainlist_open(filename);
+	test_assert(list != NULL);
+	test_assert_int_eq(domainlist_entry_count(list), 3);
+
+	uint8_t value = 0;
+	test_assert(domainlist_lookup(list, "exact.example.com", &value));
+	test_assert_int_eq(value, 1);
+	test_assert(domainlist_lookup(list, "EXACT.example.com.", &value));
+	test_assert(!domainlist_lookup(list, "sub.exact.example.com", &value));
+	test_assert(!domainlist_lookup(list, "example.com", &value));
+
+	test_assert(domainlist_lookup(list, "tree.example", &value));
+	test_assert_int_eq(value, 2);
+	test_assert(domainlist_lookup(list, "a.b.tree.example", &value));
+	test_assert_int_eq(value, 2);
+	test_assert(!domainlist_lookup(list, "subtree.example", &value));
+	test_assert(domainlist_lookup(list, "www.star.example", &value));
+	test_assert_int_eq(value, 3);
+
+	test_assert(!domainlist_lookup(list, "", &value));
+	test_assert(!domainlist_lookup(list, "unlisted", &value));
+	domainlist_close(list);
+	subtest_finished();
+}
+
+static void test_domainlist_invalid(void) {
+	subtest_start();
+	FILE *f = fopen(filename, "w");
+	fprintf(f, "not a compiled domain list, but long enough to hold a header of one\n");
+	fclose(f);
+	test_assert(domainlist_open(filename) == NULL);
+
+	struct domainlist_builder_t *builder = domainlist_builder_new();
+	test_assert(domainlist_builder_write(builder, filename));
+	domainlist_builder_free(builder);
+	struct domainlist_t *list = domainlist_open(filename);
+	test_assert(list != NULL);
+	uint8_t value;
+	test_assert(!domainlist_lookup(list, "example.com", &value));
+	domainlist_close(list);
+	subtest_finished();
+}
+
+static void test_domainlist_file(void) {
+	subtest_start();
+	const char *source = "domainlist.test.txt";
+	FILE *f = fopen(source, "w");
+	fprintf(f, "# Blocklist\n");
+	fprintf(f, "0.0.0.0 ads.example tracker.example # two names\n");
+	fprintf(f, "\n");
+	fprintf(f, ".cdn.example\n");
+	fprintf(f, "ads.example\n");
+	fprintf(f, "bad_but_accepted.example\n");
+	fprintf(f, "bad/name\n");
+	fclose(f);
+
+	struct domainlist_builder_t *builder = domainlist_builder_new();
+	test_assert(domainlist_builder_add_file(builder, source, 4));
+	test_assert(domainlist_builder_add(builder, "ads.example", 3));
+	test_assert(domainlist_builder_write(builder, filename));
+	domainlist_builder_free(builder);
+	remove(source);
+
+	struct domainlist_t *list = domainlist_open(filename);
+	test_assert(list != NULL);
+	test_assert_int_eq(domainlist_entry_count(list), 4);
+	uint8_t value = 0;
+	test_assert(domainlist_lookup(list, "ads.example", &value));
+	test_assert_int_eq(value, 4);
+	test_assert(domainlist_lookup(list, "tracker.example", &value));
+	test_assert(domainlist_lookup(list, "img.cdn.example", &value));
+	test_assert(!domainlist_lookup(list, "0.0.0.0", &value));
+	domainlist_close(list);
+	subtest_finished();
+}
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + (ts.tv_nsec * 1e-9);
+}
+
+/* Every listed name needs to be found with its value, unlisted ones never,
+ * at a cost that does not depend on the size of the list */
+static void test_domainlist_large(void) {
+	subtest_start();
+	const unsigned int count = 250000;
+	struct domainlist_builder_t *builder = domainlist_builder_new();
+	char name[64];
+	for (unsigned int i = 0; i < count; i++) {
+		snprintf(name, sizeof(name), "host%u.zone%u.example", i, i % 97);
+		test_assert(domainlist_builder_add(builder, name, i % 4));
+	}
+	const double t0 = now();
+	test_assert(domainlist_builder_write(builder, filename));
+	fprintf(stderr, "Compiled %u domain list entries in %.2f secs\n", count, now() - t0);
+	domainlist_builder_free(builder);
+
+	struct domainlist_t *list = domainlist_open(filename);
+	test_assert(list != NULL);
+	unsigned int found = 0, wrong_value = 0, false_positives = 0;
+	const double t1 = now();
+	for (unsigned int i = 0; i < count; i++) {
+		uint8_t value;
+		snprintf(name, sizeof(name), "host%u.zone%u.example", i, i % 97);
+		if (domainlist_lookup(list, name, &value)) {
+			found++;
+			wrong_value += (value != i % 4);
+		}
+		snprintf(name, sizeof(name), "host%u.zone%u.example", i, (i + 1) % 97);
+		false_positives += domainlist_lookup(list, name, &value);
+	}
+	fprintf(stderr, "Domain list lookup: %.0f ns per name\n", (now() - t1) / (2 * count) * 1e9);
+	test_assert_int_eq(found, count);
+	test_assert_int_eq(wrong_value, 0);
+	test_assert_int_eq(false_positives, 0);
+	domainlist_close(list);
+	remove(filename);
+	subtest_finished();
+}
+
+int main(int argc, char **argv) {
+	test_start(argc, argv);
+	test_domainlist_lookup();
+	test_domainlist_invalid();
+	test_domainlist_file();
+	test_domainlist_large();
+	test_finished();
+	return 0;
+}
@@ -22,20 +22,86 @@
 **/
 
 #include <stdio.h>
+#include <string.h>
+#include <pthread.h>
 #include "testbed.h"
 #include <hostname_ids.h>
 
 static void test_hostname_ids(void) {
 	subtest_start();
-	init_hostname_ids();
-	test_assert_int_eq(resolve_hostname_id(0x11223344, NULL), 0);
-	test_assert_int_eq(resolve_hostname_id(0x22334455, NULL), 0);
-	test_assert_int_eq(resolve_hostname_id(0x11223344, "foobar"), 1);
-	test_assert_int_eq(resolve_hostname_id(0x11223344, "foobar"), 1);
-	test_assert_int_eq(resolve_hostname_id(0x11223344, "barfoo"), 2);
-	test_assert_int_eq(resolve_hostname_id(0x11223344, "foobar"), 1);
-	test_assert_int_eq(resolve_hostname_id(0x22334455, "moo.com"), 1);
-	test_assert_int_eq(resolve_hostname_id(0x22334455, "foo.bar"), 2);
+	test_assert(init_hostname_ids(65536));
+	test_assert(intern_hostname_str(NULL) == NULL);
+	const struct hostname_t *foobar = intern_hostname_str("foobar");
+	const struct hostname_t *barfoo = intern_hostname_str("barfoo");
+	test_assert_int_eq(foobar->id, 1);
+	test_assert_int_eq(barfoo->id, 2);
+	test_assert_str_eq(foobar->name, "foobar");
+	test_assert_int_eq(foobar->length, 6);
+	test_assert(intern_hostname_str("foobar") == foobar);
+	test_assert(intern_hostname("foobar.com", 6) == foobar);
+	test_assert_int_eq(intern_hostname_str("moo.com")->id, 3);
+	test_assert(get_interned_hostname(2) == barfoo);
+	test_assert(get_interned_hostname(0) == NULL);
+	test_assert(get_interned_hostname(4) == NULL);
+	test_assert_int_eq(get_interned_hostname_count(), 3);
+	deinit_hostname_ids();
+	subtest_finished();
+}
+
+#define CONCURRENT_THREADS		8
+#define CONCURRENT_HOSTNAMES	2000
+
+static void* intern_many_thread_fnc(void *arg) {
+	unsigned int *ids = (unsigned int*)arg;
+	for (unsigned int i = 0; i < CONCURRENT_HOSTNAMES; i++) {
+		char hostname[32];
+		snprintf(hostname, sizeof(hostname), "host%u.example.com", i);
+		ids[i] = intern_hostname_str(hostname)->id;
+	}
+	return NULL;
+}
+
+static void test_hostname_ids_concurrent(void) {
+	subtest_start();
+	test_assert(init_hostname_ids(65536));
+	static unsigned int ids[CONCURRENT_THREADS][CONCURRENT_HOSTNAMES];
+	pthread_t threads[CONCURRENT_THREADS];
+	for (unsigned int i = 0; i < CONCURRENT_THREADS; i++) {
+		pthread_create(&threads[i], NULL, intern_many_thread_fnc, ids[i]);
+	}
+	for (unsigned int i = 0; i < CONCURRENT_THREADS; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	test_assert_int_eq(get_interned_hostname_count(), CONCURRENT_HOSTNAMES);
+	for (unsigned int i = 1; i < CONCURRENT_THREADS; i++) {
+		test_assert(!memcmp(ids[0], ids[i], sizeof(ids[0])));
+	}
+	test_assert_str_eq(get_interned_hostname(ids[0][1234])->name, "host1234.example.com");
+	deinit_hostname_ids();
+	subtest_finished();
+}
+
+static void test_hostname_ids_limit(void) {
+	subtest_start();
+	test_assert(init_hostname_ids(2));
+	const struct hostname_t *foo = intern_hostname_str("foo");
+	const struct hostname_t *bar = intern_hostname_str("bar");
+	test_assert_int_eq(foo->id, 1);
+	test_assert_int_eq(bar->id, 2);
+
+	/* Known names are still found, new ones are handed out uninterned */
+	test_assert(intern_hostname_str("foo") == foo);
+	const struct hostname_t *moo = intern_hostname_str("moo");
+	test_assert(moo);
+	test_assert_int_eq(moo->id, 0);
+	test_assert_str_eq(moo->name, "moo");
+	const struct hostname_t *moo2 = intern_hostname_str("moo");
+	test_assert(moo2 != moo);
+	test_assert_int_eq(get_interned_hostname_count(), 2);
+	release_hostname(moo);
+	release_hostname(moo2);
+	release_hostname(foo);
+	test_assert(intern_hostname_str("foo") == foo);
 	deinit_hostname_ids();
 	subtest_finished();
 }
@@ -43,6 +109,8 @@ static void test_hostname_ids(void) {
 int main(int argc, char **argv) {
 	test_start(argc, argv);
 	test_hostname_ids();
+	test_hostname_ids_concurrent();
+	test_hostname_ids_limit();
 	test_finished();
 	return 0;
 }
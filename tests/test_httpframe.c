@@ -0,0 +1,195 @@
+/**
+ *	ratched - TLS connection router that performs a man-in-the-middle attack
+ *	Copyright (C) 2017-2017 Johannes Bauer
+ *
+ *	This file is part of ratched.
+ *
+ *	ratched is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; this program is ONLY licensed under
+ *	version 3 of the License, later versions are explicitly excluded.
+ *
+ *	ratched is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with ratched; if not, write to the Free Software
+ *	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *	Johannes Bauer <JohannesBauer@gmx.de>
+**/
+
+
+#include <stdio.h>
+#include <string.h>
+#include "testbed.h"
+#include <httpframe.h>
+
+struct collected_message_t {
+	bool is_request;
+	char method[16];
+	char uri[64];
+	unsigned int status;
+	char first_header[64];
+	uint64_t offset, body_offset, body_length, wire_length;
+	bool chunked, truncated;
+};
+
+struct collected_t {
+	unsigned int count;
+	struct collected_message_t messages[8];
+	bool skip_body;
+};
+
+static bool collect_header(const struct http_message_t *message, void *argument) {
+	struct collected_t *collected = (struct collected_t*)argument;
+	return collected->skip_body;
+}
+
+static void collect_message(const struct http_message_t *message, void *argument) {
+	struct collected_t *collected = (struct collected_t*)argument;
+	if (collected->count >= 8) {
+		return;
+	}
+	struct collected_message_t *entry = &collected->messages[collected->count++];
+	entry->is_request = message->is_request;
+	if (message->is_request) {
+		snprintf(entry->method, sizeof(entry->method), "%s", message->method);
+		snprintf(entry->uri, sizeof(entry->uri), "%s", message->uri);
+	}
+	entry->status = message->status;
+	if (message->header_count) {
+		snprintf(entry->first_header, sizeof(entry->first_header), "%s=%s", message->headers[0].name, message->headers[0].value);
+	}
+	entry->offset = message->offset;
+	entry->body_offset = message->body_offset;
+	entry->body_length = message->body_length;
+	entry->wire_length = message->wire_length;
+	entry->chunked = message->chunked;
+	entry->truncated = message->truncated;
+}
+
+static void feed_string(struct http_framer_t *framer, const char *string, bool bytewise) {
+	if (bytewise) {
+		for (unsigned int i = 0; i < strlen(string); i++) {
+			http_framer_feed(framer, (const uint8_t*)string + i, 1);
+		}
+	} else {
+		http_framer_feed(framer, (const uint8_t*)string, strlen(string));
+	}
+}
+
+static void init_framer(struct http_framer_t *framer, struct collected_t *collected, bool is_request) {
+	memset(collected, 0, sizeof(*collected));
+	const struct http_framer_callbacks_t callbacks = {
+		.header = collect_header,
+		.complete = collect_message,
+		.argument = collected,
+	};
+	http_framer_init(framer, is_request, &callbacks);
+}
+
+static void test_pipelined_requests(void) {
+	subtest_start();
+	static struct http_framer_t framer;
+	struct collected_t collected;
+	const char *requests = "GET /index.html HTTP/1.1\r\nHost:  example.com \r\n\r\nPOST /form HTTP/1.1\r\nContent-Length: 5\r\n\r\nhelloHEAD / HTTP/1.0\r\n\r\n";
+	for (int bytewise = 0; bytewise < 2; bytewise++) {
+		init_framer(&framer, &collected, true);
+		feed_string(&framer, requests, bytewise);
+		test_assert_int_eq(collected.count, 3);
+		test_assert_str_eq(collected.messages[0].method, "GET");
+		test_assert_str_eq(collected.messages[0].uri, "/index.html");
+		test_assert_str_eq(collected.messages[0].first_header, "Host=example.com");
+		test_assert_int_eq(collected.messages[0].offset, 0);
+		test_assert_int_eq(collected.messages[0].wire_length, 49);
+		test_assert_str_eq(collected.messages[1].method, "POST");
+		test_assert_int_eq(collected.messages[1].offset, 49);
+		test_assert_int_eq(collected.messages[1].body_offset, 49 + 42);
+		test_assert_int_eq(collected.messages[1].body_length, 5);
+		test_assert_str_eq(collected.messages[2].method, "HEAD");
+		test_assert_int_eq(collected.messages[2].offset, 49 + 42 + 5);
+		test_assert(!collected.messages[2].truncated);
+	}
+	subtest_finished();
+}
+
+static void test_chunked_response(void) {
+	subtest_start();
+	static struct http_framer_t framer;
+	struct collected_t collected;
+	const char *responses = "HTTP/1.1 100 Continue\r\n\r\nHTTP/1.1 200 OK\r\nTransfer-Encoding: gzip, chunked\r\n\r\n4;ext=1\r\nWiki\r\n5\r\npedia\r\n0\r\nX-Trailer: yes\r\n\r\nHTTP/1.1 304 Not Modified\r\nETag: \"x\"\r\n\r\n";
+	for (int bytewise = 0; bytewise < 2; bytewise++) {
+		init_framer(&framer, &collected, false);
+		feed_string(&framer, responses, bytewise);
+		test_assert_int_eq(collected.count, 3);
+		test_assert_int_eq(collected.messages[0].status, 100);
+		test_assert_int_eq(collected.messages[1].status, 200);
+		test_assert(collected.messages[1].chunked);
+		test_assert_int_eq(collected.messages[1].body_length, 9);
+		test_assert_int_eq(collected.messages[1].offset + collected.messages[1].wire_length, collected.messages[2].offset);
+		test_assert_int_eq(collected.messages[2].status, 304);
+		test_assert_int_eq(collected.messages[2].body_length, 0);
+	}
+	subtest_finished();
+}
+
+static void test_response_until_close(void) {
+	subtest_start();
+	static struct http_framer_t framer;
+	struct collected_t collected;
+	init_framer(&framer, &collected, false);
+	feed_string(&framer, "HTTP/1.0 200 ok\r\nContent-Type: text/html\r\n\r\n<html>", false);
+	test_assert_int_eq(collected.count, 0);
+	feed_string(&framer, "</html>", false);
+	http_framer_finish(&framer);
+	test_assert_int_eq(collected.count, 1);
+	test_assert_int_eq(collected.messages[0].body_length, 13);
+	test_assert(!collected.messages[0].truncated);
+
+	init_framer(&framer, &collected, false);
+	feed_string(&framer, "HTTP/1.1 200 OK\r\nContent-Length: 100\r\n\r\nshort", false);
+	http_framer_finish(&framer);
+	test_assert_int_eq(collected.count, 1);
+	test_assert(collected.messages[0].truncated);
+	test_assert_int_eq(collected.messages[0].body_length, 5);
+
+	/* Response to a HEAD request, Content-Length has no body following */
+	init_framer(&framer, &collected, false);
+	collected.skip_body = true;
+	feed_string(&framer, "HTTP/1.1 200 OK\r\nContent-Length: 100\r\n\r\n", false);
+	test_assert_int_eq(collected.count, 1);
+	test_assert_int_eq(collected.messages[0].body_length, 0);
+	subtest_finished();
+}
+
+static void test_not_http(void) {
+	subtest_start();
+	static struct http_framer_t framer;
+	struct collected_t collected;
+	init_framer(&framer, &collected, true);
+	feed_string(&framer, "\x16\x03\x01 binary garbage\r\n\r\n", false);
+	test_assert_int_eq(framer.state, HTTP_FRAMER_FAILED);
+	feed_string(&framer, "GET / HTTP/1.1\r\n\r\n", false);
+	http_framer_finish(&framer);
+	test_assert_int_eq(collected.count, 0);
+
+	init_framer(&framer, &collected, true);
+	for (int i = 0; i < HTTP_FRAMER_MAX_HEADER_LENGTH / 16 + 1; i++) {
+		feed_string(&framer, "GET /aaaaaaaaaaa", false);
+	}
+	test_assert_int_eq(framer.state, HTTP_FRAMER_FAILED);
+	subtest_finished();
+}
+
+int main(int argc, char **argv) {
+	test_start(argc, argv);
+	test_pipelined_requests();
+	test_chunked_response();
+	test_response_until_close();
+	test_not_http();
+	test_finished();
+	return 0;
+}
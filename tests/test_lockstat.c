@@ -0,0 +1,125 @@
+/**
+ *	ratched - TLS connection router that performs a man-in-the-middle attack
+ *	Copyright (C) 2017-2017 Johannes Bauer
+ *
+ *	This file is part of ratched.
+ *
+ *	ratched is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; this program is ONLY licensed under
+ *	version 3 of the License, later versions are explicitly excluded.
+ *
+ *	ratched is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with ratched; if not, write to the Free Software
+ *	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *	Johannes Bauer <JohannesBauer@gmx.de>
+**/
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "testbed.h"
+#include <lockstat.h>
+
+static void test_lockstat_uncontended(void) {
+	subtest_start();
+	struct lockstat_mutex_t lock;
+	lockstat_mutex_init(&lock, "test.uncontended");
+	for (unsigned int i = 0; i < 1000; i++) {
+		lockstat_lock(&lock);
+		lockstat_unlock(&lock);
+	}
+	lockstat_mutex_destroy(&lock);
+
+	struct lockstat_snapshot_t snapshot;
+	test_assert(lockstat_get("test.uncontended", &snapshot));
+	test_assert_int_eq(snapshot.acquired, 1000);
+	test_assert_int_eq(snapshot.contended, 0);
+	test_assert_int_eq(snapshot.wait_nsecs, 0);
+	test_assert_int_eq(snapshot.hold_samples, 1000 / 64 + 1);
+	test_assert(!lockstat_get("test.never_locked", &snapshot));
+	subtest_finished();
+}
+
+static struct lockstat_mutex_t static_lock = LOCKSTAT_MUTEX_INITIALIZER("test.contended");
+
+static void* hold_lock_thread_fnc(void *arg) {
+	lockstat_lock(&static_lock);
+	usleep(20 * 1000);
+	lockstat_unlock(&static_lock);
+	return NULL;
+}
+
+static void test_lockstat_contended(void) {
+	subtest_start();
+	lockstat_lock(&static_lock);
+	pthread_t thread;
+	pthread_create(&thread, NULL, hold_lock_thread_fnc, NULL);
+	usleep(20 * 1000);
+	lockstat_unlock(&static_lock);
+	pthread_join(thread, NULL);
+
+	struct lockstat_snapshot_t snapshot;
+	test_assert(lockstat_get("test.contended", &snapshot));
+	test_assert_int_eq(snapshot.acquired, 2);
+	test_assert_int_eq(snapshot.contended, 1);
+	test_assert(snapshot.wait_nsecs >= 10 * 1000 * 1000);
+	test_assert(snapshot.hold_nsecs >= 30 * 1000 * 1000);
+	subtest_finished();
+}
+
+struct cond_ctx_t {
+	struct lockstat_mutex_t lock;
+	pthread_cond_t cond;
+	bool signaled;
+};
+
+static void* signal_thread_fnc(void *vctx) {
+	struct cond_ctx_t *ctx = (struct cond_ctx_t*)vctx;
+	usleep(20 * 1000);
+	lockstat_lock(&ctx->lock);
+	ctx->signaled = true;
+	pthread_cond_signal(&ctx->cond);
+	lockstat_unlock(&ctx->lock);
+	return NULL;
+}
+
+static void test_lockstat_cond_wait(void) {
+	subtest_start();
+	struct cond_ctx_t ctx = {
+		.cond = PTHREAD_COND_INITIALIZER,
+	};
+	lockstat_mutex_init(&ctx.lock, "test.cond");
+	pthread_t thread;
+	lockstat_lock(&ctx.lock);
+	pthread_create(&thread, NULL, signal_thread_fnc, &ctx);
+	while (!ctx.signaled) {
+		lockstat_cond_wait(&ctx.cond, &ctx.lock);
+	}
+	lockstat_unlock(&ctx.lock);
+	pthread_join(thread, NULL);
+	lockstat_mutex_destroy(&ctx.lock);
+
+	/* Time spent waiting on the condition is not hold time */
+	struct lockstat_snapshot_t snapshot;
+	test_assert(lockstat_get("test.cond", &snapshot));
+	test_assert_int_eq(snapshot.acquired, 2);
+	test_assert(snapshot.hold_nsecs < 10 * 1000 * 1000);
+	subtest_finished();
+}
+
+int main(int argc, char **argv) {
+	test_start(argc, argv);
+	test_lockstat_uncontended();
+	test_lockstat_contended();
+	test_lockstat_cond_wait();
+	test_finished();
+	return 0;
+}
@@ -82,6 +82,131 @@ static void test_cert_forgery(void) {
 	openssl_deinit();
 }
 
+static bool certificates_identical(X509 *a, X509 *b) {
+	uint8_t *a_der = NULL, *b_der = NULL;
+	int a_length = i2d_X509(a, &a_der);
+	int b_length = i2d_X509(b, &b_der);
+	bool identical = (a_length > 0) && (a_length == b_length) && !memcmp(a_der, b_der, a_length);
+	OPENSSL_free(a_der);
+	OPENSSL_free(b_der);
+	return identical;
+}
+
+static void test_cert_deterministic(void) {
+	openssl_init();
+	struct keyspec_t keyspec = {
+		.description = "deterministic key",
+		.cryptosystem = CRYPTOSYSTEM_RSA,
+		.rsa = {
+			.bitlength = 1024,
+		},
+	};
+	EVP_PKEY *key = openssl_create_key(&keyspec);
+	test_assert(key);
+
+	struct certificatespec_t certspec = {
+		.description = "deterministic",
+		.subject_pubkey = key,
+		.issuer_privkey = key,
+		.common_name = "foo.com",
+		.subject_alternative_dns_hostname = "foo.com",
+		.subject_alternative_ipv4_address = 0x04030201,
+		.validity_predate_seconds = 86400,
+		.validity_seconds = 86400 * 365,
+		.validity_epoch_seconds = 86400 * 7,
+	};
+	X509 *first = openssl_create_certificate(&certspec);
+	X509 *second = openssl_create_certificate(&certspec);
+	test_assert(first && second);
+	test_assert(certificates_identical(first, second));
+
+	certspec.common_name = "bar.com";
+	certspec.subject_alternative_dns_hostname = "bar.com";
+	X509 *other_host = openssl_create_certificate(&certspec);
+	test_assert(other_host);
+	test_assert(ASN1_INTEGER_cmp(X509_get0_serialNumber(first), X509_get0_serialNumber(other_host)) != 0);
+
+	certspec.validity_epoch_seconds = 0;
+	X509 *random = openssl_create_certificate(&certspec);
+	X509 *random2 = openssl_create_certificate(&certspec);
+	test_assert(random && random2);
+	test_assert(!certificates_identical(random, random2));
+
+	X509_free(first);
+	X509_free(second);
+	X509_free(other_host);
+	X509_free(random);
+	X509_free(random2);
+	EVP_PKEY_free(key);
+	openssl_deinit();
+}
+
+static bool extensions_identical(X509 *a, X509 *b, int nid) {
+	int index_a = X509_get_ext_by_NID(a, nid, -1);
+	int index_b = X509_get_ext_by_NID(b, nid, -1);
+	if ((index_a < 0) || (index_b < 0)) {
+		return false;
+	}
+	return ASN1_STRING_cmp(X509_EXTENSION_get_data(X509_get_ext(a, index_a)), X509_EXTENSION_get_data(X509_get_ext(b, index_b))) == 0;
+}
+
+static void test_cert_mirror(void) {
+	openssl_init();
+	struct keyspec_t keyspec = {
+		.description = "mirror key",
+		.cryptosystem = CRYPTOSYSTEM_ECC_FP,
+		.ecc_fp = {
+			.curve_name = "secp256r1",
+		},
+	};
+	EVP_PKEY *upstream_key = openssl_create_key(&keyspec);
+	EVP_PKEY *own_key = openssl_create_key(&keyspec);
+	test_assert(upstream_key && own_key);
+
+	struct certificatespec_t upstream_spec = {
+		.description = "upstream",
+		.subject_pubkey = upstream_key,
+		.issuer_privkey = upstream_key,
+		.common_name = "www.example.com",
+		.subject_alternative_dns_hostname = "www.example.com",
+		.subject_alternative_ipv4_address = 0x04030201,
+		.validity_predate_seconds = 12345,
+		.validity_seconds = 86400 * 90,
+	};
+	X509 *upstream = openssl_create_certificate(&upstream_spec);
+	test_assert(upstream);
+	test_assert(add_extension_rawstr(upstream, false, NID_certificate_policies, "\x30\x08\x30\x06\x06\x04\x67\x81\x0c\x01"));
+
+	struct certificatespec_t mirror_spec = {
+		.description = "mirror",
+		.subject_pubkey = own_key,
+		.issuer_privkey = own_key,
+		.common_name = "ignored.example.com",
+		.mark_certificate = false,
+		.mirror_certificate = upstream,
+	};
+	X509 *mirror = openssl_create_certificate(&mirror_spec);
+	test_assert(mirror);
+
+	test_assert(X509_NAME_cmp(X509_get_subject_name(mirror), X509_get_subject_name(upstream)) == 0);
+	test_assert(ASN1_TIME_compare(X509_get0_notBefore(mirror), X509_get0_notBefore(upstream)) == 0);
+	test_assert(ASN1_TIME_compare(X509_get0_notAfter(mirror), X509_get0_notAfter(upstream)) == 0);
+	test_assert(extensions_identical(mirror, upstream, NID_subject_alt_name));
+	test_assert(extensions_identical(mirror, upstream, NID_key_usage));
+	test_assert(extensions_identical(mirror, upstream, NID_certificate_policies));
+	test_assert(X509_get_ext_by_NID(mirror, NID_subject_alt_name, -1) >= 0);
+	test_assert(X509_get_ext_by_NID(mirror, NID_subject_alt_name, X509_get_ext_by_NID(mirror, NID_subject_alt_name, -1)) < 0);
+	test_assert(!extensions_identical(mirror, upstream, NID_subject_key_identifier));
+	test_assert(X509_check_private_key(mirror, own_key) == 1);
+	test_assert(ASN1_INTEGER_cmp(X509_get0_serialNumber(mirror), X509_get0_serialNumber(upstream)) != 0);
+
+	X509_free(mirror);
+	X509_free(upstream);
+	EVP_PKEY_free(own_key);
+	EVP_PKEY_free(upstream_key);
+	openssl_deinit();
+}
+
 static void test_cert_id(void) {
 	openssl_init();
 	X509 *cert = openssl_load_cert("local.crt", "local.crt", false);
@@ -131,6 +256,8 @@ int main(int argc, char **argv) {
 	test_start(argc, argv);
 	test_cert_generation();
 	test_cert_forgery();
+	test_cert_deterministic();
+	test_cert_mirror();
 	test_cert_id();
 	test_cert_pubkey_id();
 	test_key_pubkey_id();
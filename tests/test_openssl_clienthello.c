@@ -24,6 +24,7 @@
 #include "testbed.h"
 #include <openssl.h>
 #include <openssl_clienthello.h>
+#include <hostname_ids.h>
 
 static const uint8_t client_hello_example[] = {
 	0x16, 0x03, 0x01, 0x01, 0x04, 0x01, 0x00, 0x01, 0x00, 0x03, 0x03, 0x5a, 0x0d, 0x6e, 0x1e, 0x52,
@@ -48,11 +49,14 @@ static const uint8_t client_hello_example[] = {
 static void test_clienthello_parse(void) {
 	subtest_start();
 	openssl_init();
+	test_assert(init_hostname_ids(1024));
 
 	struct chello_t chello;
 	test_assert(parse_client_hello(&chello, client_hello_example, sizeof(client_hello_example)));
-	test_assert_str_eq(chello.server_name_indication, "localhost");
+	test_assert_str_eq(chello.server_name_indication->name, "localhost");
+	test_assert(chello.server_name_indication == intern_hostname_str("localhost"));
 	free_client_hello(&chello);
+	deinit_hostname_ids();
 	openssl_deinit();
 	subtest_finished();
 }
@@ -40,6 +40,8 @@ struct test_ctx_t {
 	struct atomic_t teardown;
 	const uint8_t *initial_data;
 	int initial_data_length;
+	SSL_CTX *server_sslctx;
+	const char *server_cipher;
 };
 
 static void tls_client_thread(void *arg) {
@@ -63,6 +65,7 @@ static void tls_server_thread(void *arg) {
 	struct test_ctx_t *ctx = (struct test_ctx_t*)arg;
 
 	struct tls_endpoint_config_t config = {
+		.sslctx = ctx->server_sslctx,
 		.tls_versions = TLS_VERSION_TLS12,
 	};
 	struct tls_endpoint_cert_source_t certsrc = {
@@ -80,11 +83,12 @@ static void tls_server_thread(void *arg) {
 	};
 
 	ctx->server_conn = openssl_tls_connect(&request);
+	ctx->server_cipher = ctx->server_conn.ssl ? SSL_get_cipher_name(ctx->server_conn.ssl) : NULL;
 	atomic_inc(&ctx->server_state);
 
 	atomic_wait_until_value(&ctx->teardown, 2);
 	SSL_shutdown(ctx->server_conn.ssl);
-	SSL_free(ctx->server_conn.ssl);
+	openssl_tls_release(ctx->server_conn.ssl);
 	X509_free(config.cert);
 	EVP_PKEY_free(config.key);
 	close(ctx->sds[1]);
@@ -169,10 +173,131 @@ static void test_tls_initial_data(void) {
 	subtest_finished();
 }
 
+static void test_tls_partial_initial_data(void) {
+	subtest_start();
+
+	struct test_ctx_t test_ctx;
+	atomic_init(&test_ctx.client_state);
+	atomic_init(&test_ctx.server_state);
+	atomic_init(&test_ctx.teardown);
+	test_assert(socketpair(AF_LOCAL, SOCK_STREAM, 0, test_ctx.sds) == 0);
+
+	/* Fire up client first */
+	start_detached_thread(tls_client_thread, &test_ctx);
+
+	/* Read out only part of the ClientHello, the remainder needs to be read
+	 * from the socket after the prefix has been replayed. */
+	uint8_t initial_data[16];
+	ssize_t length_read = read(test_ctx.sds[1], initial_data, sizeof(initial_data));
+	test_assert(length_read > 0);
+
+	test_ctx.initial_data = initial_data;
+	test_ctx.initial_data_length = length_read;
+
+	/* Then the server */
+	start_detached_thread(tls_server_thread, &test_ctx);
+
+	check_communication(&test_ctx);
+	subtest_finished();
+}
+
+static SSL *pooled_connection(SSL_CTX *sslctx, const char **cipher_name) {
+	struct test_ctx_t test_ctx = {
+		.server_sslctx = sslctx,
+	};
+	atomic_init(&test_ctx.client_state);
+	atomic_init(&test_ctx.server_state);
+	atomic_init(&test_ctx.teardown);
+	test_assert(socketpair(AF_LOCAL, SOCK_STREAM, 0, test_ctx.sds) == 0);
+
+	start_detached_thread(tls_client_thread, &test_ctx);
+	start_detached_thread(tls_server_thread, &test_ctx);
+
+	check_communication(&test_ctx);
+	if (cipher_name) {
+		*cipher_name = test_ctx.server_cipher;
+	}
+	return test_ctx.server_conn.ssl;
+}
+
+static void test_tls_pooled_context(void) {
+	subtest_start();
+
+	struct tls_endpoint_config_t config = {
+		.tls_versions = TLS_VERSION_TLS12,
+	};
+	SSL_CTX *sslctx = openssl_tls_create_context(true, &config, 1);
+	test_assert(sslctx);
+
+	/* The second connection must be served by the SSL object that the
+	 * first one returned to the pool */
+	SSL *first = pooled_connection(sslctx, NULL);
+	SSL *second = pooled_connection(sslctx, NULL);
+	test_assert(first != NULL);
+	test_assert(first == second);
+
+	openssl_tls_free_context(sslctx);
+	subtest_finished();
+}
+
+static void test_tls_pooled_ocsp_response(void) {
+	subtest_start();
+
+	struct tls_endpoint_config_t config = {
+		.tls_versions = TLS_VERSION_TLS12,
+	};
+	SSL_CTX *sslctx = openssl_tls_create_context(true, &config, 1);
+	test_assert(sslctx);
+
+	/* A response stapled on the previous connection must not survive the
+	 * SSL object's return to the pool */
+	SSL *ssl = SSL_new(sslctx);
+	test_assert(ssl);
+	uint8_t *stale_response = OPENSSL_malloc(4);
+	test_assert(stale_response);
+	memcpy(stale_response, "\x30\x03\x0a\x01", 4);
+	SSL_set_tlsext_status_ocsp_resp(ssl, stale_response, 4);
+	openssl_tls_release(ssl);
+
+	const unsigned char *response = NULL;
+	test_assert_int_eq(SSL_get_tlsext_status_ocsp_resp(ssl, &response), -1);
+	test_assert(response == NULL);
+
+	SSL *reused = pooled_connection(sslctx, NULL);
+	test_assert(reused == ssl);
+
+	openssl_tls_free_context(sslctx);
+	subtest_finished();
+}
+
+static void test_tls_cheapest_policy(void) {
+	subtest_start();
+
+	struct tls_endpoint_config_t config = {
+		.tls_versions = TLS_VERSION_TLS12,
+		.cheapest_ciphers = true,
+	};
+	SSL_CTX *sslctx = openssl_tls_create_context(true, &config, 1);
+	test_assert(sslctx);
+
+	/* The server picks from its own, cost-ordered list of AEAD ciphers */
+	const char *cipher_name = NULL;
+	pooled_connection(sslctx, &cipher_name);
+	test_assert(cipher_name != NULL);
+	test_assert(strstr(cipher_name, "GCM") || strstr(cipher_name, "CHACHA20"));
+
+	openssl_tls_free_context(sslctx);
+	subtest_finished();
+}
+
 int main(int argc, char **argv) {
 	test_start(argc, argv);
 	test_tls_direct();
 	test_tls_initial_data();
+	test_tls_partial_initial_data();
+	test_tls_pooled_context();
+	test_tls_pooled_ocsp_response();
+	test_tls_cheapest_policy();
 	test_finished();
 	return 0;
 }
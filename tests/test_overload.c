@@ -0,0 +1,161 @@
+/**
+ *	ratched - TLS connection router that performs a man-in-the-middle attack
+ *	Copyright (C) 2017-2017 Johannes Bauer
+ *
+ *	This file is part of ratched.
+ *
+ *	ratched is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; this program is ONLY licensed under
+ *	version 3 of the License, later versions are explicitly excluded.
+ *
+ *	ratched is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with ratched; if not, write to the Free Software
+ *	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *	Johannes Bauer <JohannesBauer@gmx.de>
+**/
+
+
+#include "testbed.h"
+#include <overload.h>
+#include <stats.h>
+
+static const struct overload_config_t test_config = {
+	.accept_queue = 100,
+	.handshake_p99_msecs = 500,
+	.interval_msecs = 1000,
+	.recovery_intervals = 3,
+};
+
+static void test_overload_pressure(void) {
+	test_assert(overload_init(&test_config));
+	struct overload_sample_t sample = {
+		.accept_queue = 50,
+		.crypto_wait_msecs = 1000,
+		.handshake_p99_msecs = 100,
+	};
+	/* No crypto wait target, so that is ignored */
+	test_assert(overload_pressure(&sample) == 0.5);
+	sample.handshake_p99_msecs = 750;
+	test_assert(overload_pressure(&sample) == 1.5);
+	overload_deinit();
+
+	const struct overload_config_t no_targets = {
+		.interval_msecs = 1000,
+		.recovery_intervals = 3,
+	};
+	test_assert(!overload_init(&no_targets));
+}
+
+static void test_overload_stages(void) {
+	test_assert(overload_init(&test_config));
+	const struct overload_sample_t overloaded = { .accept_queue = 150 };
+	const struct overload_sample_t hysteresis = { .accept_queue = 90 };
+	const struct overload_sample_t calm = { .accept_queue = 10 };
+
+	test_assert(overload_stage() == OVERLOAD_NORMAL);
+	test_assert(overload_update(&calm) == OVERLOAD_NORMAL);
+
+	/* One stage per interval, up to the last one */
+	test_assert(overload_update(&overloaded) == OVERLOAD_FORWARD_OPPORTUNISTIC);
+	test_assert(overload_update(&overloaded) == OVERLOAD_REJECT_UNKNOWN);
+	test_assert(overload_update(&overloaded) == OVERLOAD_CLOSE_NEW);
+	test_assert(overload_update(&overloaded) == OVERLOAD_CLOSE_NEW);
+	test_assert(overload_stage() == OVERLOAD_CLOSE_NEW);
+
+	/* Between the recovery threshold and the target, nothing changes */
+	for (int i = 0; i < 10; i++) {
+		test_assert(overload_update(&hysteresis) == OVERLOAD_CLOSE_NEW);
+	}
+
+	/* Recovery needs consecutive calm intervals */
+	test_assert(overload_update(&calm) == OVERLOAD_CLOSE_NEW);
+	test_assert(overload_update(&calm) == OVERLOAD_CLOSE_NEW);
+	test_assert(overload_update(&hysteresis) == OVERLOAD_CLOSE_NEW);
+	test_assert(overload_update(&calm) == OVERLOAD_CLOSE_NEW);
+	test_assert(overload_update(&calm) == OVERLOAD_CLOSE_NEW);
+	test_assert(overload_update(&calm) == OVERLOAD_REJECT_UNKNOWN);
+	for (int i = 0; i < 3; i++) {
+		overload_update(&calm);
+	}
+	test_assert(overload_stage() == OVERLOAD_FORWARD_OPPORTUNISTIC);
+
+	/* Renewed overload escalates immediately */
+	test_assert(overload_update(&overloaded) == OVERLOAD_REJECT_UNKNOWN);
+	for (int i = 0; i < 6; i++) {
+		overload_update(&calm);
+	}
+	test_assert(overload_stage() == OVERLOAD_NORMAL);
+
+	test_assert(stats_get(stats_counter("overload.escalations")) == 4);
+	test_assert(stats_get(stats_counter("overload.recoveries")) == 4);
+	test_assert(stats_get(stats_counter("overload.stage")) == 0);
+	overload_deinit();
+}
+
+static void test_overload_shedding(void) {
+	test_assert(overload_init(&test_config));
+	const struct overload_sample_t overloaded = { .accept_queue = 1000 };
+
+	test_assert(!overload_shed_connection());
+	test_assert(overload_adjust_mode(OPPORTUNISTIC_TLS_INTERCEPTION, true) == OPPORTUNISTIC_TLS_INTERCEPTION);
+
+	overload_update(&overloaded);
+	test_assert(!overload_shed_connection());
+	test_assert(overload_adjust_mode(OPPORTUNISTIC_TLS_INTERCEPTION, false) == TRAFFIC_FORWARDING);
+	test_assert(overload_adjust_mode(OPPORTUNISTIC_TLS_INTERCEPTION, true) == TRAFFIC_FORWARDING);
+	test_assert(overload_adjust_mode(MANDATORY_TLS_INTERCEPTION, true) == MANDATORY_TLS_INTERCEPTION);
+
+	overload_update(&overloaded);
+	test_assert(!overload_shed_connection());
+	test_assert(overload_adjust_mode(OPPORTUNISTIC_TLS_INTERCEPTION, false) == TRAFFIC_FORWARDING);
+	test_assert(overload_adjust_mode(OPPORTUNISTIC_TLS_INTERCEPTION, true) == REJECT_CONNECTION);
+	test_assert(overload_adjust_mode(MANDATORY_TLS_INTERCEPTION, true) == REJECT_CONNECTION);
+	test_assert(overload_adjust_mode(MANDATORY_TLS_INTERCEPTION, false) == MANDATORY_TLS_INTERCEPTION);
+
+	overload_update(&overloaded);
+	test_assert(overload_shed_connection());
+	overload_deinit();
+}
+
+static void test_overload_handshake_quantile(void) {
+	test_assert(overload_init(&test_config));
+	test_assert(overload_take_handshake_quantile_msecs(0.99) == 0);
+
+	for (int i = 0; i < 990; i++) {
+		overload_record_handshake(0.001);
+	}
+	for (int i = 0; i < 10; i++) {
+		overload_record_handshake(1.0);
+	}
+	/* Interpolated within the power of two bucket, so only approximately */
+	double p99 = overload_take_handshake_quantile_msecs(0.99);
+	test_assert((p99 >= 0.5) && (p99 <= 1.1));
+	test_assert(overload_take_handshake_quantile_msecs(0.99) == 0);
+
+	for (int i = 0; i < 980; i++) {
+		overload_record_handshake(0.001);
+	}
+	for (int i = 0; i < 20; i++) {
+		overload_record_handshake(1.0);
+	}
+	p99 = overload_take_handshake_quantile_msecs(0.99);
+	test_assert((p99 >= 500) && (p99 <= 1100));
+	overload_deinit();
+}
+
+int main(int argc, char **argv) {
+	test_start(argc, argv);
+	test_overload_pressure();
+	test_overload_stages();
+	test_overload_shedding();
+	test_overload_handshake_quantile();
+	test_finished();
+	return 0;
+}
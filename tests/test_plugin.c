@@ -0,0 +1,205 @@
+/**
+ *	ratched - TLS connection router that performs a man-in-the-middle attack
+ *	Copyright (C) 2017-2017 Johannes Bauer
+ *
+ *	This file is part of ratched.
+ *
+ *	ratched is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; this program is ONLY licensed under
+ *	version 3 of the License, later versions are explicitly excluded.
+ *
+ *	ratched is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with ratched; if not, write to the Free Software
+ *	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *	Johannes Bauer <JohannesBauer@gmx.de>
+**/
+
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "testbed.h"
+#include <plugin.h>
+
+struct output_t {
+	uint8_t data[256];
+	size_t length;
+	unsigned int writes[2];
+};
+
+static bool collect_output(void *argument, bool direction, const uint8_t *data, size_t length) {
+	struct output_t *output = (struct output_t*)argument;
+	memcpy(output->data + output->length, data, length);
+	output->length += length;
+	output->writes[direction]++;
+	return true;
+}
+
+static const struct ratched_plugin_api_t *api;
+static unsigned int opened, closed;
+
+static bool test_init(const struct ratched_plugin_api_t *plugin_api, const char *argument) {
+	api = plugin_api;
+	return (argument != NULL) && !strcmp(argument, "arg");
+}
+
+static enum ratched_plugin_verdict_t test_open(struct ratched_plugin_connection_t *conn) {
+	opened++;
+	conn->state = &opened;
+	return RATCHED_PLUGIN_PASS;
+}
+
+static void test_close(struct ratched_plugin_connection_t *conn) {
+	closed++;
+}
+
+/* Uppercases client data in place, appends "!" to server data, holds chunks
+ * that start with "hold" and releases held data as "released" when it sees
+ * "flush", closes on "close" */
+static enum ratched_plugin_verdict_t test_chunk(struct ratched_plugin_connection_t *conn, struct ratched_plugin_chunk_t *chunk) {
+	if ((chunk->length >= 4) && !memcmp(chunk->data, "hold", 4)) {
+		return RATCHED_PLUGIN_HOLD;
+	} else if ((chunk->length >= 5) && !memcmp(chunk->data, "flush", 5)) {
+		api->inject(conn, chunk->client_to_server, (const uint8_t*)"released", 8);
+		return RATCHED_PLUGIN_HOLD;
+	} else if ((chunk->length >= 5) && !memcmp(chunk->data, "close", 5)) {
+		return RATCHED_PLUGIN_CLOSE;
+	}
+	if (chunk->client_to_server) {
+		for (size_t i = 0; i < chunk->length; i++) {
+			if ((chunk->data[i] >= 'a') && (chunk->data[i] <= 'z')) {
+				chunk->data[i] -= 'a' - 'A';
+			}
+		}
+	} else if (chunk->length < chunk->capacity) {
+		chunk->data[chunk->length++] = '!';
+	}
+	return RATCHED_PLUGIN_PASS;
+}
+
+static const struct ratched_plugin_t test_plugin = {
+	.abi_version = RATCHED_PLUGIN_ABI_VERSION,
+	.name = "test",
+	.max_held_bytes = 10,
+	.init = test_init,
+	.connection_open = test_open,
+	.connection_close = test_close,
+	.chunk = test_chunk,
+};
+
+static enum ratched_plugin_verdict_t run_chunk(struct plugin_connection_t *pconn, struct output_t *output, bool direction, const char *text) {
+	uint8_t buffer[64];
+	uint8_t *data = buffer;
+	size_t length = strlen(text);
+	memcpy(buffer, text, length);
+	enum ratched_plugin_verdict_t verdict = plugin_connection_chunk(pconn, direction, &data, &length, sizeof(buffer));
+	if (verdict == RATCHED_PLUGIN_PASS) {
+		plugin_connection_write(pconn, direction, data, length);
+	}
+	return verdict;
+}
+
+static void test_plugin_chain(void) {
+	subtest_start();
+	struct ratched_plugin_t wrong_abi = test_plugin;
+	wrong_abi.abi_version = RATCHED_PLUGIN_ABI_VERSION + 1;
+	test_assert(!plugins_register(&wrong_abi, "arg"));
+	test_assert(!plugins_register(&test_plugin, "wrong"));
+
+	struct connection_t description = { .connection_id = 1 };
+	test_assert(plugin_connection_new(&description) == NULL);
+	test_assert(plugins_register(&test_plugin, "arg"));
+	test_assert(plugins_active());
+
+	struct plugin_connection_t *pconn = plugin_connection_new(&description);
+	test_assert(pconn != NULL);
+	struct output_t output = { 0 };
+	test_assert_int_eq(plugin_connection_open(pconn, collect_output, &output), RATCHED_PLUGIN_PASS);
+	test_assert_int_eq(opened, 1);
+
+	test_assert_int_eq(run_chunk(pconn, &output, true, "get"), RATCHED_PLUGIN_PASS);
+	test_assert_int_eq(run_chunk(pconn, &output, false, "ok"), RATCHED_PLUGIN_PASS);
+	test_assert_int_eq(run_chunk(pconn, &output, true, "hold"), RATCHED_PLUGIN_HOLD);
+	test_assert_int_eq(run_chunk(pconn, &output, true, "flush"), RATCHED_PLUGIN_HOLD);
+	test_assert_int_eq(output.length, 14);
+	test_assert(!memcmp(output.data, "GETok!released", 14));
+	test_assert_int_eq(output.writes[true], 2);
+	test_assert_int_eq(output.writes[false], 1);
+
+	/* Holding more than 10 bytes exceeds the plugin's budget */
+	test_assert_int_eq(run_chunk(pconn, &output, false, "hold 6"), RATCHED_PLUGIN_HOLD);
+	test_assert_int_eq(run_chunk(pconn, &output, false, "hold 6"), RATCHED_PLUGIN_CLOSE);
+	test_assert_int_eq(run_chunk(pconn, &output, true, "close"), RATCHED_PLUGIN_CLOSE);
+
+	plugin_connection_close(pconn);
+	plugin_connection_free(pconn);
+	test_assert_int_eq(closed, 1);
+	subtest_finished();
+}
+
+static enum ratched_plugin_verdict_t pass_chunk(struct ratched_plugin_connection_t *conn, struct ratched_plugin_chunk_t *chunk) {
+	return RATCHED_PLUGIN_PASS;
+}
+
+static const struct ratched_plugin_t pass_plugin = {
+	.abi_version = RATCHED_PLUGIN_ABI_VERSION,
+	.name = "pass",
+	.chunk = pass_chunk,
+};
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + (ts.tv_nsec * 1e-9);
+}
+
+/* Bounds what dispatching a chunk through the plugin chain and the locked
+ * write path costs on top of the plugin's own work. Even in the sanitizer
+ * build, this needs to stay far below the microseconds that decrypting and
+ * encrypting a 4 kiB TLS record take. */
+static void test_plugin_overhead(void) {
+	subtest_start();
+	plugins_deinit();
+	test_assert(plugins_register(&pass_plugin, NULL));
+
+	struct connection_t description = { .connection_id = 2 };
+	struct plugin_connection_t *pconn = plugin_connection_new(&description);
+	struct output_t output = { 0 };
+	plugin_connection_open(pconn, collect_output, &output);
+
+	const unsigned int iterations = 1000000;
+	uint8_t buffer[8192] = { 0 };
+	const double t0 = now();
+	for (unsigned int i = 0; i < iterations; i++) {
+		uint8_t *data = buffer;
+		size_t length = 4096;
+		if (plugin_connection_chunk(pconn, i & 1, &data, &length, sizeof(buffer)) == RATCHED_PLUGIN_PASS) {
+			output.length = 0;
+			plugin_connection_write(pconn, i & 1, data, 0);
+		}
+	}
+	const double nsecs_per_chunk = (now() - t0) / iterations * 1e9;
+	fprintf(stderr, "Plugin dispatch overhead: %.1f ns per chunk\n", nsecs_per_chunk);
+	test_assert(nsecs_per_chunk < 1000);
+
+	plugin_connection_close(pconn);
+	plugin_connection_free(pconn);
+	plugins_deinit();
+	test_assert(!plugins_active());
+	subtest_finished();
+}
+
+int main(int argc, char **argv) {
+	test_start(argc, argv);
+	test_plugin_chain();
+	test_plugin_overhead();
+	test_finished();
+	return 0;
+}
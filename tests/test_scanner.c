@@ -0,0 +1,283 @@
+/**
+ *	ratched - TLS connection router that performs a man-in-the-middle attack
+ *	Copyright (C) 2017-2017 Johannes Bauer
+ *
+ *	This file is part of ratched.
+ *
+ *	ratched is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; this program is ONLY licensed under
+ *	version 3 of the License, later versions are explicitly excluded.
+ *
+ *	ratched is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with ratched; if not, write to the Free Software
+ *	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *	Johannes Bauer <JohannesBauer@gmx.de>
+**/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "testbed.h"
+#include <scanner.h>
+
+#define MAX_MATCHES		4096
+
+struct match_t {
+	unsigned int pattern_index;
+	uint64_t end_offset;
+};
+
+struct match_list_t {
+	const struct scanner_t *scanner;
+	unsigned int count;
+	struct match_t matches[MAX_MATCHES];
+};
+
+static bool collect_match(const struct scan_pattern_t *pattern, uint64_t end_offset, void *argument) {
+	struct match_list_t *list = (struct match_list_t*)argument;
+	if (list->count < MAX_MATCHES) {
+		list->matches[list->count++] = (struct match_t) {
+			.pattern_index = pattern - list->scanner->patterns,
+			.end_offset = end_offset,
+		};
+	}
+	return true;
+}
+
+static int compare_matches(const void *va, const void *vb) {
+	const struct match_t *a = (const struct match_t*)va;
+	const struct match_t *b = (const struct match_t*)vb;
+	if (a->end_offset != b->end_offset) {
+		return (a->end_offset < b->end_offset) ? -1 : 1;
+	}
+	return (int)a->pattern_index - (int)b->pattern_index;
+}
+
+static bool add_string(struct scanner_t *scanner, const char *text) {
+	return scanner_add_pattern(scanner, text, (const uint8_t*)text, strlen(text), SCAN_REPORT);
+}
+
+static void test_scanner_basic(void) {
+	subtest_start();
+	struct scanner_t *scanner = scanner_new();
+	test_assert(add_string(scanner, "he"));
+	test_assert(add_string(scanner, "she"));
+	test_assert(add_string(scanner, "his"));
+	test_assert(add_string(scanner, "hers"));
+	test_assert(scanner_compile(scanner));
+
+	struct match_list_t list = { .scanner = scanner };
+	struct scan_stream_t stream = { 0 };
+	test_assert(scanner_scan(scanner, &stream, (const uint8_t*)"ushers", 6, collect_match, &list));
+	qsort(list.matches, list.count, sizeof(struct match_t), compare_matches);
+	test_assert_int_eq(list.count, 3);
+	test_assert_int_eq(list.matches[0].pattern_index, 0);
+	test_assert_int_eq(list.matches[0].end_offset, 4);
+	test_assert_int_eq(list.matches[1].pattern_index, 1);
+	test_assert_int_eq(list.matches[1].end_offset, 4);
+	test_assert_int_eq(list.matches[2].pattern_index, 3);
+	test_assert_int_eq(list.matches[2].end_offset, 6);
+
+	/* The same matches are found when the input is split anywhere */
+	list.count = 0;
+	stream = (struct scan_stream_t) { 0 };
+	const char *pieces[] = { "u", "sh", "", "e", "rs" };
+	for (unsigned int i = 0; i < 5; i++) {
+		test_assert(scanner_scan(scanner, &stream, (const uint8_t*)pieces[i], strlen(pieces[i]), collect_match, &list));
+	}
+	test_assert_int_eq(list.count, 3);
+	test_assert_int_eq(stream.offset, 6);
+	test_assert_int_eq(atomic_load(&scanner->patterns[3].matches), 2);
+
+	/* Duplicate patterns are rejected */
+	test_assert(add_string(scanner, "his"));
+	test_assert(!scanner_compile(scanner));
+	scanner_free(scanner);
+	subtest_finished();
+}
+
+static unsigned int naive_scan(const struct scanner_t *scanner, const uint8_t *data, size_t length, struct match_t *matches) {
+	unsigned int count = 0;
+	for (size_t end = 1; end <= length; end++) {
+		for (unsigned int i = 0; i < scanner->pattern_count; i++) {
+			const struct scan_pattern_t *pattern = &scanner->patterns[i];
+			if ((pattern->length <= end) && !memcmp(data + end - pattern->length, pattern->data, pattern->length)) {
+				matches[count++] = (struct match_t) {
+					.pattern_index = i,
+					.end_offset = end,
+				};
+			}
+		}
+	}
+	return count;
+}
+
+/* Compares against a naive matcher on a small alphabet, where overlapping
+ * and nested matches, failure transitions and the start state prefilter are
+ * all exercised heavily, with the input split into random pieces */
+static void test_scanner_random(void) {
+	subtest_start();
+	srand(12345);
+	for (unsigned int round = 0; round < 200; round++) {
+		struct scanner_t *scanner = scanner_new();
+		const unsigned int pattern_count = 1 + (rand() % 8);
+		for (unsigned int i = 0; i < pattern_count; i++) {
+			char pattern[8];
+			const unsigned int length = 1 + (rand() % 5);
+			for (unsigned int j = 0; j < length; j++) {
+				pattern[j] = 'a' + (rand() % 3);
+			}
+			pattern[length] = 0;
+			scanner_add_pattern(scanner, pattern, (const uint8_t*)pattern, length, SCAN_REPORT);
+		}
+		if (!scanner_compile(scanner)) {
+			/* Randomly generated duplicate */
+			scanner_free(scanner);
+			continue;
+		}
+
+		uint8_t data[300];
+		for (unsigned int i = 0; i < sizeof(data); i++) {
+			data[i] = (rand() % 8 == 0) ? 'x' : ('a' + (rand() % 4));
+		}
+		static struct match_t expected[MAX_MATCHES];
+		const unsigned int expected_count = naive_scan(scanner, data, sizeof(data), expected);
+
+		static struct match_list_t list;
+		list.scanner = scanner;
+		list.count = 0;
+		struct scan_stream_t stream = { 0 };
+		size_t offset = 0;
+		while (offset < sizeof(data)) {
+			size_t length = rand() % 20;
+			if (offset + length > sizeof(data)) {
+				length = sizeof(data) - offset;
+			}
+			scanner_scan(scanner, &stream, data + offset, length, collect_match, &list);
+			offset += length;
+		}
+		qsort(list.matches, list.count, sizeof(struct match_t), compare_matches);
+		test_assert_int_eq(list.count, expected_count);
+		test_assert(!memcmp(list.matches, expected, sizeof(struct match_t) * expected_count));
+		scanner_free(scanner);
+	}
+	subtest_finished();
+}
+
+static bool stop_at_first(const struct scan_pattern_t *pattern, uint64_t end_offset, void *argument) {
+	*((uint64_t*)argument) = end_offset;
+	return false;
+}
+
+static void test_scanner_file(void) {
+	subtest_start();
+	const char *filename = "scan_patterns.test";
+	FILE *f = fopen(filename, "w");
+	fprintf(f, "# Comment\n\n");
+	fprintf(f, "auth   report            Authorization:\\sBasic\\s\n");
+	fprintf(f, "crlf   report            \\r\\n\\x00\\\\\n");
+	fprintf(f, "token  report:terminate  ghp_\n");
+	fclose(f);
+
+	struct scanner_t *scanner = scanner_load_file(filename);
+	test_assert(scanner != NULL);
+	test_assert_int_eq(scanner->pattern_count, 3);
+	test_assert_int_eq(scanner->patterns[0].length, 21);
+	test_assert(!memcmp(scanner->patterns[0].data, "Authorization: Basic ", 21));
+	test_assert_int_eq(scanner->patterns[1].length, 4);
+	test_assert(!memcmp(scanner->patterns[1].data, "\r\n\0\\", 4));
+	test_assert_int_eq(scanner->patterns[2].flags, SCAN_REPORT | SCAN_TERMINATE);
+
+	uint64_t end_offset = 0;
+	struct scan_stream_t stream = { 0 };
+	test_assert(!scanner_scan(scanner, &stream, (const uint8_t*)"x: ghp_123", 10, stop_at_first, &end_offset));
+	test_assert_int_eq(end_offset, 7);
+	scanner_free(scanner);
+
+	/* Relays stop at terminating patterns */
+	test_assert(scan_init(filename));
+	test_assert(scan_active());
+	struct scan_relay_t relay;
+	scan_relay_init(&relay, 1, true, NULL);
+	test_assert(scan_relay_chunk(&relay, (const uint8_t*)"Authorization: Basic Zm9v\r\n", 27));
+	test_assert(scan_relay_chunk(&relay, (const uint8_t*)"gh", 2));
+	test_assert(!scan_relay_chunk(&relay, (const uint8_t*)"p_", 2));
+	scan_deinit();
+	test_assert(!scan_active());
+
+	f = fopen(filename, "w");
+	fprintf(f, "bad  report  \\q\n");
+	fclose(f);
+	test_assert(scanner_load_file(filename) == NULL);
+	f = fopen(filename, "w");
+	fprintf(f, "bad  nonsense  abc\n");
+	fclose(f);
+	test_assert(scanner_load_file(filename) == NULL);
+	remove(filename);
+	subtest_finished();
+}
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + (ts.tv_nsec * 1e-9);
+}
+
+static bool count_match(const struct scan_pattern_t *pattern, uint64_t end_offset, void *argument) {
+	(*(unsigned int*)argument)++;
+	return true;
+}
+
+/* Scanning 4 kiB chunks of text-like data for a few hundred patterns; the
+ * throughput must not depend on the number of patterns and needs to stay
+ * well above what a TLS relay thread moves, even in the sanitizer build */
+static void test_scanner_throughput(void) {
+	subtest_start();
+	srand(54321);
+	struct scanner_t *scanner = scanner_new();
+	for (unsigned int i = 0; i < 500; i++) {
+		char pattern[16];
+		snprintf(pattern, sizeof(pattern), "%c%c_secret_%03u", 'A' + (rand() % 26), 'A' + (rand() % 26), i);
+		test_assert(add_string(scanner, pattern));
+	}
+	test_assert(scanner_compile(scanner));
+
+	const size_t length = 16 * 1024 * 1024;
+	uint8_t *data = malloc(length);
+	for (size_t i = 0; i < length; i++) {
+		data[i] = ' ' + (rand() % 95);
+	}
+	memcpy(data + length / 2, scanner->patterns[17].data, scanner->patterns[17].length);
+
+	unsigned int matches = 0;
+	struct scan_stream_t stream = { 0 };
+	const double t0 = now();
+	for (size_t offset = 0; offset < length; offset += 4096) {
+		scanner_scan(scanner, &stream, data + offset, 4096, count_match, &matches);
+	}
+	const double mib_per_sec = length / (now() - t0) / 1024 / 1024;
+	fprintf(stderr, "Scanner throughput: %.0f MiB/s for %u patterns (%u states, %u byte classes)\n", mib_per_sec, scanner->pattern_count, scanner->state_count, scanner->class_count);
+	test_assert(matches >= 1);
+	test_assert(mib_per_sec > 50);
+	free(data);
+	scanner_free(scanner);
+	subtest_finished();
+}
+
+int main(int argc, char **argv) {
+	test_start(argc, argv);
+	test_scanner_basic();
+	test_scanner_random();
+	test_scanner_file();
+	test_scanner_throughput();
+	test_finished();
+	return 0;
+}
@@ -21,8 +21,40 @@
  *	Johannes Bauer <JohannesBauer@gmx.de>
 **/
 
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
 #include <pthread.h>
+#include <sys/prctl.h>
 #include "thread.h"
+#include "logging.h"
+
+#define MAX_PARALLEL_WORKERS		64
+
+struct parallel_job_t {
+	struct lockstat_mutex_t lock;
+	unsigned int next_index;
+	unsigned int count;
+	void (*job_fnc)(unsigned int index, void *argument);
+	void *argument;
+	pthread_t caller;
+};
+
+/* Names the calling thread so that it can be told apart in top(1), perf and
+ * bpftrace. This is what pthread_setname_np(3) does for the calling thread,
+ * but does not require _GNU_SOURCE. The kernel limits names to 15
+ * characters, longer names are truncated. */
+void set_thread_name(const char *fmt, ...) {
+	char name[16];
+	va_list ap;
+	va_start(ap, fmt);
+	vsnprintf(name, sizeof(name), fmt, ap);
+	va_end(ap);
+	prctl(PR_SET_NAME, name, 0, 0, 0);
+}
 
 bool start_detached_thread(void (*thread_fnc)(void*), void *argument) {
 	pthread_t thread;
@@ -31,3 +63,131 @@ bool start_detached_thread(void (*thread_fnc)(void*), void *argument) {
 	pthread_attr_setdetachstate(&thread_attrs, PTHREAD_CREATE_DETACHED);
 	return pthread_create(&thread, &thread_attrs, (void* (*)(void*))thread_fnc, argument) == 0;
 }
+
+unsigned int get_parallel_worker_count(void) {
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (cpus < 1) {
+		return 1;
+	} else if (cpus > MAX_PARALLEL_WORKERS) {
+		return MAX_PARALLEL_WORKERS;
+	}
+	return cpus;
+}
+
+static void* parallel_worker_thread_fnc(void *vjob) {
+	struct parallel_job_t *job = (struct parallel_job_t*)vjob;
+	if (!pthread_equal(pthread_self(), job->caller)) {
+		set_thread_name("worker");
+	}
+	while (true) {
+		lockstat_lock(&job->lock);
+		unsigned int index = job->next_index;
+		if (index < job->count) {
+			job->next_index++;
+		}
+		lockstat_unlock(&job->lock);
+		if (index >= job->count) {
+			break;
+		}
+		job->job_fnc(index, job->argument);
+	}
+	return NULL;
+}
+
+/* Calls job_fnc(index, argument) for every index in [0; count) using a pool
+ * of worker threads and returns once all indices have been processed. Falls
+ * back to running the jobs on the calling thread when no worker could be
+ * started. */
+void run_parallel_jobs(unsigned int count, void (*job_fnc)(unsigned int index, void *argument), void *argument) {
+	struct parallel_job_t job = {
+		.lock = LOCKSTAT_MUTEX_INITIALIZER("parallel_jobs"),
+		.count = count,
+		.job_fnc = job_fnc,
+		.argument = argument,
+		.caller = pthread_self(),
+	};
+
+	unsigned int worker_count = get_parallel_worker_count();
+	if (worker_count > count) {
+		worker_count = count;
+	}
+
+	pthread_t workers[MAX_PARALLEL_WORKERS];
+	unsigned int started = 0;
+	for (unsigned int i = 0; i < worker_count; i++) {
+		int result = pthread_create(&workers[started], NULL, parallel_worker_thread_fnc, &job);
+		if (result != 0) {
+			logmsg(LLVL_WARN, "Could not start parallel worker thread %u of %u: %s", i + 1, worker_count, strerror(result));
+			break;
+		}
+		started++;
+	}
+
+	/* The calling thread participates as well; this also guarantees progress
+	 * when no worker could be created at all. */
+	parallel_worker_thread_fnc(&job);
+	for (unsigned int i = 0; i < started; i++) {
+		pthread_join(workers[i], NULL);
+	}
+	lockstat_mutex_destroy(&job.lock);
+}
+
+static void* periodic_thread_fnc(void *vperiodic) {
+	struct periodic_thread_t *periodic = (struct periodic_thread_t*)vperiodic;
+	set_thread_name("%s", periodic->name);
+	lockstat_lock(&periodic->lock);
+	while (!periodic->quit) {
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += (time_t)periodic->interval;
+		deadline.tv_nsec += (long)((periodic->interval - (time_t)periodic->interval) * 1e9);
+		if (deadline.tv_nsec >= 1000000000) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000;
+		}
+		while (!periodic->quit && (lockstat_cond_timedwait(&periodic->cond, &periodic->lock, &deadline) == 0));
+		if (periodic->quit) {
+			break;
+		}
+		lockstat_unlock(&periodic->lock);
+		periodic->thread_fnc(periodic->argument);
+		lockstat_lock(&periodic->lock);
+	}
+	lockstat_unlock(&periodic->lock);
+	return NULL;
+}
+
+/* Starts a joinable background thread that calls thread_fnc(argument) every
+ * interval seconds until stop_periodic_thread() is called. */
+bool start_periodic_thread(struct periodic_thread_t *periodic, const char *name, double interval, void (*thread_fnc)(void *argument), void *argument) {
+	memset(periodic, 0, sizeof(*periodic));
+	lockstat_mutex_init(&periodic->lock, "periodic");
+	pthread_cond_init(&periodic->cond, NULL);
+	periodic->name = name;
+	periodic->interval = interval;
+	periodic->thread_fnc = thread_fnc;
+	periodic->argument = argument;
+	int result = pthread_create(&periodic->thread, NULL, periodic_thread_fnc, periodic);
+	if (result != 0) {
+		logmsg(LLVL_ERROR, "Could not start periodic thread: %s", strerror(result));
+		pthread_cond_destroy(&periodic->cond);
+		lockstat_mutex_destroy(&periodic->lock);
+		return false;
+	}
+	periodic->running = true;
+	return true;
+}
+
+void stop_periodic_thread(struct periodic_thread_t *periodic) {
+	if (!periodic->running) {
+		return;
+	}
+	lockstat_lock(&periodic->lock);
+	periodic->quit = true;
+	pthread_cond_signal(&periodic->cond);
+	lockstat_unlock(&periodic->lock);
+	pthread_join(periodic->thread, NULL);
+	pthread_cond_destroy(&periodic->cond);
+	lockstat_mutex_destroy(&periodic->lock);
+	periodic->running = false;
+}
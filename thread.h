@@ -25,9 +25,28 @@
 #define __THREAD_H__
 
 #include <stdbool.h>
+#include <pthread.h>
+#include "lockstat.h"
+
+struct periodic_thread_t {
+	pthread_t thread;
+	struct lockstat_mutex_t lock;
+	pthread_cond_t cond;
+	bool running;
+	bool quit;
+	const char *name;
+	double interval;
+	void (*thread_fnc)(void *argument);
+	void *argument;
+};
 
 /*************** AUTO GENERATED SECTION FOLLOWS ***************/
+void __attribute__ ((format (printf, 1, 2))) set_thread_name(const char *fmt, ...);
 bool start_detached_thread(void (*thread_fnc)(void*), void *argument);
+unsigned int get_parallel_worker_count(void);
+void run_parallel_jobs(unsigned int count, void (*job_fnc)(unsigned int index, void *argument), void *argument);
+bool start_periodic_thread(struct periodic_thread_t *periodic, const char *name, double interval, void (*thread_fnc)(void *argument), void *argument);
+void stop_periodic_thread(struct periodic_thread_t *periodic);
 /***************  AUTO GENERATED SECTION ENDS   ***************/
 
 #endif
@@ -27,6 +27,7 @@
 #include <sys/types.h>
 #include <string.h>
 #include <errno.h>
+#include <time.h>
 #include "logging.h"
 #include "tools.h"
 
@@ -47,6 +48,18 @@ bool select_read(int fd, double timeout_secs) {
 	return result == 1;
 }
 
+double monotonic_time(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + (ts.tv_nsec * 1e-9);
+}
+
+double thread_cpu_time(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return ts.tv_sec + (ts.tv_nsec * 1e-9);
+}
+
 bool pathtok(const char *path, bool (*callback)(const char *path, void *arg), void *arg) {
 	char *strcopy = strdup(path);
 	if (!strcopy) {
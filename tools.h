@@ -28,6 +28,8 @@
 
 /*************** AUTO GENERATED SECTION FOLLOWS ***************/
 bool select_read(int fd, double timeout_secs);
+double monotonic_time(void);
+double thread_cpu_time(void);
 bool pathtok(const char *path, bool (*callback)(const char *path, void *arg), void *arg);
 bool makedirs(const char *path);
 bool strxcat(char *dest, int bufsize, ...);